@@ -1493,7 +1493,21 @@ enum ZT_StateObjectType {
 	 * Canonical path: <HOME>/networks.d/<NETWORKID>.conf (16-digit hex ID)
 	 * Persistence: required if network memberships should persist
 	 */
-	ZT_STATE_OBJECT_NETWORK_CONFIG = 6
+	ZT_STATE_OBJECT_NETWORK_CONFIG = 6,
+
+	/**
+	 * Public identity of a peer (binary serialized)
+	 *
+	 * Read when a peer's identity is needed (e.g. to answer WHOIS) and the
+	 * peer is not in memory. Written when a new peer is learned. Hosts that
+	 * serve many WHOIS requests should keep these somewhere faster than one
+	 * file per peer.
+	 *
+	 * Object ID: peer address
+	 * Canonical path: <HOME>/identities.db (append-only, indexed by address)
+	 * Persistence: optional, can be cleared at any time
+	 */
+	ZT_STATE_OBJECT_PEER_IDENTITY = 7
 };
 
 /**
@@ -1555,6 +1569,60 @@ typedef void (*ZT_VirtualNetworkFrameFunction)(
 	const void*,   /* Frame data */
 	unsigned int); /* Frame length */
 
+/**
+ * A single frame in a batch passed to ZT_VirtualNetworkFrameBatchFunction
+ */
+typedef struct {
+	/**
+	 * Source MAC
+	 */
+	uint64_t sourceMac;
+
+	/**
+	 * Destination MAC
+	 */
+	uint64_t destMac;
+
+	/**
+	 * Ethernet type
+	 */
+	unsigned int etherType;
+
+	/**
+	 * VLAN ID (0 for none)
+	 */
+	unsigned int vlanId;
+
+	/**
+	 * Frame data (valid only for the duration of the callback)
+	 */
+	const void* data;
+
+	/**
+	 * Frame length
+	 */
+	unsigned int len;
+} ZT_VirtualNetworkFrame;
+
+/**
+ * Function to send several frames out to the same virtual network port
+ *
+ * This is an optional batched form of ZT_VirtualNetworkFrameFunction. If
+ * present the core uses it to deliver all frames it has decoded for one
+ * network in a single call instead of one call per frame.
+ *
+ * Parameters: (1) node, (2) user ptr, (3) network ID, (4) network user
+ * ptr, (5) array of frames, (6) number of frames in array.
+ */
+typedef void (*ZT_VirtualNetworkFrameBatchFunction)(
+	ZT_Node*,					   /* Node */
+	void*,						   /* User ptr */
+	void*,						   /* Thread ptr */
+	uint64_t,					   /* Network ID */
+	void**,						   /* Modifiable network user PTR */
+	const ZT_VirtualNetworkFrame*, /* Frames */
+	unsigned int);				   /* Number of frames */
+
 /**
  * Callback for events
  *
@@ -1639,6 +1707,50 @@ typedef int (*ZT_WirePacketSendFunction)(
 	unsigned int,					/* Packet length */
 	unsigned int);					/* TTL or 0 to use default */
 
+/**
+ * A single packet in a batch passed to ZT_WirePacketSendBatchFunction
+ */
+typedef struct {
+	/**
+	 * Local socket or -1 for "all" or "any"
+	 */
+	int64_t localSocket;
+
+	/**
+	 * Remote address
+	 */
+	const struct sockaddr_storage* address;
+
+	/**
+	 * Packet data (valid only for the duration of the callback)
+	 */
+	const void* data;
+
+	/**
+	 * Packet length
+	 */
+	unsigned int len;
+} ZT_WirePacket;
+
+/**
+ * Function to send several packets over the physical wire
+ *
+ * This is an optional batched form of ZT_WirePacketSendFunction. If
+ * present the core uses it when it sends one packet to many peers, such
+ * as for multicast, so the host can pass them to the OS in as few system
+ * calls as possible (e.g. with sendmmsg()). Packets are sent with the
+ * default TTL and failures are not reported.
+ *
+ * Parameters: (1) node, (2) user ptr, (3) thread ptr, (4) array of
+ * packets, (5) number of packets in array.
+ */
+typedef void (*ZT_WirePacketSendBatchFunction)(
+	ZT_Node*,			  /* Node */
+	void*,				  /* User ptr */
+	void*,				  /* Thread ptr */
+	const ZT_WirePacket*, /* Packets */
+	unsigned int);		  /* Number of packets */
+
 /**
  * Function to check whether a path should be used for ZeroTier traffic
  *
@@ -1700,7 +1812,11 @@ typedef int (*ZT_PathLookupFunction)(
  */
 struct ZT_Node_Callbacks {
 	/**
-	 * Struct version -- must currently be 0
+	 * Struct version -- must currently be 0, 1 or 2
+	 *
+	 * Version 1 adds virtualNetworkFrameBatchFunction and version 2 adds
+	 * wirePacketSendBatchFunction. Older callers may pass a struct that ends
+	 * at the last field of their version.
 	 */
 	long version;
 
@@ -1743,6 +1859,16 @@ struct ZT_Node_Callbacks {
 	 * OPTIONAL: Function to get hints to physical paths to ZeroTier addresses
 	 */
 	ZT_PathLookupFunction pathLookupFunction;
+
+	/**
+	 * OPTIONAL: Function to inject a batch of frames into a virtual network's TAP (version >= 1)
+	 */
+	ZT_VirtualNetworkFrameBatchFunction virtualNetworkFrameBatchFunction;
+
+	/**
+	 * OPTIONAL: Function to send a batch of packets over the physical wire (version >= 2)
+	 */
+	ZT_WirePacketSendBatchFunction wirePacketSendBatchFunction;
 };
 
 /**
@@ -419,6 +419,7 @@ namespace {
             case ZT_STATE_OBJECT_PEER:
                 res = snprintf(p, sizeof(p), "peers.d/%.10" PRIx64, id[0]);
                 break;
+            case ZT_STATE_OBJECT_PEER_IDENTITY:
             case ZT_STATE_OBJECT_NULL:
                 return;
         }
@@ -520,6 +521,8 @@ namespace {
             case ZT_STATE_OBJECT_PEER:
                 res = snprintf(p, sizeof(p), "peers.d/%.10" PRIx64, id[0]);
                 break;
+            case ZT_STATE_OBJECT_PEER_IDENTITY:
+                return -1;
             case ZT_STATE_OBJECT_NULL:
                 return -100;
         }
@@ -32,6 +32,7 @@ ifeq ($(ZT_EXTOSDEP),1)
 else
 	ONE_OBJS+=osdep/LinuxEthernetTap.o
 	ONE_OBJS+=osdep/LinuxNetLink.o
+	ONE_OBJS+=osdep/LinuxTapReactor.o
 endif
 
 # for central controller buildsk
@@ -426,7 +426,7 @@ SharedPtr<Path> Bond::getAppropriatePath(int64_t now, int32_t flowId)
 			return _paths[m_idx].p;
 		}
 		Mutex::Lock _l(_flows_m);
-		std::map<int16_t, SharedPtr<Flow> >::iterator it = _flows.find(flowId);
+		std::map<int32_t, SharedPtr<Flow> >::iterator it = _flows.find(flowId);
 		if (likely(it != _flows.end())) {
 			it->second->lastActivity = now;
 			return _paths[it->second->assignedPath].p;
@@ -715,8 +715,8 @@ SharedPtr<Bond::Flow> Bond::createFlow(int pathIdx, int32_t flowId, unsigned cha
 
 void Bond::forgetFlowsWhenNecessary(uint64_t age, bool oldest, int64_t now)
 {
-	std::map<int16_t, SharedPtr<Flow> >::iterator it = _flows.begin();
-	std::map<int16_t, SharedPtr<Flow> >::iterator oldestFlow = _flows.end();
+	std::map<int32_t, SharedPtr<Flow> >::iterator it = _flows.begin();
+	std::map<int32_t, SharedPtr<Flow> >::iterator oldestFlow = _flows.end();
 	SharedPtr<Flow> expiredFlow;
 	if (age) {	 // Remove by specific age
 		while (it != _flows.end()) {
@@ -1421,7 +1421,7 @@ void Bond::processBalanceTasks(int64_t now)
 	if ((now - _lastFlowExpirationCheck) > ZT_PEER_PATH_EXPIRATION) {
 		Mutex::Lock _l(_flows_m);
 		forgetFlowsWhenNecessary(ZT_PEER_PATH_EXPIRATION, false, now);
-		std::map<int16_t, SharedPtr<Flow> >::iterator it = _flows.begin();
+		std::map<int32_t, SharedPtr<Flow> >::iterator it = _flows.begin();
 		while (it != _flows.end()) {
 			it->second->resetByteCounts();
 			++it;
@@ -1433,7 +1433,7 @@ void Bond::processBalanceTasks(int64_t now)
 	 */
 	if (_policy == ZT_BOND_POLICY_BALANCE_XOR || _policy == ZT_BOND_POLICY_BALANCE_AWARE) {
 		Mutex::Lock _l(_flows_m);
-		std::map<int16_t, SharedPtr<Flow> >::iterator flow_it = _flows.begin();
+		std::map<int32_t, SharedPtr<Flow> >::iterator flow_it = _flows.begin();
 		while (flow_it != _flows.end()) {
 			if (_paths[flow_it->second->assignedPath].p) {
 				int originalPathIdx = flow_it->second->assignedPath;
@@ -1452,7 +1452,7 @@ void Bond::processBalanceTasks(int64_t now)
 	 */
 	if (_policy == ZT_BOND_POLICY_BALANCE_AWARE) {
 		Mutex::Lock _l(_flows_m);
-		std::map<int16_t, SharedPtr<Flow> >::iterator flow_it = _flows.begin();
+		std::map<int32_t, SharedPtr<Flow> >::iterator flow_it = _flows.begin();
 		while (flow_it != _flows.end()) {
 			if (_paths[flow_it->second->assignedPath].p) {
 				int originalPathIdx = flow_it->second->assignedPath;
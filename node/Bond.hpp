@@ -1457,7 +1457,7 @@ class Bond {
 	 */
 	int _realIdxMap[ZT_MAX_PEER_NETWORK_PATHS] = { ZT_MAX_PEER_NETWORK_PATHS };
 	int _numBondedPaths;						  // Number of paths currently included in the _realIdxMap set.
-	std::map<int16_t, SharedPtr<Flow> > _flows;	  // Flows hashed according to port and protocol
+	std::map<int32_t, SharedPtr<Flow> > _flows;	  // Flows keyed by FlowHash flow ID
 	float _qw[ZT_QOS_PARAMETER_SIZE];			  // Link quality specification (can be customized by user)
 
 	bool _run;
@@ -99,6 +99,12 @@ template <unsigned int C> class Buffer {
 		_l = l;
 	}
 
+	// Copies move only the bytes in use, not the whole capacity
+	Buffer(const Buffer& b)
+	{
+		memcpy(_b, b._b, _l = b._l);
+	}
+
 	template <unsigned int C2> Buffer(const Buffer<C2>& b)
 	{
 		*this = b;
@@ -109,17 +115,20 @@ template <unsigned int C> class Buffer {
 		copyFrom(b, l);
 	}
 
+	inline Buffer& operator=(const Buffer& b)
+	{
+		if (this != &b) {
+			memcpy(_b, b._b, _l = b._l);
+		}
+		return *this;
+	}
+
 	template <unsigned int C2> inline Buffer& operator=(const Buffer<C2>& b)
 	{
 		if (unlikely(b._l > C)) {
 			throw ZT_EXCEPTION_OUT_OF_BOUNDS;
 		}
-		if (C2 == C) {
-			memcpy(this, &b, sizeof(Buffer<C>));
-		}
-		else {
-			memcpy(_b, b._b, _l = b._l);
-		}
+		memcpy(_b, b._b, _l = b._l);
 		return *this;
 	}
 
@@ -0,0 +1,1179 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * (c) ZeroTier, Inc.
+ * https://www.zerotier.com/
+ */
+
+#include "CompiledRules.hpp"
+
+#include "Capability.hpp"
+#include "FlowHash.hpp"
+#include "InetAddress.hpp"
+#include "Membership.hpp"
+#include "NetworkConfig.hpp"
+#include "Node.hpp"
+#include "RuntimeEnvironment.hpp"
+#include "Switch.hpp"
+#include "Tag.hpp"
+#include "Utils.hpp"
+
+#include <algorithm>
+#include <map>
+#include <string.h>
+
+namespace ZeroTier {
+
+namespace {
+
+// Result of a specialized match that fails regardless of the rule's NOT bit
+#define ZT_COMPILED_RULES_HARD_NO 2
+
+static inline bool _hasPorts(const unsigned int proto)
+{
+	switch (proto) {
+		// All these start with 16-bit source and destination port in that order
+		case 0x06:	 // TCP
+		case 0x11:	 // UDP
+		case 0x84:	 // SCTP
+		case 0x88:	 // UDPLite
+			return true;
+		default:
+			return false;
+	}
+}
+
+static inline uint64_t _be64(const uint8_t* p)
+{
+	return (((uint64_t)p[0]) << 56) | (((uint64_t)p[1]) << 48) | (((uint64_t)p[2]) << 40) | (((uint64_t)p[3]) << 32) | (((uint64_t)p[4]) << 24) | (((uint64_t)p[5]) << 16) | (((uint64_t)p[6]) << 8) | ((uint64_t)p[7]);
+}
+
+// Evaluate one MATCH rule, returning its result before the NOT bit is applied
+static uint8_t _matchRule(
+	const RuntimeEnvironment* RR,
+	const NetworkConfig& nconf,
+	const Membership* membership,
+	const bool inbound,
+	const Address& ztSource,
+	const Address& ztDest,
+	const MAC& macSource,
+	const MAC& macDest,
+	const uint8_t* const frameData,
+	const unsigned int frameLen,
+	const unsigned int etherType,
+	const unsigned int vlanId,
+	const ZT_VirtualNetworkRule& rule,
+	const bool superAccept,
+	uint8_t& skipDrop)
+{
+	const ZT_VirtualNetworkRuleType rt = (ZT_VirtualNetworkRuleType)(rule.t & 0x3f);
+	uint8_t thisRuleMatches = 0;
+	uint64_t ownershipVerificationMask = 1;	  // this magic value means it hasn't been computed yet -- this is done lazily the first time it's needed
+	uint8_t hardYes = (rule.t >> 7) ^ 1;	  // XOR with the NOT bit of the rule
+	uint8_t hardNo = (rule.t >> 7) ^ 0;
+
+	switch (rt) {
+		case ZT_NETWORK_RULE_MATCH_SOURCE_ZEROTIER_ADDRESS:
+			thisRuleMatches = (uint8_t)(rule.v.zt == ztSource.toInt());
+			break;
+		case ZT_NETWORK_RULE_MATCH_DEST_ZEROTIER_ADDRESS:
+			thisRuleMatches = (uint8_t)(rule.v.zt == ztDest.toInt());
+			break;
+		case ZT_NETWORK_RULE_MATCH_VLAN_ID:
+			thisRuleMatches = (uint8_t)(rule.v.vlanId == (uint16_t)vlanId);
+			break;
+		case ZT_NETWORK_RULE_MATCH_VLAN_PCP:
+			// NOT SUPPORTED YET
+			thisRuleMatches = (uint8_t)(rule.v.vlanPcp == 0);
+			break;
+		case ZT_NETWORK_RULE_MATCH_VLAN_DEI:
+			// NOT SUPPORTED YET
+			thisRuleMatches = (uint8_t)(rule.v.vlanDei == 0);
+			break;
+		case ZT_NETWORK_RULE_MATCH_MAC_SOURCE:
+			thisRuleMatches = (uint8_t)(MAC(rule.v.mac, 6) == macSource);
+			break;
+		case ZT_NETWORK_RULE_MATCH_MAC_DEST:
+			thisRuleMatches = (uint8_t)(MAC(rule.v.mac, 6) == macDest);
+			break;
+		case ZT_NETWORK_RULE_MATCH_IPV4_SOURCE:
+			if ((etherType == ZT_ETHERTYPE_IPV4) && (frameLen >= 20)) {
+				thisRuleMatches = (uint8_t)(InetAddress((const void*)&(rule.v.ipv4.ip), 4, rule.v.ipv4.mask).containsAddress(InetAddress((const void*)(frameData + 12), 4, 0)));
+			}
+			else {
+				thisRuleMatches = hardNo;
+			}
+			break;
+		case ZT_NETWORK_RULE_MATCH_IPV4_DEST:
+			if ((etherType == ZT_ETHERTYPE_IPV4) && (frameLen >= 20)) {
+				thisRuleMatches = (uint8_t)(InetAddress((const void*)&(rule.v.ipv4.ip), 4, rule.v.ipv4.mask).containsAddress(InetAddress((const void*)(frameData + 16), 4, 0)));
+			}
+			else {
+				thisRuleMatches = hardNo;
+			}
+			break;
+		case ZT_NETWORK_RULE_MATCH_IPV6_SOURCE:
+			if ((etherType == ZT_ETHERTYPE_IPV6) && (frameLen >= 40)) {
+				thisRuleMatches = (uint8_t)(InetAddress((const void*)rule.v.ipv6.ip, 16, rule.v.ipv6.mask).containsAddress(InetAddress((const void*)(frameData + 8), 16, 0)));
+			}
+			else {
+				thisRuleMatches = hardNo;
+			}
+			break;
+		case ZT_NETWORK_RULE_MATCH_IPV6_DEST:
+			if ((etherType == ZT_ETHERTYPE_IPV6) && (frameLen >= 40)) {
+				thisRuleMatches = (uint8_t)(InetAddress((const void*)rule.v.ipv6.ip, 16, rule.v.ipv6.mask).containsAddress(InetAddress((const void*)(frameData + 24), 16, 0)));
+			}
+			else {
+				thisRuleMatches = hardNo;
+			}
+			break;
+		case ZT_NETWORK_RULE_MATCH_IP_TOS:
+			if ((etherType == ZT_ETHERTYPE_IPV4) && (frameLen >= 20)) {
+				const uint8_t tosMasked = frameData[1] & rule.v.ipTos.mask;
+				thisRuleMatches = (uint8_t)((tosMasked >= rule.v.ipTos.value[0]) && (tosMasked <= rule.v.ipTos.value[1]));
+			}
+			else if ((etherType == ZT_ETHERTYPE_IPV6) && (frameLen >= 40)) {
+				const uint8_t tosMasked = (((frameData[0] << 4) & 0xf0) | ((frameData[1] >> 4) & 0x0f)) & rule.v.ipTos.mask;
+				thisRuleMatches = (uint8_t)((tosMasked >= rule.v.ipTos.value[0]) && (tosMasked <= rule.v.ipTos.value[1]));
+			}
+			else {
+				thisRuleMatches = hardNo;
+			}
+			break;
+		case ZT_NETWORK_RULE_MATCH_IP_PROTOCOL:
+			if ((etherType == ZT_ETHERTYPE_IPV4) && (frameLen >= 20)) {
+				thisRuleMatches = (uint8_t)(rule.v.ipProtocol == frameData[9]);
+			}
+			else if (etherType == ZT_ETHERTYPE_IPV6) {
+				unsigned int pos = 0, proto = 0;
+				if (FlowHash::ipv6GetPayload(frameData, frameLen, pos, proto)) {
+					thisRuleMatches = (uint8_t)(rule.v.ipProtocol == (uint8_t)proto);
+				}
+				else {
+					thisRuleMatches = hardNo;
+				}
+			}
+			else {
+				thisRuleMatches = hardNo;
+			}
+			break;
+		case ZT_NETWORK_RULE_MATCH_ETHERTYPE:
+			thisRuleMatches = (uint8_t)(rule.v.etherType == (uint16_t)etherType);
+			break;
+		case ZT_NETWORK_RULE_MATCH_ICMP:
+			if ((etherType == ZT_ETHERTYPE_IPV4) && (frameLen >= 20)) {
+				if (frameData[9] == 0x01) {	  // IP protocol == ICMP
+					const unsigned int ihl = (frameData[0] & 0xf) * 4;
+					if (frameLen >= (ihl + 2)) {
+						if (rule.v.icmp.type == frameData[ihl]) {
+							if ((rule.v.icmp.flags & 0x01) != 0) {
+								thisRuleMatches = (uint8_t)(frameData[ihl + 1] == rule.v.icmp.code);
+							}
+							else {
+								thisRuleMatches = hardYes;
+							}
+						}
+						else {
+							thisRuleMatches = hardNo;
+						}
+					}
+					else {
+						thisRuleMatches = hardNo;
+					}
+				}
+				else {
+					thisRuleMatches = hardNo;
+				}
+			}
+			else if (etherType == ZT_ETHERTYPE_IPV6) {
+				unsigned int pos = 0, proto = 0;
+				if (FlowHash::ipv6GetPayload(frameData, frameLen, pos, proto)) {
+					if ((proto == 0x3a) && (frameLen >= (pos + 2))) {
+						if (rule.v.icmp.type == frameData[pos]) {
+							if ((rule.v.icmp.flags & 0x01) != 0) {
+								thisRuleMatches = (uint8_t)(frameData[pos + 1] == rule.v.icmp.code);
+							}
+							else {
+								thisRuleMatches = hardYes;
+							}
+						}
+						else {
+							thisRuleMatches = hardNo;
+						}
+					}
+					else {
+						thisRuleMatches = hardNo;
+					}
+				}
+				else {
+					thisRuleMatches = hardNo;
+				}
+			}
+			else {
+				thisRuleMatches = hardNo;
+			}
+			break;
+		case ZT_NETWORK_RULE_MATCH_IP_SOURCE_PORT_RANGE:
+		case ZT_NETWORK_RULE_MATCH_IP_DEST_PORT_RANGE:
+			if ((etherType == ZT_ETHERTYPE_IPV4) && (frameLen >= 20)) {
+				const unsigned int headerLen = 4 * (frameData[0] & 0xf);
+				int p = -1;
+				if ((_hasPorts(frameData[9])) && (frameLen > (headerLen + 4))) {
+					unsigned int pos = headerLen + ((rt == ZT_NETWORK_RULE_MATCH_IP_DEST_PORT_RANGE) ? 2 : 0);
+					p = (int)frameData[pos++] << 8;
+					p |= (int)frameData[pos];
+				}
+				thisRuleMatches = (p >= 0) ? (uint8_t)((p >= (int)rule.v.port[0]) && (p <= (int)rule.v.port[1])) : (uint8_t)0;
+			}
+			else if (etherType == ZT_ETHERTYPE_IPV6) {
+				unsigned int pos = 0, proto = 0;
+				if (FlowHash::ipv6GetPayload(frameData, frameLen, pos, proto)) {
+					int p = -1;
+					if ((_hasPorts(proto)) && (frameLen > (pos + 4))) {
+						if (rt == ZT_NETWORK_RULE_MATCH_IP_DEST_PORT_RANGE) {
+							pos += 2;
+						}
+						p = (int)frameData[pos++] << 8;
+						p |= (int)frameData[pos];
+					}
+					thisRuleMatches = (p > 0) ? (uint8_t)((p >= (int)rule.v.port[0]) && (p <= (int)rule.v.port[1])) : (uint8_t)0;
+				}
+				else {
+					thisRuleMatches = hardNo;
+				}
+			}
+			else {
+				thisRuleMatches = hardNo;
+			}
+			break;
+		case ZT_NETWORK_RULE_MATCH_CHARACTERISTICS: {
+			uint64_t cf = (inbound) ? ZT_RULE_PACKET_CHARACTERISTICS_INBOUND : 0ULL;
+			if (macDest.isMulticast()) {
+				cf |= ZT_RULE_PACKET_CHARACTERISTICS_MULTICAST;
+			}
+			if (macDest.isBroadcast()) {
+				cf |= ZT_RULE_PACKET_CHARACTERISTICS_BROADCAST;
+			}
+			if (ownershipVerificationMask == 1) {
+				ownershipVerificationMask = 0;
+				InetAddress src;
+				if ((etherType == ZT_ETHERTYPE_IPV4) && (frameLen >= 20)) {
+					src.set((const void*)(frameData + 12), 4, 0);
+				}
+				else if ((etherType == ZT_ETHERTYPE_IPV6) && (frameLen >= 40)) {
+					// IPv6 NDP requires special handling, since the src and dest IPs in the packet are empty or link-local.
+					if ((frameLen >= (40 + 8 + 16)) && (frameData[6] == 0x3a) && ((frameData[40] == 0x87) || (frameData[40] == 0x88))) {
+						if (frameData[40] == 0x87) {
+							// Neighbor solicitations contain no reliable source address, so we implement a small
+							// hack by considering them authenticated. Otherwise you would pretty much have to do
+							// this manually in the rule set for IPv6 to work at all.
+							ownershipVerificationMask |= ZT_RULE_PACKET_CHARACTERISTICS_SENDER_IP_AUTHENTICATED;
+						}
+						else {
+							// Neighbor advertisements on the other hand can absolutely be authenticated.
+							src.set((const void*)(frameData + 40 + 8), 16, 0);
+						}
+					}
+					else {
+						// Other IPv6 packets can be handled normally
+						src.set((const void*)(frameData + 8), 16, 0);
+					}
+				}
+				else if ((etherType == ZT_ETHERTYPE_ARP) && (frameLen >= 28)) {
+					src.set((const void*)(frameData + 14), 4, 0);
+				}
+				if (inbound) {
+					if (membership) {
+						if ((src) && (membership->hasCertificateOfOwnershipFor<InetAddress>(nconf, src))) {
+							ownershipVerificationMask |= ZT_RULE_PACKET_CHARACTERISTICS_SENDER_IP_AUTHENTICATED;
+						}
+						if (membership->hasCertificateOfOwnershipFor<MAC>(nconf, macSource)) {
+							ownershipVerificationMask |= ZT_RULE_PACKET_CHARACTERISTICS_SENDER_MAC_AUTHENTICATED;
+						}
+					}
+				}
+				else {
+					for (unsigned int i = 0; i < nconf.certificateOfOwnershipCount; ++i) {
+						if ((src) && (nconf.certificatesOfOwnership[i].owns(src))) {
+							ownershipVerificationMask |= ZT_RULE_PACKET_CHARACTERISTICS_SENDER_IP_AUTHENTICATED;
+						}
+						if (nconf.certificatesOfOwnership[i].owns(macSource)) {
+							ownershipVerificationMask |= ZT_RULE_PACKET_CHARACTERISTICS_SENDER_MAC_AUTHENTICATED;
+						}
+					}
+				}
+			}
+			cf |= ownershipVerificationMask;
+			if ((etherType == ZT_ETHERTYPE_IPV4) && (frameLen >= 20) && (frameData[9] == 0x06)) {
+				const unsigned int headerLen = 4 * (frameData[0] & 0xf);
+				cf |= (uint64_t)frameData[headerLen + 13];
+				cf |= (((uint64_t)(frameData[headerLen + 12] & 0x0f)) << 8);
+			}
+			else if (etherType == ZT_ETHERTYPE_IPV6) {
+				unsigned int pos = 0, proto = 0;
+				if (FlowHash::ipv6GetPayload(frameData, frameLen, pos, proto)) {
+					if ((proto == 0x06) && (frameLen > (pos + 14))) {
+						cf |= (uint64_t)frameData[pos + 13];
+						cf |= (((uint64_t)(frameData[pos + 12] & 0x0f)) << 8);
+					}
+				}
+			}
+			thisRuleMatches = (uint8_t)((cf & rule.v.characteristics) != 0);
+		} break;
+		case ZT_NETWORK_RULE_MATCH_FRAME_SIZE_RANGE:
+			thisRuleMatches = (uint8_t)((frameLen >= (unsigned int)rule.v.frameSize[0]) && (frameLen <= (unsigned int)rule.v.frameSize[1]));
+			break;
+		case ZT_NETWORK_RULE_MATCH_RANDOM:
+			thisRuleMatches = (uint8_t)((uint32_t)(RR->node->prng() & 0xffffffffULL) <= rule.v.randomProbability);
+			break;
+		case ZT_NETWORK_RULE_MATCH_TAGS_DIFFERENCE:
+		case ZT_NETWORK_RULE_MATCH_TAGS_BITWISE_AND:
+		case ZT_NETWORK_RULE_MATCH_TAGS_BITWISE_OR:
+		case ZT_NETWORK_RULE_MATCH_TAGS_BITWISE_XOR:
+		case ZT_NETWORK_RULE_MATCH_TAGS_EQUAL: {
+			const Tag* const localTag = std::lower_bound(&(nconf.tags[0]), &(nconf.tags[nconf.tagCount]), rule.v.tag.id, Tag::IdComparePredicate());
+			if ((localTag != &(nconf.tags[nconf.tagCount])) && (localTag->id() == rule.v.tag.id)) {
+				const Tag* const remoteTag = ((membership) ? membership->getTag(nconf, rule.v.tag.id) : (const Tag*)0);
+				if (remoteTag) {
+					const uint32_t ltv = localTag->value();
+					const uint32_t rtv = remoteTag->value();
+					if (rt == ZT_NETWORK_RULE_MATCH_TAGS_DIFFERENCE) {
+						const uint32_t diff = (ltv > rtv) ? (ltv - rtv) : (rtv - ltv);
+						thisRuleMatches = (uint8_t)(diff <= rule.v.tag.value);
+					}
+					else if (rt == ZT_NETWORK_RULE_MATCH_TAGS_BITWISE_AND) {
+						thisRuleMatches = (uint8_t)((ltv & rtv) == rule.v.tag.value);
+					}
+					else if (rt == ZT_NETWORK_RULE_MATCH_TAGS_BITWISE_OR) {
+						thisRuleMatches = (uint8_t)((ltv | rtv) == rule.v.tag.value);
+					}
+					else if (rt == ZT_NETWORK_RULE_MATCH_TAGS_BITWISE_XOR) {
+						thisRuleMatches = (uint8_t)((ltv ^ rtv) == rule.v.tag.value);
+					}
+					else if (rt == ZT_NETWORK_RULE_MATCH_TAGS_EQUAL) {
+						thisRuleMatches = (uint8_t)((ltv == rule.v.tag.value) && (rtv == rule.v.tag.value));
+					}
+					else {	 // sanity check, can't really happen
+						thisRuleMatches = hardNo;
+					}
+				}
+				else {
+					if ((inbound) && (! superAccept)) {
+						thisRuleMatches = hardNo;
+					}
+					else {
+						// Outbound side is not strict since if we have to match both tags and
+						// we are sending a first packet to a recipient, we probably do not know
+						// about their tags yet. They will filter on inbound and we will filter
+						// once we get their tag. If we are a tee/redirect target we are also
+						// not strict since we likely do not have these tags.
+						skipDrop = 1;
+						thisRuleMatches = hardYes;
+					}
+				}
+			}
+			else {
+				thisRuleMatches = hardNo;
+			}
+		} break;
+		case ZT_NETWORK_RULE_MATCH_TAG_SENDER:
+		case ZT_NETWORK_RULE_MATCH_TAG_RECEIVER: {
+			const Tag* const localTag = std::lower_bound(&(nconf.tags[0]), &(nconf.tags[nconf.tagCount]), rule.v.tag.id, Tag::IdComparePredicate());
+			if (superAccept) {
+				skipDrop = 1;
+				thisRuleMatches = hardYes;
+			}
+			else if (((rt == ZT_NETWORK_RULE_MATCH_TAG_SENDER) && (inbound)) || ((rt == ZT_NETWORK_RULE_MATCH_TAG_RECEIVER) && (! inbound))) {
+				const Tag* const remoteTag = ((membership) ? membership->getTag(nconf, rule.v.tag.id) : (const Tag*)0);
+				if (remoteTag) {
+					thisRuleMatches = (uint8_t)(remoteTag->value() == rule.v.tag.value);
+				}
+				else {
+					if (rt == ZT_NETWORK_RULE_MATCH_TAG_RECEIVER) {
+						// If we are checking the receiver and this is an outbound packet, we
+						// can't be strict since we may not yet know the receiver's tag.
+						skipDrop = 1;
+						thisRuleMatches = hardYes;
+					}
+					else {
+						thisRuleMatches = hardNo;
+					}
+				}
+			}
+			else {	 // sender and outbound or receiver and inbound
+				if ((localTag != &(nconf.tags[nconf.tagCount])) && (localTag->id() == rule.v.tag.id)) {
+					thisRuleMatches = (uint8_t)(localTag->value() == rule.v.tag.value);
+				}
+				else {
+					thisRuleMatches = hardNo;
+				}
+			}
+		} break;
+		case ZT_NETWORK_RULE_MATCH_INTEGER_RANGE: {
+			uint64_t integer = 0;
+			const unsigned int bits = (rule.v.intRange.format & 63) + 1;
+			const unsigned int bytes = ((bits + 8 - 1) / 8);   // integer ceiling of division by 8
+			if ((rule.v.intRange.format & 0x80) == 0) {
+				// Big-endian
+				unsigned int idx = rule.v.intRange.idx + (8 - bytes);
+				const unsigned int eof = idx + bytes;
+				if (eof <= frameLen) {
+					while (idx < eof) {
+						integer <<= 8;
+						integer |= frameData[idx++];
+					}
+				}
+				integer &= 0xffffffffffffffffULL >> (64 - bits);
+			}
+			else {
+				// Little-endian
+				unsigned int idx = rule.v.intRange.idx;
+				const unsigned int eof = idx + bytes;
+				if (eof <= frameLen) {
+					while (idx < eof) {
+						integer >>= 8;
+						integer |= ((uint64_t)frameData[idx++]) << 56;
+					}
+				}
+				integer >>= (64 - bits);
+			}
+			thisRuleMatches = (uint8_t)((integer >= rule.v.intRange.start) && (integer <= (rule.v.intRange.start + (uint64_t)rule.v.intRange.end)));
+		} break;
+
+		// The result of an unsupported MATCH is configurable at the network
+		// level via a flag.
+		default:
+			thisRuleMatches = (uint8_t)((nconf.flags & ZT_NETWORKCONFIG_FLAG_RULES_RESULT_OF_UNSUPPORTED_MATCH) != 0);
+			break;
+	}
+
+	return thisRuleMatches;
+}
+
+// Take an ACTION whose set matched, returning a result or -1 to continue with the next rule
+static inline int _takeAction(
+	const RuntimeEnvironment* RR,
+	const bool inbound,
+	const Address& ztSource,
+	Address& ztDest,
+	const ZT_VirtualNetworkRule& rule,
+	const unsigned int frameLen,
+	const bool superAccept,
+	uint8_t& skipDrop,
+	Address& cc,
+	unsigned int& ccLength,
+	bool& ccWatch,
+	uint8_t& qosBucket)
+{
+	const ZT_VirtualNetworkRuleType rt = (ZT_VirtualNetworkRuleType)(rule.t & 0x3f);
+	switch (rt) {
+		case ZT_NETWORK_RULE_ACTION_PRIORITY:
+			qosBucket = (rule.v.qosBucket <= 8) ? rule.v.qosBucket : 4;	  // 4 = default bucket (no priority)
+			return DOZTFILTER_ACCEPT;
+
+		case ZT_NETWORK_RULE_ACTION_DROP:
+			if (! ! skipDrop) {
+				skipDrop = 0;
+				return -1;
+			}
+			return DOZTFILTER_DROP;
+
+		case ZT_NETWORK_RULE_ACTION_ACCEPT:
+			return (superAccept ? DOZTFILTER_SUPER_ACCEPT : DOZTFILTER_ACCEPT);	  // match, accept packet
+
+		// These are initially handled together since preliminary logic is common
+		case ZT_NETWORK_RULE_ACTION_TEE:
+		case ZT_NETWORK_RULE_ACTION_WATCH:
+		case ZT_NETWORK_RULE_ACTION_REDIRECT: {
+			const Address fwdAddr(rule.v.fwd.address);
+			if (fwdAddr == ztSource) {
+				// Skip as no-op since source is target
+			}
+			else if (fwdAddr == RR->identity.address()) {
+				if (inbound) {
+					return DOZTFILTER_SUPER_ACCEPT;
+				}
+			}
+			else if (fwdAddr == ztDest) {
+			}
+			else {
+				if (rt == ZT_NETWORK_RULE_ACTION_REDIRECT) {
+					ztDest = fwdAddr;
+					return DOZTFILTER_REDIRECT;
+				}
+				else {
+					cc = fwdAddr;
+					ccLength = (rule.v.fwd.length != 0) ? ((frameLen < (unsigned int)rule.v.fwd.length) ? frameLen : (unsigned int)rule.v.fwd.length) : frameLen;
+					ccWatch = (rt == ZT_NETWORK_RULE_ACTION_WATCH);
+				}
+			}
+		}
+			return -1;
+
+		case ZT_NETWORK_RULE_ACTION_BREAK:
+			return DOZTFILTER_NO_MATCH;
+
+		// Unrecognized ACTIONs are ignored as no-ops
+		default:
+			return -1;
+	}
+}
+
+// Note an ACTION whose set did not match
+static inline void _skipAction(const RuntimeEnvironment* RR, const bool inbound, const ZT_VirtualNetworkRule& rule, bool& superAccept)
+{
+	// If this is an incoming packet and we are a TEE or REDIRECT target, we should
+	// super-accept if we accept at all. This will cause us to accept redirected or
+	// tee'd packets in spite of MAC and ZT addressing checks.
+	if (inbound) {
+		switch ((ZT_VirtualNetworkRuleType)(rule.t & 0x3f)) {
+			case ZT_NETWORK_RULE_ACTION_TEE:
+			case ZT_NETWORK_RULE_ACTION_WATCH:
+			case ZT_NETWORK_RULE_ACTION_REDIRECT:
+				if (RR->identity.address() == rule.v.fwd.address) {
+					superAccept = true;
+				}
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+}	// anonymous namespace
+
+ZtFilterResult doZtFilter(
+	const RuntimeEnvironment* RR,
+	Trace::RuleResultLog& rrl,
+	const NetworkConfig& nconf,
+	const Membership* membership,	// can be NULL
+	const bool inbound,
+	const Address& ztSource,
+	Address& ztDest,   // MUTABLE -- is changed on REDIRECT actions
+	const MAC& macSource,
+	const MAC& macDest,
+	const uint8_t* const frameData,
+	const unsigned int frameLen,
+	const unsigned int etherType,
+	const unsigned int vlanId,
+	const ZT_VirtualNetworkRule* rules,	  // cannot be NULL
+	const unsigned int ruleCount,
+	Address& cc,			  // MUTABLE -- set to TEE destination if TEE action is taken or left alone otherwise
+	unsigned int& ccLength,	  // MUTABLE -- set to length of packet payload to TEE
+	bool& ccWatch,			  // MUTABLE -- set to true for WATCH target as opposed to normal TEE
+	uint8_t& qosBucket)		  // MUTABLE -- set to the value of the argument provided to PRIORITY
+{
+	// Set to true if we are a TEE/REDIRECT/WATCH target
+	bool superAccept = false;
+
+	// The default match state for each set of entries starts as 'true' since an
+	// ACTION with no MATCH entries preceding it is always taken.
+	uint8_t thisSetMatches = 1;
+	uint8_t skipDrop = 0;
+
+	rrl.clear();
+
+	for (unsigned int rn = 0; rn < ruleCount; ++rn) {
+		// First check if this is an ACTION
+		if ((unsigned int)(rules[rn].t & 0x3f) <= (unsigned int)ZT_NETWORK_RULE_ACTION__MAX_ID) {
+			if (thisSetMatches) {
+				const int r = _takeAction(RR, inbound, ztSource, ztDest, rules[rn], frameLen, superAccept, skipDrop, cc, ccLength, ccWatch, qosBucket);
+				if (r >= 0) {
+					return (ZtFilterResult)r;
+				}
+			}
+			else {
+				_skipAction(RR, inbound, rules[rn], superAccept);
+				thisSetMatches = 1;	  // reset to default true for next batch of entries
+			}
+			continue;
+		}
+
+		// Circuit breaker: no need to evaluate an AND if the set's match state
+		// is currently false since anything AND false is false.
+		if ((! thisSetMatches) && (! (rules[rn].t & 0x40))) {
+			rrl.logSkipped(rn, thisSetMatches);
+			continue;
+		}
+
+		// If this was not an ACTION evaluate next MATCH and update thisSetMatches with (AND [result])
+		const uint8_t thisRuleMatches = _matchRule(RR, nconf, membership, inbound, ztSource, ztDest, macSource, macDest, frameData, frameLen, etherType, vlanId, rules[rn], superAccept, skipDrop);
+
+		rrl.log(rn, thisRuleMatches, thisSetMatches);
+
+		if ((rules[rn].t & 0x40)) {
+			thisSetMatches |= (thisRuleMatches ^ ((rules[rn].t >> 7) & 1));
+		}
+		else {
+			thisSetMatches &= (thisRuleMatches ^ ((rules[rn].t >> 7) & 1));
+		}
+	}
+
+	return DOZTFILTER_NO_MATCH;
+}
+
+CompiledRules::Frame::Frame(const uint8_t* frameData, unsigned int frameLen, unsigned int et, unsigned int vid)
+	: data(frameData)
+	, len(frameLen)
+	, etherType(et)
+	, vlanId(vid)
+	, ipv4(false)
+	, ipv6(false)
+	, ipProtocol(-1)
+	, portsInvalid(true)
+	, sourcePort(-1)
+	, destPort(-1)
+	, ipv4Source(0)
+	, ipv4Dest(0)
+{
+	// Port quirks mirror _matchRule(): a missing port never matches, an IPv6
+	// port of zero is treated as missing, and an unparseable header fails
+	// even NOT matches.
+	if ((et == ZT_ETHERTYPE_IPV4) && (frameLen >= 20)) {
+		ipv4 = true;
+		ipProtocol = (int)frameData[9];
+		portsInvalid = false;
+		ipv4Source = ((uint32_t)frameData[12] << 24) | ((uint32_t)frameData[13] << 16) | ((uint32_t)frameData[14] << 8) | (uint32_t)frameData[15];
+		ipv4Dest = ((uint32_t)frameData[16] << 24) | ((uint32_t)frameData[17] << 16) | ((uint32_t)frameData[18] << 8) | (uint32_t)frameData[19];
+		const unsigned int headerLen = 4 * (frameData[0] & 0xf);
+		if ((_hasPorts(frameData[9])) && (frameLen > (headerLen + 4))) {
+			sourcePort = ((int)frameData[headerLen] << 8) | (int)frameData[headerLen + 1];
+			destPort = ((int)frameData[headerLen + 2] << 8) | (int)frameData[headerLen + 3];
+		}
+	}
+	else if (et == ZT_ETHERTYPE_IPV6) {
+		ipv6 = (frameLen >= 40);
+		unsigned int pos = 0, proto = 0;
+		if (FlowHash::ipv6GetPayload(frameData, frameLen, pos, proto)) {
+			ipProtocol = (int)(proto & 0xff);
+			portsInvalid = false;
+			if ((_hasPorts(proto)) && (frameLen > (pos + 4))) {
+				sourcePort = ((int)frameData[pos] << 8) | (int)frameData[pos + 1];
+				destPort = ((int)frameData[pos + 2] << 8) | (int)frameData[pos + 3];
+				if (sourcePort == 0) {
+					sourcePort = -1;
+				}
+				if (destPort == 0) {
+					destPort = -1;
+				}
+			}
+		}
+	}
+}
+
+bool CompiledRules::_flowInvariant(const ZT_VirtualNetworkRule& r)
+{
+	switch (r.t & 0x3f) {
+		case ZT_NETWORK_RULE_ACTION_TEE:
+		case ZT_NETWORK_RULE_ACTION_WATCH:
+			// A length limit makes the copy length depend on frame size
+			return (r.v.fwd.length == 0);
+		case ZT_NETWORK_RULE_MATCH_IP_TOS:
+		case ZT_NETWORK_RULE_MATCH_ICMP:
+		case ZT_NETWORK_RULE_MATCH_FRAME_SIZE_RANGE:
+		case ZT_NETWORK_RULE_MATCH_RANDOM:
+		case ZT_NETWORK_RULE_MATCH_INTEGER_RANGE:
+			return false;
+		case ZT_NETWORK_RULE_MATCH_CHARACTERISTICS:
+			// TCP flags vary per packet and IP ownership of ARP and NDP frames
+			// is checked against addresses inside the payload
+			return ((r.v.characteristics & (0xfffULL | ZT_RULE_PACKET_CHARACTERISTICS_SENDER_IP_AUTHENTICATED)) == 0);
+		default:
+			return true;
+	}
+}
+
+CompiledRules::CompiledRules() : _groupedSets(0), _cacheable(true)
+{
+}
+
+CompiledRules::CompiledRules(const ZT_VirtualNetworkRule* rules, unsigned int ruleCount) : _rules(rules, rules + ruleCount), _groupedSets(0), _cacheable(true)
+{
+	_prog.resize(ruleCount);
+	for (unsigned int i = 0; i < ruleCount; ++i) {
+		const ZT_VirtualNetworkRule& r = _rules[i];
+		_Insn& in = _prog[i];
+		memset(&in, 0, sizeof(_Insn));
+		in.t = r.t;
+		in.rule = (uint16_t)i;
+		in.op = (uint8_t)_opFor(r);
+		if (! _flowInvariant(r)) {
+			_cacheable = false;
+		}
+		switch (in.op) {
+			case OP_ZT_SOURCE:
+			case OP_ZT_DEST:
+				in.v[0] = r.v.zt;
+				break;
+			case OP_VLAN_ID:
+				in.v[0] = r.v.vlanId;
+				break;
+			case OP_MAC_SOURCE:
+			case OP_MAC_DEST:
+				in.v[0] = MAC(r.v.mac, 6).toInt();
+				break;
+			case OP_ETHERTYPE:
+				in.v[0] = r.v.etherType;
+				break;
+			case OP_IP_PROTOCOL:
+				in.v[0] = r.v.ipProtocol;
+				break;
+			case OP_IPV4_SOURCE:
+			case OP_IPV4_DEST:
+				in.v[0] = Utils::ntoh((uint32_t)r.v.ipv4.ip);
+				in.v[1] = r.v.ipv4.mask;
+				break;
+			case OP_IPV6_SOURCE:
+			case OP_IPV6_DEST: {
+				// Like InetAddress::containsAddress() the rule's address is
+				// not masked, so host bits in it make the rule never match.
+				const unsigned int bits = r.v.ipv6.mask;
+				in.v[0] = _be64(r.v.ipv6.ip);
+				in.v[1] = _be64(r.v.ipv6.ip + 8);
+				in.v[2] = (bits == 0) ? 0ULL : ((bits >= 64) ? 0xffffffffffffffffULL : (0xffffffffffffffffULL << (64 - bits)));
+				in.v[3] = (bits <= 64) ? 0ULL : (0xffffffffffffffffULL << (128 - bits));
+			} break;
+			case OP_SOURCE_PORT:
+			case OP_DEST_PORT:
+				in.v[0] = r.v.port[0];
+				in.v[1] = r.v.port[1];
+				break;
+			case OP_FRAME_SIZE:
+				in.v[0] = r.v.frameSize[0];
+				in.v[1] = r.v.frameSize[1];
+				break;
+			default:
+				break;
+		}
+	}
+
+	// Circuit breaker targets: once a set is false every following AND match
+	// up to the next OR match or ACTION is skipped.
+	unsigned int target = ruleCount;
+	for (unsigned int i = ruleCount; i > 0; --i) {
+		_Insn& in = _prog[i - 1];
+		in.next = (uint16_t)target;
+		if ((in.op == OP_ACTION) || ((in.t & 0x40) != 0)) {
+			target = i - 1;
+		}
+	}
+
+	// Merge runs of single-match sets ending in a terminal ACTION. A set can
+	// only start a run at a set boundary, where the set's state is always true.
+	for (unsigned int i = 0; (i + 1) < ruleCount;) {
+		std::vector<uint16_t> sets;
+		const uint8_t op = _prog[i].op;
+		unsigned int j = i;
+		while ((j + 1) < ruleCount) {
+			const _Insn& m = _prog[j];
+			if ((m.op != op) || (m.op == OP_ACTION) || (m.op == OP_GENERIC) || ((m.t & 0xc0) != 0) || ((j > 0) && (_prog[j - 1].op != OP_ACTION)) || (_prog[j + 1].op != OP_ACTION)) {
+				break;
+			}
+			const unsigned int at = _rules[j + 1].t & 0x3f;
+			if ((at != ZT_NETWORK_RULE_ACTION_DROP) && (at != ZT_NETWORK_RULE_ACTION_ACCEPT) && (at != ZT_NETWORK_RULE_ACTION_BREAK) && (at != ZT_NETWORK_RULE_ACTION_PRIORITY)) {
+				break;
+			}
+			sets.push_back((uint16_t)j);
+			j += 2;
+		}
+		if (sets.size() >= ZT_COMPILED_RULES_MIN_GROUP) {
+			_groups.push_back(_Group());
+			_Group& g = _groups.back();
+			g.op = op;
+			g.first = i;
+			g.sets.swap(sets);
+			_buildGroup(g);
+			_groupedSets += (unsigned int)g.sets.size();
+			_prog[i].op = OP_GROUP;
+			_prog[i].group = (uint16_t)(_groups.size() - 1);
+			_prog[i].next = (uint16_t)j;
+			i = j;
+		}
+		else {
+			++i;
+		}
+	}
+}
+
+ZtFilterResult CompiledRules::filter(
+	const RuntimeEnvironment* RR,
+	const NetworkConfig& nconf,
+	const Membership* membership,
+	const bool inbound,
+	const Address& ztSource,
+	Address& ztDest,
+	const MAC& macSource,
+	const MAC& macDest,
+	const Frame& frame,
+	Address& cc,
+	unsigned int& ccLength,
+	bool& ccWatch,
+	uint8_t& qosBucket) const
+{
+	bool superAccept = false;
+	uint8_t thisSetMatches = 1;
+	uint8_t skipDrop = 0;
+
+	const unsigned int n = (unsigned int)_prog.size();
+	unsigned int pc = 0;
+	while (pc < n) {
+		const _Insn& in = _prog[pc];
+		uint8_t thisRuleMatches;
+		switch (in.op) {
+			case OP_ACTION: {
+				if (thisSetMatches) {
+					const int r = _takeAction(RR, inbound, ztSource, ztDest, _rules[in.rule], frame.len, superAccept, skipDrop, cc, ccLength, ccWatch, qosBucket);
+					if (r >= 0) {
+						return (ZtFilterResult)r;
+					}
+				}
+				else {
+					_skipAction(RR, inbound, _rules[in.rule], superAccept);
+					thisSetMatches = 1;
+				}
+				++pc;
+			}
+				continue;
+
+			case OP_GROUP: {
+				const _Group& g = _groups[in.group];
+				const int32_t hit = _lookupGroup(g, ztSource, ztDest, macSource, macDest, frame);
+				if (hit < 0) {
+					pc = in.next;
+					continue;
+				}
+				const int r = _takeAction(RR, inbound, ztSource, ztDest, _rules[g.sets[hit] + 1], frame.len, superAccept, skipDrop, cc, ccLength, ccWatch, qosBucket);
+				if (r >= 0) {
+					return (ZtFilterResult)r;
+				}
+				// A DROP skipped because of a lenient tag match, so carry on with the next set
+				pc = g.sets[hit] + 2;
+			}
+				continue;
+
+			case OP_GENERIC:
+				if ((! thisSetMatches) && (! (in.t & 0x40))) {
+					pc = in.next;
+					continue;
+				}
+				thisRuleMatches = _matchRule(RR, nconf, membership, inbound, ztSource, ztDest, macSource, macDest, frame.data, frame.len, frame.etherType, frame.vlanId, _rules[in.rule], superAccept, skipDrop) ^ ((in.t >> 7) & 1);
+				break;
+
+			default: {
+				if ((! thisSetMatches) && (! (in.t & 0x40))) {
+					pc = in.next;
+					continue;
+				}
+				const unsigned int m = _matchSpecialized(in, ztSource, ztDest, macSource, macDest, frame);
+				thisRuleMatches = (m == ZT_COMPILED_RULES_HARD_NO) ? (uint8_t)0 : (uint8_t)(m ^ ((in.t >> 7) & 1));
+			} break;
+		}
+
+		if ((in.t & 0x40)) {
+			thisSetMatches |= thisRuleMatches;
+		}
+		else {
+			thisSetMatches &= thisRuleMatches;
+		}
+		++pc;
+	}
+
+	return DOZTFILTER_NO_MATCH;
+}
+
+CompiledRules::_Op CompiledRules::_opFor(const ZT_VirtualNetworkRule& r)
+{
+	const unsigned int rt = r.t & 0x3f;
+	if (rt <= (unsigned int)ZT_NETWORK_RULE_ACTION__MAX_ID) {
+		return OP_ACTION;
+	}
+	switch (rt) {
+		case ZT_NETWORK_RULE_MATCH_SOURCE_ZEROTIER_ADDRESS:
+			return OP_ZT_SOURCE;
+		case ZT_NETWORK_RULE_MATCH_DEST_ZEROTIER_ADDRESS:
+			return OP_ZT_DEST;
+		case ZT_NETWORK_RULE_MATCH_VLAN_ID:
+			return OP_VLAN_ID;
+		case ZT_NETWORK_RULE_MATCH_MAC_SOURCE:
+			return OP_MAC_SOURCE;
+		case ZT_NETWORK_RULE_MATCH_MAC_DEST:
+			return OP_MAC_DEST;
+		case ZT_NETWORK_RULE_MATCH_ETHERTYPE:
+			return OP_ETHERTYPE;
+		case ZT_NETWORK_RULE_MATCH_IP_PROTOCOL:
+			return OP_IP_PROTOCOL;
+		// Out of range netmasks are left to InetAddress to keep its exact behavior
+		case ZT_NETWORK_RULE_MATCH_IPV4_SOURCE:
+			return (r.v.ipv4.mask <= 32) ? OP_IPV4_SOURCE : OP_GENERIC;
+		case ZT_NETWORK_RULE_MATCH_IPV4_DEST:
+			return (r.v.ipv4.mask <= 32) ? OP_IPV4_DEST : OP_GENERIC;
+		case ZT_NETWORK_RULE_MATCH_IPV6_SOURCE:
+			return (r.v.ipv6.mask <= 128) ? OP_IPV6_SOURCE : OP_GENERIC;
+		case ZT_NETWORK_RULE_MATCH_IPV6_DEST:
+			return (r.v.ipv6.mask <= 128) ? OP_IPV6_DEST : OP_GENERIC;
+		case ZT_NETWORK_RULE_MATCH_IP_SOURCE_PORT_RANGE:
+			return OP_SOURCE_PORT;
+		case ZT_NETWORK_RULE_MATCH_IP_DEST_PORT_RANGE:
+			return OP_DEST_PORT;
+		case ZT_NETWORK_RULE_MATCH_FRAME_SIZE_RANGE:
+			return OP_FRAME_SIZE;
+		default:
+			return OP_GENERIC;
+	}
+}
+
+unsigned int CompiledRules::_matchSpecialized(const _Insn& in, const Address& ztSource, const Address& ztDest, const MAC& macSource, const MAC& macDest, const Frame& f)
+{
+	switch (in.op) {
+		case OP_ZT_SOURCE:
+			return (unsigned int)(in.v[0] == ztSource.toInt());
+		case OP_ZT_DEST:
+			return (unsigned int)(in.v[0] == ztDest.toInt());
+		case OP_VLAN_ID:
+			return (unsigned int)(in.v[0] == (uint64_t)((uint16_t)f.vlanId));
+		case OP_MAC_SOURCE:
+			return (unsigned int)(in.v[0] == macSource.toInt());
+		case OP_MAC_DEST:
+			return (unsigned int)(in.v[0] == macDest.toInt());
+		case OP_ETHERTYPE:
+			return (unsigned int)(in.v[0] == (uint64_t)((uint16_t)f.etherType));
+		case OP_IP_PROTOCOL:
+			if (f.ipProtocol < 0) {
+				return ZT_COMPILED_RULES_HARD_NO;
+			}
+			return (unsigned int)(in.v[0] == (uint64_t)f.ipProtocol);
+		case OP_IPV4_SOURCE:
+		case OP_IPV4_DEST: {
+			if (! f.ipv4) {
+				return ZT_COMPILED_RULES_HARD_NO;
+			}
+			const unsigned int bits = (unsigned int)in.v[1];
+			if (bits == 0) {
+				return 1;
+			}
+			const uint32_t a = (in.op == OP_IPV4_SOURCE) ? f.ipv4Source : f.ipv4Dest;
+			return (unsigned int)((a >> (32 - bits)) == ((uint32_t)in.v[0] >> (32 - bits)));
+		}
+		case OP_IPV6_SOURCE:
+		case OP_IPV6_DEST: {
+			if (! f.ipv6) {
+				return ZT_COMPILED_RULES_HARD_NO;
+			}
+			const uint8_t* const a = f.data + ((in.op == OP_IPV6_SOURCE) ? 8 : 24);
+			return (unsigned int)(((_be64(a) & in.v[2]) == in.v[0]) && ((_be64(a + 8) & in.v[3]) == in.v[1]));
+		}
+		case OP_SOURCE_PORT:
+		case OP_DEST_PORT: {
+			if (f.portsInvalid) {
+				return ZT_COMPILED_RULES_HARD_NO;
+			}
+			const int p = (in.op == OP_SOURCE_PORT) ? f.sourcePort : f.destPort;
+			return (unsigned int)((p >= 0) && ((uint64_t)p >= in.v[0]) && ((uint64_t)p <= in.v[1]));
+		}
+		case OP_FRAME_SIZE:
+			return (unsigned int)(((uint64_t)f.len >= in.v[0]) && ((uint64_t)f.len <= in.v[1]));
+		default:
+			return 0;
+	}
+}
+
+int32_t CompiledRules::_lookupGroup(const _Group& g, const Address& ztSource, const Address& ztDest, const MAC& macSource, const MAC& macDest, const Frame& f)
+{
+	uint64_t k;
+	switch (g.op) {
+		case OP_ZT_SOURCE:
+			k = ztSource.toInt();
+			break;
+		case OP_ZT_DEST:
+			k = ztDest.toInt();
+			break;
+		case OP_VLAN_ID:
+			k = (uint16_t)f.vlanId;
+			break;
+		case OP_MAC_SOURCE:
+			k = macSource.toInt();
+			break;
+		case OP_MAC_DEST:
+			k = macDest.toInt();
+			break;
+		case OP_ETHERTYPE:
+			k = (uint16_t)f.etherType;
+			break;
+		case OP_IP_PROTOCOL:
+			if (f.ipProtocol < 0) {
+				return -1;
+			}
+			k = (uint64_t)f.ipProtocol;
+			break;
+
+		case OP_SOURCE_PORT:
+		case OP_DEST_PORT:
+		case OP_FRAME_SIZE: {
+			if (g.op == OP_FRAME_SIZE) {
+				k = f.len;
+			}
+			else {
+				const int p = (g.op == OP_SOURCE_PORT) ? f.sourcePort : f.destPort;
+				if ((f.portsInvalid) || (p < 0)) {
+					return -1;
+				}
+				k = (uint64_t)p;
+			}
+			// Intervals: keys are sorted start points of elementary intervals
+			std::vector<uint64_t>::const_iterator i(std::upper_bound(g.keys.begin(), g.keys.end(), k));
+			if (i == g.keys.begin()) {
+				return -1;
+			}
+			return g.hits[(i - g.keys.begin()) - 1];
+		}
+
+		case OP_IPV4_SOURCE:
+		case OP_IPV4_DEST:
+		case OP_IPV6_SOURCE:
+		case OP_IPV6_DEST: {
+			// Walk the prefix trie keeping the first set of any prefix passed
+			uint64_t a[2];
+			unsigned int bits;
+			if ((g.op == OP_IPV4_SOURCE) || (g.op == OP_IPV4_DEST)) {
+				if (! f.ipv4) {
+					return -1;
+				}
+				a[0] = ((uint64_t)((g.op == OP_IPV4_SOURCE) ? f.ipv4Source : f.ipv4Dest)) << 32;
+				a[1] = 0;
+				bits = 32;
+			}
+			else {
+				if (! f.ipv6) {
+					return -1;
+				}
+				const uint8_t* const p = f.data + ((g.op == OP_IPV6_SOURCE) ? 8 : 24);
+				a[0] = _be64(p);
+				a[1] = _be64(p + 8);
+				bits = 128;
+			}
+			int32_t best = g.trie[0].set;
+			int32_t node = 0;
+			for (unsigned int b = 0; b < bits; ++b) {
+				node = g.trie[node].child[(a[b >> 6] >> (63 - (b & 63))) & 1];
+				if (node < 0) {
+					break;
+				}
+				const int32_t s = g.trie[node].set;
+				if ((s >= 0) && ((best < 0) || (s < best))) {
+					best = s;
+				}
+			}
+			return best;
+		}
+
+		default:
+			return -1;
+	}
+
+	// Exact keys
+	std::vector<uint64_t>::const_iterator i(std::lower_bound(g.keys.begin(), g.keys.end(), k));
+	if ((i == g.keys.end()) || (*i != k)) {
+		return -1;
+	}
+	return g.hits[i - g.keys.begin()];
+}
+
+void CompiledRules::_buildGroup(_Group& g) const
+{
+	switch (g.op) {
+		case OP_SOURCE_PORT:
+		case OP_DEST_PORT:
+		case OP_FRAME_SIZE: {
+			std::vector<uint64_t> points;
+			points.push_back(0);
+			for (unsigned int s = 0; s < (unsigned int)g.sets.size(); ++s) {
+				const _Insn& in = _prog[g.sets[s]];
+				if (in.v[0] <= in.v[1]) {
+					points.push_back(in.v[0]);
+					points.push_back(in.v[1] + 1);
+				}
+			}
+			std::sort(points.begin(), points.end());
+			points.erase(std::unique(points.begin(), points.end()), points.end());
+			for (std::vector<uint64_t>::const_iterator p(points.begin()); p != points.end(); ++p) {
+				int32_t hit = -1;
+				for (unsigned int s = 0; s < (unsigned int)g.sets.size(); ++s) {
+					const _Insn& in = _prog[g.sets[s]];
+					if ((*p >= in.v[0]) && (*p <= in.v[1])) {
+						hit = (int32_t)s;
+						break;
+					}
+				}
+				g.keys.push_back(*p);
+				g.hits.push_back(hit);
+			}
+		} break;
+
+		case OP_IPV4_SOURCE:
+		case OP_IPV4_DEST:
+		case OP_IPV6_SOURCE:
+		case OP_IPV6_DEST: {
+			const bool v4 = ((g.op == OP_IPV4_SOURCE) || (g.op == OP_IPV4_DEST));
+			_TrieNode root;
+			root.child[0] = -1;
+			root.child[1] = -1;
+			root.set = -1;
+			g.trie.push_back(root);
+			for (unsigned int s = 0; s < (unsigned int)g.sets.size(); ++s) {
+				const _Insn& in = _prog[g.sets[s]];
+				uint64_t a[2];
+				unsigned int bits;
+				if (v4) {
+					a[0] = in.v[0] << 32;
+					a[1] = 0;
+					bits = (unsigned int)in.v[1];
+				}
+				else {
+					if (((in.v[0] & in.v[2]) != in.v[0]) || ((in.v[1] & in.v[3]) != in.v[1])) {
+						continue;	// host bits set, can never match
+					}
+					a[0] = in.v[0];
+					a[1] = in.v[1];
+					bits = 128;
+					for (unsigned int b = 0; b < 128; ++b) {
+						if (((in.v[2 + (b >> 6)] >> (63 - (b & 63))) & 1) == 0) {
+							bits = b;
+							break;
+						}
+					}
+				}
+				int32_t node = 0;
+				for (unsigned int b = 0; b < bits; ++b) {
+					const unsigned int c = (unsigned int)((a[b >> 6] >> (63 - (b & 63))) & 1);
+					if (g.trie[node].child[c] < 0) {
+						_TrieNode n;
+						n.child[0] = -1;
+						n.child[1] = -1;
+						n.set = -1;
+						g.trie.push_back(n);
+						g.trie[node].child[c] = (int32_t)(g.trie.size() - 1);
+					}
+					node = g.trie[node].child[c];
+				}
+				if (g.trie[node].set < 0) {
+					g.trie[node].set = (int32_t)s;
+				}
+			}
+		} break;
+
+		default: {
+			std::map<uint64_t, int32_t> first;
+			for (unsigned int s = 0; s < (unsigned int)g.sets.size(); ++s) {
+				first.insert(std::pair<uint64_t, int32_t>(_prog[g.sets[s]].v[0], (int32_t)s));
+			}
+			for (std::map<uint64_t, int32_t>::const_iterator f(first.begin()); f != first.end(); ++f) {
+				g.keys.push_back(f->first);
+				g.hits.push_back(f->second);
+			}
+		} break;
+	}
+}
+
+}	// namespace ZeroTier
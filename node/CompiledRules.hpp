@@ -0,0 +1,243 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * (c) ZeroTier, Inc.
+ * https://www.zerotier.com/
+ */
+
+#ifndef ZT_COMPILEDRULES_HPP
+#define ZT_COMPILEDRULES_HPP
+
+#include "../include/ZeroTierOne.h"
+#include "Address.hpp"
+#include "Constants.hpp"
+#include "MAC.hpp"
+#include "Trace.hpp"
+
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Minimum number of consecutive single-match rule sets merged into one lookup
+ */
+#define ZT_COMPILED_RULES_MIN_GROUP 4
+
+namespace ZeroTier {
+
+class RuntimeEnvironment;
+class NetworkConfig;
+class Membership;
+
+/**
+ * Result of evaluating one rule set against a frame
+ */
+enum ZtFilterResult { DOZTFILTER_NO_MATCH, DOZTFILTER_DROP, DOZTFILTER_REDIRECT, DOZTFILTER_ACCEPT, DOZTFILTER_SUPER_ACCEPT };
+
+/**
+ * Evaluate a rule set by interpreting it one rule at a time
+ *
+ * This is the reference implementation of the rules engine. It is used when
+ * remote tracing is enabled since it records a per-rule result log.
+ *
+ * @param RR Runtime environment
+ * @param rrl Rule result log (cleared and then filled)
+ * @param nconf Network configuration
+ * @param membership Membership of remote peer or NULL if none
+ * @param inbound True if frame is inbound
+ * @param ztSource ZeroTier source address
+ * @param ztDest ZeroTier destination address (changed by REDIRECT)
+ * @param macSource Source MAC
+ * @param macDest Destination MAC
+ * @param frameData Frame payload
+ * @param frameLen Length of frame payload
+ * @param etherType Ethernet type
+ * @param vlanId VLAN ID
+ * @param rules Rules to evaluate
+ * @param ruleCount Number of rules
+ * @param cc Set to TEE/WATCH destination if one is taken
+ * @param ccLength Set to length of frame to TEE/WATCH
+ * @param ccWatch Set to true if cc is a WATCH target
+ * @param qosBucket Set to argument of PRIORITY action if one is taken
+ * @return Result
+ */
+ZtFilterResult doZtFilter(
+	const RuntimeEnvironment* RR,
+	Trace::RuleResultLog& rrl,
+	const NetworkConfig& nconf,
+	const Membership* membership,
+	const bool inbound,
+	const Address& ztSource,
+	Address& ztDest,
+	const MAC& macSource,
+	const MAC& macDest,
+	const uint8_t* const frameData,
+	const unsigned int frameLen,
+	const unsigned int etherType,
+	const unsigned int vlanId,
+	const ZT_VirtualNetworkRule* rules,
+	const unsigned int ruleCount,
+	Address& cc,
+	unsigned int& ccLength,
+	bool& ccWatch,
+	uint8_t& qosBucket);
+
+/**
+ * A rule set compiled for fast evaluation
+ *
+ * Compilation turns each rule into an instruction that tests pre-parsed frame
+ * fields and carries a jump past the AND matches that the interpreter's
+ * circuit breaker would skip. Runs of at least ZT_COMPILED_RULES_MIN_GROUP
+ * consecutive rule sets that each consist of one plain match of the same
+ * kind followed by a terminal action (typical of long allow and deny lists)
+ * are merged into a single lookup: sorted keys for exact matches, elementary
+ * intervals for port and frame size ranges and a binary prefix trie for IP
+ * networks. Each lookup returns the first set in the run that matches, so
+ * evaluation order and results are exactly those of doZtFilter().
+ *
+ * Compiled rule sets are immutable once built and are built when a network
+ * config or capability is applied, never on the packet path.
+ */
+class CompiledRules {
+  public:
+	/**
+	 * Frame headers parsed once for all rule sets evaluated against a frame
+	 */
+	class Frame {
+	  public:
+		Frame(const uint8_t* frameData, unsigned int frameLen, unsigned int etherType, unsigned int vlanId);
+
+		const uint8_t* data;
+		unsigned int len;
+		unsigned int etherType;
+		unsigned int vlanId;
+
+		bool ipv4;			 // IPv4 header present
+		bool ipv6;			 // IPv6 header present
+		int ipProtocol;		 // IP protocol or -1 if not IP or unparseable
+		bool portsInvalid;	 // port matches are hard failures (not IP or unparseable)
+		int sourcePort;		 // source port or -1 if none
+		int destPort;		 // destination port or -1 if none
+		uint32_t ipv4Source;   // host byte order
+		uint32_t ipv4Dest;	   // host byte order
+	};
+
+	CompiledRules();
+
+	/**
+	 * @param rules Rules to compile (copied)
+	 * @param ruleCount Number of rules
+	 */
+	CompiledRules(const ZT_VirtualNetworkRule* rules, unsigned int ruleCount);
+
+	/**
+	 * Evaluate this rule set
+	 *
+	 * Arguments and results are as for doZtFilter(), except that no rule
+	 * result log is kept.
+	 */
+	ZtFilterResult filter(
+		const RuntimeEnvironment* RR,
+		const NetworkConfig& nconf,
+		const Membership* membership,
+		const bool inbound,
+		const Address& ztSource,
+		Address& ztDest,
+		const MAC& macSource,
+		const MAC& macDest,
+		const Frame& frame,
+		Address& cc,
+		unsigned int& ccLength,
+		bool& ccWatch,
+		uint8_t& qosBucket) const;
+
+	/**
+	 * @return Number of rules compiled
+	 */
+	inline unsigned int ruleCount() const
+	{
+		return (unsigned int)_rules.size();
+	}
+
+	/**
+	 * @return Number of rule sets merged into group lookups
+	 */
+	inline unsigned int groupedSetCount() const
+	{
+		return _groupedSets;
+	}
+
+	/**
+	 * Check whether this rule set gives the same result for every frame of a flow
+	 *
+	 * This is false if any rule looks at something other than addresses,
+	 * ports, protocol, ethertype, VLAN and credentials, such as RANDOM, frame
+	 * size, TOS, ICMP type, TCP flags or arbitrary payload bytes.
+	 *
+	 * @return True if results may be cached by flow (see FlowCache)
+	 */
+	inline bool cacheable() const
+	{
+		return _cacheable;
+	}
+
+  private:
+	enum _Op {
+		OP_ACTION,
+		OP_GENERIC,
+		OP_ZT_SOURCE,
+		OP_ZT_DEST,
+		OP_VLAN_ID,
+		OP_MAC_SOURCE,
+		OP_MAC_DEST,
+		OP_ETHERTYPE,
+		OP_IP_PROTOCOL,
+		OP_IPV4_SOURCE,
+		OP_IPV4_DEST,
+		OP_IPV6_SOURCE,
+		OP_IPV6_DEST,
+		OP_SOURCE_PORT,
+		OP_DEST_PORT,
+		OP_FRAME_SIZE,
+		OP_GROUP
+	};
+
+	struct _Insn {
+		uint8_t op;
+		uint8_t t;			 // rule type and NOT/OR flags
+		uint16_t rule;		 // index in _rules
+		uint16_t next;		 // where to go if this AND match can be skipped
+		uint16_t group;		 // index in _groups for OP_GROUP
+		uint64_t v[4];		 // pre-decoded match arguments
+	};
+
+	struct _TrieNode {
+		int32_t child[2];
+		int32_t set;   // first set ending at this prefix or -1
+	};
+
+	struct _Group {
+		uint8_t op;					// match op shared by all sets
+		unsigned int first;			// index in _prog of first set
+		std::vector<uint16_t> sets;	// index in _prog of each set's match
+		std::vector<uint64_t> keys;	// sorted keys or interval start points
+		std::vector<int32_t> hits;	// first set for each entry in keys or -1
+		std::vector<_TrieNode> trie;
+	};
+
+	static _Op _opFor(const ZT_VirtualNetworkRule& r);
+	static bool _flowInvariant(const ZT_VirtualNetworkRule& r);
+	static unsigned int _matchSpecialized(const _Insn& in, const Address& ztSource, const Address& ztDest, const MAC& macSource, const MAC& macDest, const Frame& f);
+	static int32_t _lookupGroup(const _Group& g, const Address& ztSource, const Address& ztDest, const MAC& macSource, const MAC& macDest, const Frame& f);
+	void _buildGroup(_Group& g) const;
+
+	std::vector<ZT_VirtualNetworkRule> _rules;
+	std::vector<_Insn> _prog;
+	std::vector<_Group> _groups;
+	unsigned int _groupedSets;
+	bool _cacheable;
+};
+
+}	// namespace ZeroTier
+
+#endif
@@ -300,10 +300,20 @@
 #define ZT_RX_QUEUE_SIZE 32
 
 /**
- * Size of TX queue
+ * Maximum number of packets queued for one destination awaiting WHOIS or a path
  */
 #define ZT_TX_QUEUE_SIZE 32
 
+/**
+ * Maximum bytes of packets queued for one destination
+ */
+#define ZT_TX_QUEUE_MAX_BYTES 65536
+
+/**
+ * Maximum number of destinations with queued packets
+ */
+#define ZT_TX_QUEUE_MAX_DESTINATIONS 4096
+
 /**
  * Minimum delay between timer task checks to prevent thrashing
  */
@@ -314,11 +324,32 @@
  */
 #define ZT_HOUSEKEEPING_PERIOD 30000
 
+/**
+ * Maximum table entries visited per background task call by incremental cleaning
+ *
+ * Multicaster::clean() and Network::clean() start a pass every
+ * ZT_HOUSEKEEPING_PERIOD and finish it in slices of about this many
+ * entries, so their locks are never held for a whole table walk.
+ */
+#define ZT_HOUSEKEEPING_CLEAN_BUDGET 1024
+
 /**
  * Delay between WHOIS retries in ms
  */
 #define ZT_WHOIS_RETRY_DELAY 500
 
+/**
+ * Maximum time in ms a WHOIS request waits to be batched with others
+ */
+#define ZT_WHOIS_BATCH_DELAY 100
+
+/**
+ * Maximum number of addresses in one WHOIS request
+ *
+ * At this size the reply still fits in one unfragmented packet.
+ */
+#define ZT_WHOIS_BATCH_MAX 16
+
 /**
  * Transmit queue entry timeout
  */
@@ -336,6 +367,23 @@
  */
 #define ZT_RELAY_MAX_HOPS 3
 
+/**
+ * Number of slots in the relay's cache of destination paths
+ */
+#define ZT_RELAY_ROUTE_CACHE_SIZE 4096
+
+/**
+ * How long a cached relay path is used before it is looked up again in ms
+ *
+ * A cached direct path that stops being alive is looked up again at once.
+ */
+#define ZT_RELAY_ROUTE_TTL 500
+
+/**
+ * Number of slots in the lock-free filter of recent unite attempts
+ */
+#define ZT_RELAY_UNITE_FILTER_SIZE 4096
+
 /**
  * Expire time for multicast 'likes' and indirect multicast memberships in ms
  */
@@ -363,6 +411,23 @@
  */
 #define ZT_PING_CHECK_INTERVAL 5000
 
+/**
+ * Maximum number of due peers handled by one background task pass
+ *
+ * Peers left over are handled by the next pass, one timer granularity later.
+ */
+#define ZT_PEER_TIMER_BUDGET 1024
+
+/**
+ * How often each path is checked for being unused and dropped, in ms
+ */
+#define ZT_PATH_UNUSED_CHECK_INTERVAL ZT_HOUSEKEEPING_PERIOD
+
+/**
+ * Maximum number of due path checks handled by one background task pass
+ */
+#define ZT_PATH_TIMER_BUDGET 1024
+
 /**
  * How often the local.conf file is checked for changes (service, should be moved there)
  */
@@ -388,6 +453,14 @@
  */
 #define ZT_PEER_PATH_EXPIRATION ((ZT_PEER_PING_PERIOD * 4) + 3000)
 
+/**
+ * Number of path slots stored inline in each peer
+ *
+ * Most peers have one or two paths. Further slots are allocated as a peer
+ * needs them, up to ZT_MAX_PEER_NETWORK_PATHS.
+ */
+#define ZT_PEER_INLINE_PATHS 2
+
 /**
  * How often to retry expired paths that we're still remembering
  */
@@ -495,11 +568,19 @@
 #define ZT_AQM_NUM_BUCKETS 9
 
 /**
- * All unspecified traffic is put in this bucket. Anything in a bucket with a
- * smaller value is de-prioritized. Anything in a bucket with a higher value is
- prioritized over other traffic.
+ * QoS bucket of traffic that no PRIORITY rule classified
+ *
+ * Such traffic is not put in any of the ZT_AQM_NUM_BUCKETS buckets rules
+ * select, but spread by flow ID over ZT_AQM_NUM_DEFAULT_SUBQUEUES queues of
+ * its own so that flows are isolated from one another. Those queues share
+ * one ZT_AQM_QUANTUM, so against rule buckets they weigh as one bucket.
+ */
+#define ZT_AQM_UNCLASSIFIED 0xff
+
+/**
+ * Number of queues unclassified traffic is spread over
  */
-#define ZT_AQM_DEFAULT_BUCKET 0
+#define ZT_AQM_NUM_DEFAULT_SUBQUEUES 8
 
 /**
  * Timeout for overall peer activity (measured from last receive)
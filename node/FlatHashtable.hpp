@@ -0,0 +1,591 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * (c) ZeroTier, Inc.
+ * https://www.zerotier.com/
+ */
+
+#ifndef ZT_FLATHASHTABLE_HPP
+#define ZT_FLATHASHTABLE_HPP
+
+#include "Constants.hpp"
+#include "Utils.hpp"
+
+#include <new>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+
+/**
+ * Number of control bytes examined at once when probing a FlatHashtable
+ */
+#define ZT_FLATHASHTABLE_GROUP 16
+
+namespace ZeroTier {
+
+/**
+ * Open addressing hash table with the same interface as Hashtable
+ *
+ * Entries are stored inline in one array next to an array of control bytes,
+ * one per slot, holding 7 bits of the entry's hash or an empty or deleted
+ * marker. Lookups examine a group of 16 control bytes at a time (with SSE2
+ * where available) and only compare keys whose stored hash bits match, so a
+ * lookup usually touches one cache line of control bytes and one of entries
+ * and never chases pointers.
+ *
+ * Key hashes are mixed with a random per-process secret, so that which keys
+ * collide cannot be predicted by whoever chooses them (e.g. remote peers
+ * choosing addresses and ports).
+ *
+ * Unlike Hashtable, set() and operator[] may move existing entries, so
+ * pointers and references to values are only valid until the next insert.
+ * Erasing never moves entries, so any entry (not just the current one) may
+ * be erased while iterating.
+ */
+template <typename K, typename V> class FlatHashtable {
+  private:
+	struct _Slot {
+		_Slot(const K& k, const V& v) : k(k), v(v)
+		{
+		}
+		_Slot(const K& k) : k(k), v()
+		{
+		}
+		K k;
+		V v;
+	};
+
+	enum { _EMPTY = -128, _DELETED = -2 };
+
+  public:
+	/**
+	 * A simple forward iterator (different from STL)
+	 *
+	 * Any key may be erased during iteration. Don't use set() since that may
+	 * rehash and invalidate the iterator. Note the erasing the key will destroy
+	 * the targets of the pointers returned by next().
+	 *
+	 * Long walks can be split up by saving position() and later starting a
+	 * new iterator there. If the table was rehashed in between, entries may
+	 * be skipped or visited twice but the walk still ends.
+	 */
+	class Iterator {
+	  public:
+		/**
+		 * @param ht Hash table to iterate over
+		 * @param start Position to start at (default: beginning)
+		 */
+		Iterator(FlatHashtable& ht, const unsigned long start = 0) : _idx(start), _ht(&ht)
+		{
+		}
+
+		/**
+		 * @param kptr Pointer to set to point to next key
+		 * @param vptr Pointer to set to point to next value
+		 * @return True if kptr and vptr are set, false if no more entries
+		 */
+		inline bool next(K*& kptr, V*& vptr)
+		{
+			while (_idx < _ht->_cap) {
+				const unsigned long i = _idx++;
+				if (_ht->_ctrl[i] >= 0) {
+					kptr = &(_ht->_slots[i].k);
+					vptr = &(_ht->_slots[i].v);
+					return true;
+				}
+			}
+			return false;
+		}
+
+		/**
+		 * @return Position from which a new iterator would continue this one
+		 */
+		inline unsigned long position() const
+		{
+			return _idx;
+		}
+
+	  private:
+		unsigned long _idx;
+		FlatHashtable* _ht;
+	};
+
+	/**
+	 * @param bc Initial capacity in entries (default: 64), allocated on first insert
+	 */
+	FlatHashtable(unsigned long bc = 64) : _ctrl((int8_t*)0), _slots((_Slot*)0), _cap(0), _s(0), _growthLeft(0), _initialCap(_capacityFor(bc))
+	{
+	}
+
+	FlatHashtable(const FlatHashtable<K, V>& ht) : _ctrl((int8_t*)0), _slots((_Slot*)0), _cap(0), _s(0), _growthLeft(0), _initialCap(ht._initialCap)
+	{
+		_copy(ht);
+	}
+
+	~FlatHashtable()
+	{
+		_free();
+	}
+
+	inline FlatHashtable& operator=(const FlatHashtable<K, V>& ht)
+	{
+		if (this != &ht) {
+			_free();
+			_initialCap = ht._initialCap;
+			_copy(ht);
+		}
+		return *this;
+	}
+
+	/**
+	 * Erase all entries
+	 */
+	inline void clear()
+	{
+		if (_s) {
+			for (unsigned long i = 0; i < _cap; ++i) {
+				if (_ctrl[i] >= 0) {
+					_slots[i].~_Slot();
+				}
+			}
+			_s = 0;
+		}
+		if (_cap) {
+			memset(_ctrl, (int)_EMPTY, _cap);
+			_growthLeft = _maxLoad(_cap);
+		}
+	}
+
+	/**
+	 * @return Vector of all keys
+	 */
+	inline typename std::vector<K> keys() const
+	{
+		typename std::vector<K> k;
+		if (_s) {
+			k.reserve(_s);
+			for (unsigned long i = 0; i < _cap; ++i) {
+				if (_ctrl[i] >= 0) {
+					k.push_back(_slots[i].k);
+				}
+			}
+		}
+		return k;
+	}
+
+	/**
+	 * Append all keys (in unspecified order) to the supplied vector or list
+	 *
+	 * @param v Vector, list, or other compliant container
+	 * @tparam Type of V (generally inferred)
+	 */
+	template <typename C> inline void appendKeys(C& v) const
+	{
+		if (_s) {
+			for (unsigned long i = 0; i < _cap; ++i) {
+				if (_ctrl[i] >= 0) {
+					v.push_back(_slots[i].k);
+				}
+			}
+		}
+	}
+
+	/**
+	 * @return Vector of all entries (pairs of K,V)
+	 */
+	inline typename std::vector<std::pair<K, V> > entries() const
+	{
+		typename std::vector<std::pair<K, V> > k;
+		if (_s) {
+			k.reserve(_s);
+			for (unsigned long i = 0; i < _cap; ++i) {
+				if (_ctrl[i] >= 0) {
+					k.push_back(std::pair<K, V>(_slots[i].k, _slots[i].v));
+				}
+			}
+		}
+		return k;
+	}
+
+	/**
+	 * @param k Key
+	 * @return Pointer to value or NULL if not found
+	 */
+	inline V* get(const K& k)
+	{
+		const unsigned long i = _find(k, _hash(k));
+		return (i < _cap) ? &(_slots[i].v) : (V*)0;
+	}
+	inline const V* get(const K& k) const
+	{
+		return const_cast<FlatHashtable*>(this)->get(k);
+	}
+
+	/**
+	 * @param k Key
+	 * @param v Value to fill with result
+	 * @return True if value was found and set (if false, v is not modified)
+	 */
+	inline bool get(const K& k, V& v) const
+	{
+		const unsigned long i = _find(k, _hash(k));
+		if (i < _cap) {
+			v = _slots[i].v;
+			return true;
+		}
+		return false;
+	}
+
+	/**
+	 * @param k Key to check
+	 * @return True if key is present
+	 */
+	inline bool contains(const K& k) const
+	{
+		return (_find(k, _hash(k)) < _cap);
+	}
+
+	/**
+	 * @param k Key
+	 * @return True if value was present
+	 */
+	inline bool erase(const K& k)
+	{
+		const unsigned long i = _find(k, _hash(k));
+		if (i < _cap) {
+			_slots[i].~_Slot();
+			--_s;
+			// A group that still has an empty slot never made a probe continue
+			// past it, so the slot can become empty again instead of a tombstone.
+			if (_Group(_ctrl + (i & ~((unsigned long)ZT_FLATHASHTABLE_GROUP - 1))).matchEmpty()) {
+				_ctrl[i] = (int8_t)_EMPTY;
+				++_growthLeft;
+			}
+			else {
+				_ctrl[i] = (int8_t)_DELETED;
+			}
+			return true;
+		}
+		return false;
+	}
+
+	/**
+	 * @param k Key
+	 * @param v Value
+	 * @return Reference to value in table
+	 */
+	inline V& set(const K& k, const V& v)
+	{
+		const uint64_t h = _hash(k);
+		unsigned long i = _find(k, h);
+		if (i < _cap) {
+			_slots[i].v = v;
+			return _slots[i].v;
+		}
+		i = _prepareInsert(h);
+		new (_slots + i) _Slot(k, v);
+		return _slots[i].v;
+	}
+
+	/**
+	 * @param k Key
+	 * @return Value, possibly newly created
+	 */
+	inline V& operator[](const K& k)
+	{
+		const uint64_t h = _hash(k);
+		unsigned long i = _find(k, h);
+		if (i < _cap) {
+			return _slots[i].v;
+		}
+		i = _prepareInsert(h);
+		new (_slots + i) _Slot(k);
+		return _slots[i].v;
+	}
+
+	/**
+	 * @return Number of entries
+	 */
+	inline unsigned long size() const
+	{
+		return _s;
+	}
+
+	/**
+	 * @return True if table is empty
+	 */
+	inline bool empty() const
+	{
+		return (_s == 0);
+	}
+
+  private:
+	// Bit masks of control bytes in a group that match a condition
+	class _Group {
+	  public:
+		explicit _Group(const int8_t* c)
+#ifdef ZT_ARCH_X64
+			: _c(_mm_loadu_si128(reinterpret_cast<const __m128i*>(c)))
+#else
+			: _c(c)
+#endif
+		{
+		}
+
+		inline unsigned int match(const int8_t h2) const
+		{
+#ifdef ZT_ARCH_X64
+			return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_c, _mm_set1_epi8(h2)));
+#else
+			unsigned int m = 0;
+			for (unsigned int i = 0; i < ZT_FLATHASHTABLE_GROUP; ++i) {
+				m |= (unsigned int)(_c[i] == h2) << i;
+			}
+			return m;
+#endif
+		}
+
+		inline unsigned int matchEmpty() const
+		{
+			return match((int8_t)_EMPTY);
+		}
+
+		inline unsigned int matchEmptyOrDeleted() const
+		{
+#ifdef ZT_ARCH_X64
+			return (unsigned int)_mm_movemask_epi8(_c);
+#else
+			unsigned int m = 0;
+			for (unsigned int i = 0; i < ZT_FLATHASHTABLE_GROUP; ++i) {
+				m |= (unsigned int)(_c[i] < 0) << i;
+			}
+			return m;
+#endif
+		}
+
+	  private:
+#ifdef ZT_ARCH_X64
+		const __m128i _c;
+#else
+		const int8_t* const _c;
+#endif
+	};
+
+	static inline unsigned int _lowestBit(const unsigned int m)
+	{
+#ifdef __GNUC__
+		return (unsigned int)__builtin_ctz(m);
+#else
+		unsigned int b = 0;
+		while (! (m & (1U << b))) {
+			++b;
+		}
+		return b;
+#endif
+	}
+
+	template <typename O> static inline uint64_t _hc(const O& obj)
+	{
+		return (uint64_t)obj.hashCode();
+	}
+	static inline uint64_t _hc(const uint64_t i)
+	{
+		return i;
+	}
+	static inline uint64_t _hc(const uint32_t i)
+	{
+		return (uint64_t)i;
+	}
+	static inline uint64_t _hc(const uint16_t i)
+	{
+		return (uint64_t)i;
+	}
+	static inline uint64_t _hc(const int i)
+	{
+		return (uint64_t)i;
+	}
+
+	static inline const uint64_t* _secret()
+	{
+		static const struct _Secret {
+			_Secret()
+			{
+				Utils::getSecureRandom(s, sizeof(s));
+			}
+			uint64_t s[2];
+		} secret;
+		return secret.s;
+	}
+
+	// Keyed variant of the MurmurHash3 64-bit finalizer
+	static inline uint64_t _hash(const K& k)
+	{
+		const uint64_t* const s = _secret();
+		uint64_t h = _hc(k) ^ s[0];
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= s[1];
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 33;
+		return h;
+	}
+
+	static inline unsigned long _capacityFor(const unsigned long n)
+	{
+		unsigned long c = ZT_FLATHASHTABLE_GROUP;
+		while (c < n) {
+			c <<= 1;
+		}
+		return c;
+	}
+
+	static inline unsigned long _maxLoad(const unsigned long cap)
+	{
+		return cap - (cap / 8);
+	}
+
+	// Returns slot index or _cap if not found
+	inline unsigned long _find(const K& k, const uint64_t h) const
+	{
+		if (! _s) {
+			return _cap;
+		}
+		const unsigned long groupMask = (_cap / ZT_FLATHASHTABLE_GROUP) - 1;
+		const int8_t h2 = (int8_t)(h & 0x7f);
+		unsigned long g = (unsigned long)(h >> 7) & groupMask;
+		for (unsigned long step = 1;; ++step) {
+			const unsigned long base = g * ZT_FLATHASHTABLE_GROUP;
+			const _Group grp(_ctrl + base);
+			for (unsigned int m = grp.match(h2); m; m &= m - 1) {
+				const unsigned long i = base + _lowestBit(m);
+				if (_slots[i].k == k) {
+					return i;
+				}
+			}
+			if (grp.matchEmpty()) {
+				return _cap;
+			}
+			g = (g + step) & groupMask;
+		}
+	}
+
+	// First empty or deleted slot on the probe sequence for h
+	inline unsigned long _findFree(const uint64_t h) const
+	{
+		const unsigned long groupMask = (_cap / ZT_FLATHASHTABLE_GROUP) - 1;
+		unsigned long g = (unsigned long)(h >> 7) & groupMask;
+		for (unsigned long step = 1;; ++step) {
+			const unsigned long base = g * ZT_FLATHASHTABLE_GROUP;
+			const unsigned int m = _Group(_ctrl + base).matchEmptyOrDeleted();
+			if (m) {
+				return base + _lowestBit(m);
+			}
+			g = (g + step) & groupMask;
+		}
+	}
+
+	// Claims a slot for a new entry with hash h; caller constructs it
+	inline unsigned long _prepareInsert(const uint64_t h)
+	{
+		if (! _cap) {
+			_rehash(_initialCap);
+		}
+		unsigned long i = _findFree(h);
+		if ((_growthLeft == 0) && (_ctrl[i] == (int8_t)_EMPTY)) {
+			// Out of empty slots: purge tombstones if they are most of the
+			// load, otherwise grow.
+			_rehash((_s < (_maxLoad(_cap) / 2)) ? _cap : (_cap * 2));
+			i = _findFree(h);
+		}
+		if (_ctrl[i] == (int8_t)_EMPTY) {
+			--_growthLeft;
+		}
+		_ctrl[i] = (int8_t)(h & 0x7f);
+		++_s;
+		return i;
+	}
+
+	inline void _rehash(const unsigned long nc)
+	{
+		int8_t* const oldCtrl = _ctrl;
+		_Slot* const oldSlots = _slots;
+		const unsigned long oldCap = _cap;
+
+		_ctrl = reinterpret_cast<int8_t*>(::malloc(nc));
+		_slots = reinterpret_cast<_Slot*>(::malloc(sizeof(_Slot) * nc));
+		if ((! _ctrl) || (! _slots)) {
+			::free(_ctrl);
+			::free(_slots);
+			_ctrl = oldCtrl;
+			_slots = oldSlots;
+			throw ZT_EXCEPTION_OUT_OF_MEMORY;
+		}
+		memset(_ctrl, (int)_EMPTY, nc);
+		_cap = nc;
+		_growthLeft = _maxLoad(nc) - _s;
+
+		for (unsigned long i = 0; i < oldCap; ++i) {
+			if (oldCtrl[i] >= 0) {
+				const uint64_t h = _hash(oldSlots[i].k);
+				const unsigned long ni = _findFree(h);
+				_ctrl[ni] = (int8_t)(h & 0x7f);
+				new (_slots + ni) _Slot(std::move(oldSlots[i]));
+				oldSlots[i].~_Slot();
+			}
+		}
+		::free(oldCtrl);
+		::free(oldSlots);
+	}
+
+	// Layout is identical between tables of the same type and capacity, so
+	// copies duplicate control bytes and construct entries in place.
+	inline void _copy(const FlatHashtable<K, V>& ht)
+	{
+		if (ht._cap) {
+			_ctrl = reinterpret_cast<int8_t*>(::malloc(ht._cap));
+			_slots = reinterpret_cast<_Slot*>(::malloc(sizeof(_Slot) * ht._cap));
+			if ((! _ctrl) || (! _slots)) {
+				::free(_ctrl);
+				::free(_slots);
+				_ctrl = (int8_t*)0;
+				_slots = (_Slot*)0;
+				throw ZT_EXCEPTION_OUT_OF_MEMORY;
+			}
+			memcpy(_ctrl, ht._ctrl, ht._cap);
+			_cap = ht._cap;
+			for (unsigned long i = 0; i < _cap; ++i) {
+				if (_ctrl[i] >= 0) {
+					new (_slots + i) _Slot(ht._slots[i]);
+				}
+			}
+			_s = ht._s;
+			_growthLeft = ht._growthLeft;
+		}
+	}
+
+	inline void _free()
+	{
+		clear();
+		::free(_ctrl);
+		::free(_slots);
+		_ctrl = (int8_t*)0;
+		_slots = (_Slot*)0;
+		_cap = 0;
+		_growthLeft = 0;
+	}
+
+	int8_t* _ctrl;
+	_Slot* _slots;
+	unsigned long _cap;
+	unsigned long _s;
+	unsigned long _growthLeft;
+	unsigned long _initialCap;
+};
+
+}	// namespace ZeroTier
+
+#endif
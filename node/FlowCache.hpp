@@ -0,0 +1,246 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * (c) ZeroTier, Inc.
+ * https://www.zerotier.com/
+ */
+
+#ifndef ZT_FLOWCACHE_HPP
+#define ZT_FLOWCACHE_HPP
+
+#include "Address.hpp"
+#include "CompiledRules.hpp"
+#include "Constants.hpp"
+#include "MAC.hpp"
+#include "Mutex.hpp"
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Number of independently locked shards in each flow cache
+ */
+#define ZT_FLOW_CACHE_SHARDS 32
+
+/**
+ * Direct-mapped entries per shard
+ */
+#define ZT_FLOW_CACHE_SHARD_ENTRIES 64
+
+/**
+ * Minimum number of rules in a network config for its decisions to be cached
+ *
+ * Below this evaluating compiled rules costs about as much as a lookup.
+ */
+#define ZT_FLOW_CACHE_MIN_RULES 32
+
+/**
+ * Value of Decision::qosBucket if no PRIORITY action was taken
+ */
+#define ZT_FLOW_CACHE_NO_PRIORITY 0xff
+
+namespace ZeroTier {
+
+/**
+ * Cache of frame filter decisions by flow
+ *
+ * Frames of one flow produce the same rule engine result as long as the
+ * network config and the remote member's credentials are unchanged and the
+ * rules only look at fields in the flow key. Entries are tagged with the
+ * generations of the config and membership snapshots they were computed
+ * from, so publishing a new snapshot implicitly invalidates every entry
+ * that depended on the old one.
+ *
+ * The cache is direct-mapped and sharded by key hash. A collision simply
+ * replaces the older entry. Lookups take no lock: each entry carries a
+ * sequence number that writers make odd while they update it, and readers
+ * discard what they copied if the number changed. Writers are serialized by
+ * a lock per shard. Storage is allocated on first insert so that networks
+ * that never use it cost nothing.
+ */
+class FlowCache {
+  public:
+	/**
+	 * Flow key: direction, ZeroTier and MAC addresses and IP 5-tuple
+	 *
+	 * Keys are compared and hashed as raw memory so unused fields must be
+	 * zero, which set() takes care of.
+	 */
+	struct Key {
+		/**
+		 * @param inbound True for inbound frames
+		 * @param ztSource ZeroTier source
+		 * @param ztDest ZeroTier destination
+		 * @param macSource Source MAC
+		 * @param macDest Destination MAC
+		 * @param f Parsed frame
+		 */
+		inline void set(const bool inbound, const Address& ztSource, const Address& ztDest, const MAC& macSource, const MAC& macDest, const CompiledRules::Frame& f)
+		{
+			memset(this, 0, sizeof(Key));
+			zt[0] = ztSource.toInt();
+			zt[1] = ztDest.toInt();
+			mac[0] = macSource.toInt();
+			mac[1] = macDest.toInt();
+			if (f.ipv4) {
+				memcpy(ip, f.data + 12, 8);
+			}
+			else if (f.ipv6) {
+				memcpy(ip, f.data + 8, 32);
+			}
+			port[0] = f.sourcePort;
+			port[1] = f.destPort;
+			ipProtocol = (int16_t)f.ipProtocol;
+			etherType = (uint16_t)f.etherType;
+			vlanId = (uint16_t)f.vlanId;
+			flags = (uint16_t)((inbound ? 0x01 : 0) | (f.ipv4 ? 0x02 : 0) | (f.ipv6 ? 0x04 : 0) | (f.portsInvalid ? 0x08 : 0));
+		}
+
+		inline bool operator==(const Key& k) const
+		{
+			return (memcmp(this, &k, sizeof(Key)) == 0);
+		}
+
+		inline unsigned long hashCode() const
+		{
+			uint64_t w[sizeof(Key) / 8];
+			memcpy(w, this, sizeof(w));
+			uint64_t h = 0;
+			for (unsigned int i = 0; i < (sizeof(Key) / 8); ++i) {
+				h = (h ^ w[i]) * 0x9e3779b97f4a7c15ULL;
+				h ^= h >> 29;
+			}
+			return (unsigned long)h;
+		}
+
+		uint64_t zt[2];
+		uint64_t mac[2];
+		uint8_t ip[32];
+		int32_t port[2];
+		int16_t ipProtocol;
+		uint16_t etherType;
+		uint16_t vlanId;
+		uint16_t flags;
+	};
+
+	/**
+	 * Outcome of filtering a frame
+	 */
+	struct Decision {
+		Decision() : accept(0), capability(-1), qosBucket(ZT_FLOW_CACHE_NO_PRIORITY), ccWatch(false), capabilityCcWatch(false)
+		{
+		}
+
+		Address finalDest;		 // differs from the frame's destination after REDIRECT
+		Address cc;				 // TEE or WATCH target of the base rules
+		Address capabilityCc;	 // TEE or WATCH target of the matching capability
+		int accept;				 // -1 DROP action, 0 no match (drop), 1 accept, 2 super-accept
+		int capability;			 // index of matching local capability or -1
+		uint8_t qosBucket;		 // PRIORITY bucket or ZT_FLOW_CACHE_NO_PRIORITY
+		bool ccWatch;
+		bool capabilityCcWatch;
+	};
+
+	FlowCache() : _shards((_Shard*)0)
+	{
+	}
+
+	~FlowCache()
+	{
+		delete[] _shards.load();
+	}
+
+	/**
+	 * @param k Flow key
+	 * @param configGeneration Generation of network config snapshot in use
+	 * @param memberGeneration Generation of member credential snapshot in use (0 if none)
+	 * @param d Decision to fill on hit
+	 * @return True on hit
+	 */
+	inline bool get(const Key& k, const uint64_t configGeneration, const uint64_t memberGeneration, Decision& d) const
+	{
+		_Shard* const shards = _shards.load(std::memory_order_acquire);
+		if (! shards) {
+			return false;
+		}
+		const unsigned long h = k.hashCode();
+		const _Entry& e = shards[h % ZT_FLOW_CACHE_SHARDS].entries[(h / ZT_FLOW_CACHE_SHARDS) % ZT_FLOW_CACHE_SHARD_ENTRIES];
+		const uint32_t seq = e.seq.load(std::memory_order_acquire);
+		if ((seq & 1) != 0) {
+			return false;
+		}
+		if ((e.configGeneration != configGeneration) || (e.memberGeneration != memberGeneration) || (! (e.key == k))) {
+			return false;
+		}
+		d = e.decision;
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return (e.seq.load(std::memory_order_relaxed) == seq);
+	}
+
+	/**
+	 * @param k Flow key
+	 * @param configGeneration Generation of network config snapshot the decision was computed from
+	 * @param memberGeneration Generation of member credential snapshot the decision was computed from (0 if none)
+	 * @param d Decision
+	 */
+	inline void set(const Key& k, const uint64_t configGeneration, const uint64_t memberGeneration, const Decision& d)
+	{
+		_Shard* shards = _shards.load(std::memory_order_acquire);
+		if (! shards) {
+			Mutex::Lock _l(_allocLock);
+			shards = _shards.load(std::memory_order_acquire);
+			if (! shards) {
+				shards = new _Shard[ZT_FLOW_CACHE_SHARDS];
+				_shards.store(shards, std::memory_order_release);
+			}
+		}
+		const unsigned long h = k.hashCode();
+		_Shard& s = shards[h % ZT_FLOW_CACHE_SHARDS];
+		Mutex::Lock _l(s.lock);
+		_Entry& e = s.entries[(h / ZT_FLOW_CACHE_SHARDS) % ZT_FLOW_CACHE_SHARD_ENTRIES];
+		const uint32_t seq = e.seq.load(std::memory_order_relaxed);
+		e.seq.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		e.key = k;
+		e.configGeneration = configGeneration;
+		e.memberGeneration = memberGeneration;
+		e.decision = d;
+		e.seq.store(seq + 2, std::memory_order_release);
+	}
+
+  private:
+	FlowCache(const FlowCache&)
+	{
+	}
+	const FlowCache& operator=(const FlowCache&)
+	{
+		return *this;
+	}
+
+	struct _Entry {
+		// Generation 0 is never assigned to a config, so zeroed entries never hit
+		_Entry() : seq(0), configGeneration(0), memberGeneration(0)
+		{
+			memset(&key, 0, sizeof(key));
+		}
+		std::atomic<uint32_t> seq;	 // odd while an update is in progress
+		Key key;
+		uint64_t configGeneration;
+		uint64_t memberGeneration;
+		Decision decision;
+	};
+
+	struct _Shard {
+		Mutex lock;
+		_Entry entries[ZT_FLOW_CACHE_SHARD_ENTRIES];
+	};
+
+	std::atomic<_Shard*> _shards;
+	Mutex _allocLock;
+};
+
+}	// namespace ZeroTier
+
+#endif
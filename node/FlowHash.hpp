@@ -0,0 +1,277 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * (c) ZeroTier, Inc.
+ * https://www.zerotier.com/
+ */
+
+#ifndef ZT_FLOWHASH_HPP
+#define ZT_FLOWHASH_HPP
+
+#include "Constants.hpp"
+#include "Utils.hpp"
+
+#include <stdint.h>
+#include <string.h>
+
+namespace ZeroTier {
+
+/**
+ * RSS-style flow classifier for Ethernet frames carried over virtual networks
+ *
+ * Frames are hashed on their inner L3/L4 5-tuple (plus VLAN ID) with a
+ * SipHash-2-4 keyed by a per-process random key. The endpoints are put into
+ * canonical order before hashing so both directions of a conversation map to
+ * the same flow ID. The resulting ID is used for receive worker selection,
+ * bond path selection and AQM bucket assignment.
+ */
+class FlowHash {
+  public:
+	/**
+	 * Compute a flow ID for a frame
+	 *
+	 * @param etherType Ethernet type of frame
+	 * @param data Frame payload (after the Ethernet header)
+	 * @param len Length of payload
+	 * @return Non-negative flow ID or ZT_QOS_NO_FLOW if frame is not IP
+	 */
+	static inline int32_t compute(unsigned int etherType, const uint8_t* data, unsigned int len)
+	{
+		// Flow key: vlan[2] proto[1] addrA[16] addrB[16] portA[2] portB[2]
+		uint8_t k[39];
+		unsigned int vlanId = 0;
+
+		// Skip up to two 802.1Q / 802.1ad tags, keeping the innermost VLAN ID
+		for (unsigned int tags = 0; (tags < 2) && ((etherType == 0x8100) || (etherType == 0x88a8)); ++tags) {
+			if (len < 4)
+				return ZT_QOS_NO_FLOW;
+			vlanId = (((unsigned int)data[0] << 8) | (unsigned int)data[1]) & 0xfff;
+			etherType = ((unsigned int)data[2] << 8) | (unsigned int)data[3];
+			data += 4;
+			len -= 4;
+		}
+
+		unsigned int alen, proto, l4;
+		bool ports;
+		const uint8_t *sa, *da;
+		if ((etherType == 0x0800) && (len >= 20)) {
+			const unsigned int headerLen = 4 * (data[0] & 0xf);
+			if ((headerLen < 20) || (headerLen > len))
+				return ZT_QOS_NO_FLOW;
+			alen = 4;
+			proto = data[9];
+			sa = data + 12;
+			da = data + 16;
+			l4 = headerLen;
+			// Only the first fragment carries ports, so hash fragmented datagrams on addresses only
+			ports = (((((unsigned int)data[6] << 8) | (unsigned int)data[7]) & 0x3fff) == 0);
+		}
+		else if ((etherType == 0x86dd) && (len >= 40)) {
+			alen = 16;
+			sa = data + 8;
+			da = data + 24;
+			if (! ipv6GetPayload(data, len, l4, proto))
+				return ZT_QOS_NO_FLOW;
+			ports = true;
+		}
+		else {
+			return ZT_QOS_NO_FLOW;
+		}
+
+		unsigned int sp = 0, dp = 0;
+		if (ports) {
+			switch (proto) {
+				// All these start with 16-bit source and destination port in that order
+				case 0x06:	 // TCP
+				case 0x11:	 // UDP
+				case 0x84:	 // SCTP
+				case 0x88:	 // UDPLite
+					if (len >= (l4 + 4)) {
+						sp = ((unsigned int)data[l4] << 8) | (unsigned int)data[l4 + 1];
+						dp = ((unsigned int)data[l4 + 2] << 8) | (unsigned int)data[l4 + 3];
+					}
+					break;
+				default:
+					break;
+			}
+		}
+
+		// Canonical order: lower (address, port) endpoint first
+		int c = memcmp(sa, da, alen);
+		if ((c > 0) || ((c == 0) && (sp > dp))) {
+			const uint8_t* t = sa;
+			sa = da;
+			da = t;
+			const unsigned int tp = sp;
+			sp = dp;
+			dp = tp;
+		}
+
+		unsigned int p = 0;
+		k[p++] = (uint8_t)(vlanId >> 8);
+		k[p++] = (uint8_t)vlanId;
+		k[p++] = (uint8_t)proto;
+		memcpy(k + p, sa, alen);
+		p += alen;
+		memcpy(k + p, da, alen);
+		p += alen;
+		k[p++] = (uint8_t)(sp >> 8);
+		k[p++] = (uint8_t)sp;
+		k[p++] = (uint8_t)(dp >> 8);
+		k[p++] = (uint8_t)dp;
+
+		return (int32_t)(sipHash24(_key(), k, p) & 0x7fffffffULL);
+	}
+
+	/**
+	 * Walk IPv6 extension headers to find the upper layer payload
+	 *
+	 * @param frameData IPv6 packet
+	 * @param frameLen Length of packet
+	 * @param pos Set to offset of upper layer header
+	 * @param proto Set to upper layer protocol
+	 * @return True if packet appears valid; pos and proto will be set
+	 */
+	static inline bool ipv6GetPayload(const uint8_t* frameData, unsigned int frameLen, unsigned int& pos, unsigned int& proto)
+	{
+		if (frameLen < 40) {
+			return false;
+		}
+		pos = 40;
+		proto = frameData[6];
+		while (pos <= frameLen) {
+			switch (proto) {
+				case 0:		// hop-by-hop options
+				case 43:	// routing
+				case 60:	// destination options
+				case 135:	// mobility options
+					if ((pos + 8) > frameLen) {
+						return false;	// invalid!
+					}
+					proto = frameData[pos];
+					pos += ((unsigned int)frameData[pos + 1] * 8) + 8;
+					break;
+
+				// case 44: // fragment -- we currently can't parse these and they are deprecated in IPv6 anyway
+				// case 50:
+				// case 51: // IPSec ESP and AH -- we have to stop here since this is encrypted stuff
+				default:
+					return true;
+			}
+		}
+		return false;	// overflow == invalid
+	}
+
+	/**
+	 * SipHash-2-4
+	 *
+	 * @param key 128-bit key as two 64-bit words
+	 * @param in Input data
+	 * @param len Length of input
+	 * @return 64-bit hash
+	 */
+	static inline uint64_t sipHash24(const uint64_t key[2], const uint8_t* in, unsigned int len)
+	{
+		uint64_t v0 = key[0] ^ 0x736f6d6570736575ULL;
+		uint64_t v1 = key[1] ^ 0x646f72616e646f6dULL;
+		uint64_t v2 = key[0] ^ 0x6c7967656e657261ULL;
+		uint64_t v3 = key[1] ^ 0x7465646279746573ULL;
+		const uint64_t b = ((uint64_t)len) << 56;
+
+		const uint8_t* const end = in + (len & ~7U);
+		while (in != end) {
+			const uint64_t m = _le64(in);
+			in += 8;
+			v3 ^= m;
+			_sipRound(v0, v1, v2, v3);
+			_sipRound(v0, v1, v2, v3);
+			v0 ^= m;
+		}
+
+		uint64_t m = b;
+		switch (len & 7) {
+			case 7:
+				m |= ((uint64_t)in[6]) << 48;
+				// fall through
+			case 6:
+				m |= ((uint64_t)in[5]) << 40;
+				// fall through
+			case 5:
+				m |= ((uint64_t)in[4]) << 32;
+				// fall through
+			case 4:
+				m |= ((uint64_t)in[3]) << 24;
+				// fall through
+			case 3:
+				m |= ((uint64_t)in[2]) << 16;
+				// fall through
+			case 2:
+				m |= ((uint64_t)in[1]) << 8;
+				// fall through
+			case 1:
+				m |= ((uint64_t)in[0]);
+				break;
+			default:
+				break;
+		}
+		v3 ^= m;
+		_sipRound(v0, v1, v2, v3);
+		_sipRound(v0, v1, v2, v3);
+		v0 ^= m;
+
+		v2 ^= 0xff;
+		_sipRound(v0, v1, v2, v3);
+		_sipRound(v0, v1, v2, v3);
+		_sipRound(v0, v1, v2, v3);
+		_sipRound(v0, v1, v2, v3);
+		return (v0 ^ v1 ^ v2 ^ v3);
+	}
+
+  private:
+	static inline const uint64_t* _key()
+	{
+		static const _Key k;
+		return k.k;
+	}
+
+	struct _Key {
+		_Key()
+		{
+			Utils::getSecureRandom(k, sizeof(k));
+		}
+		uint64_t k[2];
+	};
+
+	static inline uint64_t _sipRotl(const uint64_t x, const unsigned int b)
+	{
+		return (x << b) | (x >> (64 - b));
+	}
+
+	static inline void _sipRound(uint64_t& v0, uint64_t& v1, uint64_t& v2, uint64_t& v3)
+	{
+		v0 += v1;
+		v1 = _sipRotl(v1, 13);
+		v1 ^= v0;
+		v0 = _sipRotl(v0, 32);
+		v2 += v3;
+		v3 = _sipRotl(v3, 16);
+		v3 ^= v2;
+		v0 += v3;
+		v3 = _sipRotl(v3, 21);
+		v3 ^= v0;
+		v2 += v1;
+		v1 = _sipRotl(v1, 17);
+		v1 ^= v2;
+		v2 = _sipRotl(v2, 32);
+	}
+
+	static inline uint64_t _le64(const uint8_t* p)
+	{
+		return ((uint64_t)p[0]) | (((uint64_t)p[1]) << 8) | (((uint64_t)p[2]) << 16) | (((uint64_t)p[3]) << 24) | (((uint64_t)p[4]) << 32) | (((uint64_t)p[5]) << 40) | (((uint64_t)p[6]) << 48) | (((uint64_t)p[7]) << 56);
+	}
+};
+
+}	// namespace ZeroTier
+
+#endif
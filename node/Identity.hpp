@@ -21,6 +21,11 @@
 
 #define ZT_IDENTITY_STRING_BUFFER_LENGTH 384
 
+/**
+ * Maximum length of a binary serialized identity, including private key
+ */
+#define ZT_IDENTITY_MAX_BINARY_SERIALIZED_LENGTH (ZT_ADDRESS_LENGTH + 2 + ZT_ECC_PUBLIC_KEY_SET_LEN + ZT_ECC_PRIVATE_KEY_SET_LEN)
+
 namespace ZeroTier {
 
 /**
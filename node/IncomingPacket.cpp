@@ -14,6 +14,7 @@
 #include "Capability.hpp"
 #include "CertificateOfMembership.hpp"
 #include "Constants.hpp"
+#include "FlowHash.hpp"
 #include "Metrics.hpp"
 #include "NetworkController.hpp"
 #include "Node.hpp"
@@ -60,7 +61,9 @@ bool IncomingPacket::tryDecode(const RuntimeEnvironment* RR, void* tPtr, int32_t
 			return _doHELLO(RR, tPtr, false);
 		}
 
-		const SharedPtr<Peer> peer(RR->topology->getPeer(tPtr, sourceAddress));
+		const SnapshotReaders::Pass pass;
+		SharedPtr<Peer> loadedPeer;
+		const SharedPtr<Peer>& peer = RR->topology->borrowPeer(tPtr, sourceAddress, loadedPeer);
 		if (peer) {
 			if (! _authenticated) {
 				if (! dearmor(peer->key(), peer->aesKeys(), RR->identity)) {
@@ -593,7 +596,7 @@ bool IncomingPacket::_doOK(const RuntimeEnvironment* RR, void* tPtr, const Share
 			}
 
 			if (! hops()) {
-				_path->updateLatency((unsigned int)latency, RR->node->now());
+				peer->updatePathLatency(_path, (unsigned int)latency, RR->node->now());
 			}
 
 			peer->setRemoteVersion(vProto, vMajor, vMinor, vRevision);
@@ -605,8 +608,13 @@ bool IncomingPacket::_doOK(const RuntimeEnvironment* RR, void* tPtr, const Share
 
 		case Packet::VERB_WHOIS:
 			if (RR->topology->isUpstream(peer->identity())) {
-				const Identity id(*this, ZT_PROTO_VERB_WHOIS__OK__IDX_IDENTITY);
-				RR->sw->doAnythingWaitingForPeer(tPtr, RR->topology->addPeer(tPtr, SharedPtr<Peer>(new Peer(RR, RR->identity, id))));
+				// Batched requests are answered with all known identities back to back
+				unsigned int ptr = ZT_PROTO_VERB_WHOIS__OK__IDX_IDENTITY;
+				while (ptr < size()) {
+					Identity id;
+					ptr += id.deserialize(*this, ptr);
+					RR->sw->doAnythingWaitingForPeer(tPtr, RR->topology->addPeer(tPtr, SharedPtr<Peer>(new Peer(RR, RR->identity, id))));
+				}
 			}
 			break;
 
@@ -731,108 +739,20 @@ bool IncomingPacket::_doRENDEZVOUS(const RuntimeEnvironment* RR, void* tPtr, con
 	return true;
 }
 
-// Returns true if packet appears valid; pos and proto will be set
-static bool _ipv6GetPayload(const uint8_t* frameData, unsigned int frameLen, unsigned int& pos, unsigned int& proto)
-{
-	if (frameLen < 40) {
-		return false;
-	}
-	pos = 40;
-	proto = frameData[6];
-	while (pos <= frameLen) {
-		switch (proto) {
-			case 0:		// hop-by-hop options
-			case 43:	// routing
-			case 60:	// destination options
-			case 135:	// mobility options
-				if ((pos + 8) > frameLen) {
-					return false;	// invalid!
-				}
-				proto = frameData[pos];
-				pos += ((unsigned int)frameData[pos + 1] * 8) + 8;
-				break;
-
-			// case 44: // fragment -- we currently can't parse these and they are deprecated in IPv6 anyway
-			// case 50:
-			// case 51: // IPSec ESP and AH -- we have to stop here since this is encrypted stuff
-			default:
-				return true;
-		}
-	}
-	return false;	// overflow == invalid
-}
-
 bool IncomingPacket::_doFRAME(const RuntimeEnvironment* RR, void* tPtr, const SharedPtr<Peer>& peer, int32_t flowId)
 {
 	Metrics::pkt_frame_in++;
+	// The flow ID selects the receive worker for every frame, but bonds only
+	// track flows for policies that assign paths by flow.
 	int32_t _flowId = ZT_QOS_NO_FLOW;
-
-	if (peer->flowHashingSupported()) {
-		if (size() > ZT_PROTO_VERB_FRAME_IDX_PAYLOAD) {
-			const unsigned int etherType = at<uint16_t>(ZT_PROTO_VERB_FRAME_IDX_ETHERTYPE);
-			const unsigned int frameLen = size() - ZT_PROTO_VERB_FRAME_IDX_PAYLOAD;
-			const uint8_t* const frameData = reinterpret_cast<const uint8_t*>(data()) + ZT_PROTO_VERB_FRAME_IDX_PAYLOAD;
-
-			if (etherType == ZT_ETHERTYPE_IPV4 && (frameLen >= 20)) {
-				uint16_t srcPort = 0;
-				uint16_t dstPort = 0;
-				uint8_t proto = (reinterpret_cast<const uint8_t*>(frameData)[9]);
-				const unsigned int headerLen = 4 * (reinterpret_cast<const uint8_t*>(frameData)[0] & 0xf);
-				switch (proto) {
-					case 0x01:	 // ICMP
-						// flowId = 0x01;
-						break;
-					// All these start with 16-bit source and destination port in that order
-					case 0x06:	 // TCP
-					case 0x11:	 // UDP
-					case 0x84:	 // SCTP
-					case 0x88:	 // UDPLite
-						if (frameLen > (headerLen + 4)) {
-							unsigned int pos = headerLen + 0;
-							srcPort = (reinterpret_cast<const uint8_t*>(frameData)[pos++]) << 8;
-							srcPort |= (reinterpret_cast<const uint8_t*>(frameData)[pos]);
-							pos++;
-							dstPort = (reinterpret_cast<const uint8_t*>(frameData)[pos++]) << 8;
-							dstPort |= (reinterpret_cast<const uint8_t*>(frameData)[pos]);
-							_flowId = dstPort ^ srcPort ^ proto;
-						}
-						break;
-				}
-			}
-
-			if (etherType == ZT_ETHERTYPE_IPV6 && (frameLen >= 40)) {
-				uint16_t srcPort = 0;
-				uint16_t dstPort = 0;
-				unsigned int pos;
-				unsigned int proto;
-				_ipv6GetPayload((const uint8_t*)frameData, frameLen, pos, proto);
-				switch (proto) {
-					case 0x3A:	 // ICMPv6
-						// flowId = 0x3A;
-						break;
-					// All these start with 16-bit source and destination port in that order
-					case 0x06:	 // TCP
-					case 0x11:	 // UDP
-					case 0x84:	 // SCTP
-					case 0x88:	 // UDPLite
-						if (frameLen > (pos + 4)) {
-							srcPort = (reinterpret_cast<const uint8_t*>(frameData)[pos++]) << 8;
-							srcPort |= (reinterpret_cast<const uint8_t*>(frameData)[pos]);
-							pos++;
-							dstPort = (reinterpret_cast<const uint8_t*>(frameData)[pos++]) << 8;
-							dstPort |= (reinterpret_cast<const uint8_t*>(frameData)[pos]);
-							_flowId = dstPort ^ srcPort ^ proto;
-						}
-						break;
-					default:
-						break;
-				}
-			}
-		}
+	if (size() > ZT_PROTO_VERB_FRAME_IDX_PAYLOAD) {
+		_flowId = FlowHash::compute(at<uint16_t>(ZT_PROTO_VERB_FRAME_IDX_ETHERTYPE), reinterpret_cast<const uint8_t*>(data()) + ZT_PROTO_VERB_FRAME_IDX_PAYLOAD, size() - ZT_PROTO_VERB_FRAME_IDX_PAYLOAD);
 	}
+	const int32_t bondFlowId = (peer->flowHashingSupported()) ? _flowId : ZT_QOS_NO_FLOW;
 
 	const uint64_t nwid = at<uint64_t>(ZT_PROTO_VERB_FRAME_IDX_NETWORK_ID);
-	const SharedPtr<Network> network(RR->node->network(nwid));
+	const Node::NetworkReader nr(*(RR->node), nwid);
+	const SharedPtr<Network>& network = nr.network();
 	bool trustEstablished = false;
 	if (network) {
 		if (network->gate(tPtr, peer)) {
@@ -852,7 +772,7 @@ bool IncomingPacket::_doFRAME(const RuntimeEnvironment* RR, void* tPtr, const Sh
 			return false;
 		}
 	}
-	peer->received(tPtr, _path, hops(), packetId(), payloadLength(), Packet::VERB_FRAME, 0, Packet::VERB_NOP, trustEstablished, nwid, _flowId);
+	peer->received(tPtr, _path, hops(), packetId(), payloadLength(), Packet::VERB_FRAME, 0, Packet::VERB_NOP, trustEstablished, nwid, bondFlowId);
 
 	return true;
 }
@@ -861,73 +781,17 @@ bool IncomingPacket::_doEXT_FRAME(const RuntimeEnvironment* RR, void* tPtr, cons
 {
 	Metrics::pkt_ext_frame_in++;
 
+	// The flow ID selects the receive worker for every frame, but bonds only
+	// track flows for policies that assign paths by flow.
 	int32_t _flowId = ZT_QOS_NO_FLOW;
-	if (peer->flowHashingSupported()) {
-		if (size() > ZT_PROTO_VERB_EXT_FRAME_IDX_PAYLOAD) {
-			const unsigned int etherType = at<uint16_t>(ZT_PROTO_VERB_EXT_FRAME_IDX_ETHERTYPE);
-			const unsigned int frameLen = size() - ZT_PROTO_VERB_EXT_FRAME_IDX_PAYLOAD;
-			const uint8_t* const frameData = reinterpret_cast<const uint8_t*>(data()) + ZT_PROTO_VERB_EXT_FRAME_IDX_PAYLOAD;
-
-			if (etherType == ZT_ETHERTYPE_IPV4 && (frameLen >= 20)) {
-				uint16_t srcPort = 0;
-				uint16_t dstPort = 0;
-				uint8_t proto = (reinterpret_cast<const uint8_t*>(frameData)[9]);
-				const unsigned int headerLen = 4 * (reinterpret_cast<const uint8_t*>(frameData)[0] & 0xf);
-				switch (proto) {
-					case 0x01:	 // ICMP
-						// flowId = 0x01;
-						break;
-					// All these start with 16-bit source and destination port in that order
-					case 0x06:	 // TCP
-					case 0x11:	 // UDP
-					case 0x84:	 // SCTP
-					case 0x88:	 // UDPLite
-						if (frameLen > (headerLen + 4)) {
-							unsigned int pos = headerLen + 0;
-							srcPort = (reinterpret_cast<const uint8_t*>(frameData)[pos++]) << 8;
-							srcPort |= (reinterpret_cast<const uint8_t*>(frameData)[pos]);
-							pos++;
-							dstPort = (reinterpret_cast<const uint8_t*>(frameData)[pos++]) << 8;
-							dstPort |= (reinterpret_cast<const uint8_t*>(frameData)[pos]);
-							_flowId = dstPort ^ srcPort ^ proto;
-						}
-						break;
-				}
-			}
-
-			if (etherType == ZT_ETHERTYPE_IPV6 && (frameLen >= 40)) {
-				uint16_t srcPort = 0;
-				uint16_t dstPort = 0;
-				unsigned int pos;
-				unsigned int proto;
-				_ipv6GetPayload((const uint8_t*)frameData, frameLen, pos, proto);
-				switch (proto) {
-					case 0x3A:	 // ICMPv6
-						// flowId = 0x3A;
-						break;
-					// All these start with 16-bit source and destination port in that order
-					case 0x06:	 // TCP
-					case 0x11:	 // UDP
-					case 0x84:	 // SCTP
-					case 0x88:	 // UDPLite
-						if (frameLen > (pos + 4)) {
-							srcPort = (reinterpret_cast<const uint8_t*>(frameData)[pos++]) << 8;
-							srcPort |= (reinterpret_cast<const uint8_t*>(frameData)[pos]);
-							pos++;
-							dstPort = (reinterpret_cast<const uint8_t*>(frameData)[pos++]) << 8;
-							dstPort |= (reinterpret_cast<const uint8_t*>(frameData)[pos]);
-							_flowId = dstPort ^ srcPort ^ proto;
-						}
-						break;
-					default:
-						break;
-				}
-			}
-		}
+	if (size() > ZT_PROTO_VERB_EXT_FRAME_IDX_PAYLOAD) {
+		_flowId = FlowHash::compute(at<uint16_t>(ZT_PROTO_VERB_EXT_FRAME_IDX_ETHERTYPE), reinterpret_cast<const uint8_t*>(data()) + ZT_PROTO_VERB_EXT_FRAME_IDX_PAYLOAD, size() - ZT_PROTO_VERB_EXT_FRAME_IDX_PAYLOAD);
 	}
+	const int32_t bondFlowId = (peer->flowHashingSupported()) ? _flowId : ZT_QOS_NO_FLOW;
 
 	const uint64_t nwid = at<uint64_t>(ZT_PROTO_VERB_EXT_FRAME_IDX_NETWORK_ID);
-	const SharedPtr<Network> network(RR->node->network(nwid));
+	const Node::NetworkReader nr(*(RR->node), nwid);
+	const SharedPtr<Network>& network = nr.network();
 	if (network) {
 		const unsigned int flags = (*this)[ZT_PROTO_VERB_EXT_FRAME_IDX_FLAGS];
 
@@ -954,7 +818,7 @@ bool IncomingPacket::_doEXT_FRAME(const RuntimeEnvironment* RR, void* tPtr, cons
 			const uint8_t* const frameData = (const uint8_t*)field(comLen + ZT_PROTO_VERB_EXT_FRAME_IDX_PAYLOAD, frameLen);
 
 			if ((! from) || (from == network->mac())) {
-				peer->received(tPtr, _path, hops(), packetId(), payloadLength(), Packet::VERB_EXT_FRAME, 0, Packet::VERB_NOP, true, nwid, _flowId);	  // trustEstablished because COM is okay
+				peer->received(tPtr, _path, hops(), packetId(), payloadLength(), Packet::VERB_EXT_FRAME, 0, Packet::VERB_NOP, true, nwid, bondFlowId);	  // trustEstablished because COM is okay
 				return true;
 			}
 
@@ -966,7 +830,7 @@ bool IncomingPacket::_doEXT_FRAME(const RuntimeEnvironment* RR, void* tPtr, cons
 						}
 						else {
 							RR->t->incomingNetworkFrameDropped(tPtr, network, _path, packetId(), size(), peer->address(), Packet::VERB_EXT_FRAME, from, to, "bridging not allowed (remote)");
-							peer->received(tPtr, _path, hops(), packetId(), payloadLength(), Packet::VERB_EXT_FRAME, 0, Packet::VERB_NOP, true, nwid, _flowId);	  // trustEstablished because COM is okay
+							peer->received(tPtr, _path, hops(), packetId(), payloadLength(), Packet::VERB_EXT_FRAME, 0, Packet::VERB_NOP, true, nwid, bondFlowId);	  // trustEstablished because COM is okay
 							return true;
 						}
 					}
@@ -974,13 +838,13 @@ bool IncomingPacket::_doEXT_FRAME(const RuntimeEnvironment* RR, void* tPtr, cons
 						if (to.isMulticast()) {
 							if (network->config().multicastLimit == 0) {
 								RR->t->incomingNetworkFrameDropped(tPtr, network, _path, packetId(), size(), peer->address(), Packet::VERB_EXT_FRAME, from, to, "multicast disabled");
-								peer->received(tPtr, _path, hops(), packetId(), payloadLength(), Packet::VERB_EXT_FRAME, 0, Packet::VERB_NOP, true, nwid, _flowId);	  // trustEstablished because COM is okay
+								peer->received(tPtr, _path, hops(), packetId(), payloadLength(), Packet::VERB_EXT_FRAME, 0, Packet::VERB_NOP, true, nwid, bondFlowId);	  // trustEstablished because COM is okay
 								return true;
 							}
 						}
 						else if (! network->config().permitsBridging(RR->identity.address())) {
 							RR->t->incomingNetworkFrameDropped(tPtr, network, _path, packetId(), size(), peer->address(), Packet::VERB_EXT_FRAME, from, to, "bridging not allowed (local)");
-							peer->received(tPtr, _path, hops(), packetId(), payloadLength(), Packet::VERB_EXT_FRAME, 0, Packet::VERB_NOP, true, nwid, _flowId);	  // trustEstablished because COM is okay
+							peer->received(tPtr, _path, hops(), packetId(), payloadLength(), Packet::VERB_EXT_FRAME, 0, Packet::VERB_NOP, true, nwid, bondFlowId);	  // trustEstablished because COM is okay
 							return true;
 						}
 					}
@@ -1003,10 +867,10 @@ bool IncomingPacket::_doEXT_FRAME(const RuntimeEnvironment* RR, void* tPtr, cons
 			_path->send(RR, tPtr, outp.data(), outp.size(), RR->node->now());
 		}
 
-		peer->received(tPtr, _path, hops(), packetId(), payloadLength(), Packet::VERB_EXT_FRAME, 0, Packet::VERB_NOP, true, nwid, _flowId);
+		peer->received(tPtr, _path, hops(), packetId(), payloadLength(), Packet::VERB_EXT_FRAME, 0, Packet::VERB_NOP, true, nwid, bondFlowId);
 	}
 	else {
-		peer->received(tPtr, _path, hops(), packetId(), payloadLength(), Packet::VERB_EXT_FRAME, 0, Packet::VERB_NOP, false, nwid, _flowId);
+		peer->received(tPtr, _path, hops(), packetId(), payloadLength(), Packet::VERB_EXT_FRAME, 0, Packet::VERB_NOP, false, nwid, bondFlowId);
 	}
 
 	return true;
@@ -1311,7 +1175,8 @@ bool IncomingPacket::_doMULTICAST_FRAME(const RuntimeEnvironment* RR, void* tPtr
 	const uint64_t nwid = at<uint64_t>(ZT_PROTO_VERB_MULTICAST_FRAME_IDX_NETWORK_ID);
 	const unsigned int flags = (*this)[ZT_PROTO_VERB_MULTICAST_FRAME_IDX_FLAGS];
 
-	const SharedPtr<Network> network(RR->node->network(nwid));
+	const Node::NetworkReader nr(*(RR->node), nwid);
+	const SharedPtr<Network>& network = nr.network();
 	if (network) {
 		// Offset -- size of optional fields added to position of later fields
 		unsigned int offset = 0;
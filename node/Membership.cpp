@@ -127,8 +127,8 @@ Membership::AddCredentialResult Membership::addCredential(const RuntimeEnvironme
 }
 
 // Template out addCredential() for many cred types to avoid copypasta
-template <typename C>
-static Membership::AddCredentialResult _addCredImpl(Hashtable<uint32_t, C>& remoteCreds, const Hashtable<uint64_t, int64_t>& revocations, const RuntimeEnvironment* RR, void* tPtr, const NetworkConfig& nconf, const C& cred)
+template <typename C, typename T>
+static Membership::AddCredentialResult _addCredImpl(T& remoteCreds, const FlatHashtable<uint64_t, int64_t>& revocations, const RuntimeEnvironment* RR, void* tPtr, const NetworkConfig& nconf, const C& cred)
 {
 	C* rc = remoteCreds.get(cred.id());
 	if (rc) {
@@ -211,11 +211,12 @@ Membership::AddCredentialResult Membership::addCredential(const RuntimeEnvironme
 	}
 }
 
-void Membership::clean(const int64_t now, const NetworkConfig& nconf)
+bool Membership::clean(const int64_t now, const NetworkConfig& nconf)
 {
-	_cleanCredImpl<Tag>(nconf, _remoteTags);
-	_cleanCredImpl<Capability>(nconf, _remoteCaps);
-	_cleanCredImpl<CertificateOfOwnership>(nconf, _remoteCoos);
+	bool removed = _cleanCredImpl<Tag>(nconf, _remoteTags);
+	removed |= _cleanCredImpl<Capability>(nconf, _remoteCaps);
+	removed |= _cleanCredImpl<CertificateOfOwnership>(nconf, _remoteCoos);
+	return removed;
 }
 
 }	// namespace ZeroTier
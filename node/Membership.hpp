@@ -14,6 +14,7 @@
 #include "CertificateOfMembership.hpp"
 #include "Constants.hpp"
 #include "Credential.hpp"
+#include "FlatHashtable.hpp"
 #include "Hashtable.hpp"
 #include "NetworkConfig.hpp"
 #include "Revocation.hpp"
@@ -131,6 +132,14 @@ class Membership {
 		return (((t) && (_isCredentialTimestampValid(nconf, *t))) ? t : (Tag*)0);
 	}
 
+	/**
+	 * @return All capabilities received from this member, including any that are no longer valid
+	 */
+	inline const Hashtable<uint32_t, Capability>& remoteCapabilities() const
+	{
+		return _remoteCaps;
+	}
+
 	/**
 	 * Validate and add a credential if signature is okay and it's otherwise good
 	 */
@@ -161,8 +170,9 @@ class Membership {
 	 *
 	 * @param now Current time
 	 * @param nconf Current network configuration
+	 * @return True if any credentials were removed
 	 */
-	void clean(const int64_t now, const NetworkConfig& nconf);
+	bool clean(const int64_t now, const NetworkConfig& nconf);
 
 	/**
 	 * Generates a key for the internal use in indexing credentials by type and credential ID
@@ -227,16 +237,19 @@ class Membership {
 		return false;
 	}
 
-	template <typename C> inline void _cleanCredImpl(const NetworkConfig& nconf, Hashtable<uint32_t, C>& remoteCreds)
+	template <typename C, typename T> inline bool _cleanCredImpl(const NetworkConfig& nconf, T& remoteCreds)
 	{
+		bool removed = false;
 		uint32_t* k = (uint32_t*)0;
 		C* v = (C*)0;
-		typename Hashtable<uint32_t, C>::Iterator i(remoteCreds);
+		typename T::Iterator i(remoteCreds);
 		while (i.next(k, v)) {
 			if (! _isCredentialTimestampValid(nconf, *v)) {
 				remoteCreds.erase(*k);
+				removed = true;
 			}
 		}
+		return removed;
 	}
 
 	// Last time we pushed MULTICAST_LIKE(s)
@@ -252,35 +265,37 @@ class Membership {
 	CertificateOfMembership _com;
 
 	// Revocations by credentialKey()
-	Hashtable<uint64_t, int64_t> _revocations;
+	FlatHashtable<uint64_t, int64_t> _revocations;
 
-	// Remote credentials that we have received from this member (and that are valid)
-	Hashtable<uint32_t, Tag> _remoteTags;
+	// Remote credentials that we have received from this member (and that are
+	// valid). Capabilities and COOs stay in chained Hashtables because they are
+	// scanned in iteration order, which should not vary between processes.
+	FlatHashtable<uint32_t, Tag> _remoteTags;
 	Hashtable<uint32_t, Capability> _remoteCaps;
 	Hashtable<uint32_t, CertificateOfOwnership> _remoteCoos;
 
   public:
 	class CapabilityIterator {
 	  public:
-		CapabilityIterator(Membership& m, const NetworkConfig& nconf) : _hti(m._remoteCaps), _k((uint32_t*)0), _c((Capability*)0), _m(m), _nconf(nconf)
+		CapabilityIterator(const Membership& m, const NetworkConfig& nconf) : _hti(*(const_cast<Hashtable<uint32_t, Capability>*>(&(m._remoteCaps)))), _k((uint32_t*)0), _c((Capability*)0), _m(m), _nconf(nconf)
 		{
 		}
 
-		inline Capability* next()
+		inline const Capability* next()
 		{
 			while (_hti.next(_k, _c)) {
 				if (_m._isCredentialTimestampValid(_nconf, *_c)) {
 					return _c;
 				}
 			}
-			return (Capability*)0;
+			return (const Capability*)0;
 		}
 
 	  private:
 		Hashtable<uint32_t, Capability>::Iterator _hti;
 		uint32_t* _k;
 		Capability* _c;
-		Membership& _m;
+		const Membership& _m;
 		const NetworkConfig& _nconf;
 	};
 };
@@ -104,6 +104,28 @@ prometheus::simpleapi::counter_metric_t tcp_recv { data.Add({ { "protocol", "tcp
 prometheus::simpleapi::gauge_metric_t network_num_joined { "zt_num_networks", "number of networks this instance is joined to" };
 prometheus::simpleapi::gauge_family_t network_num_multicast_groups { "zt_network_multicast_groups_subscribed", "number of multicast groups networks are subscribed to" };
 prometheus::simpleapi::counter_family_t network_packets { "zt_network_packets", "number of incoming/outgoing packets per network" };
+prometheus::simpleapi::counter_family_t network_flow_cache { "zt_network_flow_cache", "number of flow cache lookups per network" };
+
+// Peer State Store Metrics
+prometheus::simpleapi::gauge_family_t peer_store_time { "zt_peer_store_time", "duration of the last peer state store load or save (ms)" };
+prometheus::simpleapi::gauge_metric_t peer_store_load_time { peer_store_time.Add({ { "operation", "load" } }) };
+prometheus::simpleapi::gauge_metric_t peer_store_save_time { peer_store_time.Add({ { "operation", "save" } }) };
+prometheus::simpleapi::gauge_metric_t peer_store_peers { "zt_peer_store_peers", "number of peers in the peer state store" };
+
+// State Object Writer Metrics
+prometheus::simpleapi::gauge_metric_t state_write_queue_depth { "zt_state_write_queue_depth", "number of state objects waiting to be written to disk" };
+prometheus::CustomFamily<prometheus::Histogram<uint64_t> >& state_write_latency_family =
+	prometheus::Builder<prometheus::Histogram<uint64_t> >().Name("zt_state_write_latency").Help("time to write a state object to disk (ms)").Register(prometheus::simpleapi::registry);
+prometheus::Histogram<uint64_t>& state_write_latency { state_write_latency_family.Add({}, std::vector<uint64_t> { 1, 3, 10, 30, 100, 300, 1000, 3000 }) };
+
+// Relay Metrics
+prometheus::simpleapi::counter_metric_t relay_queue_drops { "zt_relay_queue_drops", "number of datagrams not relayed because their relay worker's queue was full" };
+
+// Housekeeping Metrics
+prometheus::CustomFamily<prometheus::Histogram<uint64_t> >& housekeeping_pass_time =
+	prometheus::Builder<prometheus::Histogram<uint64_t> >().Name("zt_housekeeping_pass_time").Help("time spent in one full cleaning pass over a table (us)").Register(prometheus::simpleapi::registry);
+prometheus::Histogram<uint64_t>& multicast_clean_pass_time { housekeeping_pass_time.Add({ { "table", "multicast" } }, std::vector<uint64_t> { 10, 30, 100, 300, 1000, 3000, 10000, 30000, 100000 }) };
+prometheus::Histogram<uint64_t>& network_clean_pass_time { housekeeping_pass_time.Add({ { "table", "network" } }, std::vector<uint64_t> { 10, 30, 100, 300, 1000, 3000, 10000, 30000, 100000 }) };
 
 #ifndef ZT_NO_PEER_METRICS
 // PeerMetrics
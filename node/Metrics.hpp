@@ -105,6 +105,26 @@ extern prometheus::simpleapi::counter_metric_t tcp_recv;
 extern prometheus::simpleapi::gauge_metric_t network_num_joined;
 extern prometheus::simpleapi::gauge_family_t network_num_multicast_groups;
 extern prometheus::simpleapi::counter_family_t network_packets;
+extern prometheus::simpleapi::counter_family_t network_flow_cache;
+
+// Peer State Store Metrics
+extern prometheus::simpleapi::gauge_family_t peer_store_time;
+extern prometheus::simpleapi::gauge_metric_t peer_store_load_time;
+extern prometheus::simpleapi::gauge_metric_t peer_store_save_time;
+extern prometheus::simpleapi::gauge_metric_t peer_store_peers;
+
+// State Object Writer Metrics
+extern prometheus::simpleapi::gauge_metric_t state_write_queue_depth;
+extern prometheus::CustomFamily<prometheus::Histogram<uint64_t> >& state_write_latency_family;
+extern prometheus::Histogram<uint64_t>& state_write_latency;
+
+// Relay Metrics
+extern prometheus::simpleapi::counter_metric_t relay_queue_drops;
+
+// Housekeeping Metrics
+extern prometheus::CustomFamily<prometheus::Histogram<uint64_t> >& housekeeping_pass_time;
+extern prometheus::Histogram<uint64_t>& multicast_clean_pass_time;
+extern prometheus::Histogram<uint64_t>& network_clean_pass_time;
 
 #ifndef ZT_NO_PEER_METRICS
 // Peer Metrics
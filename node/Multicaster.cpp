@@ -10,6 +10,7 @@
 
 #include "CertificateOfMembership.hpp"
 #include "Constants.hpp"
+#include "Metrics.hpp"
 #include "Network.hpp"
 #include "Node.hpp"
 #include "Packet.hpp"
@@ -17,12 +18,53 @@
 #include "RuntimeEnvironment.hpp"
 #include "Switch.hpp"
 #include "Topology.hpp"
+#include "WireBatch.hpp"
 
 #include <algorithm>
+#include <chrono>
 
 namespace ZeroTier {
 
-Multicaster::Multicaster(const RuntimeEnvironment* renv) : RR(renv), _groups(32)
+namespace {
+
+// Distinct random indexes below n, drawn one at a time by a partial
+// Fisher-Yates shuffle that remembers its swaps instead of making them,
+// so drawing k indexes costs O(k) however large n is.
+class RandomIndexes {
+  public:
+	RandomIndexes(const unsigned long n, const unsigned long expected) : _swapped(expected * 2), _n(n), _i(0)
+	{
+	}
+
+	inline bool next(const uint64_t r, unsigned long& idx)
+	{
+		if (_i >= _n) {
+			return false;
+		}
+		const uint64_t j = _i + (r % (_n - _i));
+		idx = (unsigned long)_at(j);
+		if (j != _i) {
+			_swapped.set(j, _at(_i));
+		}
+		++_i;
+		return true;
+	}
+
+  private:
+	inline uint64_t _at(const uint64_t k) const
+	{
+		const uint64_t* const v = _swapped.get(k);
+		return (v) ? *v : k;
+	}
+
+	FlatHashtable<uint64_t, uint64_t> _swapped;
+	const uint64_t _n;
+	uint64_t _i;
+};
+
+}	// anonymous namespace
+
+Multicaster::Multicaster(const RuntimeEnvironment* renv) : RR(renv), _groups(32), _lastCleanPass(0), _cleanCursor(0), _cleaning(false), _cleanPassTime(0)
 {
 }
 
@@ -30,14 +72,22 @@ Multicaster::~Multicaster()
 {
 }
 
+void Multicaster::add(void* tPtr, int64_t now, uint64_t nwid, const MulticastGroup& mg, const Address& member)
+{
+	Mutex::Lock _l(_groups_m);
+	WireBatch batch(RR, tPtr);
+	_add(tPtr, now, nwid, mg, _groups[Multicaster::Key(nwid, mg)], member, batch);
+}
+
 void Multicaster::addMultiple(void* tPtr, int64_t now, uint64_t nwid, const MulticastGroup& mg, const void* addresses, unsigned int count, unsigned int totalKnown)
 {
 	const unsigned char* p = (const unsigned char*)addresses;
 	const unsigned char* e = p + (5 * count);
 	Mutex::Lock _l(_groups_m);
+	WireBatch batch(RR, tPtr);
 	MulticastGroupStatus& gs = _groups[Multicaster::Key(nwid, mg)];
 	while (p != e) {
-		_add(tPtr, now, nwid, mg, gs, Address(p, 5));
+		_add(tPtr, now, nwid, mg, gs, Address(p, 5), batch);
 		p += 5;
 	}
 }
@@ -47,20 +97,13 @@ void Multicaster::remove(uint64_t nwid, const MulticastGroup& mg, const Address&
 	Mutex::Lock _l(_groups_m);
 	MulticastGroupStatus* s = _groups.get(Multicaster::Key(nwid, mg));
 	if (s) {
-		for (std::vector<MulticastGroupMember>::iterator m(s->members.begin()); m != s->members.end(); ++m) {
-			if (m->address == member) {
-				s->members.erase(m);
-				break;
-			}
-		}
+		s->members.remove(member);
 	}
 }
 
 unsigned int Multicaster::gather(const Address& queryingPeer, uint64_t nwid, const MulticastGroup& mg, Buffer<ZT_PROTO_MAX_PACKET_LENGTH>& appendTo, unsigned int limit) const
 {
-	unsigned char* p;
-	unsigned int added = 0, i, k, rptr, totalKnown = 0;
-	uint64_t a, picked[(ZT_PROTO_MAX_PACKET_LENGTH / 5) + 2];
+	unsigned int added = 0, totalKnown = 0;
 
 	if (! limit) {
 		return 0;
@@ -91,27 +134,12 @@ unsigned int Multicaster::gather(const Address& queryingPeer, uint64_t nwid, con
 
 		// Members are returned in random order so that repeated gather queries
 		// will return different subsets of a large multicast group.
-		k = 0;
-		while ((added < limit) && (k < s->members.size()) && ((appendTo.size() + ZT_ADDRESS_LENGTH) <= ZT_PROTO_MAX_PACKET_LENGTH)) {
-			rptr = (unsigned int)RR->node->prng();
-
-		restart_member_scan:
-			a = s->members[rptr % (unsigned int)s->members.size()].address.toInt();
-			for (i = 0; i < k; ++i) {
-				if (picked[i] == a) {
-					++rptr;
-					goto restart_member_scan;
-				}
-			}
-			picked[k++] = a;
-
-			if (queryingPeer.toInt() != a) {   // do not return the peer that is making the request as a result
-				p = (unsigned char*)appendTo.appendField(ZT_ADDRESS_LENGTH);
-				*(p++) = (unsigned char)((a >> 32) & 0xff);
-				*(p++) = (unsigned char)((a >> 24) & 0xff);
-				*(p++) = (unsigned char)((a >> 16) & 0xff);
-				*(p++) = (unsigned char)((a >> 8) & 0xff);
-				*p = (unsigned char)(a & 0xff);
+		RandomIndexes picks(s->members.size(), std::min((unsigned long)limit, (unsigned long)(ZT_PROTO_MAX_PACKET_LENGTH / ZT_ADDRESS_LENGTH)));
+		unsigned long idx = 0;
+		while ((added < limit) && ((appendTo.size() + ZT_ADDRESS_LENGTH) <= ZT_PROTO_MAX_PACKET_LENGTH) && (picks.next(RR->node->prng(), idx))) {
+			const Address& a = s->members[idx];
+			if (a != queryingPeer) {   // do not return the peer that is making the request as a result
+				a.appendTo(appendTo);
 				++added;
 			}
 		}
@@ -131,20 +159,12 @@ std::vector<Address> Multicaster::getMembers(uint64_t nwid, const MulticastGroup
 	if (! s) {
 		return ls;
 	}
-	for (std::vector<MulticastGroupMember>::const_reverse_iterator m(s->members.rbegin()); m != s->members.rend(); ++m) {
-		ls.push_back(m->address);
-		if (ls.size() >= limit) {
-			break;
-		}
-	}
+	s->members.newest(ls, limit);
 	return ls;
 }
 
 void Multicaster::send(void* tPtr, int64_t now, const SharedPtr<Network>& network, const Address& origin, const MulticastGroup& mg, const MAC& src, unsigned int etherType, const void* data, unsigned int len)
 {
-	unsigned long idxbuf[4096];
-	unsigned long* indexes = idxbuf;
-
 	// If we're in hub-and-spoke designated multicast replication mode, see if we
 	// have a multicast replicator active. If so, pick the best and send it
 	// there. If we are a multicast replicator or if none are alive, fall back
@@ -193,30 +213,17 @@ void Multicaster::send(void* tPtr, int64_t now, const SharedPtr<Network>& networ
 
 	try {
 		Mutex::Lock _l(_groups_m);
+		WireBatch batch(RR, tPtr);
 		MulticastGroupStatus& gs = _groups[Multicaster::Key(network->id(), mg)];
 
-		if (! gs.members.empty()) {
-			// Allocate a memory buffer if group is monstrous
-			if (gs.members.size() > (sizeof(idxbuf) / sizeof(unsigned long))) {
-				indexes = new unsigned long[gs.members.size()];
-			}
-
-			// Generate a random permutation of member indexes
-			for (unsigned long i = 0; i < gs.members.size(); ++i) {
-				indexes[i] = i;
-			}
-			for (unsigned long i = (unsigned long)gs.members.size() - 1; i > 0; --i) {
-				unsigned long j = (unsigned long)RR->node->prng() % (i + 1);
-				unsigned long tmp = indexes[j];
-				indexes[j] = indexes[i];
-				indexes[i] = tmp;
-			}
-		}
-
 		Address activeBridges[ZT_MAX_NETWORK_SPECIALISTS];
 		const unsigned int activeBridgeCount = network->config().activeBridges(activeBridges);
 		const unsigned int limit = network->config().multicastLimit;
 
+		// Recipients are members picked in random order
+		RandomIndexes picks(gs.members.size(), limit);
+		unsigned long idx = 0;
+
 		if (gs.members.size() >= limit) {
 			// Skip queue if we already have enough members to complete the send operation
 			OutboundMulticast out;
@@ -238,15 +245,14 @@ void Multicaster::send(void* tPtr, int64_t now, const SharedPtr<Network>& networ
 
 			for (unsigned int i = 0; i < activeBridgeCount; ++i) {
 				if ((activeBridges[i] != RR->identity.address()) && (activeBridges[i] != origin)) {
-					out.sendOnly(RR, tPtr, activeBridges[i]);	// optimization: don't use dedup log if it's a one-pass send
+					out.sendOnly(RR, tPtr, activeBridges[i], batch);	// optimization: don't use dedup log if it's a one-pass send
 				}
 			}
 
-			unsigned long idx = 0;
-			while ((count < limit) && (idx < gs.members.size())) {
-				const Address ma(gs.members[indexes[idx++]].address);
+			while ((count < limit) && (picks.next(RR->node->prng(), idx))) {
+				const Address ma(gs.members[idx]);
 				if ((std::find(activeBridges, activeBridges + activeBridgeCount, ma) == (activeBridges + activeBridgeCount)) && (ma != origin)) {
-					out.sendOnly(RR, tPtr, ma);	  // optimization: don't use dedup log if it's a one-pass send
+					out.sendOnly(RR, tPtr, ma, batch);	  // optimization: don't use dedup log if it's a one-pass send
 					++count;
 				}
 			}
@@ -323,39 +329,50 @@ void Multicaster::send(void* tPtr, int64_t now, const SharedPtr<Network>& networ
 
 			for (unsigned int i = 0; i < activeBridgeCount; ++i) {
 				if (activeBridges[i] != RR->identity.address()) {
-					out.sendAndLog(RR, tPtr, activeBridges[i]);
+					out.sendAndLog(RR, tPtr, activeBridges[i], batch);
 					if (++count >= limit) {
 						break;
 					}
 				}
 			}
 
-			unsigned long idx = 0;
-			while ((count < limit) && (idx < gs.members.size())) {
-				Address ma(gs.members[indexes[idx++]].address);
+			while ((count < limit) && (picks.next(RR->node->prng(), idx))) {
+				const Address ma(gs.members[idx]);
 				if (std::find(activeBridges, activeBridges + activeBridgeCount, ma) == (activeBridges + activeBridgeCount)) {
-					out.sendAndLog(RR, tPtr, ma);
+					out.sendAndLog(RR, tPtr, ma, batch);
 					++count;
 				}
 			}
 		}
 	}
 	catch (...) {
-	}	// this is a sanity check to catch any failures and make sure indexes[] still gets deleted
-
-	// Free allocated memory buffer if any
-	if (indexes != idxbuf) {
-		delete[] indexes;
-	}
+	}	// this is a sanity check to catch any failures
 }
 
-void Multicaster::clean(int64_t now)
+bool Multicaster::clean(int64_t now, unsigned long budget)
 {
 	Mutex::Lock _l(_groups_m);
+
+	if (! _cleaning) {
+		if ((now - _lastCleanPass) < ZT_HOUSEKEEPING_PERIOD) {
+			return false;
+		}
+		_lastCleanPass = now;
+		_cleanCursor = 0;
+		_cleaning = true;
+		_cleanPassTime = 0;
+	}
+	const std::chrono::steady_clock::time_point start(std::chrono::steady_clock::now());
+
+	// Expiring a group's members is done as a whole, so the budget can be overrun by one group
+	unsigned long visited = 0;
 	Multicaster::Key* k = (Multicaster::Key*)0;
 	MulticastGroupStatus* s = (MulticastGroupStatus*)0;
-	Hashtable<Multicaster::Key, MulticastGroupStatus>::Iterator mm(_groups);
-	while (mm.next(k, s)) {
+	FlatHashtable<Multicaster::Key, MulticastGroupStatus>::Iterator mm(_groups, _cleanCursor);
+	bool more = true;
+	while ((visited < budget) && (more = mm.next(k, s))) {
+		visited += 1 + (unsigned long)s->txQueue.size();
+
 		for (std::list<OutboundMulticast>::iterator tx(s->txQueue.begin()); tx != s->txQueue.end();) {
 			if ((tx->expired(now)) || (tx->atLimit())) {
 				s->txQueue.erase(tx++);
@@ -365,33 +382,24 @@ void Multicaster::clean(int64_t now)
 			}
 		}
 
-		unsigned long count = 0;
-		{
-			std::vector<MulticastGroupMember>::iterator reader(s->members.begin());
-			std::vector<MulticastGroupMember>::iterator writer(reader);
-			while (reader != s->members.end()) {
-				if ((now - reader->timestamp) < ZT_MULTICAST_LIKE_EXPIRE) {
-					*writer = *reader;
-					++writer;
-					++count;
-				}
-				++reader;
-			}
-		}
+		visited += s->members.expire(now, ZT_MULTICAST_LIKE_EXPIRE);
 
-		if (count) {
-			s->members.resize(count);
-		}
-		else if (s->txQueue.empty()) {
+		if ((s->members.empty()) && (s->txQueue.empty())) {
 			_groups.erase(*k);
 		}
-		else {
-			s->members.clear();
-		}
 	}
+
+	_cleanPassTime += (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	if (more) {
+		_cleanCursor = mm.position();
+		return true;
+	}
+	_cleaning = false;
+	Metrics::multicast_clean_pass_time.Observe(_cleanPassTime);
+	return false;
 }
 
-void Multicaster::_add(void* tPtr, int64_t now, uint64_t nwid, const MulticastGroup& mg, MulticastGroupStatus& gs, const Address& member)
+void Multicaster::_add(void* tPtr, int64_t now, uint64_t nwid, const MulticastGroup& mg, MulticastGroupStatus& gs, const Address& member, WireBatch& batch)
 {
 	// assumes _groups_m is locked
 
@@ -400,16 +408,8 @@ void Multicaster::_add(void* tPtr, int64_t now, uint64_t nwid, const MulticastGr
 		return;
 	}
 
-	std::vector<MulticastGroupMember>::iterator m(std::lower_bound(gs.members.begin(), gs.members.end(), member));
-	if (m != gs.members.end()) {
-		if (m->address == member) {
-			m->timestamp = now;
-			return;
-		}
-		gs.members.insert(m, MulticastGroupMember(member, now));
-	}
-	else {
-		gs.members.push_back(MulticastGroupMember(member, now));
+	if (! gs.members.add(member, now)) {
+		return;
 	}
 
 	for (std::list<OutboundMulticast>::iterator tx(gs.txQueue.begin()); tx != gs.txQueue.end();) {
@@ -417,7 +417,7 @@ void Multicaster::_add(void* tPtr, int64_t now, uint64_t nwid, const MulticastGr
 			gs.txQueue.erase(tx++);
 		}
 		else {
-			tx->sendIfNew(RR, tPtr, member);
+			tx->sendIfNew(RR, tPtr, member, batch);
 			if (tx->atLimit()) {
 				gs.txQueue.erase(tx++);
 			}
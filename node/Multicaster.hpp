@@ -11,7 +11,7 @@
 
 #include "Address.hpp"
 #include "Constants.hpp"
-#include "Hashtable.hpp"
+#include "FlatHashtable.hpp"
 #include "MAC.hpp"
 #include "MulticastGroup.hpp"
 #include "Mutex.hpp"
@@ -31,6 +31,7 @@ class RuntimeEnvironment;
 class CertificateOfMembership;
 class Packet;
 class Network;
+class WireBatch;
 
 /**
  * Database of known multicast peers within a network
@@ -48,11 +49,7 @@ class Multicaster {
 	 * @param mg Multicast group
 	 * @param member New member address
 	 */
-	inline void add(void* tPtr, int64_t now, uint64_t nwid, const MulticastGroup& mg, const Address& member)
-	{
-		Mutex::Lock _l(_groups_m);
-		_add(tPtr, now, nwid, mg, _groups[Multicaster::Key(nwid, mg)], member);
-	}
+	void add(void* tPtr, int64_t now, uint64_t nwid, const MulticastGroup& mg, const Address& member);
 
 	/**
 	 * Add multiple addresses from a binary array of 5-byte address fields
@@ -124,10 +121,15 @@ class Multicaster {
 	/**
 	 * Clean database
 	 *
-	 * @param RR Runtime environment
+	 * A pass over all groups starts every ZT_HOUSEKEEPING_PERIOD and is done
+	 * a slice at a time, so _groups_m is only held for up to budget groups
+	 * and members per call.
+	 *
 	 * @param now Current time
+	 * @param budget Maximum number of entries to visit in this call
+	 * @return True if a pass is still in progress and this should be called again soon
 	 */
-	void clean(int64_t now);
+	bool clean(int64_t now, unsigned long budget);
 
   private:
 	struct Key {
@@ -155,41 +157,175 @@ class Multicaster {
 		}
 	};
 
-	struct MulticastGroupMember {
-		MulticastGroupMember()
+	/**
+	 * Members of one multicast group
+	 *
+	 * Members are kept in a dense array so random recipients can be picked in
+	 * O(1), with a hash from address to array slot for O(1) add and remove.
+	 * A list threaded through the array runs from the least to the most
+	 * recently refreshed member, so expiry only touches expired members.
+	 * Timestamps are assumed not to go backwards.
+	 */
+	class MulticastGroupMembers {
+	  public:
+		MulticastGroupMembers() : _index(8), _oldest(_NIL), _newest(_NIL)
+		{
+		}
+
+		inline unsigned long size() const
+		{
+			return (unsigned long)_m.size();
+		}
+		inline bool empty() const
+		{
+			return _m.empty();
+		}
+
+		/**
+		 * @param i Index from 0 to size()-1
+		 * @return Member at this index (indexes change as members are removed)
+		 */
+		inline const Address& operator[](const unsigned long i) const
 		{
+			return _m[i].address;
 		}
-		MulticastGroupMember(const Address& a, uint64_t ts) : address(a), timestamp(ts)
+
+		/**
+		 * Add a member or refresh its timestamp
+		 *
+		 * @param a Member address
+		 * @param ts Time of last notification
+		 * @return True if a is a new member
+		 */
+		inline bool add(const Address& a, const int64_t ts)
 		{
+			const unsigned long* const i = _index.get(a);
+			if (i) {
+				_m[*i].timestamp = ts;
+				_unlink(*i);
+				_linkNewest(*i);
+				return false;
+			}
+			const unsigned long n = (unsigned long)_m.size();
+			_m.push_back(_Member(a, ts));
+			_index.set(a, n);
+			_linkNewest(n);
+			return true;
 		}
 
-		inline bool operator<(const MulticastGroupMember& a) const
+		/**
+		 * @param a Member address
+		 * @return True if a was a member
+		 */
+		inline bool remove(const Address& a)
 		{
-			return (address < a.address);
+			const unsigned long* const i = _index.get(a);
+			if (i) {
+				_erase(*i);
+				return true;
+			}
+			return false;
 		}
-		inline bool operator==(const MulticastGroupMember& a) const
+
+		/**
+		 * Remove members not refreshed within maxAge
+		 *
+		 * @param now Current time
+		 * @param maxAge Maximum age of a member's timestamp
+		 * @return Number of members removed
+		 */
+		inline unsigned long expire(const int64_t now, const int64_t maxAge)
 		{
-			return (address == a.address);
+			unsigned long n = 0;
+			while ((_oldest != _NIL) && ((now - _m[_oldest].timestamp) >= maxAge)) {
+				_erase(_oldest);
+				++n;
+			}
+			return n;
 		}
-		inline bool operator!=(const MulticastGroupMember& a) const
+
+		/**
+		 * @param v Vector to receive up to limit members, most recently refreshed first
+		 * @param limit Maximum number of members to append
+		 */
+		inline void newest(std::vector<Address>& v, const unsigned long limit) const
 		{
-			return (address != a.address);
+			for (unsigned long i = _newest, n = 0; (i != _NIL) && (n < limit); i = _m[i].older, ++n) {
+				v.push_back(_m[i].address);
+			}
 		}
-		inline bool operator<(const Address& a) const
+
+	  private:
+		static const unsigned long _NIL = ~0UL;
+
+		struct _Member {
+			_Member(const Address& a, const int64_t ts) : address(a), timestamp(ts), older(_NIL), newer(_NIL)
+			{
+			}
+			Address address;
+			int64_t timestamp;	 // time of last notification
+			unsigned long older, newer;
+		};
+
+		inline void _unlink(const unsigned long i)
 		{
-			return (address < a);
+			_Member& m = _m[i];
+			if (m.older != _NIL) {
+				_m[m.older].newer = m.newer;
+			}
+			else {
+				_oldest = m.newer;
+			}
+			if (m.newer != _NIL) {
+				_m[m.newer].older = m.older;
+			}
+			else {
+				_newest = m.older;
+			}
 		}
-		inline bool operator==(const Address& a) const
+
+		inline void _linkNewest(const unsigned long i)
 		{
-			return (address == a);
+			_m[i].older = _newest;
+			_m[i].newer = _NIL;
+			if (_newest != _NIL) {
+				_m[_newest].newer = i;
+			}
+			else {
+				_oldest = i;
+			}
+			_newest = i;
 		}
-		inline bool operator!=(const Address& a) const
+
+		// Remove by moving the last member into slot i
+		inline void _erase(const unsigned long i)
 		{
-			return (address != a);
+			_unlink(i);
+			_index.erase(_m[i].address);
+			const unsigned long last = (unsigned long)_m.size() - 1;
+			if (i != last) {
+				_Member& m = _m[i];
+				m = _m[last];
+				if (m.older != _NIL) {
+					_m[m.older].newer = i;
+				}
+				else {
+					_oldest = i;
+				}
+				if (m.newer != _NIL) {
+					_m[m.newer].older = i;
+				}
+				else {
+					_newest = i;
+				}
+				_index.set(m.address, i);
+			}
+			_m.pop_back();
 		}
 
-		Address address;
-		int64_t timestamp;	 // time of last notification
+		std::vector<_Member> _m;
+		FlatHashtable<Address, unsigned long> _index;
+		unsigned long _oldest, _newest;
 	};
 
 	struct MulticastGroupStatus {
@@ -198,15 +334,22 @@ class Multicaster {
 		}
 
 		int64_t lastExplicitGather;
-		std::list<OutboundMulticast> txQueue;		 // pending outbound multicasts
-		std::vector<MulticastGroupMember> members;	 // members of this group
+		std::list<OutboundMulticast> txQueue;	// pending outbound multicasts
+		MulticastGroupMembers members;			// members of this group
 	};
 
-	void _add(void* tPtr, int64_t now, uint64_t nwid, const MulticastGroup& mg, MulticastGroupStatus& gs, const Address& member);
+	void _add(void* tPtr, int64_t now, uint64_t nwid, const MulticastGroup& mg, MulticastGroupStatus& gs, const Address& member, WireBatch& batch);
 
 	const RuntimeEnvironment* const RR;
 
-	Hashtable<Multicaster::Key, MulticastGroupStatus> _groups;
+	FlatHashtable<Multicaster::Key, MulticastGroupStatus> _groups;
+
+	// State of the clean() pass in progress, if any
+	int64_t _lastCleanPass;	  // start of the last pass
+	unsigned long _cleanCursor;	  // FlatHashtable::Iterator position in _groups
+	bool _cleaning;
+	uint64_t _cleanPassTime;	 // microseconds spent in this pass so far
+
 	Mutex _groups_m;
 };
 
@@ -25,6 +25,7 @@
 #include "Switch.hpp"
 #include "Trace.hpp"
 
+#include <chrono>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -34,614 +35,31 @@ namespace ZeroTier {
 
 namespace {
 
-// Returns true if packet appears valid; pos and proto will be set
-static inline bool _ipv6GetPayload(const uint8_t* frameData, unsigned int frameLen, unsigned int& pos, unsigned int& proto)
-{
-	if (frameLen < 40) {
-		return false;
-	}
-	pos = 40;
-	proto = frameData[6];
-	while (pos <= frameLen) {
-		switch (proto) {
-			case 0:		// hop-by-hop options
-			case 43:	// routing
-			case 60:	// destination options
-			case 135:	// mobility options
-				if ((pos + 8) > frameLen) {
-					return false;	// invalid!
-				}
-				proto = frameData[pos];
-				pos += ((unsigned int)frameData[pos + 1] * 8) + 8;
-				break;
-
-			// case 44: // fragment -- we currently can't parse these and they are deprecated in IPv6 anyway
-			// case 50:
-			// case 51: // IPSec ESP and AH -- we have to stop here since this is encrypted stuff
-			default:
-				return true;
-		}
-	}
-	return false;	// overflow == invalid
-}
-
-enum _doZtFilterResult { DOZTFILTER_NO_MATCH, DOZTFILTER_DROP, DOZTFILTER_REDIRECT, DOZTFILTER_ACCEPT, DOZTFILTER_SUPER_ACCEPT };
-
-static _doZtFilterResult _doZtFilter(
+// Evaluate a rule set with its compiled program, or with the interpreter if
+// remote tracing needs a per-rule result log
+static inline ZtFilterResult _filter(
 	const RuntimeEnvironment* RR,
 	Trace::RuleResultLog& rrl,
 	const NetworkConfig& nconf,
-	const Membership* membership,	// can be NULL
+	const CompiledRules& compiled,
+	const CompiledRules::Frame& frame,
+	const Membership* membership,
 	const bool inbound,
 	const Address& ztSource,
-	Address& ztDest,   // MUTABLE -- is changed on REDIRECT actions
+	Address& ztDest,
 	const MAC& macSource,
 	const MAC& macDest,
-	const uint8_t* const frameData,
-	const unsigned int frameLen,
-	const unsigned int etherType,
-	const unsigned int vlanId,
-	const ZT_VirtualNetworkRule* rules,	  // cannot be NULL
+	const ZT_VirtualNetworkRule* rules,
 	const unsigned int ruleCount,
-	Address& cc,			  // MUTABLE -- set to TEE destination if TEE action is taken or left alone otherwise
-	unsigned int& ccLength,	  // MUTABLE -- set to length of packet payload to TEE
-	bool& ccWatch,			  // MUTABLE -- set to true for WATCH target as opposed to normal TEE
-	uint8_t& qosBucket)		  // MUTABLE -- set to the value of the argument provided to PRIORITY
+	Address& cc,
+	unsigned int& ccLength,
+	bool& ccWatch,
+	uint8_t& qosBucket)
 {
-	// Set to true if we are a TEE/REDIRECT/WATCH target
-	bool superAccept = false;
-
-	// The default match state for each set of entries starts as 'true' since an
-	// ACTION with no MATCH entries preceding it is always taken.
-	uint8_t thisSetMatches = 1;
-	uint8_t skipDrop = 0;
-
-	rrl.clear();
-
-	// uncomment for easier debugging fprintf
-	// if (!ztDest) { return DOZTFILTER_ACCEPT; }
-#ifdef ZT_TRACE
-	// char buf[40], buf2[40];
-	// fprintf(stderr, "\nsrc %s dest %s inbound: %d ethertype %u", ztSource.toString(buf), ztDest.toString(buf2), inbound, etherType);
-#endif
-
-	for (unsigned int rn = 0; rn < ruleCount; ++rn) {
-		const ZT_VirtualNetworkRuleType rt = (ZT_VirtualNetworkRuleType)(rules[rn].t & 0x3f);
-#ifdef ZT_TRACE
-		// fprintf(stderr, "\n%02u %02d", rn, rt);
-#endif
-
-		// First check if this is an ACTION
-		if ((unsigned int)rt <= (unsigned int)ZT_NETWORK_RULE_ACTION__MAX_ID) {
-			if (thisSetMatches) {
-				switch (rt) {
-					case ZT_NETWORK_RULE_ACTION_PRIORITY:
-						qosBucket = (rules[rn].v.qosBucket <= 8) ? rules[rn].v.qosBucket : 4;	// 4 = default bucket (no priority)
-						return DOZTFILTER_ACCEPT;
-
-					case ZT_NETWORK_RULE_ACTION_DROP: {
-						if (! ! skipDrop) {
-#ifdef ZT_TRACE
-							// fprintf(stderr, "\tskip Drop");
-#endif
-							skipDrop = 0;
-							continue;
-						}
-#ifdef ZT_TRACE
-						// fprintf(stderr, "\tDrop\n");
-#endif
-						return DOZTFILTER_DROP;
-					}
-
-					case ZT_NETWORK_RULE_ACTION_ACCEPT: {
-#ifdef ZT_TRACE
-						// fprintf(stderr, "\tAccept\n");
-#endif
-						return (superAccept ? DOZTFILTER_SUPER_ACCEPT : DOZTFILTER_ACCEPT);	  // match, accept packet
-					}
-
-					// These are initially handled together since preliminary logic is common
-					case ZT_NETWORK_RULE_ACTION_TEE:
-					case ZT_NETWORK_RULE_ACTION_WATCH:
-					case ZT_NETWORK_RULE_ACTION_REDIRECT: {
-						const Address fwdAddr(rules[rn].v.fwd.address);
-						if (fwdAddr == ztSource) {
-							// Skip as no-op since source is target
-						}
-						else if (fwdAddr == RR->identity.address()) {
-							if (inbound) {
-								return DOZTFILTER_SUPER_ACCEPT;
-							}
-							else {
-							}
-						}
-						else if (fwdAddr == ztDest) {
-						}
-						else {
-							if (rt == ZT_NETWORK_RULE_ACTION_REDIRECT) {
-								ztDest = fwdAddr;
-								return DOZTFILTER_REDIRECT;
-							}
-							else {
-								cc = fwdAddr;
-								ccLength = (rules[rn].v.fwd.length != 0) ? ((frameLen < (unsigned int)rules[rn].v.fwd.length) ? frameLen : (unsigned int)rules[rn].v.fwd.length) : frameLen;
-								ccWatch = (rt == ZT_NETWORK_RULE_ACTION_WATCH);
-							}
-						}
-					}
-						continue;
-
-					case ZT_NETWORK_RULE_ACTION_BREAK:
-						return DOZTFILTER_NO_MATCH;
-
-					// Unrecognized ACTIONs are ignored as no-ops
-					default:
-						continue;
-				}
-			}
-			else {
-				// If this is an incoming packet and we are a TEE or REDIRECT target, we should
-				// super-accept if we accept at all. This will cause us to accept redirected or
-				// tee'd packets in spite of MAC and ZT addressing checks.
-				if (inbound) {
-					switch (rt) {
-						case ZT_NETWORK_RULE_ACTION_TEE:
-						case ZT_NETWORK_RULE_ACTION_WATCH:
-						case ZT_NETWORK_RULE_ACTION_REDIRECT:
-							if (RR->identity.address() == rules[rn].v.fwd.address) {
-								superAccept = true;
-							}
-							break;
-						default:
-							break;
-					}
-				}
-
-				thisSetMatches = 1;	  // reset to default true for next batch of entries
-				continue;
-			}
-		}
-
-		// Circuit breaker: no need to evaluate an AND if the set's match state
-		// is currently false since anything AND false is false.
-		if ((! thisSetMatches) && (! (rules[rn].t & 0x40))) {
-			rrl.logSkipped(rn, thisSetMatches);
-			continue;
-		}
-
-		// If this was not an ACTION evaluate next MATCH and update thisSetMatches with (AND [result])
-		uint8_t thisRuleMatches = 0;
-		uint64_t ownershipVerificationMask = 1;		// this magic value means it hasn't been computed yet -- this is done lazily the first time it's needed
-		uint8_t hardYes = (rules[rn].t >> 7) ^ 1;	// XOR with the NOT bit of the rule
-		uint8_t hardNo = (rules[rn].t >> 7) ^ 0;
-
-		switch (rt) {
-			case ZT_NETWORK_RULE_MATCH_SOURCE_ZEROTIER_ADDRESS:
-				thisRuleMatches = (uint8_t)(rules[rn].v.zt == ztSource.toInt());
-				break;
-			case ZT_NETWORK_RULE_MATCH_DEST_ZEROTIER_ADDRESS:
-				thisRuleMatches = (uint8_t)(rules[rn].v.zt == ztDest.toInt());
-				break;
-			case ZT_NETWORK_RULE_MATCH_VLAN_ID:
-				thisRuleMatches = (uint8_t)(rules[rn].v.vlanId == (uint16_t)vlanId);
-				break;
-			case ZT_NETWORK_RULE_MATCH_VLAN_PCP:
-				// NOT SUPPORTED YET
-				thisRuleMatches = (uint8_t)(rules[rn].v.vlanPcp == 0);
-				break;
-			case ZT_NETWORK_RULE_MATCH_VLAN_DEI:
-				// NOT SUPPORTED YET
-				thisRuleMatches = (uint8_t)(rules[rn].v.vlanDei == 0);
-				break;
-			case ZT_NETWORK_RULE_MATCH_MAC_SOURCE:
-				thisRuleMatches = (uint8_t)(MAC(rules[rn].v.mac, 6) == macSource);
-				break;
-			case ZT_NETWORK_RULE_MATCH_MAC_DEST:
-				thisRuleMatches = (uint8_t)(MAC(rules[rn].v.mac, 6) == macDest);
-				break;
-			case ZT_NETWORK_RULE_MATCH_IPV4_SOURCE:
-				if ((etherType == ZT_ETHERTYPE_IPV4) && (frameLen >= 20)) {
-					thisRuleMatches = (uint8_t)(InetAddress((const void*)&(rules[rn].v.ipv4.ip), 4, rules[rn].v.ipv4.mask).containsAddress(InetAddress((const void*)(frameData + 12), 4, 0)));
-				}
-				else {
-					thisRuleMatches = hardNo;
-				}
-				break;
-			case ZT_NETWORK_RULE_MATCH_IPV4_DEST:
-				if ((etherType == ZT_ETHERTYPE_IPV4) && (frameLen >= 20)) {
-					thisRuleMatches = (uint8_t)(InetAddress((const void*)&(rules[rn].v.ipv4.ip), 4, rules[rn].v.ipv4.mask).containsAddress(InetAddress((const void*)(frameData + 16), 4, 0)));
-				}
-				else {
-					thisRuleMatches = hardNo;
-				}
-				break;
-			case ZT_NETWORK_RULE_MATCH_IPV6_SOURCE:
-				if ((etherType == ZT_ETHERTYPE_IPV6) && (frameLen >= 40)) {
-					thisRuleMatches = (uint8_t)(InetAddress((const void*)rules[rn].v.ipv6.ip, 16, rules[rn].v.ipv6.mask).containsAddress(InetAddress((const void*)(frameData + 8), 16, 0)));
-				}
-				else {
-					thisRuleMatches = hardNo;
-				}
-				break;
-			case ZT_NETWORK_RULE_MATCH_IPV6_DEST:
-				if ((etherType == ZT_ETHERTYPE_IPV6) && (frameLen >= 40)) {
-					thisRuleMatches = (uint8_t)(InetAddress((const void*)rules[rn].v.ipv6.ip, 16, rules[rn].v.ipv6.mask).containsAddress(InetAddress((const void*)(frameData + 24), 16, 0)));
-				}
-				else {
-					thisRuleMatches = hardNo;
-				}
-				break;
-			case ZT_NETWORK_RULE_MATCH_IP_TOS:
-				if ((etherType == ZT_ETHERTYPE_IPV4) && (frameLen >= 20)) {
-					const uint8_t tosMasked = frameData[1] & rules[rn].v.ipTos.mask;
-					thisRuleMatches = (uint8_t)((tosMasked >= rules[rn].v.ipTos.value[0]) && (tosMasked <= rules[rn].v.ipTos.value[1]));
-				}
-				else if ((etherType == ZT_ETHERTYPE_IPV6) && (frameLen >= 40)) {
-					const uint8_t tosMasked = (((frameData[0] << 4) & 0xf0) | ((frameData[1] >> 4) & 0x0f)) & rules[rn].v.ipTos.mask;
-					thisRuleMatches = (uint8_t)((tosMasked >= rules[rn].v.ipTos.value[0]) && (tosMasked <= rules[rn].v.ipTos.value[1]));
-				}
-				else {
-					thisRuleMatches = hardNo;
-				}
-				break;
-			case ZT_NETWORK_RULE_MATCH_IP_PROTOCOL:
-				if ((etherType == ZT_ETHERTYPE_IPV4) && (frameLen >= 20)) {
-					thisRuleMatches = (uint8_t)(rules[rn].v.ipProtocol == frameData[9]);
-				}
-				else if (etherType == ZT_ETHERTYPE_IPV6) {
-					unsigned int pos = 0, proto = 0;
-					if (_ipv6GetPayload(frameData, frameLen, pos, proto)) {
-						thisRuleMatches = (uint8_t)(rules[rn].v.ipProtocol == (uint8_t)proto);
-					}
-					else {
-						thisRuleMatches = hardNo;
-					}
-				}
-				else {
-					thisRuleMatches = hardNo;
-				}
-				break;
-			case ZT_NETWORK_RULE_MATCH_ETHERTYPE:
-				thisRuleMatches = (uint8_t)(rules[rn].v.etherType == (uint16_t)etherType);
-				break;
-			case ZT_NETWORK_RULE_MATCH_ICMP:
-				if ((etherType == ZT_ETHERTYPE_IPV4) && (frameLen >= 20)) {
-					if (frameData[9] == 0x01) {	  // IP protocol == ICMP
-						const unsigned int ihl = (frameData[0] & 0xf) * 4;
-						if (frameLen >= (ihl + 2)) {
-							if (rules[rn].v.icmp.type == frameData[ihl]) {
-								if ((rules[rn].v.icmp.flags & 0x01) != 0) {
-									thisRuleMatches = (uint8_t)(frameData[ihl + 1] == rules[rn].v.icmp.code);
-								}
-								else {
-									thisRuleMatches = hardYes;
-								}
-							}
-							else {
-								thisRuleMatches = hardNo;
-							}
-						}
-						else {
-							thisRuleMatches = hardNo;
-						}
-					}
-					else {
-						thisRuleMatches = hardNo;
-					}
-				}
-				else if (etherType == ZT_ETHERTYPE_IPV6) {
-					unsigned int pos = 0, proto = 0;
-					if (_ipv6GetPayload(frameData, frameLen, pos, proto)) {
-						if ((proto == 0x3a) && (frameLen >= (pos + 2))) {
-							if (rules[rn].v.icmp.type == frameData[pos]) {
-								if ((rules[rn].v.icmp.flags & 0x01) != 0) {
-									thisRuleMatches = (uint8_t)(frameData[pos + 1] == rules[rn].v.icmp.code);
-								}
-								else {
-									thisRuleMatches = hardYes;
-								}
-							}
-							else {
-								thisRuleMatches = hardNo;
-							}
-						}
-						else {
-							thisRuleMatches = hardNo;
-						}
-					}
-					else {
-						thisRuleMatches = hardNo;
-					}
-				}
-				else {
-					thisRuleMatches = hardNo;
-				}
-				break;
-			case ZT_NETWORK_RULE_MATCH_IP_SOURCE_PORT_RANGE:
-			case ZT_NETWORK_RULE_MATCH_IP_DEST_PORT_RANGE:
-				if ((etherType == ZT_ETHERTYPE_IPV4) && (frameLen >= 20)) {
-					const unsigned int headerLen = 4 * (frameData[0] & 0xf);
-					int p = -1;
-					switch (frameData[9]) {	  // IP protocol number
-						// All these start with 16-bit source and destination port in that order
-						case 0x06:	 // TCP
-						case 0x11:	 // UDP
-						case 0x84:	 // SCTP
-						case 0x88:	 // UDPLite
-							if (frameLen > (headerLen + 4)) {
-								unsigned int pos = headerLen + ((rt == ZT_NETWORK_RULE_MATCH_IP_DEST_PORT_RANGE) ? 2 : 0);
-								p = (int)frameData[pos++] << 8;
-								p |= (int)frameData[pos];
-							}
-							break;
-					}
-
-					thisRuleMatches = (p >= 0) ? (uint8_t)((p >= (int)rules[rn].v.port[0]) && (p <= (int)rules[rn].v.port[1])) : (uint8_t)0;
-				}
-				else if (etherType == ZT_ETHERTYPE_IPV6) {
-					unsigned int pos = 0, proto = 0;
-					if (_ipv6GetPayload(frameData, frameLen, pos, proto)) {
-						int p = -1;
-						switch (proto) {   // IP protocol number
-							// All these start with 16-bit source and destination port in that order
-							case 0x06:	 // TCP
-							case 0x11:	 // UDP
-							case 0x84:	 // SCTP
-							case 0x88:	 // UDPLite
-								if (frameLen > (pos + 4)) {
-									if (rt == ZT_NETWORK_RULE_MATCH_IP_DEST_PORT_RANGE) {
-										pos += 2;
-									}
-									p = (int)frameData[pos++] << 8;
-									p |= (int)frameData[pos];
-								}
-								break;
-						}
-						thisRuleMatches = (p > 0) ? (uint8_t)((p >= (int)rules[rn].v.port[0]) && (p <= (int)rules[rn].v.port[1])) : (uint8_t)0;
-					}
-					else {
-						thisRuleMatches = hardNo;
-					}
-				}
-				else {
-					thisRuleMatches = hardNo;
-				}
-				break;
-			case ZT_NETWORK_RULE_MATCH_CHARACTERISTICS: {
-				uint64_t cf = (inbound) ? ZT_RULE_PACKET_CHARACTERISTICS_INBOUND : 0ULL;
-				if (macDest.isMulticast()) {
-					cf |= ZT_RULE_PACKET_CHARACTERISTICS_MULTICAST;
-				}
-				if (macDest.isBroadcast()) {
-					cf |= ZT_RULE_PACKET_CHARACTERISTICS_BROADCAST;
-				}
-				if (ownershipVerificationMask == 1) {
-					ownershipVerificationMask = 0;
-					InetAddress src;
-					if ((etherType == ZT_ETHERTYPE_IPV4) && (frameLen >= 20)) {
-						src.set((const void*)(frameData + 12), 4, 0);
-					}
-					else if ((etherType == ZT_ETHERTYPE_IPV6) && (frameLen >= 40)) {
-						// IPv6 NDP requires special handling, since the src and dest IPs in the packet are empty or link-local.
-						if ((frameLen >= (40 + 8 + 16)) && (frameData[6] == 0x3a) && ((frameData[40] == 0x87) || (frameData[40] == 0x88))) {
-							if (frameData[40] == 0x87) {
-								// Neighbor solicitations contain no reliable source address, so we implement a small
-								// hack by considering them authenticated. Otherwise you would pretty much have to do
-								// this manually in the rule set for IPv6 to work at all.
-								ownershipVerificationMask |= ZT_RULE_PACKET_CHARACTERISTICS_SENDER_IP_AUTHENTICATED;
-							}
-							else {
-								// Neighbor advertisements on the other hand can absolutely be authenticated.
-								src.set((const void*)(frameData + 40 + 8), 16, 0);
-							}
-						}
-						else {
-							// Other IPv6 packets can be handled normally
-							src.set((const void*)(frameData + 8), 16, 0);
-						}
-					}
-					else if ((etherType == ZT_ETHERTYPE_ARP) && (frameLen >= 28)) {
-						src.set((const void*)(frameData + 14), 4, 0);
-					}
-					if (inbound) {
-						if (membership) {
-							if ((src) && (membership->hasCertificateOfOwnershipFor<InetAddress>(nconf, src))) {
-								ownershipVerificationMask |= ZT_RULE_PACKET_CHARACTERISTICS_SENDER_IP_AUTHENTICATED;
-							}
-							if (membership->hasCertificateOfOwnershipFor<MAC>(nconf, macSource)) {
-								ownershipVerificationMask |= ZT_RULE_PACKET_CHARACTERISTICS_SENDER_MAC_AUTHENTICATED;
-							}
-						}
-					}
-					else {
-						for (unsigned int i = 0; i < nconf.certificateOfOwnershipCount; ++i) {
-							if ((src) && (nconf.certificatesOfOwnership[i].owns(src))) {
-								ownershipVerificationMask |= ZT_RULE_PACKET_CHARACTERISTICS_SENDER_IP_AUTHENTICATED;
-							}
-							if (nconf.certificatesOfOwnership[i].owns(macSource)) {
-								ownershipVerificationMask |= ZT_RULE_PACKET_CHARACTERISTICS_SENDER_MAC_AUTHENTICATED;
-							}
-						}
-					}
-				}
-				cf |= ownershipVerificationMask;
-				if ((etherType == ZT_ETHERTYPE_IPV4) && (frameLen >= 20) && (frameData[9] == 0x06)) {
-					const unsigned int headerLen = 4 * (frameData[0] & 0xf);
-					cf |= (uint64_t)frameData[headerLen + 13];
-					cf |= (((uint64_t)(frameData[headerLen + 12] & 0x0f)) << 8);
-				}
-				else if (etherType == ZT_ETHERTYPE_IPV6) {
-					unsigned int pos = 0, proto = 0;
-					if (_ipv6GetPayload(frameData, frameLen, pos, proto)) {
-						if ((proto == 0x06) && (frameLen > (pos + 14))) {
-							cf |= (uint64_t)frameData[pos + 13];
-							cf |= (((uint64_t)(frameData[pos + 12] & 0x0f)) << 8);
-						}
-					}
-				}
-				thisRuleMatches = (uint8_t)((cf & rules[rn].v.characteristics) != 0);
-			} break;
-			case ZT_NETWORK_RULE_MATCH_FRAME_SIZE_RANGE:
-				thisRuleMatches = (uint8_t)((frameLen >= (unsigned int)rules[rn].v.frameSize[0]) && (frameLen <= (unsigned int)rules[rn].v.frameSize[1]));
-				break;
-			case ZT_NETWORK_RULE_MATCH_RANDOM:
-				thisRuleMatches = (uint8_t)((uint32_t)(RR->node->prng() & 0xffffffffULL) <= rules[rn].v.randomProbability);
-				break;
-			case ZT_NETWORK_RULE_MATCH_TAGS_DIFFERENCE:
-			case ZT_NETWORK_RULE_MATCH_TAGS_BITWISE_AND:
-			case ZT_NETWORK_RULE_MATCH_TAGS_BITWISE_OR:
-			case ZT_NETWORK_RULE_MATCH_TAGS_BITWISE_XOR:
-			case ZT_NETWORK_RULE_MATCH_TAGS_EQUAL: {
-				const Tag* const localTag = std::lower_bound(&(nconf.tags[0]), &(nconf.tags[nconf.tagCount]), rules[rn].v.tag.id, Tag::IdComparePredicate());
-				if ((localTag != &(nconf.tags[nconf.tagCount])) && (localTag->id() == rules[rn].v.tag.id)) {
-					const Tag* const remoteTag = ((membership) ? membership->getTag(nconf, rules[rn].v.tag.id) : (const Tag*)0);
-#ifdef ZT_TRACE
-					/*fprintf(stderr, "\tlocal tag [%u: %u] remote tag [%u: %u] match [%u]",
-							!!localTag ? localTag->id() : 0,
-							!!localTag ? localTag->value() : 0,
-							!!remoteTag ? remoteTag->id() : 0,
-							!!remoteTag ? remoteTag->value() : 0,
-							thisRuleMatches);*/
-#endif
-					if (remoteTag) {
-						const uint32_t ltv = localTag->value();
-						const uint32_t rtv = remoteTag->value();
-						if (rt == ZT_NETWORK_RULE_MATCH_TAGS_DIFFERENCE) {
-							const uint32_t diff = (ltv > rtv) ? (ltv - rtv) : (rtv - ltv);
-							thisRuleMatches = (uint8_t)(diff <= rules[rn].v.tag.value);
-						}
-						else if (rt == ZT_NETWORK_RULE_MATCH_TAGS_BITWISE_AND) {
-							thisRuleMatches = (uint8_t)((ltv & rtv) == rules[rn].v.tag.value);
-						}
-						else if (rt == ZT_NETWORK_RULE_MATCH_TAGS_BITWISE_OR) {
-							thisRuleMatches = (uint8_t)((ltv | rtv) == rules[rn].v.tag.value);
-						}
-						else if (rt == ZT_NETWORK_RULE_MATCH_TAGS_BITWISE_XOR) {
-							thisRuleMatches = (uint8_t)((ltv ^ rtv) == rules[rn].v.tag.value);
-						}
-						else if (rt == ZT_NETWORK_RULE_MATCH_TAGS_EQUAL) {
-							thisRuleMatches = (uint8_t)((ltv == rules[rn].v.tag.value) && (rtv == rules[rn].v.tag.value));
-						}
-						else {	 // sanity check, can't really happen
-							thisRuleMatches = hardNo;
-						}
-					}
-					else {
-						if ((inbound) && (! superAccept)) {
-							thisRuleMatches = hardNo;
-#ifdef ZT_TRACE
-							// fprintf(stderr, "\tinbound ");
-#endif
-						}
-						else {
-							// Outbound side is not strict since if we have to match both tags and
-							// we are sending a first packet to a recipient, we probably do not know
-							// about their tags yet. They will filter on inbound and we will filter
-							// once we get their tag. If we are a tee/redirect target we are also
-							// not strict since we likely do not have these tags.
-							skipDrop = 1;
-							thisRuleMatches = hardYes;
-#ifdef ZT_TRACE
-							// fprintf(stderr, "\toutbound ");
-#endif
-						}
-					}
-				}
-				else {
-					thisRuleMatches = hardNo;
-				}
-			} break;
-			case ZT_NETWORK_RULE_MATCH_TAG_SENDER:
-			case ZT_NETWORK_RULE_MATCH_TAG_RECEIVER: {
-				const Tag* const localTag = std::lower_bound(&(nconf.tags[0]), &(nconf.tags[nconf.tagCount]), rules[rn].v.tag.id, Tag::IdComparePredicate());
-#ifdef ZT_TRACE
-				/*const Tag *const remoteTag = ((membership) ? membership->getTag(nconf,rules[rn].v.tag.id) : (const Tag *)0);
-				fprintf(stderr, "\tlocal tag [%u: %u] remote tag [%u: %u] match [%u]",
-						!!localTag ? localTag->id() : 0,
-						!!localTag ? localTag->value() : 0,
-						!!remoteTag ? remoteTag->id() : 0,
-						!!remoteTag ? remoteTag->value() : 0,
-						thisRuleMatches);*/
-#endif
-				if (superAccept) {
-					skipDrop = 1;
-					thisRuleMatches = hardYes;
-				}
-				else if (((rt == ZT_NETWORK_RULE_MATCH_TAG_SENDER) && (inbound)) || ((rt == ZT_NETWORK_RULE_MATCH_TAG_RECEIVER) && (! inbound))) {
-					const Tag* const remoteTag = ((membership) ? membership->getTag(nconf, rules[rn].v.tag.id) : (const Tag*)0);
-					if (remoteTag) {
-						thisRuleMatches = (uint8_t)(remoteTag->value() == rules[rn].v.tag.value);
-					}
-					else {
-						if (rt == ZT_NETWORK_RULE_MATCH_TAG_RECEIVER) {
-							// If we are checking the receiver and this is an outbound packet, we
-							// can't be strict since we may not yet know the receiver's tag.
-							skipDrop = 1;
-							thisRuleMatches = hardYes;
-						}
-						else {
-							thisRuleMatches = hardNo;
-						}
-					}
-				}
-				else {	 // sender and outbound or receiver and inbound
-					if ((localTag != &(nconf.tags[nconf.tagCount])) && (localTag->id() == rules[rn].v.tag.id)) {
-						thisRuleMatches = (uint8_t)(localTag->value() == rules[rn].v.tag.value);
-					}
-					else {
-						thisRuleMatches = hardNo;
-					}
-				}
-			} break;
-			case ZT_NETWORK_RULE_MATCH_INTEGER_RANGE: {
-				uint64_t integer = 0;
-				const unsigned int bits = (rules[rn].v.intRange.format & 63) + 1;
-				const unsigned int bytes = ((bits + 8 - 1) / 8);   // integer ceiling of division by 8
-				if ((rules[rn].v.intRange.format & 0x80) == 0) {
-					// Big-endian
-					unsigned int idx = rules[rn].v.intRange.idx + (8 - bytes);
-					const unsigned int eof = idx + bytes;
-					if (eof <= frameLen) {
-						while (idx < eof) {
-							integer <<= 8;
-							integer |= frameData[idx++];
-						}
-					}
-					integer &= 0xffffffffffffffffULL >> (64 - bits);
-				}
-				else {
-					// Little-endian
-					unsigned int idx = rules[rn].v.intRange.idx;
-					const unsigned int eof = idx + bytes;
-					if (eof <= frameLen) {
-						while (idx < eof) {
-							integer >>= 8;
-							integer |= ((uint64_t)frameData[idx++]) << 56;
-						}
-					}
-					integer >>= (64 - bits);
-				}
-				thisRuleMatches = (uint8_t)((integer >= rules[rn].v.intRange.start) && (integer <= (rules[rn].v.intRange.start + (uint64_t)rules[rn].v.intRange.end)));
-			} break;
-
-			// The result of an unsupported MATCH is configurable at the network
-			// level via a flag.
-			default:
-				thisRuleMatches = (uint8_t)((nconf.flags & ZT_NETWORKCONFIG_FLAG_RULES_RESULT_OF_UNSUPPORTED_MATCH) != 0);
-				break;
-		}
-
-		rrl.log(rn, thisRuleMatches, thisSetMatches);
-
-		if ((rules[rn].t & 0x40)) {
-			thisSetMatches |= (thisRuleMatches ^ ((rules[rn].t >> 7) & 1));
-		}
-		else {
-			thisSetMatches &= (thisRuleMatches ^ ((rules[rn].t >> 7) & 1));
-		}
+	if (nconf.remoteTraceTarget) {
+		return doZtFilter(RR, rrl, nconf, membership, inbound, ztSource, ztDest, macSource, macDest, frame.data, frame.len, frame.etherType, frame.vlanId, rules, ruleCount, cc, ccLength, ccWatch, qosBucket);
 	}
-
-	return DOZTFILTER_NO_MATCH;
+	return compiled.filter(RR, nconf, membership, inbound, ztSource, ztDest, macSource, macDest, frame, cc, ccLength, ccWatch, qosBucket);
 }
 
 }	// anonymous namespace
@@ -660,16 +78,27 @@ Network::Network(const RuntimeEnvironment* renv, void* tPtr, uint64_t nwid, void
 	, _destroyed(false)
 	, _netconfFailure(NETCONF_FAILURE_NONE)
 	, _portError(0)
+	, _lastCleanPass(0)
+	, _cleanCursor(0)
+	, _cleanPhase(-1)
+	, _cleanPassTime(0)
+	, _filterGeneration(0)
 	, _num_multicast_groups { Metrics::network_num_multicast_groups.Add({ { "network_id", _nwidStr } }) }
 	, _incoming_packets_accepted { Metrics::network_packets.Add({ { "direction", "rx" }, { "network_id", _nwidStr }, { "accepted", "yes" } }) }
 	, _incoming_packets_dropped { Metrics::network_packets.Add({ { "direction", "rx" }, { "network_id", _nwidStr }, { "accepted", "no" } }) }
 	, _outgoing_packets_accepted { Metrics::network_packets.Add({ { "direction", "tx" }, { "network_id", _nwidStr }, { "accepted", "yes" } }) }
 	, _outgoing_packets_dropped { Metrics::network_packets.Add({ { "direction", "tx" }, { "network_id", _nwidStr }, { "accepted", "no" } }) }
+	, _flow_cache_hits { Metrics::network_flow_cache.Add({ { "network_id", _nwidStr }, { "result", "hit" } }) }
+	, _flow_cache_misses { Metrics::network_flow_cache.Add({ { "network_id", _nwidStr }, { "result", "miss" } }) }
 {
 	for (int i = 0; i < ZT_NETWORK_MAX_INCOMING_UPDATES; ++i) {
 		_incomingConfigChunks[i].ts = 0;
 	}
 
+	NetworkConfig* const emptyConfig = new NetworkConfig();
+	_filterConfig.publish(new _FilterConfig(*emptyConfig, ++_filterGeneration));
+	delete emptyConfig;
+
 	if (nconf) {
 		this->setConfiguration(tPtr, *nconf, false);
 		_lastConfigUpdate = 0;	 // still want to re-request since it's likely outdated
@@ -744,96 +173,132 @@ bool Network::filterOutgoingPacket(
 	const unsigned int vlanId,
 	uint8_t& qosBucket)
 {
-	Address ztFinalDest(ztDest);
-	int localCapabilityIndex = -1;
-	int accept = 0;
 	Trace::RuleResultLog rrl, crrl;
-	Address cc;
-	unsigned int ccLength = 0;
-	bool ccWatch = false;
+	unsigned int ccLength = frameLen, ccLength2 = frameLen;
+
+	// Config and credentials are read from snapshots rather than under _lock,
+	// so frames on one network are filtered in parallel and config updates
+	// never stall forwarding. Borrowed membership snapshots stay valid while
+	// fc is open.
+	const SnapshotPtr<_FilterConfig>::Reader fc(_filterConfig);
+	const NetworkConfig& nconf = fc->nconf;
+
+	const SharedPtr<_MembershipSnapshot>* const ms = (ztDest) ? _filterMemberships.borrow(ztDest) : (const SharedPtr<_MembershipSnapshot>*)0;
+	const Membership* const membership = (ms) ? &((*ms)->membership) : (const Membership*)0;
+	const uint64_t memberGeneration = (ms) ? (*ms)->generation : 0;
+
+	// Headers are parsed once for the base rules and every capability
+	const CompiledRules::Frame frame(frameData, frameLen, etherType, vlanId);
+
+	// Outbound capabilities are our own, so only the config decides whether
+	// results can be cached. Tracing needs the per-rule logs so bypasses it.
+	const bool useCache = (fc->cacheable) && (! nconf.remoteTraceTarget) && (RR->node->flowCacheEnabled());
+	FlowCache::Key key;
+	FlowCache::Decision d;
+	bool cached = false;
+	if (useCache) {
+		key.set(false, ztSource, ztDest, macSource, macDest, frame);
+		cached = _flowCache.get(key, fc->generation, memberGeneration, d);
+		if (cached) {
+			_flow_cache_hits++;
+		}
+		else {
+			_flow_cache_misses++;
+		}
+	}
 
-	Mutex::Lock _l(_lock);
+	if (! cached) {
+		d.finalDest = ztDest;
+		switch (_filter(RR, rrl, nconf, fc->rules, frame, membership, false, ztSource, d.finalDest, macSource, macDest, nconf.rules, nconf.ruleCount, d.cc, ccLength, d.ccWatch, d.qosBucket)) {
+			case DOZTFILTER_NO_MATCH: {
+				for (unsigned int c = 0; c < nconf.capabilityCount; ++c) {
+					d.finalDest = ztDest;	// sanity check, shouldn't be possible if there was no match
+					Address cc2;
+					bool ccWatch2 = false;
+					switch (_filter(
+						RR,
+						crrl,
+						nconf,
+						fc->capabilityRules[c],
+						frame,
+						membership,
+						false,
+						ztSource,
+						d.finalDest,
+						macSource,
+						macDest,
+						nconf.capabilities[c].rules(),
+						nconf.capabilities[c].ruleCount(),
+						cc2,
+						ccLength2,
+						ccWatch2,
+						d.qosBucket)) {
+						case DOZTFILTER_NO_MATCH:
+						case DOZTFILTER_DROP:	// explicit DROP in a capability just terminates its evaluation and is an anti-pattern
+							break;
 
-	Membership* const membership = (ztDest) ? _memberships.get(ztDest) : (Membership*)0;
-
-	switch (_doZtFilter(RR, rrl, _config, membership, false, ztSource, ztFinalDest, macSource, macDest, frameData, frameLen, etherType, vlanId, _config.rules, _config.ruleCount, cc, ccLength, ccWatch, qosBucket)) {
-		case DOZTFILTER_NO_MATCH: {
-			for (unsigned int c = 0; c < _config.capabilityCount; ++c) {
-				ztFinalDest = ztDest;	// sanity check, shouldn't be possible if there was no match
-				Address cc2;
-				unsigned int ccLength2 = 0;
-				bool ccWatch2 = false;
-				switch (_doZtFilter(
-					RR,
-					crrl,
-					_config,
-					membership,
-					false,
-					ztSource,
-					ztFinalDest,
-					macSource,
-					macDest,
-					frameData,
-					frameLen,
-					etherType,
-					vlanId,
-					_config.capabilities[c].rules(),
-					_config.capabilities[c].ruleCount(),
-					cc2,
-					ccLength2,
-					ccWatch2,
-					qosBucket)) {
-					case DOZTFILTER_NO_MATCH:
-					case DOZTFILTER_DROP:	// explicit DROP in a capability just terminates its evaluation and is an anti-pattern
+						case DOZTFILTER_REDIRECT:	// interpreted as ACCEPT but finalDest will have been changed in the rules engine
+						case DOZTFILTER_ACCEPT:
+						case DOZTFILTER_SUPER_ACCEPT:	// no difference in behavior on outbound side in capabilities
+							d.capability = (int)c;
+							d.capabilityCc = cc2;
+							d.capabilityCcWatch = ccWatch2;
+							d.accept = 1;
+							break;
+					}
+					if (d.accept) {
 						break;
+					}
+				}
+			} break;
 
-					case DOZTFILTER_REDIRECT:	// interpreted as ACCEPT but ztFinalDest will have been changed in _doZtFilter()
-					case DOZTFILTER_ACCEPT:
-					case DOZTFILTER_SUPER_ACCEPT:	// no difference in behavior on outbound side in capabilities
-						localCapabilityIndex = (int)c;
-						accept = 1;
-
-						if ((! noTee) && (cc2)) {
-							Packet outp(cc2, RR->identity.address(), Packet::VERB_EXT_FRAME);
-							outp.append(_id);
-							outp.append((uint8_t)(ccWatch2 ? 0x16 : 0x02));
-							macDest.appendTo(outp);
-							macSource.appendTo(outp);
-							outp.append((uint16_t)etherType);
-							outp.append(frameData, ccLength2);
-							RR->sw->send(tPtr, outp, true, _id, ZT_QOS_NO_FLOW);
-						}
+			case DOZTFILTER_DROP:
+				d.accept = -1;
+				break;
 
-						break;
-				}
-				if (accept) {
-					break;
-				}
-			}
-		} break;
+			case DOZTFILTER_REDIRECT:	// interpreted as ACCEPT but finalDest will have been changed in the rules engine
+			case DOZTFILTER_ACCEPT:
+				d.accept = 1;
+				break;
 
-		case DOZTFILTER_DROP:
-			if (_config.remoteTraceTarget) {
-				RR->t->networkFilter(tPtr, *this, rrl, (Trace::RuleResultLog*)0, (Capability*)0, ztSource, ztDest, macSource, macDest, frameData, frameLen, etherType, vlanId, noTee, false, 0);
-			}
-			return false;
+			case DOZTFILTER_SUPER_ACCEPT:
+				d.accept = 2;
+				break;
+		}
+
+		if (useCache) {
+			_flowCache.set(key, fc->generation, memberGeneration, d);
+		}
+	}
 
-		case DOZTFILTER_REDIRECT:	// interpreted as ACCEPT but ztFinalDest will have been changed in _doZtFilter()
-		case DOZTFILTER_ACCEPT:
-			accept = 1;
-			break;
+	if (d.qosBucket != ZT_FLOW_CACHE_NO_PRIORITY) {
+		qosBucket = d.qosBucket;
+	}
 
-		case DOZTFILTER_SUPER_ACCEPT:
-			accept = 2;
-			break;
+	if (d.accept < 0) {
+		if (nconf.remoteTraceTarget) {
+			RR->t->networkFilter(tPtr, *this, rrl, (Trace::RuleResultLog*)0, (Capability*)0, ztSource, ztDest, macSource, macDest, frameData, frameLen, etherType, vlanId, noTee, false, 0);
+		}
+		return false;
 	}
 
-	if (accept) {
+	if (d.accept) {
 		_outgoing_packets_accepted++;
-		if ((! noTee) && (cc)) {
-			Packet outp(cc, RR->identity.address(), Packet::VERB_EXT_FRAME);
+		if ((! noTee) && (d.capabilityCc)) {
+			Packet outp(d.capabilityCc, RR->identity.address(), Packet::VERB_EXT_FRAME);
 			outp.append(_id);
-			outp.append((uint8_t)(ccWatch ? 0x16 : 0x02));
+			outp.append((uint8_t)(d.capabilityCcWatch ? 0x16 : 0x02));
+			macDest.appendTo(outp);
+			macSource.appendTo(outp);
+			outp.append((uint16_t)etherType);
+			outp.append(frameData, ccLength2);
+			RR->sw->send(tPtr, outp, true, _id, ZT_QOS_NO_FLOW);
+		}
+
+		if ((! noTee) && (d.cc)) {
+			Packet outp(d.cc, RR->identity.address(), Packet::VERB_EXT_FRAME);
+			outp.append(_id);
+			outp.append((uint8_t)(d.ccWatch ? 0x16 : 0x02));
 			macDest.appendTo(outp);
 			macSource.appendTo(outp);
 			outp.append((uint16_t)etherType);
@@ -841,8 +306,8 @@ bool Network::filterOutgoingPacket(
 			RR->sw->send(tPtr, outp, true, _id, ZT_QOS_NO_FLOW);
 		}
 
-		if ((ztDest != ztFinalDest) && (ztFinalDest)) {
-			Packet outp(ztFinalDest, RR->identity.address(), Packet::VERB_EXT_FRAME);
+		if ((ztDest != d.finalDest) && (d.finalDest)) {
+			Packet outp(d.finalDest, RR->identity.address(), Packet::VERB_EXT_FRAME);
 			outp.append(_id);
 			outp.append((uint8_t)0x04);
 			macDest.appendTo(outp);
@@ -851,13 +316,13 @@ bool Network::filterOutgoingPacket(
 			outp.append(frameData, frameLen);
 			RR->sw->send(tPtr, outp, true, _id, ZT_QOS_NO_FLOW);
 
-			if (_config.remoteTraceTarget) {
+			if (nconf.remoteTraceTarget) {
 				RR->t->networkFilter(
 					tPtr,
 					*this,
 					rrl,
-					(localCapabilityIndex >= 0) ? &crrl : (Trace::RuleResultLog*)0,
-					(localCapabilityIndex >= 0) ? &(_config.capabilities[localCapabilityIndex]) : (Capability*)0,
+					(d.capability >= 0) ? &crrl : (Trace::RuleResultLog*)0,
+					(d.capability >= 0) ? &(nconf.capabilities[d.capability]) : (Capability*)0,
 					ztSource,
 					ztDest,
 					macSource,
@@ -873,13 +338,13 @@ bool Network::filterOutgoingPacket(
 			return false;	// DROP locally, since we redirected
 		}
 		else {
-			if (_config.remoteTraceTarget) {
+			if (nconf.remoteTraceTarget) {
 				RR->t->networkFilter(
 					tPtr,
 					*this,
 					rrl,
-					(localCapabilityIndex >= 0) ? &crrl : (Trace::RuleResultLog*)0,
-					(localCapabilityIndex >= 0) ? &(_config.capabilities[localCapabilityIndex]) : (Capability*)0,
+					(d.capability >= 0) ? &crrl : (Trace::RuleResultLog*)0,
+					(d.capability >= 0) ? &(nconf.capabilities[d.capability]) : (Capability*)0,
 					ztSource,
 					ztDest,
 					macSource,
@@ -897,13 +362,13 @@ bool Network::filterOutgoingPacket(
 	}
 	else {
 		_outgoing_packets_dropped++;
-		if (_config.remoteTraceTarget) {
+		if (nconf.remoteTraceTarget) {
 			RR->t->networkFilter(
 				tPtr,
 				*this,
 				rrl,
-				(localCapabilityIndex >= 0) ? &crrl : (Trace::RuleResultLog*)0,
-				(localCapabilityIndex >= 0) ? &(_config.capabilities[localCapabilityIndex]) : (Capability*)0,
+				(d.capability >= 0) ? &crrl : (Trace::RuleResultLog*)0,
+				(d.capability >= 0) ? &(nconf.capabilities[d.capability]) : (Capability*)0,
 				ztSource,
 				ztDest,
 				macSource,
@@ -931,78 +396,120 @@ int Network::filterIncomingPacket(
 	const unsigned int etherType,
 	const unsigned int vlanId)
 {
-	Address ztFinalDest(ztDest);
 	Trace::RuleResultLog rrl, crrl;
-	int accept = 0;
-	Address cc;
-	unsigned int ccLength = 0;
-	bool ccWatch = false;
+	unsigned int ccLength = frameLen, ccLength2 = frameLen;
 	const Capability* c = (Capability*)0;
 
-	uint8_t qosBucket = 255;   // For incoming packets this is a dummy value
+	// Borrowed membership snapshots stay valid while fc is open.
+	const SnapshotPtr<_FilterConfig>::Reader fc(_filterConfig);
+	const NetworkConfig& nconf = fc->nconf;
 
-	Mutex::Lock _l(_lock);
+	const SharedPtr<_MembershipSnapshot>* const ms = _filterMemberships.borrow(sourcePeer->address());
+	SharedPtr<_MembershipSnapshot> created;
+	if (! ms) {
+		// First frame from this member, so create its Membership as before
+		Mutex::Lock _l(_lock);
+		_membership(sourcePeer->address());
+		created = _publishMembership(sourcePeer->address());
+	}
+	const _MembershipSnapshot& snapshot = (ms) ? **ms : *created;
+	const Membership& membership = snapshot.membership;
+
+	const CompiledRules::Frame frame(frameData, frameLen, etherType, vlanId);
+
+	// Inbound the sender's capabilities are evaluated too, so they must be
+	// cacheable as well as the config
+	const bool useCache = (fc->cacheable) && (snapshot.cacheable) && (! nconf.remoteTraceTarget) && (RR->node->flowCacheEnabled());
+	FlowCache::Key key;
+	FlowCache::Decision d;
+	bool cached = false;
+	if (useCache) {
+		key.set(true, sourcePeer->address(), ztDest, macSource, macDest, frame);
+		cached = _flowCache.get(key, fc->generation, snapshot.generation, d);
+		if (cached) {
+			_flow_cache_hits++;
+		}
+		else {
+			_flow_cache_misses++;
+		}
+	}
 
-	Membership& membership = _membership(sourcePeer->address());
-
-	switch (_doZtFilter(RR, rrl, _config, &membership, true, sourcePeer->address(), ztFinalDest, macSource, macDest, frameData, frameLen, etherType, vlanId, _config.rules, _config.ruleCount, cc, ccLength, ccWatch, qosBucket)) {
-		case DOZTFILTER_NO_MATCH: {
-			Membership::CapabilityIterator mci(membership, _config);
-			while ((c = mci.next())) {
-				ztFinalDest = ztDest;	// sanity check, should be unmodified if there was no match
-				Address cc2;
-				unsigned int ccLength2 = 0;
-				bool ccWatch2 = false;
-				switch (_doZtFilter(RR, crrl, _config, &membership, true, sourcePeer->address(), ztFinalDest, macSource, macDest, frameData, frameLen, etherType, vlanId, c->rules(), c->ruleCount(), cc2, ccLength2, ccWatch2, qosBucket)) {
-					case DOZTFILTER_NO_MATCH:
-					case DOZTFILTER_DROP:	// explicit DROP in a capability just terminates its evaluation and is an anti-pattern
-						break;
-					case DOZTFILTER_REDIRECT:	// interpreted as ACCEPT but ztDest will have been changed in _doZtFilter()
-					case DOZTFILTER_ACCEPT:
-						accept = 1;	  // ACCEPT
-						break;
-					case DOZTFILTER_SUPER_ACCEPT:
-						accept = 2;	  // super-ACCEPT
-						break;
-				}
+	if (! cached) {
+		d.finalDest = ztDest;
+		switch (_filter(RR, rrl, nconf, fc->rules, frame, &membership, true, sourcePeer->address(), d.finalDest, macSource, macDest, nconf.rules, nconf.ruleCount, d.cc, ccLength, d.ccWatch, d.qosBucket)) {
+			case DOZTFILTER_NO_MATCH: {
+				Membership::CapabilityIterator mci(membership, nconf);
+				while ((c = mci.next())) {
+					d.finalDest = ztDest;	// sanity check, should be unmodified if there was no match
+					Address cc2;
+					bool ccWatch2 = false;
+					const CompiledRules* const compiled = snapshot.capabilityRules.get(c->id());
+					switch ((compiled) ? _filter(RR, crrl, nconf, *compiled, frame, &membership, true, sourcePeer->address(), d.finalDest, macSource, macDest, c->rules(), c->ruleCount(), cc2, ccLength2, ccWatch2, d.qosBucket)
+									   : doZtFilter(RR, crrl, nconf, &membership, true, sourcePeer->address(), d.finalDest, macSource, macDest, frameData, frameLen, etherType, vlanId, c->rules(), c->ruleCount(), cc2, ccLength2, ccWatch2, d.qosBucket)) {
+						case DOZTFILTER_NO_MATCH:
+						case DOZTFILTER_DROP:	// explicit DROP in a capability just terminates its evaluation and is an anti-pattern
+							break;
+						case DOZTFILTER_REDIRECT:	// interpreted as ACCEPT but finalDest will have been changed in the rules engine
+						case DOZTFILTER_ACCEPT:
+							d.accept = 1;	// ACCEPT
+							break;
+						case DOZTFILTER_SUPER_ACCEPT:
+							d.accept = 2;	// super-ACCEPT
+							break;
+					}
 
-				if (accept) {
-					if (cc2) {
-						Packet outp(cc2, RR->identity.address(), Packet::VERB_EXT_FRAME);
-						outp.append(_id);
-						outp.append((uint8_t)(ccWatch2 ? 0x1c : 0x08));
-						macDest.appendTo(outp);
-						macSource.appendTo(outp);
-						outp.append((uint16_t)etherType);
-						outp.append(frameData, ccLength2);
-						RR->sw->send(tPtr, outp, true, _id, ZT_QOS_NO_FLOW);
+					if (d.accept) {
+						d.capabilityCc = cc2;
+						d.capabilityCcWatch = ccWatch2;
+						break;
 					}
-					break;
 				}
-			}
-		} break;
+			} break;
 
-		case DOZTFILTER_DROP:
-			if (_config.remoteTraceTarget) {
-				RR->t->networkFilter(tPtr, *this, rrl, (Trace::RuleResultLog*)0, (Capability*)0, sourcePeer->address(), ztDest, macSource, macDest, frameData, frameLen, etherType, vlanId, false, true, 0);
-			}
-			return 0;	// DROP
-
-		case DOZTFILTER_REDIRECT:	// interpreted as ACCEPT but ztFinalDest will have been changed in _doZtFilter()
-		case DOZTFILTER_ACCEPT:
-			accept = 1;	  // ACCEPT
-			break;
-		case DOZTFILTER_SUPER_ACCEPT:
-			accept = 2;	  // super-ACCEPT
-			break;
+			case DOZTFILTER_DROP:
+				d.accept = -1;
+				break;
+
+			case DOZTFILTER_REDIRECT:	// interpreted as ACCEPT but finalDest will have been changed in the rules engine
+			case DOZTFILTER_ACCEPT:
+				d.accept = 1;	// ACCEPT
+				break;
+			case DOZTFILTER_SUPER_ACCEPT:
+				d.accept = 2;	// super-ACCEPT
+				break;
+		}
+
+		if (useCache) {
+			_flowCache.set(key, fc->generation, snapshot.generation, d);
+		}
+	}
+
+	// PRIORITY has no effect on incoming packets, so d.qosBucket is ignored
+
+	if (d.accept < 0) {
+		if (nconf.remoteTraceTarget) {
+			RR->t->networkFilter(tPtr, *this, rrl, (Trace::RuleResultLog*)0, (Capability*)0, sourcePeer->address(), ztDest, macSource, macDest, frameData, frameLen, etherType, vlanId, false, true, 0);
+		}
+		return 0;	// DROP
 	}
 
-	if (accept) {
+	if (d.accept) {
 		_incoming_packets_accepted++;
-		if (cc) {
-			Packet outp(cc, RR->identity.address(), Packet::VERB_EXT_FRAME);
+		if (d.capabilityCc) {
+			Packet outp(d.capabilityCc, RR->identity.address(), Packet::VERB_EXT_FRAME);
 			outp.append(_id);
-			outp.append((uint8_t)(ccWatch ? 0x1c : 0x08));
+			outp.append((uint8_t)(d.capabilityCcWatch ? 0x1c : 0x08));
+			macDest.appendTo(outp);
+			macSource.appendTo(outp);
+			outp.append((uint16_t)etherType);
+			outp.append(frameData, ccLength2);
+			RR->sw->send(tPtr, outp, true, _id, ZT_QOS_NO_FLOW);
+		}
+
+		if (d.cc) {
+			Packet outp(d.cc, RR->identity.address(), Packet::VERB_EXT_FRAME);
+			outp.append(_id);
+			outp.append((uint8_t)(d.ccWatch ? 0x1c : 0x08));
 			macDest.appendTo(outp);
 			macSource.appendTo(outp);
 			outp.append((uint16_t)etherType);
@@ -1010,8 +517,8 @@ int Network::filterIncomingPacket(
 			RR->sw->send(tPtr, outp, true, _id, ZT_QOS_NO_FLOW);
 		}
 
-		if ((ztDest != ztFinalDest) && (ztFinalDest)) {
-			Packet outp(ztFinalDest, RR->identity.address(), Packet::VERB_EXT_FRAME);
+		if ((ztDest != d.finalDest) && (d.finalDest)) {
+			Packet outp(d.finalDest, RR->identity.address(), Packet::VERB_EXT_FRAME);
 			outp.append(_id);
 			outp.append((uint8_t)0x0a);
 			macDest.appendTo(outp);
@@ -1020,7 +527,7 @@ int Network::filterIncomingPacket(
 			outp.append(frameData, frameLen);
 			RR->sw->send(tPtr, outp, true, _id, ZT_QOS_NO_FLOW);
 
-			if (_config.remoteTraceTarget) {
+			if (nconf.remoteTraceTarget) {
 				RR->t->networkFilter(tPtr, *this, rrl, (c) ? &crrl : (Trace::RuleResultLog*)0, c, sourcePeer->address(), ztDest, macSource, macDest, frameData, frameLen, etherType, vlanId, false, true, 0);
 			}
 			return 0;	// DROP locally, since we redirected
@@ -1030,10 +537,10 @@ int Network::filterIncomingPacket(
 		_incoming_packets_dropped++;
 	}
 
-	if (_config.remoteTraceTarget) {
-		RR->t->networkFilter(tPtr, *this, rrl, (c) ? &crrl : (Trace::RuleResultLog*)0, c, sourcePeer->address(), ztDest, macSource, macDest, frameData, frameLen, etherType, vlanId, false, true, accept);
+	if (nconf.remoteTraceTarget) {
+		RR->t->networkFilter(tPtr, *this, rrl, (c) ? &crrl : (Trace::RuleResultLog*)0, c, sourcePeer->address(), ztDest, macSource, macDest, frameData, frameLen, etherType, vlanId, false, true, d.accept);
 	}
-	return accept;
+	return d.accept;
 }
 
 bool Network::subscribedToMulticastGroup(const MulticastGroup& mg, bool includeBridgedGroups) const
@@ -1143,7 +650,7 @@ uint64_t Network::handleConfigChunk(void* tPtr, const uint64_t packetId, const A
 			if (fastPropagate) {
 				Address* a = (Address*)0;
 				Membership* m = (Membership*)0;
-				Hashtable<Address, Membership>::Iterator i(_memberships);
+				FlatHashtable<Address, Membership>::Iterator i(_memberships);
 				while (i.next(a, m)) {
 					if ((*a != source) && (*a != controller())) {
 						Packet outp(*a, RR->identity.address(), Packet::VERB_NETWORK_CONFIG);
@@ -1240,6 +747,7 @@ int Network::setConfiguration(void* tPtr, const NetworkConfig& nconf, bool saveT
 			Mutex::Lock _l(_lock);
 
 			_config = nconf;
+			_filterConfig.publish(new _FilterConfig(nconf, ++_filterGeneration));
 			_lastConfigUpdate = RR->node->now();
 			_netconfFailure = NETCONF_FAILURE_NONE;
 
@@ -1500,39 +1008,79 @@ bool Network::recentlyAssociatedWith(const Address& addr)
 	return ((m) && (m->recentlyAssociated(RR->node->now())));
 }
 
-void Network::clean()
+bool Network::clean(const int64_t now, const unsigned long budget)
 {
-	const int64_t now = RR->node->now();
 	Mutex::Lock _l(_lock);
 
 	if (_destroyed) {
-		return;
+		return false;
 	}
 
-	{
-		Hashtable<MulticastGroup, uint64_t>::Iterator i(_multicastGroupsBehindMe);
+	if (_cleanPhase < 0) {
+		if ((now - _lastCleanPass) < ZT_HOUSEKEEPING_PERIOD) {
+			return false;
+		}
+		_lastCleanPass = now;
+		_cleanCursor = 0;
+		_cleanPhase = 0;
+		_cleanPassTime = 0;
+	}
+	const std::chrono::steady_clock::time_point start(std::chrono::steady_clock::now());
+
+	unsigned long visited = 0;
+	if (_cleanPhase == 0) {
+		FlatHashtable<MulticastGroup, uint64_t>::Iterator i(_multicastGroupsBehindMe, _cleanCursor);
 		MulticastGroup* mg = (MulticastGroup*)0;
 		uint64_t* ts = (uint64_t*)0;
-		while (i.next(mg, ts)) {
+		bool more = true;
+		while ((visited < budget) && (more = i.next(mg, ts))) {
+			++visited;
 			if ((now - *ts) > (ZT_MULTICAST_LIKE_EXPIRE * 2)) {
 				_multicastGroupsBehindMe.erase(*mg);
 			}
 		}
+		if (more) {
+			_cleanCursor = i.position();
+		}
+		else {
+			_cleanCursor = 0;
+			_cleanPhase = 1;
+		}
 	}
 
-	{
+	if (_cleanPhase == 1) {
+		// Only memberships that lost credentials, or were dropped, get a new
+		// snapshot; the others' flow cache entries are still correct
+		FlatHashtable<Address, Membership>::Iterator i(_memberships, _cleanCursor);
 		Address* a = (Address*)0;
 		Membership* m = (Membership*)0;
-		Hashtable<Address, Membership>::Iterator i(_memberships);
-		while (i.next(a, m)) {
+		bool more = true;
+		while ((visited < budget) && (more = i.next(a, m))) {
+			++visited;
 			if (! RR->topology->getPeerNoCache(*a)) {
+				_filterMemberships.erase(*a);
 				_memberships.erase(*a);
 			}
-			else {
-				m->clean(now, _config);
+			else if (m->clean(now, _config)) {
+				_publishMembership(*a);
 			}
 		}
+		if (more) {
+			_cleanCursor = i.position();
+		}
+		else {
+			_cleanCursor = 0;
+			_cleanPhase = -1;
+		}
+	}
+
+	_cleanPassTime += (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	if (_cleanPhase < 0) {
+		_filterConfig.reclaim();
+		Metrics::network_clean_pass_time.Observe(_cleanPassTime);
+		return false;
 	}
+	return true;
 }
 
 void Network::learnBridgeRoute(const MAC& mac, const Address& addr)
@@ -1589,7 +1137,11 @@ Membership::AddCredentialResult Network::addCredential(void* tPtr, const Certifi
 		return Membership::ADD_REJECTED;
 	}
 	Mutex::Lock _l(_lock);
-	return _membership(com.issuedTo()).addCredential(RR, tPtr, _config, com);
+	const Membership::AddCredentialResult result = _membership(com.issuedTo()).addCredential(RR, tPtr, _config, com);
+	if (result == Membership::ADD_ACCEPTED_NEW) {
+		_publishMembership(com.issuedTo());
+	}
+	return result;
 }
 
 Membership::AddCredentialResult Network::addCredential(void* tPtr, const Address& sentFrom, const Revocation& rev)
@@ -1602,11 +1154,14 @@ Membership::AddCredentialResult Network::addCredential(void* tPtr, const Address
 	Membership& m = _membership(rev.target());
 
 	const Membership::AddCredentialResult result = m.addCredential(RR, tPtr, _config, rev);
+	if (result == Membership::ADD_ACCEPTED_NEW) {
+		_publishMembership(rev.target());
+	}
 
 	if ((result == Membership::ADD_ACCEPTED_NEW) && (rev.fastPropagate())) {
 		Address* a = (Address*)0;
 		Membership* m = (Membership*)0;
-		Hashtable<Address, Membership>::Iterator i(_memberships);
+		FlatHashtable<Address, Membership>::Iterator i(_memberships);
 		while (i.next(a, m)) {
 			if ((*a != sentFrom) && (*a != rev.signer())) {
 				Packet outp(*a, RR->identity.address(), Packet::VERB_NETWORK_CREDENTIALS);
@@ -1764,7 +1319,7 @@ void Network::_sendUpdatesToMembers(void* tPtr, const MulticastGroup* const newM
 	{
 		Address* a = (Address*)0;
 		Membership* m = (Membership*)0;
-		Hashtable<Address, Membership>::Iterator i(_memberships);
+		FlatHashtable<Address, Membership>::Iterator i(_memberships);
 		while (i.next(a, m)) {
 			const Identity remoteIdentity(RR->topology->getIdentity(tPtr, *a));
 			if (remoteIdentity) {
@@ -1823,6 +1378,14 @@ Membership& Network::_membership(const Address& a)
 	return _memberships[a];
 }
 
+SharedPtr<Network::_MembershipSnapshot> Network::_publishMembership(const Address& a)
+{
+	// assumes _lock is locked
+	const SharedPtr<_MembershipSnapshot> ms(new _MembershipSnapshot(_membership(a), ++_filterGeneration));
+	_filterMemberships.set(a, ms);
+	return ms;
+}
+
 void Network::setAuthenticationRequired(void* tPtr, const char* issuerURL, const char* centralEndpoint, const char* clientID, const char* ssoProvider, const char* nonce, const char* state)
 {
 	Mutex::Lock _l(_lock);
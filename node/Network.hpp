@@ -13,8 +13,11 @@
 #include "Address.hpp"
 #include "AtomicCounter.hpp"
 #include "CertificateOfMembership.hpp"
+#include "CompiledRules.hpp"
 #include "Constants.hpp"
 #include "Dictionary.hpp"
+#include "FlowCache.hpp"
+#include "FlatHashtable.hpp"
 #include "Hashtable.hpp"
 #include "MAC.hpp"
 #include "Membership.hpp"
@@ -23,7 +26,9 @@
 #include "Multicaster.hpp"
 #include "Mutex.hpp"
 #include "NetworkConfig.hpp"
+#include "ShardedHashtable.hpp"
 #include "SharedPtr.hpp"
+#include "SnapshotPtr.hpp"
 
 #include <algorithm>
 #include <map>
@@ -35,6 +40,14 @@
 #define ZT_NETWORK_MAX_INCOMING_UPDATES 3
 #define ZT_NETWORK_MAX_UPDATE_CHUNKS	((ZT_NETWORKCONFIG_DICT_CAPACITY / 1024) + 1)
 
+/**
+ * Shards in each network's table of membership snapshots
+ *
+ * Updates are serialized by the network's lock anyway, so this only needs to
+ * keep each shard's slot array small.
+ */
+#define ZT_NETWORK_MEMBERSHIP_SHARDS 16
+
 namespace ZeroTier {
 
 class RuntimeEnvironment;
@@ -110,6 +123,22 @@ class Network {
 		return _mac;
 	}
 
+	/**
+	 * @return Number of frames whose filter decision was taken from the flow cache
+	 */
+	inline uint64_t flowCacheHits() const
+	{
+		return _flow_cache_hits.value();
+	}
+
+	/**
+	 * @return Number of cacheable frames whose filter decision had to be computed
+	 */
+	inline uint64_t flowCacheMisses() const
+	{
+		return _flow_cache_misses.value();
+	}
+
 	/**
 	 * Apply filters to an outgoing packet
 	 *
@@ -294,8 +323,16 @@ class Network {
 
 	/**
 	 * Do periodic cleanup and housekeeping tasks
+	 *
+	 * A pass over bridged multicast groups and memberships starts every
+	 * ZT_HOUSEKEEPING_PERIOD and is done a slice at a time, so _lock is only
+	 * held for up to budget entries per call.
+	 *
+	 * @param now Current time
+	 * @param budget Maximum number of entries to visit in this call
+	 * @return True if a pass is still in progress and this should be called again soon
 	 */
-	void clean();
+	bool clean(int64_t now, unsigned long budget);
 
 	/**
 	 * Push state to members such as multicast group memberships and latest COM (if needed)
@@ -360,7 +397,11 @@ class Network {
 			return Membership::ADD_REJECTED;
 		}
 		Mutex::Lock _l(_lock);
-		return _membership(cap.issuedTo()).addCredential(RR, tPtr, _config, cap);
+		const Membership::AddCredentialResult result = _membership(cap.issuedTo()).addCredential(RR, tPtr, _config, cap);
+		if (result == Membership::ADD_ACCEPTED_NEW) {
+			_publishMembership(cap.issuedTo());
+		}
+		return result;
 	}
 
 	/**
@@ -372,7 +413,11 @@ class Network {
 			return Membership::ADD_REJECTED;
 		}
 		Mutex::Lock _l(_lock);
-		return _membership(tag.issuedTo()).addCredential(RR, tPtr, _config, tag);
+		const Membership::AddCredentialResult result = _membership(tag.issuedTo()).addCredential(RR, tPtr, _config, tag);
+		if (result == Membership::ADD_ACCEPTED_NEW) {
+			_publishMembership(tag.issuedTo());
+		}
+		return result;
 	}
 
 	/**
@@ -389,7 +434,11 @@ class Network {
 			return Membership::ADD_REJECTED;
 		}
 		Mutex::Lock _l(_lock);
-		return _membership(coo.issuedTo()).addCredential(RR, tPtr, _config, coo);
+		const Membership::AddCredentialResult result = _membership(coo.issuedTo()).addCredential(RR, tPtr, _config, coo);
+		if (result == Membership::ADD_ACCEPTED_NEW) {
+			_publishMembership(coo.issuedTo());
+		}
+		return result;
 	}
 
 	/**
@@ -472,7 +521,7 @@ class Network {
 	bool _portInitialized;
 
 	std::vector<MulticastGroup> _myMulticastGroups;					// multicast groups that we belong to (according to tap)
-	Hashtable<MulticastGroup, uint64_t> _multicastGroupsBehindMe;	// multicast groups that seem to be behind us and when we last saw them (if we are a bridge)
+	FlatHashtable<MulticastGroup, uint64_t> _multicastGroupsBehindMe;	// multicast groups that seem to be behind us and when we last saw them (if we are a bridge)
 	Hashtable<MAC, Address> _remoteBridgeRoutes;					// remote addresses where given MACs are reachable (for tracking devices behind remote bridges)
 
 	NetworkConfig _config;
@@ -498,7 +547,71 @@ class Network {
 	int _portError;	  // return value from port config callback
 	std::string _authenticationURL;
 
-	Hashtable<Address, Membership> _memberships;
+	FlatHashtable<Address, Membership> _memberships;
+
+	// State of the clean() pass in progress, if any
+	int64_t _lastCleanPass;	  // start of the last pass
+	unsigned long _cleanCursor;	  // FlatHashtable::Iterator position in the table being cleaned
+	int _cleanPhase;	 // 0: bridged multicast groups, 1: memberships, -1: no pass in progress
+	uint64_t _cleanPassTime;	 // microseconds spent in this pass so far
+
+	/**
+	 * Copy of one member's credentials as seen by the frame filters
+	 */
+	struct _MembershipSnapshot {
+		_MembershipSnapshot(const Membership& m, const uint64_t g) : membership(m), generation(g), cacheable(true)
+		{
+			uint32_t* id = (uint32_t*)0;
+			Capability* cap = (Capability*)0;
+			Hashtable<uint32_t, Capability>::Iterator i(*(const_cast<Hashtable<uint32_t, Capability>*>(&(membership.remoteCapabilities()))));
+			while (i.next(id, cap)) {
+				const CompiledRules cr(cap->rules(), cap->ruleCount());
+				cacheable &= cr.cacheable();
+				capabilityRules.set(*id, cr);
+			}
+		}
+		const Membership membership;
+		const uint64_t generation;	 // tags flow cache entries computed from this snapshot
+		Hashtable<uint32_t, CompiledRules> capabilityRules;	  // compiled rules of this member's capabilities by ID
+		bool cacheable;	  // all of capabilityRules are cacheable
+		AtomicCounter __refCount;
+	};
+	typedef ShardedHashtable<Address, SharedPtr<_MembershipSnapshot>, ZT_NETWORK_MEMBERSHIP_SHARDS> _MembershipSnapshots;
+
+	/**
+	 * Network config as seen by the frame filters, with its rules compiled
+	 */
+	struct _FilterConfig {
+		_FilterConfig(const NetworkConfig& nc, const uint64_t g) : nconf(nc), rules(nc.rules, nc.ruleCount), generation(g), cacheable(rules.cacheable())
+		{
+			unsigned int ruleCount = nc.ruleCount;
+			for (unsigned int c = 0; c < nc.capabilityCount; ++c) {
+				capabilityRules.push_back(CompiledRules(nc.capabilities[c].rules(), nc.capabilities[c].ruleCount()));
+				cacheable &= capabilityRules.back().cacheable();
+				ruleCount += nc.capabilities[c].ruleCount();
+			}
+			cacheable &= (ruleCount >= ZT_FLOW_CACHE_MIN_RULES);
+		}
+		const NetworkConfig nconf;
+		const CompiledRules rules;
+		const uint64_t generation;	 // tags flow cache entries computed from this snapshot
+		std::vector<CompiledRules> capabilityRules;	  // parallel to nconf.capabilities[]
+		bool cacheable;	  // base rules and all capabilityRules are cacheable and worth caching
+	};
+
+	// Immutable copies of _config and of each entry in _memberships read
+	// without locking by filterOutgoingPacket() and filterIncomingPacket().
+	// These are replaced (with _lock held) whenever what they mirror changes,
+	// one member at a time for memberships.
+	SnapshotPtr<_FilterConfig> _filterConfig;
+	_MembershipSnapshots _filterMemberships;
+
+	// Every snapshot above gets a new generation, so a flow cache entry is
+	// only used with the exact config and credentials it was computed from.
+	uint64_t _filterGeneration;	  // last generation assigned, guarded by _lock
+	FlowCache _flowCache;
+
+	SharedPtr<_MembershipSnapshot> _publishMembership(const Address& a);   // assumes _lock is locked
 
 	Mutex _lock;
 
@@ -509,6 +622,8 @@ class Network {
 	prometheus::simpleapi::counter_metric_t _incoming_packets_dropped;
 	prometheus::simpleapi::counter_metric_t _outgoing_packets_accepted;
 	prometheus::simpleapi::counter_metric_t _outgoing_packets_dropped;
+	prometheus::simpleapi::counter_metric_t _flow_cache_hits;
+	prometheus::simpleapi::counter_metric_t _flow_cache_misses;
 };
 
 }	// namespace ZeroTier
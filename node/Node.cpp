@@ -27,6 +27,7 @@
 #include "Trace.hpp"
 
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -47,18 +48,24 @@ Node::Node(void* uptr, void* tptr, const struct ZT_Node_Config* config, const st
 	: _RR(this)
 	, RR(&_RR)
 	, _uPtr(uptr)
-	, _networks(8)
 	, _now(now)
 	, _lastPingCheck(0)
 	, _lastGratuitousPingCheck(0)
 	, _lastHousekeepingRun(0)
 	, _lastMemoizedTraceSettings(0)
 	, _lowBandwidthMode(false)
+	, _flowCacheEnabled(false)
 {
-	if (callbacks->version != 0) {
+	if ((callbacks->version < 0) || (callbacks->version > 2)) {
 		throw ZT_EXCEPTION_INVALID_ARGUMENT;
 	}
-	memcpy(&_cb, callbacks, sizeof(ZT_Node_Callbacks));
+	memset(&_cb, 0, sizeof(ZT_Node_Callbacks));
+	if (callbacks->version >= 2) {
+		memcpy(&_cb, callbacks, sizeof(ZT_Node_Callbacks));
+	}
+	else {
+		memcpy(&_cb, callbacks, (callbacks->version >= 1) ? offsetof(ZT_Node_Callbacks, wirePacketSendBatchFunction) : offsetof(ZT_Node_Callbacks, virtualNetworkFrameBatchFunction));
+	}
 	memcpy(&_config, config, sizeof(ZT_Node_Config));
 
 	// Initialize non-cryptographic PRNG from a good random source
@@ -66,6 +73,8 @@ Node::Node(void* uptr, void* tptr, const struct ZT_Node_Config* config, const st
 
 	_online = false;
 
+	_networks.publish(new _NetworkTable(8));
+
 	memset(_expectingRepliesToBucketPtr, 0, sizeof(_expectingRepliesToBucketPtr));
 	memset(_expectingRepliesTo, 0, sizeof(_expectingRepliesTo));
 	memset(_lastIdentityVerification, 0, sizeof(_lastIdentityVerification));
@@ -175,9 +184,13 @@ Node::Node(void* uptr, void* tptr, const struct ZT_Node_Config* config, const st
 
 Node::~Node()
 {
+	// Worker threads call into the objects below, so stop them first
+	if (RR->pm) {
+		RR->pm->stopThreads();
+	}
 	{
 		Mutex::Lock _l(_networks_m);
-		_networks.clear();	 // destroy all networks before shutdown
+		_networks.publish(new _NetworkTable());	  // destroy all networks before shutdown
 	}
 	// Explicitly call destructors then free memory for all other objects.
 	if (RR->sa) {
@@ -204,10 +217,20 @@ Node::~Node()
 	::free(RR->rtmem);
 }
 
+void Node::_pullInBackgroundTaskDeadline(volatile int64_t* nextBackgroundTaskDeadline) const
+{
+	const int64_t whoisDeadline = RR->sw->whoisFlushDeadline();
+	if ((whoisDeadline) && (whoisDeadline < *nextBackgroundTaskDeadline)) {
+		*nextBackgroundTaskDeadline = whoisDeadline;
+	}
+}
+
 ZT_ResultCode Node::processWirePacket(void* tptr, int64_t now, int64_t localSocket, const struct sockaddr_storage* remoteAddress, const void* packetData, unsigned int packetLength, volatile int64_t* nextBackgroundTaskDeadline)
 {
 	_now = now;
+	const SnapshotReaders::Pass pass;
 	RR->sw->onRemotePacket(tptr, localSocket, *(reinterpret_cast<const InetAddress*>(remoteAddress)), packetData, packetLength);
+	_pullInBackgroundTaskDeadline(nextBackgroundTaskDeadline);
 	return ZT_RESULT_OK;
 }
 
@@ -224,9 +247,11 @@ ZT_ResultCode Node::processVirtualNetworkFrame(
 	volatile int64_t* nextBackgroundTaskDeadline)
 {
 	_now = now;
-	SharedPtr<Network> nw(this->network(nwid));
+	const NetworkReader nr(*this, nwid);
+	const SharedPtr<Network>& nw = nr.network();
 	if (nw) {
 		RR->sw->onLocalEthernet(tptr, nw, MAC(sourceMac), MAC(destMac), etherType, vlanId, frameData, frameLength);
+		_pullInBackgroundTaskDeadline(nextBackgroundTaskDeadline);
 		return ZT_RESULT_OK;
 	}
 	else {
@@ -234,83 +259,77 @@ ZT_ResultCode Node::processVirtualNetworkFrame(
 	}
 }
 
-void Node::initMultithreading(unsigned int concurrency, bool cpuPinningEnabled)
+void Node::initMultithreading(unsigned int concurrency, bool cpuPinningEnabled, unsigned int relayThreads)
 {
 	RR->pm->setUpPostDecodeReceiveThreads(concurrency, cpuPinningEnabled);
+	RR->pm->setUpEncryptThreads(concurrency, cpuPinningEnabled);
+	RR->pm->setUpRelayThreads(relayThreads, cpuPinningEnabled);
 }
 
-// Closure used to ping upstream and active/online peers
-class _PingPeersThatNeedPing {
+// Closure used to ping upstreams and other peers we should always contact
+class _PingAlwaysContactPeer {
   public:
-	_PingPeersThatNeedPing(const RuntimeEnvironment* renv, void* tPtr, Hashtable<Address, std::vector<InetAddress> >& alwaysContact, int64_t now)
+	_PingAlwaysContactPeer(const RuntimeEnvironment* renv, void* tPtr, int64_t now)
 		: RR(renv)
 		, _tPtr(tPtr)
-		, _alwaysContact(alwaysContact)
 		, _now(now)
 		, _bestCurrentUpstream(RR->topology->getUpstreamPeer(0))
 	{
 	}
 
-	inline void operator()(Topology& t, const SharedPtr<Peer>& p)
+	// Returns false if the peer was skipped, in which case it is WHOISed as if unknown
+	inline bool operator()(const SharedPtr<Peer>& p, const std::vector<InetAddress>& alwaysContactEndpoints)
 	{
-		const std::vector<InetAddress>* const alwaysContactEndpoints = _alwaysContact.get(p->address());
-		if (alwaysContactEndpoints) {
-			ZT_PeerRole role = RR->topology->role(p->address());
+		ZT_PeerRole role = RR->topology->role(p->address());
 
-			// Contact upstream peers as infrequently as possible
-			int roleBasedTimerScale = (role == ZT_PEER_ROLE_LEAF) ? 2 : 16;
+		// Contact upstream peers as infrequently as possible
+		int roleBasedTimerScale = (role == ZT_PEER_ROLE_LEAF) ? 2 : 16;
 
-			// Unless we don't any have paths to the roots, then we shouldn't wait a long time to contact them
-			bool hasPaths = p->paths(RR->node->now()).size() > 0;
-			roleBasedTimerScale = (role != ZT_PEER_ROLE_LEAF && ! hasPaths) ? 0 : roleBasedTimerScale;
+		// Unless we don't any have paths to the roots, then we shouldn't wait a long time to contact them
+		bool hasPaths = p->paths(RR->node->now()).size() > 0;
+		roleBasedTimerScale = (role != ZT_PEER_ROLE_LEAF && ! hasPaths) ? 0 : roleBasedTimerScale;
 
-			if ((RR->node->now() - p->lastSentFullHello()) <= (ZT_PATH_HEARTBEAT_PERIOD * roleBasedTimerScale)) {
-				return;
-			}
+		if ((RR->node->now() - p->lastSentFullHello()) <= (ZT_PATH_HEARTBEAT_PERIOD * roleBasedTimerScale)) {
+			return false;
+		}
 
-			const unsigned int sent = p->doPingAndKeepalive(_tPtr, _now);
-			bool contacted = (sent != 0);
+		const unsigned int sent = p->doPingAndKeepalive(_tPtr, _now);
+		bool contacted = (sent != 0);
 
-			if ((sent & 0x1) == 0) {   // bit 0x1 == IPv4 sent
-				for (unsigned long k = 0, ptr = (unsigned long)RR->node->prng(); k < (unsigned long)alwaysContactEndpoints->size(); ++k) {
-					const InetAddress& addr = (*alwaysContactEndpoints)[ptr++ % alwaysContactEndpoints->size()];
-					if (addr.ss_family == AF_INET) {
-						p->sendHELLO(_tPtr, -1, addr, _now);
-						contacted = true;
-						break;
-					}
+		if ((sent & 0x1) == 0) {   // bit 0x1 == IPv4 sent
+			for (unsigned long k = 0, ptr = (unsigned long)RR->node->prng(); k < (unsigned long)alwaysContactEndpoints.size(); ++k) {
+				const InetAddress& addr = alwaysContactEndpoints[ptr++ % alwaysContactEndpoints.size()];
+				if (addr.ss_family == AF_INET) {
+					p->sendHELLO(_tPtr, -1, addr, _now);
+					contacted = true;
+					break;
 				}
 			}
+		}
 
-			if ((sent & 0x2) == 0) {   // bit 0x2 == IPv6 sent
-				for (unsigned long k = 0, ptr = (unsigned long)RR->node->prng(); k < (unsigned long)alwaysContactEndpoints->size(); ++k) {
-					const InetAddress& addr = (*alwaysContactEndpoints)[ptr++ % alwaysContactEndpoints->size()];
-					if (addr.ss_family == AF_INET6) {
-						p->sendHELLO(_tPtr, -1, addr, _now);
-						contacted = true;
-						break;
-					}
+		if ((sent & 0x2) == 0) {   // bit 0x2 == IPv6 sent
+			for (unsigned long k = 0, ptr = (unsigned long)RR->node->prng(); k < (unsigned long)alwaysContactEndpoints.size(); ++k) {
+				const InetAddress& addr = alwaysContactEndpoints[ptr++ % alwaysContactEndpoints.size()];
+				if (addr.ss_family == AF_INET6) {
+					p->sendHELLO(_tPtr, -1, addr, _now);
+					contacted = true;
+					break;
 				}
 			}
+		}
 
-			if ((! contacted) && (_bestCurrentUpstream)) {
-				const SharedPtr<Path> up(_bestCurrentUpstream->getAppropriatePath(_now, true));
-				if (up) {
-					p->sendHELLO(_tPtr, up->localSocket(), up->address(), _now);
-				}
+		if ((! contacted) && (_bestCurrentUpstream)) {
+			const SharedPtr<Path> up(_bestCurrentUpstream->getAppropriatePath(_now, true));
+			if (up) {
+				p->sendHELLO(_tPtr, up->localSocket(), up->address(), _now);
 			}
-
-			_alwaysContact.erase(p->address());	  // after this we'll WHOIS all upstreams that remain
-		}
-		else if (p->isActive(_now)) {
-			p->doPingAndKeepalive(_tPtr, _now);
 		}
+		return true;
 	}
 
   private:
 	const RuntimeEnvironment* RR;
 	void* _tPtr;
-	Hashtable<Address, std::vector<InetAddress> >& _alwaysContact;
 	const int64_t _now;
 	const SharedPtr<Peer> _bestCurrentUpstream;
 };
@@ -382,8 +401,8 @@ ZT_ResultCode Node::processBackgroundTasks(void* tptr, int64_t now, volatile int
 			int timerScale = _lowBandwidthMode ? 64 : 1;
 			std::vector<std::pair<SharedPtr<Network>, bool> > networkConfigNeeded;
 			{
-				Mutex::Lock l(_networks_m);
-				Hashtable<uint64_t, SharedPtr<Network> >::Iterator i(_networks);
+				const SnapshotPtr<_NetworkTable>::Reader networks(_networks);
+				_NetworkTable::Iterator i(*const_cast<_NetworkTable*>(networks.ptr()));
 				uint64_t* nwid = (uint64_t*)0;
 				SharedPtr<Network>* network = (SharedPtr<Network>*)0;
 				while (i.next(nwid, network)) {
@@ -392,17 +411,19 @@ ZT_ResultCode Node::processBackgroundTasks(void* tptr, int64_t now, volatile int
 				}
 			}
 
-			// Ping active peers, upstreams, and others that we should always contact
-			_PingPeersThatNeedPing pfunc(RR, tptr, alwaysContact, now);
-			RR->topology->eachPeer<_PingPeersThatNeedPing&>(pfunc);
-
-			// Run WHOIS to create Peer for alwaysContact addresses that could not be contacted
+			// Ping upstreams and others that we should always contact, or WHOIS
+			// them if they are not known yet. Other peers are pinged at their
+			// own deadlines below.
 			{
+				_PingAlwaysContactPeer pfunc(RR, tptr, now);
 				Hashtable<Address, std::vector<InetAddress> >::Iterator i(alwaysContact);
-				Address* upstreamAddress = (Address*)0;
-				std::vector<InetAddress>* upstreamStableEndpoints = (std::vector<InetAddress>*)0;
-				while (i.next(upstreamAddress, upstreamStableEndpoints)) {
-					RR->sw->requestWhois(tptr, now, *upstreamAddress);
+				Address* address = (Address*)0;
+				std::vector<InetAddress>* stableEndpoints = (std::vector<InetAddress>*)0;
+				while (i.next(address, stableEndpoints)) {
+					const SharedPtr<Peer> p(RR->topology->getPeerNoCache(*address));
+					if ((! p) || (! pfunc(p, *stableEndpoints))) {
+						RR->sw->requestWhois(tptr, now, *address);
+					}
 				}
 			}
 
@@ -431,6 +452,29 @@ ZT_ResultCode Node::processBackgroundTasks(void* tptr, int64_t now, volatile int
 		timeUntilNextPingCheck -= (unsigned long)timeSinceLastPingCheck;
 	}
 
+	// Ping peers and drop expired ones as their deadlines come up, rather
+	// than visiting every peer on every ping check
+	int64_t nextPeerDeadline;
+	try {
+		std::vector<SharedPtr<Peer> > duePeers;
+		RR->topology->takeDuePeers(tptr, now, duePeers, ZT_PEER_TIMER_BUDGET);
+		const int64_t minDelay = _lowBandwidthMode ? (ZT_PING_CHECK_INTERVAL * 5) : ZT_CORE_TIMER_TASK_GRANULARITY;
+		for (std::vector<SharedPtr<Peer> >::const_iterator p(duePeers.begin()); p != duePeers.end(); ++p) {
+			if ((*p)->isActive(now)) {
+				(*p)->doPingAndKeepalive(tptr, now);
+			}
+			RR->topology->schedulePeer((*p)->address(), std::max((*p)->nextPingDeadline(now), now + minDelay));
+		}
+		nextPeerDeadline = RR->topology->nextPeerDeadline(now);
+
+		// Unused paths are dropped the same way
+		RR->topology->expirePaths(now, ZT_PATH_TIMER_BUDGET);
+		nextPeerDeadline = std::min(nextPeerDeadline, RR->topology->nextPathDeadline(now));
+	}
+	catch (...) {
+		return ZT_RESULT_FATAL_ERROR_INTERNAL;
+	}
+
 	if ((now - _lastMemoizedTraceSettings) >= (ZT_HOUSEKEEPING_PERIOD / 4)) {
 		_lastMemoizedTraceSettings = now;
 		RR->t->updateMemoizedSettings();
@@ -441,15 +485,38 @@ ZT_ResultCode Node::processBackgroundTasks(void* tptr, int64_t now, volatile int
 		try {
 			RR->topology->doPeriodicTasks(tptr, now);
 			RR->sa->clean(now);
-			RR->mc->clean(now);
+			{
+				// Free network tables replaced while a frame was being processed
+				Mutex::Lock _l(_networks_m);
+				_networks.reclaim();
+			}
 		}
 		catch (...) {
 			return ZT_RESULT_FATAL_ERROR_INTERNAL;
 		}
 	}
 
+	// Expire multicast subscriptions, bridged groups and memberships a slice
+	// at a time so no lock is held for a whole table walk
+	bool cleaning;
 	try {
-		*nextBackgroundTaskDeadline = now + (int64_t)std::max(std::min(bondCheckInterval, std::min(timeUntilNextPingCheck, RR->sw->doTimerTasks(tptr, now))), (unsigned long)ZT_CORE_TIMER_TASK_GRANULARITY);
+		cleaning = RR->mc->clean(now, ZT_HOUSEKEEPING_CLEAN_BUDGET);
+		const std::vector<SharedPtr<Network> > networks(allNetworks());
+		for (std::vector<SharedPtr<Network> >::const_iterator n(networks.begin()); n != networks.end(); ++n) {
+			cleaning |= (*n)->clean(now, ZT_HOUSEKEEPING_CLEAN_BUDGET);
+		}
+	}
+	catch (...) {
+		return ZT_RESULT_FATAL_ERROR_INTERNAL;
+	}
+
+	try {
+		const unsigned long timeUntilNextPeer = (unsigned long)std::max(nextPeerDeadline - now, (int64_t)0);
+		unsigned long timeUntilNextTask = std::min(std::min(bondCheckInterval, timeUntilNextPeer), std::min(timeUntilNextPingCheck, RR->sw->doTimerTasks(tptr, now)));
+		if (cleaning) {
+			timeUntilNextTask = 0;	 // continue the cleaning pass on the next tick
+		}
+		*nextBackgroundTaskDeadline = now + (int64_t)std::max(timeUntilNextTask, (unsigned long)ZT_CORE_TIMER_TASK_GRANULARITY);
 	}
 	catch (...) {
 		return ZT_RESULT_FATAL_ERROR_INTERNAL;
@@ -461,9 +528,11 @@ ZT_ResultCode Node::processBackgroundTasks(void* tptr, int64_t now, volatile int
 ZT_ResultCode Node::join(uint64_t nwid, void* uptr, void* tptr)
 {
 	Mutex::Lock _l(_networks_m);
-	SharedPtr<Network>& nw = _networks[nwid];
-	if (! nw) {
-		nw = SharedPtr<Network>(new Network(RR, tptr, nwid, uptr, (const NetworkConfig*)0));
+	if (! _networks.current()->contains(nwid)) {
+		const SharedPtr<Network> nw(new Network(RR, tptr, nwid, uptr, (const NetworkConfig*)0));
+		_NetworkTable* const networks = new _NetworkTable(*(_networks.current()));
+		networks->set(nwid, nw);
+		_networks.publish(networks);
 	}
 	return ZT_RESULT_OK;
 }
@@ -474,7 +543,7 @@ ZT_ResultCode Node::leave(uint64_t nwid, void** uptr, void* tptr)
 	void** nUserPtr = (void**)0;
 	{
 		Mutex::Lock _l(_networks_m);
-		SharedPtr<Network>* nw = _networks.get(nwid);
+		const SharedPtr<Network>* nw = _networks.current()->get(nwid);
 		RR->sw->removeNetworkQoSControlBlock(nwid);
 		if (! nw) {
 			return ZT_RESULT_OK;
@@ -493,7 +562,9 @@ ZT_ResultCode Node::leave(uint64_t nwid, void** uptr, void* tptr)
 
 	{
 		Mutex::Lock _l(_networks_m);
-		_networks.erase(nwid);
+		_NetworkTable* const networks = new _NetworkTable(*(_networks.current()));
+		networks->erase(nwid);
+		_networks.publish(networks);
 	}
 
 	uint64_t tmp[2];
@@ -630,8 +701,8 @@ ZT_PeerList* Node::peers() const
 
 ZT_VirtualNetworkConfig* Node::networkConfig(uint64_t nwid) const
 {
-	Mutex::Lock _l(_networks_m);
-	const SharedPtr<Network>* nw = _networks.get(nwid);
+	const SnapshotPtr<_NetworkTable>::Reader networks(_networks);
+	const SharedPtr<Network>* nw = networks->get(nwid);
 	if (nw) {
 		ZT_VirtualNetworkConfig* nc = (ZT_VirtualNetworkConfig*)::malloc(sizeof(ZT_VirtualNetworkConfig));
 		(*nw)->externalConfig(nc);
@@ -642,9 +713,9 @@ ZT_VirtualNetworkConfig* Node::networkConfig(uint64_t nwid) const
 
 ZT_VirtualNetworkList* Node::networks() const
 {
-	Mutex::Lock _l(_networks_m);
+	const SnapshotPtr<_NetworkTable>::Reader networks(_networks);
 
-	char* buf = (char*)::malloc(sizeof(ZT_VirtualNetworkList) + (sizeof(ZT_VirtualNetworkConfig) * _networks.size()));
+	char* buf = (char*)::malloc(sizeof(ZT_VirtualNetworkList) + (sizeof(ZT_VirtualNetworkConfig) * networks->size()));
 	if (! buf) {
 		return (ZT_VirtualNetworkList*)0;
 	}
@@ -652,7 +723,7 @@ ZT_VirtualNetworkList* Node::networks() const
 	nl->networks = (ZT_VirtualNetworkConfig*)(buf + sizeof(ZT_VirtualNetworkList));
 
 	nl->networkCount = 0;
-	Hashtable<uint64_t, SharedPtr<Network> >::Iterator i(*const_cast<Hashtable<uint64_t, SharedPtr<Network> >*>(&_networks));
+	_NetworkTable::Iterator i(*const_cast<_NetworkTable*>(networks.ptr()));
 	uint64_t* k = (uint64_t*)0;
 	SharedPtr<Network>* v = (SharedPtr<Network>*)0;
 	while (i.next(k, v)) {
@@ -727,8 +798,8 @@ bool Node::shouldUsePathForZeroTierTraffic(void* tPtr, const Address& ztaddr, co
 	}
 
 	{
-		Mutex::Lock _l(_networks_m);
-		Hashtable<uint64_t, SharedPtr<Network> >::Iterator i(_networks);
+		const SnapshotPtr<_NetworkTable>::Reader networks(_networks);
+		_NetworkTable::Iterator i(*const_cast<_NetworkTable*>(networks.ptr()));
 		uint64_t* k = (uint64_t*)0;
 		SharedPtr<Network>* v = (SharedPtr<Network>*)0;
 		while (i.next(k, v)) {
@@ -12,6 +12,7 @@
 #include "../include/ZeroTierOne.h"
 #include "Bond.hpp"
 #include "Constants.hpp"
+#include "FlatHashtable.hpp"
 #include "Hashtable.hpp"
 #include "InetAddress.hpp"
 #include "MAC.hpp"
@@ -21,6 +22,7 @@
 #include "Path.hpp"
 #include "RuntimeEnvironment.hpp"
 #include "SelfAwareness.hpp"
+#include "SnapshotPtr.hpp"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -100,32 +102,94 @@ class Node : public NetworkController::Sender {
 		return (_cb.wirePacketSendFunction(reinterpret_cast<ZT_Node*>(this), _uPtr, tPtr, localSocket, reinterpret_cast<const struct sockaddr_storage*>(&addr), data, len, ttl) == 0);
 	}
 
+	/**
+	 * Send several packets to the wire
+	 *
+	 * Uses the batch callback if the host provided one, otherwise falls
+	 * back to one wirePacketSendFunction call per packet.
+	 */
+	inline void putPackets(void* tPtr, const ZT_WirePacket* packets, unsigned int count)
+	{
+		if (_cb.wirePacketSendBatchFunction) {
+			_cb.wirePacketSendBatchFunction(reinterpret_cast<ZT_Node*>(this), _uPtr, tPtr, packets, count);
+		}
+		else {
+			for (unsigned int i = 0; i < count; ++i) {
+				_cb.wirePacketSendFunction(reinterpret_cast<ZT_Node*>(this), _uPtr, tPtr, packets[i].localSocket, packets[i].address, packets[i].data, packets[i].len, 0);
+			}
+		}
+	}
+
 	inline void putFrame(void* tPtr, uint64_t nwid, void** nuptr, const MAC& source, const MAC& dest, unsigned int etherType, unsigned int vlanId, const void* data, unsigned int len)
 	{
 		_cb.virtualNetworkFrameFunction(reinterpret_cast<ZT_Node*>(this), _uPtr, tPtr, nwid, nuptr, source.toInt(), dest.toInt(), etherType, vlanId, data, len);
 	}
 
-	inline SharedPtr<Network> network(uint64_t nwid) const
+	/**
+	 * Deliver several frames for the same network to the host
+	 *
+	 * Uses the batch callback if the host provided one, otherwise falls
+	 * back to one virtualNetworkFrameFunction call per frame.
+	 */
+	inline void putFrames(void* tPtr, uint64_t nwid, void** nuptr, const ZT_VirtualNetworkFrame* frames, unsigned int count)
 	{
-		Mutex::Lock _l(_networks_m);
-		const SharedPtr<Network>* n = _networks.get(nwid);
-		if (n) {
-			return *n;
+		if (_cb.virtualNetworkFrameBatchFunction) {
+			_cb.virtualNetworkFrameBatchFunction(reinterpret_cast<ZT_Node*>(this), _uPtr, tPtr, nwid, nuptr, frames, count);
+		}
+		else {
+			for (unsigned int i = 0; i < count; ++i) {
+				_cb.virtualNetworkFrameFunction(reinterpret_cast<ZT_Node*>(this), _uPtr, tPtr, nwid, nuptr, frames[i].sourceMac, frames[i].destMac, frames[i].etherType, frames[i].vlanId, frames[i].data, frames[i].len);
+			}
+		}
+	}
+
+	/**
+	 * Borrowed reference to a joined network for the duration of one packet
+	 *
+	 * This pins the current network table snapshot, so looking a network up
+	 * takes no lock and the SharedPtr it returns refers to the table's own
+	 * copy without touching its reference count. Only create these on the
+	 * stack and copy the SharedPtr if the network must outlive this object.
+	 */
+	class NetworkReader {
+	  public:
+		NetworkReader(const Node& n, const uint64_t nwid) : _r(n._networks), _n(_r->get(nwid))
+		{
 		}
-		return SharedPtr<Network>();
+
+		/**
+		 * @return Network or NULL SharedPtr if not joined
+		 */
+		inline const SharedPtr<Network>& network() const
+		{
+			static const SharedPtr<Network> nullNetwork;
+			return (_n) ? *_n : nullNetwork;
+		}
+
+	  private:
+		NetworkReader(const NetworkReader&);
+		const NetworkReader& operator=(const NetworkReader&);
+
+		const SnapshotPtr<FlatHashtable<uint64_t, SharedPtr<Network> > >::Reader _r;
+		const SharedPtr<Network>* const _n;
+	};
+
+	inline SharedPtr<Network> network(uint64_t nwid) const
+	{
+		return NetworkReader(*this, nwid).network();
 	}
 
 	inline bool belongsToNetwork(uint64_t nwid) const
 	{
-		Mutex::Lock _l(_networks_m);
-		return _networks.contains(nwid);
+		const SnapshotPtr<_NetworkTable>::Reader networks(_networks);
+		return networks->contains(nwid);
 	}
 
 	inline std::vector<SharedPtr<Network> > allNetworks() const
 	{
 		std::vector<SharedPtr<Network> > nw;
-		Mutex::Lock _l(_networks_m);
-		Hashtable<uint64_t, SharedPtr<Network> >::Iterator i(*const_cast<Hashtable<uint64_t, SharedPtr<Network> >*>(&_networks));
+		const SnapshotPtr<_NetworkTable>::Reader networks(_networks);
+		_NetworkTable::Iterator i(*const_cast<_NetworkTable*>(networks.ptr()));
 		uint64_t* k = (uint64_t*)0;
 		SharedPtr<Network>* v = (SharedPtr<Network>*)0;
 		while (i.next(k, v)) {
@@ -300,7 +364,32 @@ class Node : public NetworkController::Sender {
 		return _config.enableEncryptedHello != 0;
 	}
 
-	void initMultithreading(unsigned int concurrency, bool cpuPinningEnabled);
+	/**
+	 * Enable or disable caching of frame filter decisions by flow
+	 *
+	 * @param isEnabled If true, networks whose rules allow it cache filter results (see FlowCache)
+	 */
+	inline void setFlowCacheEnabled(bool isEnabled)
+	{
+		_flowCacheEnabled = isEnabled;
+	}
+
+	inline bool flowCacheEnabled() const
+	{
+		return _flowCacheEnabled;
+	}
+
+	/**
+	 * Start receive and encrypt workers, and optionally relay workers
+	 *
+	 * @param concurrency Number of receive and of encrypt workers
+	 * @param cpuPinningEnabled If true pin relay workers to their own cores
+	 * @param relayThreads Number of relay workers, or 0 to relay on the thread that received the datagram
+	 */
+	void initMultithreading(unsigned int concurrency, bool cpuPinningEnabled, unsigned int relayThreads);
+
+	// Move the host's background task deadline earlier if work queued meanwhile needs it
+	void _pullInBackgroundTaskDeadline(volatile int64_t* nextBackgroundTaskDeadline) const;
 
   public:
 	RuntimeEnvironment _RR;
@@ -342,7 +431,10 @@ class Node : public NetworkController::Sender {
 	Hashtable<_LocalControllerAuth, int64_t> _localControllerAuthorizations;
 	Mutex _localControllerAuthorizations_m;
 
-	Hashtable<uint64_t, SharedPtr<Network> > _networks;
+	// Joined networks, replaced as a whole (with _networks_m held) on join and
+	// leave so that the per-frame lookups above never lock
+	typedef FlatHashtable<uint64_t, SharedPtr<Network> > _NetworkTable;
+	SnapshotPtr<_NetworkTable> _networks;
 	Mutex _networks_m;
 
 	std::vector<InetAddress> _directPaths;
@@ -361,6 +453,7 @@ class Node : public NetworkController::Sender {
 	volatile int64_t _prngState[2];
 	bool _online;
 	bool _lowBandwidthMode;
+	volatile bool _flowCacheEnabled;
 };
 
 }	// namespace ZeroTier
@@ -14,6 +14,7 @@
 #include "RuntimeEnvironment.hpp"
 #include "Switch.hpp"
 #include "Topology.hpp"
+#include "WireBatch.hpp"
 
 namespace ZeroTier {
 
@@ -63,25 +64,24 @@ void OutboundMulticast::init(
 	dest.mac().appendTo(_packet);
 	_packet.append((uint32_t)dest.adi());
 	_packet.append((uint16_t)etherType);
+	_frameAt = _packet.size();
 	_packet.append(payload, _frameLen);
-	if (! disableCompression) {
-		_packet.compress();
-	}
 
-	memcpy(_frameData, payload, _frameLen);
+	// Rules are evaluated against the original frame, so keep a copy only if the packet's is compressed
+	if ((! disableCompression) && (_packet.compress())) {
+		memcpy(_frameData, payload, _frameLen);
+		_frameAt = 0;
+	}
 }
 
-void OutboundMulticast::sendOnly(const RuntimeEnvironment* RR, void* tPtr, const Address& toAddr)
+void OutboundMulticast::sendOnly(const RuntimeEnvironment* RR, void* tPtr, const Address& toAddr, WireBatch& batch)
 {
 	const SharedPtr<Network> nw(RR->node->network(_nwid));
+	const uint8_t* const frame = (_frameAt) ? reinterpret_cast<const uint8_t*>(_packet.field(_frameAt, _frameLen)) : _frameData;
 	uint8_t QoSBucket = 255;   // Dummy value
-	if ((nw) && (nw->filterOutgoingPacket(tPtr, true, RR->identity.address(), toAddr, _macSrc, _macDest, _frameData, _frameLen, _etherType, 0, QoSBucket))) {
+	if ((nw) && (nw->filterOutgoingPacket(tPtr, true, RR->identity.address(), toAddr, _macSrc, _macDest, frame, _frameLen, _etherType, 0, QoSBucket))) {
 		nw->pushCredentialsIfNeeded(tPtr, toAddr, RR->node->now());
-		_packet.newInitializationVector();
-		_packet.setDestination(toAddr);
-		RR->node->expectReplyTo(_packet.packetId());
-		_tmp = _packet;
-		RR->sw->send(tPtr, _tmp, true, _nwid, ZT_QOS_NO_FLOW);
+		RR->sw->sendCopy(tPtr, _packet, toAddr, true, _nwid, ZT_QOS_NO_FLOW, batch);
 	}
 }
 
@@ -23,10 +23,16 @@ namespace ZeroTier {
 
 class CertificateOfMembership;
 class RuntimeEnvironment;
+class WireBatch;
 
 /**
  * An outbound multicast packet
  *
+ * The packet is composed once and never modified. Each recipient gets a
+ * copy armored straight into a WireBatch, so the frame is not copied per
+ * recipient. A separate copy of the frame for evaluating rules is only
+ * kept if the packet's copy is compressed.
+ *
  * This object isn't guarded by a mutex; caller must synchronize access.
  */
 class OutboundMulticast {
@@ -100,8 +106,9 @@ class OutboundMulticast {
 	 * @param RR Runtime environment
 	 * @param tPtr Thread pointer to be handed through to any callbacks called as a result of this call
 	 * @param toAddr Destination address
+	 * @param batch Batch to add packet to
 	 */
-	void sendOnly(const RuntimeEnvironment* RR, void* tPtr, const Address& toAddr);
+	void sendOnly(const RuntimeEnvironment* RR, void* tPtr, const Address& toAddr, WireBatch& batch);
 
 	/**
 	 * Just send and log but do not check sent log
@@ -109,11 +116,12 @@ class OutboundMulticast {
 	 * @param RR Runtime environment
 	 * @param tPtr Thread pointer to be handed through to any callbacks called as a result of this call
 	 * @param toAddr Destination address
+	 * @param batch Batch to add packet to
 	 */
-	inline void sendAndLog(const RuntimeEnvironment* RR, void* tPtr, const Address& toAddr)
+	inline void sendAndLog(const RuntimeEnvironment* RR, void* tPtr, const Address& toAddr, WireBatch& batch)
 	{
 		_alreadySentTo.push_back(toAddr);
-		sendOnly(RR, tPtr, toAddr);
+		sendOnly(RR, tPtr, toAddr, batch);
 	}
 
 	/**
@@ -132,12 +140,13 @@ class OutboundMulticast {
 	 * @param RR Runtime environment
 	 * @param tPtr Thread pointer to be handed through to any callbacks called as a result of this call
 	 * @param toAddr Destination address
+	 * @param batch Batch to add packet to
 	 * @return True if address is new and packet was sent to switch, false if duplicate
 	 */
-	inline bool sendIfNew(const RuntimeEnvironment* RR, void* tPtr, const Address& toAddr)
+	inline bool sendIfNew(const RuntimeEnvironment* RR, void* tPtr, const Address& toAddr, WireBatch& batch)
 	{
 		if (std::find(_alreadySentTo.begin(), _alreadySentTo.end(), toAddr) == _alreadySentTo.end()) {
-			sendAndLog(RR, tPtr, toAddr);
+			sendAndLog(RR, tPtr, toAddr, batch);
 			return true;
 		}
 		else {
@@ -152,8 +161,9 @@ class OutboundMulticast {
 	MAC _macDest;
 	unsigned int _limit;
 	unsigned int _frameLen;
+	unsigned int _frameAt;	 // index of frame in _packet, or 0 if it is in _frameData
 	unsigned int _etherType;
-	Packet _packet, _tmp;
+	Packet _packet;
 	std::vector<Address> _alreadySentTo;
 	uint8_t _frameData[ZT_MAX_MTU];
 };
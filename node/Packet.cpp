@@ -1163,6 +1163,88 @@ void Packet::armor(const void* key, bool encryptPayload, bool extendedArmor, con
 	}
 }
 
+uint64_t Packet::armorTo(void* out, const Address& dest, bool fragmented, const void* key, bool encryptPayload, const AES aesKeys[2]) const
+{
+	const uint8_t* const data = reinterpret_cast<const uint8_t*>(this->data());
+	uint8_t* const o = reinterpret_cast<uint8_t*>(out);
+	const uint8_t* const payload = data + ZT_PACKET_IDX_VERB;
+	uint8_t* const outPayload = o + ZT_PACKET_IDX_VERB;
+	const unsigned int payloadLen = size() - ZT_PACKET_IDX_VERB;
+
+	// Header of the copy, with everything that armor() would change set for this send
+	Utils::getSecureRandom(o + ZT_PACKET_IDX_IV, 8);
+	dest.copyTo(o + ZT_PACKET_IDX_DEST, ZT_ADDRESS_LENGTH);
+	memcpy(o + ZT_PACKET_IDX_SOURCE, data + ZT_PACKET_IDX_SOURCE, ZT_ADDRESS_LENGTH);
+	uint8_t flags = data[ZT_PACKET_IDX_FLAGS] & (uint8_t)(~(ZT_PROTO_FLAG_EXTENDED_ARMOR | ZT_PROTO_FLAG_FRAGMENTED | 0x38));
+	if (fragmented) {
+		flags |= ZT_PROTO_FLAG_FRAGMENTED;
+	}
+
+	if ((aesKeys) && (encryptPayload)) {
+		o[ZT_PACKET_IDX_FLAGS] = flags | (uint8_t)(ZT_PROTO_CIPHER_SUITE__AES_GMAC_SIV << 3);
+
+		AES::GMACSIVEncryptor enc(aesKeys[0], aesKeys[1]);
+		enc.init(Utils::loadMachineEndian<uint64_t>(o + ZT_PACKET_IDX_IV), outPayload);
+		enc.aad(o + ZT_PACKET_IDX_DEST, 11);
+		enc.update1(payload, payloadLen);
+		enc.finish1();
+		enc.update2(payload, payloadLen);
+		const uint64_t* const tag = enc.finish2();
+
+#ifdef ZT_NO_UNALIGNED_ACCESS
+		Utils::copy<8>(o, tag);
+		Utils::copy<8>(o + ZT_PACKET_IDX_MAC, tag + 1);
+#else
+		*reinterpret_cast<uint64_t*>(o + ZT_PACKET_IDX_IV) = tag[0];
+		*reinterpret_cast<uint64_t*>(o + ZT_PACKET_IDX_MAC) = tag[1];
+#endif
+	}
+	else {
+		o[ZT_PACKET_IDX_FLAGS] = flags | (uint8_t)((encryptPayload ? ZT_PROTO_CIPHER_SUITE__C25519_POLY1305_SALSA2012 : ZT_PROTO_CIPHER_SUITE__C25519_POLY1305_NONE) << 3);
+
+		uint8_t mangledKey[32];
+		_salsa20MangleKey((const unsigned char*)key, mangledKey, o, size());
+
+		if (ZT_HAS_FAST_CRYPTO()) {
+			uint64_t keyStream[(ZT_PROTO_MAX_PACKET_LENGTH + 64 + 8) / 8];
+			uint64_t mac[2];
+
+			ZT_FAST_SINGLE_PASS_SALSA2012(keyStream, ((encryptPayload) ? payloadLen : 0) + 64, (o + ZT_PACKET_IDX_IV), mangledKey);
+			if (encryptPayload) {
+				Salsa20::memxor(outPayload, payload, reinterpret_cast<const uint8_t*>(keyStream + 8), payloadLen);
+			}
+			else {
+				memcpy(outPayload, payload, payloadLen);
+			}
+			Poly1305::compute(mac, outPayload, payloadLen, keyStream);
+
+#ifdef ZT_NO_TYPE_PUNNING
+			memcpy(o + ZT_PACKET_IDX_MAC, mac, 8);
+#else
+			(*reinterpret_cast<uint64_t*>(o + ZT_PACKET_IDX_MAC)) = mac[0];
+#endif
+		}
+		else {
+			uint64_t macKey[4];
+			uint64_t mac[2];
+
+			Salsa20 s20(mangledKey, o + ZT_PACKET_IDX_IV);
+			s20.crypt12(ZERO_KEY, macKey, sizeof(macKey));
+			if (encryptPayload) {
+				s20.crypt12(payload, outPayload, payloadLen);
+			}
+			else {
+				memcpy(outPayload, payload, payloadLen);
+			}
+
+			Poly1305::compute(mac, outPayload, payloadLen, macKey);
+			memcpy(o + ZT_PACKET_IDX_MAC, mac, 8);
+		}
+	}
+
+	return Utils::loadBigEndian<uint64_t>(o + ZT_PACKET_IDX_IV);
+}
+
 bool Packet::dearmor(const void* key, const AES aesKeys[2], const Identity& identity)
 {
 	uint8_t* const data = reinterpret_cast<uint8_t*>(unsafeData());
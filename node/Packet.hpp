@@ -1363,6 +1363,25 @@ class Packet : public Buffer<ZT_PROTO_MAX_PACKET_LENGTH> {
 	 */
 	void armor(const void* key, bool encryptPayload, bool extendedArmor, const AES aesKeys[2], const Identity& identity);
 
+	/**
+	 * Armor a copy of this packet for a destination without modifying it
+	 *
+	 * The copy gets a new IV and the given destination, and is otherwise
+	 * what armor() would produce. The payload is encrypted straight from
+	 * this packet into out, so sending one packet to many peers writes only
+	 * the header of each copy instead of copying the whole packet first.
+	 * Extended armor is not supported.
+	 *
+	 * @param out Buffer of at least size() bytes to receive the armored copy
+	 * @param dest Destination of copy
+	 * @param fragmented Value of the fragmented flag in the copy
+	 * @param key 32-byte key
+	 * @param encryptPayload If true, encrypt packet payload, else just MAC
+	 * @param aesKeys If non-NULL these are the two keys for AES-GMAC-SIV
+	 * @return Packet ID of the armored copy
+	 */
+	uint64_t armorTo(void* out, const Address& dest, bool fragmented, const void* key, bool encryptPayload, const AES aesKeys[2]) const;
+
 	/**
 	 * Verify and (if encrypted) decrypt packet
 	 *
@@ -1430,8 +1449,11 @@ class Packet : public Buffer<ZT_PROTO_MAX_PACKET_LENGTH> {
 	 */
 	inline void _salsa20MangleKey(const unsigned char* in, unsigned char* out) const
 	{
-		const unsigned char* d = (const unsigned char*)data();
+		_salsa20MangleKey(in, out, (const unsigned char*)data(), size());
+	}
 
+	static inline void _salsa20MangleKey(const unsigned char* in, unsigned char* out, const unsigned char* d, const unsigned int size)
+	{
 		// IV and source/destination addresses. Using the addresses divides the
 		// key space into two halves-- A->B and B->A (since order will change).
 		for (unsigned int i = 0; i < 18; ++i) {	  // 8 + (ZT_ADDRESS_LENGTH * 2) == 18
@@ -1445,8 +1467,8 @@ class Packet : public Buffer<ZT_PROTO_MAX_PACKET_LENGTH> {
 
 		// Raw packet size in bytes -- thus each packet size defines a new
 		// key space.
-		out[19] = in[19] ^ (unsigned char)(size() & 0xff);
-		out[20] = in[20] ^ (unsigned char)((size() >> 8) & 0xff);	// little endian
+		out[19] = in[19] ^ (unsigned char)(size & 0xff);
+		out[20] = in[20] ^ (unsigned char)((size >> 8) & 0xff);	// little endian
 
 		// Rest of raw key is used unchanged
 		for (unsigned int i = 21; i < 32; ++i) {
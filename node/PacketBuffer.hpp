@@ -0,0 +1,113 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * (c) ZeroTier, Inc.
+ * https://www.zerotier.com/
+ */
+
+#ifndef ZT_PACKETBUFFER_HPP
+#define ZT_PACKETBUFFER_HPP
+
+#include "AtomicCounter.hpp"
+#include "Constants.hpp"
+#include "Mutex.hpp"
+#include "Packet.hpp"
+#include "SharedPtr.hpp"
+
+#include <new>
+#include <stddef.h>
+#include <vector>
+
+/**
+ * Maximum number of released packet buffers kept for reuse
+ */
+#define ZT_PACKET_BUFFER_POOL_SIZE 128
+
+namespace ZeroTier {
+
+/**
+ * A reference counted packet in pooled storage
+ *
+ * Queues hold SharedPtr<PacketBuffer> handles, so a packet is copied once
+ * when it is first queued and is then passed around and sent in place. A
+ * PacketBuffer is a Packet, so anything that takes a Packet works on it
+ * directly. Storage of released buffers is kept and reused, so in steady
+ * state queueing a packet does not touch the system allocator.
+ */
+class PacketBuffer : public Packet {
+	friend class SharedPtr<PacketBuffer>;
+
+  public:
+	/**
+	 * @param p Packet to copy (only its bytes in use are copied)
+	 */
+	PacketBuffer(const Packet& p) : Packet(p)
+	{
+	}
+
+	static inline void* operator new(size_t s)
+	{
+		if (s == sizeof(PacketBuffer)) {
+			_Pool& p = _pool();
+			Mutex::Lock _l(p.lock);
+			if (! p.free.empty()) {
+				void* const b = p.free.back();
+				p.free.pop_back();
+				return b;
+			}
+		}
+		return ::operator new(s);
+	}
+
+	static inline void operator delete(void* b, size_t s)
+	{
+		if (s == sizeof(PacketBuffer)) {
+			_Pool& p = _pool();
+			Mutex::Lock _l(p.lock);
+			if (p.free.size() < ZT_PACKET_BUFFER_POOL_SIZE) {
+				p.free.push_back(b);
+				return;
+			}
+		}
+		::operator delete(b);
+	}
+
+	/**
+	 * @return Number of released buffers currently held for reuse
+	 */
+	static inline unsigned long pooled()
+	{
+		_Pool& p = _pool();
+		Mutex::Lock _l(p.lock);
+		return (unsigned long)p.free.size();
+	}
+
+  private:
+	struct _Pool {
+		_Pool()
+		{
+			free.reserve(ZT_PACKET_BUFFER_POOL_SIZE);
+		}
+		~_Pool()
+		{
+			for (std::vector<void*>::iterator b(free.begin()); b != free.end(); ++b) {
+				::operator delete(*b);
+			}
+		}
+		Mutex lock;
+		std::vector<void*> free;
+	};
+
+	static inline _Pool& _pool()
+	{
+		static _Pool p;
+		return p;
+	}
+
+	AtomicCounter __refCount;
+};
+
+}	// namespace ZeroTier
+
+#endif
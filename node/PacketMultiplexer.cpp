@@ -9,19 +9,109 @@
 #include "PacketMultiplexer.hpp"
 
 #include "Constants.hpp"
+#include "Metrics.hpp"
 #include "Node.hpp"
 #include "RuntimeEnvironment.hpp"
+#include "Switch.hpp"
+#include "WireBatch.hpp"
 
+#include <algorithm>
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifdef __LINUX__
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#endif
+
 namespace ZeroTier {
 
 PacketMultiplexer::PacketMultiplexer(const RuntimeEnvironment* renv)
+	: _concurrency(0)
+	, _rxThreadCount(0)
+	, _enabled(false)
+	, _txConcurrency(0)
+	, _txEnabled(false)
+	, _relayConcurrency(0)
+	, _relayEnabled(false)
 {
 	RR = renv;
 };
 
+PacketMultiplexer::~PacketMultiplexer()
+{
+	stopThreads();
+
+	// Anything still queued was never delivered
+	for (std::vector<BlockingQueue<PacketRecord*>*>::iterator q(_rxPacketQueues.begin()); q != _rxPacketQueues.end(); ++q) {
+		std::vector<PacketRecord*> left((*q)->drain());
+		_rxPacketVector.insert(_rxPacketVector.end(), left.begin(), left.end());
+		delete *q;
+	}
+	for (std::vector<BlockingQueue<TxPacketRecord*>*>::iterator q(_txPacketQueues.begin()); q != _txPacketQueues.end(); ++q) {
+		std::vector<TxPacketRecord*> left((*q)->drain());
+		_txPacketVector.insert(_txPacketVector.end(), left.begin(), left.end());
+		delete *q;
+	}
+	for (std::vector<BlockingQueue<RelayRecord*>*>::iterator q(_relayQueues.begin()); q != _relayQueues.end(); ++q) {
+		std::vector<RelayRecord*> left((*q)->drain());
+		_relayRecordVector.insert(_relayRecordVector.end(), left.begin(), left.end());
+		delete *q;
+	}
+	for (std::vector<PacketRecord*>::iterator i(_rxPacketVector.begin()); i != _rxPacketVector.end(); ++i) {
+		delete *i;
+	}
+	for (std::vector<TxPacketRecord*>::iterator i(_txPacketVector.begin()); i != _txPacketVector.end(); ++i) {
+		delete *i;
+	}
+	for (std::vector<RelayRecord*>::iterator i(_relayRecordVector.begin()); i != _relayRecordVector.end(); ++i) {
+		delete *i;
+	}
+}
+
+void PacketMultiplexer::stopThreads()
+{
+	_enabled = false;
+	_txEnabled = false;
+	_relayEnabled = false;
+	for (std::vector<BlockingQueue<PacketRecord*>*>::iterator q(_rxPacketQueues.begin()); q != _rxPacketQueues.end(); ++q) {
+		(*q)->stop();
+	}
+	for (std::vector<BlockingQueue<TxPacketRecord*>*>::iterator q(_txPacketQueues.begin()); q != _txPacketQueues.end(); ++q) {
+		(*q)->stop();
+	}
+	for (std::vector<BlockingQueue<RelayRecord*>*>::iterator q(_relayQueues.begin()); q != _relayQueues.end(); ++q) {
+		(*q)->stop();
+	}
+	for (std::vector<std::thread>::iterator t(_rxThreads.begin()); t != _rxThreads.end(); ++t) {
+		if (t->joinable()) {
+			t->join();
+		}
+	}
+	for (std::vector<std::thread>::iterator t(_txThreads.begin()); t != _txThreads.end(); ++t) {
+		if (t->joinable()) {
+			t->join();
+		}
+	}
+	for (std::vector<std::thread>::iterator t(_relayThreads.begin()); t != _relayThreads.end(); ++t) {
+		if (t->joinable()) {
+			t->join();
+		}
+	}
+	_rxThreads.clear();
+	_txThreads.clear();
+	_relayThreads.clear();
+
+	// The encrypt workers are gone, so nothing left in their queues will be sent
+	for (std::vector<BlockingQueue<TxPacketRecord*>*>::iterator q(_txPacketQueues.begin()); q != _txPacketQueues.end(); ++q) {
+		std::vector<TxPacketRecord*> left((*q)->drain());
+		Mutex::Lock l(_txPacketVector_m);
+		_txPacketVector.insert(_txPacketVector.end(), left.begin(), left.end());
+	}
+}
+
 void PacketMultiplexer::putFrame(void* tPtr, uint64_t nwid, void** nuptr, const MAC& source, const MAC& dest, unsigned int etherType, unsigned int vlanId, const void* data, unsigned int len, unsigned int flowId)
 {
 #if defined(__APPLE__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__WINDOWS__)
@@ -57,7 +147,10 @@ void PacketMultiplexer::putFrame(void* tPtr, uint64_t nwid, void** nuptr, const
 	memcpy(packet->data, data, len);
 
 	int bucket = flowId % _concurrency;
-	_rxPacketQueues[bucket]->postLimit(packet, 2048);
+	if (! _rxPacketQueues[bucket]->postLimit(packet, 2048)) {
+		Mutex::Lock l(_rxPacketVector_m);
+		_rxPacketVector.push_back(packet);
+	}
 }
 
 void PacketMultiplexer::setUpPostDecodeReceiveThreads(unsigned int concurrency, bool cpuPinningEnabled)
@@ -79,39 +172,234 @@ void PacketMultiplexer::setUpPostDecodeReceiveThreads(unsigned int concurrency,
 		_rxThreads.push_back(std::thread([this, i, _enablePinning]() {
 			fprintf(stderr, "Created post-decode packet ingestion thread %d\n", i);
 
-			PacketRecord* packet = nullptr;
+			std::vector<PacketRecord*> batch;
+			batch.reserve(ZT_PACKET_MULTIPLEXER_MAX_BATCH);
+			ZT_VirtualNetworkFrame frames[ZT_PACKET_MULTIPLEXER_MAX_BATCH];
 			for (;;) {
-				if (! _rxPacketQueues[i]->get(packet)) {
+				batch.clear();
+				if (! _rxPacketQueues[i]->getBatch(batch, ZT_PACKET_MULTIPLEXER_MAX_BATCH)) {
 					break;
 				}
-				if (! packet) {
-					break;
+
+				// Deliver runs of consecutive frames for the same network in one call
+				unsigned int runStart = 0;
+				while (runStart < (unsigned int)batch.size()) {
+					const PacketRecord* const first = batch[runStart];
+					unsigned int runEnd = runStart;
+					while ((runEnd < (unsigned int)batch.size()) && (batch[runEnd]->nwid == first->nwid) && (batch[runEnd]->nuptr == first->nuptr) && (batch[runEnd]->tPtr == first->tPtr)) {
+						const PacketRecord* const packet = batch[runEnd];
+						ZT_VirtualNetworkFrame& f = frames[runEnd - runStart];
+						f.sourceMac = packet->source;
+						f.destMac = packet->dest;
+						f.etherType = packet->etherType;
+						f.vlanId = packet->vlanId;
+						f.data = (const void*)packet->data;
+						f.len = packet->len;
+						++runEnd;
+					}
+					RR->node->putFrames(first->tPtr, first->nwid, first->nuptr, frames, runEnd - runStart);
+					runStart = runEnd;
+				}
+
+				{
+					Mutex::Lock l(_rxPacketVector_m);
+					_rxPacketVector.insert(_rxPacketVector.end(), batch.begin(), batch.end());
 				}
+			}
+		}));
+	}
+}
+
+bool PacketMultiplexer::putPacket(void* tPtr, const Packet& packet, bool encrypt, uint64_t nwid, int32_t flowId)
+{
+	if (! _txEnabled) {
+		return false;
+	}
+
+	TxPacketRecord* rec;
+	_txPacketVector_m.lock();
+	if (_txPacketVector.empty()) {
+		rec = new TxPacketRecord;
+	}
+	else {
+		rec = _txPacketVector.back();
+		_txPacketVector.pop_back();
+	}
+	_txPacketVector_m.unlock();
+
+	rec->tPtr = tPtr;
+	rec->nwid = nwid;
+	rec->flowId = flowId;
+	rec->encrypt = encrypt;
+	rec->packet.copyFrom(packet.data(), packet.size());
+
+	// All packets for one destination go through the same worker, keeping them in order
+	const unsigned int shard = (unsigned int)(packet.destination().toInt() % (uint64_t)_txConcurrency);
+	if (! _txPacketQueues[shard]->postLimit(rec, ZT_PACKET_MULTIPLEXER_MAX_TX_QUEUE)) {
+		// Stopped while waiting for room
+		Mutex::Lock l(_txPacketVector_m);
+		_txPacketVector.push_back(rec);
+		return false;
+	}
+	return true;
+}
+
+void PacketMultiplexer::setUpEncryptThreads(unsigned int concurrency, bool cpuPinningEnabled)
+{
+#if defined(__APPLE__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__WINDOWS__)
+	return;
+#endif
+	if ((concurrency == 0) || (! _txThreads.empty())) {
+		return;
+	}
+	_txConcurrency = concurrency;
 
-				// fprintf(stderr, "popped packet from queue %d\n", i);
+	for (unsigned int i = 0; i < _txConcurrency; ++i) {
+		_txPacketQueues.push_back(new BlockingQueue<TxPacketRecord*>());
+	}
 
-				MAC sourceMac = MAC(packet->source);
-				MAC destMac = MAC(packet->dest);
+	// Each worker armors whatever tap threads have queued for its destinations
+	// and sends each batch to the host in one call
+	for (unsigned int i = 0; i < _txConcurrency; ++i) {
+		_txThreads.push_back(std::thread([this, i]() {
+			fprintf(stderr, "Created transmit encrypt thread %d\n", i);
 
-				RR->node->putFrame(packet->tPtr, packet->nwid, packet->nuptr, sourceMac, destMac, packet->etherType, 0, (const void*)packet->data, packet->len);
+			std::vector<TxPacketRecord*> batch;
+			batch.reserve(ZT_PACKET_MULTIPLEXER_MAX_BATCH);
+			WireBatch wire(RR, (void*)0);
+			for (;;) {
+				batch.clear();
+				if (! _txPacketQueues[i]->getBatch(batch, ZT_PACKET_MULTIPLEXER_MAX_BATCH)) {
+					break;
+				}
+				for (std::vector<TxPacketRecord*>::iterator r(batch.begin()); r != batch.end(); ++r) {
+					try {
+						wire.setThreadPtr((*r)->tPtr);
+						RR->sw->sendCopy((*r)->tPtr, (*r)->packet, (*r)->packet.destination(), (*r)->encrypt, (*r)->nwid, (*r)->flowId, wire);
+					}
+					catch (...) {
+					}
+				}
+				wire.flush();
 				{
-					Mutex::Lock l(_rxPacketVector_m);
-					_rxPacketVector.push_back(packet);
+					Mutex::Lock l(_txPacketVector_m);
+					_txPacketVector.insert(_txPacketVector.end(), batch.begin(), batch.end());
+				}
+			}
+		}));
+	}
+	_txEnabled = true;
+}
+
+bool PacketMultiplexer::putRelay(void* tPtr, const void* data, unsigned int len, int64_t now)
+{
+	if ((! _relayEnabled) || (len > ZT_MAX_PHYSMTU)) {
+		return false;
+	}
+
+	RelayRecord* rec;
+	_relayRecordVector_m.lock();
+	if (_relayRecordVector.empty()) {
+		rec = new RelayRecord;
+	}
+	else {
+		rec = _relayRecordVector.back();
+		_relayRecordVector.pop_back();
+	}
+	_relayRecordVector_m.unlock();
+
+	rec->tPtr = tPtr;
+	rec->now = now;
+	rec->len = len;
+	memcpy(rec->data, data, len);
+
+	// All datagrams for one destination go through the same worker, keeping them in order
+	const unsigned int shard = (unsigned int)(Address(rec->data + ZT_PACKET_IDX_DEST, ZT_ADDRESS_LENGTH).toInt() % (uint64_t)_relayConcurrency);
+	if (! _relayQueues[shard]->tryPost(rec, ZT_PACKET_MULTIPLEXER_MAX_RELAY_QUEUE)) {
+		// Never stall the wire reader on a slow relay worker; relayed UDP is best effort
+		Metrics::relay_queue_drops++;
+		Mutex::Lock l(_relayRecordVector_m);
+		_relayRecordVector.push_back(rec);
+	}
+	return true;
+}
+
+// Orders relay records by destination; used with a stable sort so each destination's datagrams stay in order
+static bool _relayRecordDestinationLess(const RelayRecord* a, const RelayRecord* b)
+{
+	return (memcmp(a->data + ZT_PACKET_IDX_DEST, b->data + ZT_PACKET_IDX_DEST, ZT_ADDRESS_LENGTH) < 0);
+}
+
+void PacketMultiplexer::setUpRelayThreads(unsigned int concurrency, bool cpuPinningEnabled)
+{
+#if defined(__APPLE__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__WINDOWS__)
+	return;
+#endif
+	if ((concurrency == 0) || (! _relayThreads.empty())) {
+		return;
+	}
+	_relayConcurrency = concurrency;
+
+	for (unsigned int i = 0; i < _relayConcurrency; ++i) {
+		_relayQueues.push_back(new BlockingQueue<RelayRecord*>());
+	}
+
+	const unsigned int cores = std::thread::hardware_concurrency();
+	for (unsigned int i = 0; i < _relayConcurrency; ++i) {
+		_relayThreads.push_back(std::thread([this, i, cpuPinningEnabled, cores]() {
+			fprintf(stderr, "Created relay thread %d\n", i);
+#ifdef __LINUX__
+			// Tap threads pin from core 0 upward, so relay workers take cores from the top down
+			if ((cpuPinningEnabled) && (i < cores)) {
+				const unsigned int core = cores - 1 - i;
+				fprintf(stderr, "Pinning relay thread %u to core %u\n", i, core);
+				cpu_set_t cpuset;
+				CPU_ZERO(&cpuset);
+				CPU_SET(core, &cpuset);
+				const int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+				if (rc != 0) {
+					fprintf(stderr, "Failed to pin relay thread %u to core %u: %s\n", i, core, strerror(rc));
 				}
-				/*
-				if (ZT_ResultCode_isFatal(err)) {
-					char tmp[256];
-					OSUtils::ztsnprintf(tmp, sizeof(tmp), "error processing packet: %d", (int)err);
-					Mutex::Lock _l(_termReason_m);
-					_termReason = ONE_UNRECOVERABLE_ERROR;
-					_fatalErrorMessage = tmp;
-					this->terminate();
+			}
+#endif
+
+			std::vector<RelayRecord*> batch;
+			batch.reserve(ZT_PACKET_MULTIPLEXER_MAX_BATCH);
+			uint8_t* datagrams[ZT_PACKET_MULTIPLEXER_MAX_BATCH];
+			unsigned int lens[ZT_PACKET_MULTIPLEXER_MAX_BATCH];
+			for (;;) {
+				batch.clear();
+				if (! _relayQueues[i]->getBatch(batch, ZT_PACKET_MULTIPLEXER_MAX_BATCH)) {
 					break;
 				}
-				*/
+				std::stable_sort(batch.begin(), batch.end(), _relayRecordDestinationLess);
+
+				// Relay each run of datagrams for the same destination in one call
+				unsigned int runStart = 0;
+				while (runStart < (unsigned int)batch.size()) {
+					const RelayRecord* const first = batch[runStart];
+					unsigned int runEnd = runStart;
+					while ((runEnd < (unsigned int)batch.size()) && (batch[runEnd]->tPtr == first->tPtr) && (memcmp(batch[runEnd]->data + ZT_PACKET_IDX_DEST, first->data + ZT_PACKET_IDX_DEST, ZT_ADDRESS_LENGTH) == 0)) {
+						datagrams[runEnd - runStart] = batch[runEnd]->data;
+						lens[runEnd - runStart] = batch[runEnd]->len;
+						++runEnd;
+					}
+					try {
+						RR->sw->relay(first->tPtr, datagrams, lens, runEnd - runStart, batch[runEnd - 1]->now);
+					}
+					catch (...) {
+					}
+					runStart = runEnd;
+				}
+
+				{
+					Mutex::Lock l(_relayRecordVector_m);
+					_relayRecordVector.insert(_relayRecordVector.end(), batch.begin(), batch.end());
+				}
 			}
 		}));
 	}
+	_relayEnabled = true;
 }
 
 }	// namespace ZeroTier
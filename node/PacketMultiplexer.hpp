@@ -12,11 +12,31 @@
 #include "../osdep/BlockingQueue.hpp"
 #include "MAC.hpp"
 #include "Mutex.hpp"
+#include "Packet.hpp"
 #include "RuntimeEnvironment.hpp"
 
+#include <atomic>
 #include <thread>
 #include <vector>
 
+/**
+ * Maximum number of queued frames handed to the host in one batch
+ */
+#define ZT_PACKET_MULTIPLEXER_MAX_BATCH 64
+
+/**
+ * Maximum number of packets waiting in one encrypt worker's queue
+ *
+ * When a queue is full the thread submitting the packet (normally a tap
+ * reader) blocks until the worker catches up.
+ */
+#define ZT_PACKET_MULTIPLEXER_MAX_TX_QUEUE 1024
+
+/**
+ * Maximum number of datagrams waiting in one relay worker's queue
+ */
+#define ZT_PACKET_MULTIPLEXER_MAX_RELAY_QUEUE 4096
+
 namespace ZeroTier {
 
 struct PacketRecord {
@@ -32,16 +52,86 @@ struct PacketRecord {
 	unsigned int flowId;
 };
 
+struct TxPacketRecord {
+	void* tPtr;
+	uint64_t nwid;
+	int32_t flowId;
+	bool encrypt;
+	Packet packet;
+};
+
+struct RelayRecord {
+	void* tPtr;
+	int64_t now;
+	unsigned int len;
+	uint8_t data[ZT_MAX_PHYSMTU];
+};
+
 class PacketMultiplexer {
   public:
 	const RuntimeEnvironment* RR;
 
 	PacketMultiplexer(const RuntimeEnvironment* renv);
+	~PacketMultiplexer();
 
 	void setUpPostDecodeReceiveThreads(unsigned int concurrency, bool cpuPinningEnabled);
 
 	void putFrame(void* tPtr, uint64_t nwid, void** nuptr, const MAC& source, const MAC& dest, unsigned int etherType, unsigned int vlanId, const void* data, unsigned int len, unsigned int flowId);
 
+	/**
+	 * Start the transmit-side encrypt workers
+	 *
+	 * Each worker owns the destinations whose address hashes to it, so
+	 * packets to one peer are armored and sent in the order submitted. A
+	 * worker armors each batch it dequeues into a WireBatch and hands it to
+	 * the host in one call.
+	 *
+	 * @param concurrency Number of encrypt workers
+	 * @param cpuPinningEnabled Currently unused
+	 */
+	void setUpEncryptThreads(unsigned int concurrency, bool cpuPinningEnabled);
+
+	/**
+	 * Hand an outgoing packet to the encrypt worker for its destination
+	 *
+	 * The packet is copied. The worker sends it via Switch::sendCopy(). If
+	 * the worker's queue is full this blocks, pushing back on the caller.
+	 *
+	 * @return False if encrypt workers are not running or were stopped; caller should send the packet itself
+	 */
+	bool putPacket(void* tPtr, const Packet& packet, bool encrypt, uint64_t nwid, int32_t flowId);
+
+	/**
+	 * Start the relay workers
+	 *
+	 * Each worker owns the destinations whose address hashes to it. It takes
+	 * whatever datagrams are waiting, groups them by destination, and hands
+	 * each group to Switch::relay() so its path is looked up once. Until this
+	 * is called datagrams are relayed inline by the thread that received them.
+	 *
+	 * @param concurrency Number of relay workers (0 to keep relaying inline)
+	 * @param cpuPinningEnabled If true pin worker N to core (cores - 1 - N), away from tap threads pinned from core 0
+	 */
+	void setUpRelayThreads(unsigned int concurrency, bool cpuPinningEnabled);
+
+	/**
+	 * Hand a datagram to be relayed to the relay worker for its destination
+	 *
+	 * The datagram is copied. If the worker's queue is full it is dropped
+	 * and counted instead, so the caller never waits on a relay worker.
+	 *
+	 * @return False if relay workers are not running or the datagram is too large; caller should relay it itself
+	 */
+	bool putRelay(void* tPtr, const void* data, unsigned int len, int64_t now);
+
+	/**
+	 * Stop and join all worker threads
+	 *
+	 * Packets still queued for the encrypt workers are dropped. Must be
+	 * called before the rest of the runtime environment is torn down.
+	 */
+	void stopThreads();
+
 	std::vector<BlockingQueue<PacketRecord*>*> _rxPacketQueues;
 
 	unsigned int _concurrency;
@@ -53,6 +143,20 @@ class PacketMultiplexer {
 	std::vector<std::thread> _rxThreads;
 	unsigned int _rxThreadCount;
 	bool _enabled;
+
+	std::vector<BlockingQueue<TxPacketRecord*>*> _txPacketQueues;
+	std::vector<TxPacketRecord*> _txPacketVector;
+	Mutex _txPacketVector_m;
+	std::vector<std::thread> _txThreads;
+	unsigned int _txConcurrency;
+	std::atomic<bool> _txEnabled;	// read by tap threads in putPacket()
+
+	std::vector<BlockingQueue<RelayRecord*>*> _relayQueues;
+	std::vector<RelayRecord*> _relayRecordVector;
+	Mutex _relayRecordVector_m;
+	std::vector<std::thread> _relayThreads;
+	unsigned int _relayConcurrency;
+	std::atomic<bool> _relayEnabled;	// read by I/O threads in putRelay()
 };
 
 }	// namespace ZeroTier
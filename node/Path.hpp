@@ -68,7 +68,9 @@ class Path {
 
 		inline unsigned long hashCode() const
 		{
-			return (unsigned long)(_k[0] + _k[1] + _k[2]);
+			// Multiply each word by a different odd constant so that addresses
+			// and ports differing in compensating ways do not collide.
+			return (unsigned long)((_k[0] * 0x9e3779b97f4a7c15ULL) ^ (_k[1] * 0xc2b2ae3d27d4eb4fULL) ^ (_k[2] * 0x165667b19e3779f9ULL));
 		}
 
 		inline bool operator==(const HashKey& k) const
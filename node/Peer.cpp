@@ -43,6 +43,9 @@ Peer::Peer(const RuntimeEnvironment* renv, const Identity& myIdentity, const Ide
 	, _vMajor(0)
 	, _vMinor(0)
 	, _vRevision(0)
+	, _bestPathSeq(0)
+	, _bestPath((Path*)0)
+	, _bestPathValidUntil(0)
 	, _id(peerIdentity)
 	, _directPathPushCutoffCount(0)
 	, _echoRequestCutoffCount(0)
@@ -91,6 +94,9 @@ void Peer::received(
 		case Packet::VERB_NETWORK_CONFIG_REQUEST:
 		case Packet::VERB_NETWORK_CONFIG:
 		case Packet::VERB_MULTICAST_FRAME:
+			if (! isActive(now)) {
+				RR->topology->schedulePeer(_id.address(), now);	  // idle peers aren't pinged, start again
+			}
 			_lastNontrivialReceive = now;
 			break;
 		default:
@@ -111,9 +117,12 @@ void Peer::received(
 		bool havePath = false;
 		{
 			Mutex::Lock _l(_paths_m);
-			for (unsigned int i = 0; i < ZT_MAX_PEER_NETWORK_PATHS; ++i) {
+			for (unsigned int i = 0; i < _paths.size(); ++i) {
 				if (_paths[i].p) {
 					if (_paths[i].p == path) {
+						if ((now - _paths[i].lr) >= ZT_PEER_PATH_EXPIRATION) {
+							_setBestPath((Path*)0, 0);
+						}
 						_paths[i].lr = now;
 						havePath = true;
 						break;
@@ -139,7 +148,7 @@ void Peer::received(
 				unsigned int oldestPathAge = 0;
 				unsigned int replacePath = ZT_MAX_PEER_NETWORK_PATHS;
 
-				for (unsigned int i = 0; i < ZT_MAX_PEER_NETWORK_PATHS; ++i) {
+				for (unsigned int i = 0; i < _paths.size(); ++i) {
 					if (_paths[i].p) {
 						// Keep track of oldest path as a last resort option
 						unsigned int currAge = _paths[i].p->age(now);
@@ -162,10 +171,15 @@ void Peer::received(
 					}
 				}
 
-				// If we didn't find a good candidate then resort to replacing oldest path
-				replacePath = (replacePath == ZT_MAX_PEER_NETWORK_PATHS) ? oldestPathIdx : replacePath;
+				// If every slot is taken make room for another path, or failing that
+				// resort to replacing oldest path
+				if (replacePath == ZT_MAX_PEER_NETWORK_PATHS) {
+					const unsigned int firstNewSlot = _paths.size();
+					replacePath = (_paths.grow()) ? firstNewSlot : oldestPathIdx;
+				}
 				if (replacePath != ZT_MAX_PEER_NETWORK_PATHS) {
 					RR->t->peerLearnedNewPath(tPtr, networkId, *this, path, packetId);
+					_setBestPath((Path*)0, 0);
 					_paths[replacePath].lr = now;
 					_paths[replacePath].p = path;
 					_paths[replacePath].priority = 1;
@@ -260,6 +274,22 @@ void Peer::received(
 
 SharedPtr<Path> Peer::getAppropriatePath(int64_t now, bool includeExpired, int32_t flowId)
 {
+	if (! includeExpired) {
+		// Paths are canonicalized in Topology, which frees them only after
+		// every pass that might have seen them ends, so the cached pointer
+		// stays valid for the duration of this one.
+		const SnapshotReaders::Pass pass;
+		const uint32_t seq = _bestPathSeq.load(std::memory_order_acquire);
+		if ((seq & 1) == 0) {
+			Path* const p = _bestPath.load(std::memory_order_relaxed);
+			const int64_t validUntil = _bestPathValidUntil.load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if ((p) && (now < validUntil) && (_bestPathSeq.load(std::memory_order_relaxed) == seq)) {
+				return SharedPtr<Path>(p);
+			}
+		}
+	}
+
 	Mutex::Lock _l(_paths_m);
 	Mutex::Lock _lb(_bond_m);
 	if (_bond && _bond->isReady()) {
@@ -269,9 +299,14 @@ SharedPtr<Path> Peer::getAppropriatePath(int64_t now, bool includeExpired, int32
 	/**
 	 * Send traffic across the highest quality path only. This algorithm will still
 	 * use the old path quality metric from protocol version 9.
+	 *
+	 * While every candidate is alive its quality does not depend on time, so
+	 * the choice holds until a candidate expires or stops being alive or
+	 * until path state changes, which invalidates it explicitly.
 	 */
 	long bestPathQuality = 2147483647;
-	for (unsigned int i = 0; i < ZT_MAX_PEER_NETWORK_PATHS; ++i) {
+	int64_t validUntil = (includeExpired || _bond) ? 0 : 0x7fffffffffffffffLL;
+	for (unsigned int i = 0; i < _paths.size(); ++i) {
 		if (_paths[i].p) {
 			if ((includeExpired) || ((now - _paths[i].lr) < ZT_PEER_PATH_EXPIRATION)) {
 				const long q = _paths[i].p->quality(now) / _paths[i].priority;
@@ -279,6 +314,12 @@ SharedPtr<Path> Peer::getAppropriatePath(int64_t now, bool includeExpired, int32
 					bestPathQuality = q;
 					bestPath = i;
 				}
+				if (_paths[i].p->alive(now)) {
+					validUntil = std::min(validUntil, std::min(_paths[i].lr + ZT_PEER_PATH_EXPIRATION, _paths[i].p->lastIn() + ZT_PATH_HEARTBEAT_PERIOD + 5000));
+				}
+				else {
+					validUntil = 0;
+				}
 			}
 		}
 		else {
@@ -286,11 +327,21 @@ SharedPtr<Path> Peer::getAppropriatePath(int64_t now, bool includeExpired, int32
 		}
 	}
 	if (bestPath != ZT_MAX_PEER_NETWORK_PATHS) {
+		if (validUntil > now) {
+			_setBestPath(_paths[bestPath].p.ptr(), validUntil);
+		}
 		return _paths[bestPath].p;
 	}
 	return SharedPtr<Path>();
 }
 
+void Peer::updatePathLatency(const SharedPtr<Path>& path, unsigned int l, int64_t now)
+{
+	path->updateLatency(l, now);
+	Mutex::Lock _l(_paths_m);
+	_setBestPath((Path*)0, 0);
+}
+
 void Peer::introduce(void* const tPtr, const int64_t now, const SharedPtr<Peer>& other) const
 {
 	unsigned int myBestV4ByScope[ZT_INETADDRESS_MAX_SCOPE + 1];
@@ -314,7 +365,7 @@ void Peer::introduce(void* const tPtr, const int64_t now, const SharedPtr<Peer>&
 
 	Mutex::Lock _l1(_paths_m);
 
-	for (unsigned int i = 0; i < ZT_MAX_PEER_NETWORK_PATHS; ++i) {
+	for (unsigned int i = 0; i < _paths.size(); ++i) {
 		if (_paths[i].p) {
 			const long q = _paths[i].p->quality(now) / _paths[i].priority;
 			const unsigned int s = (unsigned int)_paths[i].p->ipScope();
@@ -340,7 +391,7 @@ void Peer::introduce(void* const tPtr, const int64_t now, const SharedPtr<Peer>&
 
 	Mutex::Lock _l2(other->_paths_m);
 
-	for (unsigned int i = 0; i < ZT_MAX_PEER_NETWORK_PATHS; ++i) {
+	for (unsigned int i = 0; i < other->_paths.size(); ++i) {
 		if (other->_paths[i].p) {
 			const long q = other->_paths[i].p->quality(now) / other->_paths[i].priority;
 			const unsigned int s = (unsigned int)other->_paths[i].p->ipScope();
@@ -503,7 +554,7 @@ void Peer::performMultipathStateCheck(void* tPtr, int64_t now)
 	 */
 	int numAlivePaths = 0;
 	bool atLeastOneNonExpired = false;
-	for (unsigned int i = 0; i < ZT_MAX_PEER_NETWORK_PATHS; ++i) {
+	for (unsigned int i = 0; i < _paths.size(); ++i) {
 		if (_paths[i].p) {
 			if (_paths[i].p->alive(now)) {
 				numAlivePaths++;
@@ -515,6 +566,7 @@ void Peer::performMultipathStateCheck(void* tPtr, int64_t now)
 	}
 	if (_bond) {
 		if (numAlivePaths == 0 && ! atLeastOneNonExpired) {
+			_setBestPath((Path*)0, 0);
 			_bond = SharedPtr<Bond>();
 			RR->bc->destroyBond(_id.address().toInt());
 		}
@@ -523,12 +575,13 @@ void Peer::performMultipathStateCheck(void* tPtr, int64_t now)
 	_localMultipathSupported = ((numAlivePaths >= 1) && (RR->bc->inUse()) && (ZT_PROTO_VERSION > 9));
 	if (_localMultipathSupported && ! _bond) {
 		if (RR->bc) {
+			_setBestPath((Path*)0, 0);
 			_bond = RR->bc->createBond(RR, this);
 			/**
 			 * Allow new bond to retroactively learn all paths known to this peer
 			 */
 			if (_bond) {
-				for (unsigned int i = 0; i < ZT_MAX_PEER_NETWORK_PATHS; ++i) {
+				for (unsigned int i = 0; i < _paths.size(); ++i) {
 					if (_paths[i].p) {
 						_bond->nominatePathToBond(_paths[i].p, now);
 					}
@@ -556,7 +609,7 @@ unsigned int Peer::doPingAndKeepalive(void* tPtr, int64_t now)
 		// redirects us its redirect target links override all other links and we
 		// let those old links expire.
 		long maxPriority = 0;
-		for (unsigned int i = 0; i < ZT_MAX_PEER_NETWORK_PATHS; ++i) {
+		for (unsigned int i = 0; i < _paths.size(); ++i) {
 			if (_paths[i].p) {
 				maxPriority = std::max(_paths[i].priority, maxPriority);
 			}
@@ -566,7 +619,7 @@ unsigned int Peer::doPingAndKeepalive(void* tPtr, int64_t now)
 		}
 
 		bool deletionOccurred = false;
-		for (unsigned int i = 0; i < ZT_MAX_PEER_NETWORK_PATHS; ++i) {
+		for (unsigned int i = 0; i < _paths.size(); ++i) {
 			if (_paths[i].p) {
 				// Clean expired and reduced priority paths
 				if (((now - _paths[i].lr) < ZT_PEER_PATH_EXPIRATION) && (_paths[i].priority == maxPriority)) {
@@ -577,12 +630,13 @@ unsigned int Peer::doPingAndKeepalive(void* tPtr, int64_t now)
 					}
 				}
 				else {
+					_setBestPath((Path*)0, 0);
 					_paths[i] = _PeerPath();
 					deletionOccurred = true;
 				}
 			}
 			if (! _paths[i].p || deletionOccurred) {
-				for (unsigned int j = i; j < ZT_MAX_PEER_NETWORK_PATHS; ++j) {
+				for (unsigned int j = i; j < _paths.size(); ++j) {
 					if (_paths[j].p && i != j) {
 						_paths[i] = _paths[j];
 						_paths[j] = _PeerPath();
@@ -594,7 +648,7 @@ unsigned int Peer::doPingAndKeepalive(void* tPtr, int64_t now)
 		}
 #ifndef ZT_NO_PEER_METRICS
 		uint16_t alive_path_count_tmp = 0, dead_path_count_tmp = 0;
-		for (unsigned int i = 0; i < ZT_MAX_PEER_NETWORK_PATHS; ++i) {
+		for (unsigned int i = 0; i < _paths.size(); ++i) {
 			if (_paths[i].p) {
 				if (_paths[i].p->alive(now)) {
 					alive_path_count_tmp++;
@@ -614,6 +668,25 @@ unsigned int Peer::doPingAndKeepalive(void* tPtr, int64_t now)
 	return sent;
 }
 
+int64_t Peer::nextPingDeadline(int64_t now)
+{
+	if (! isActive(now)) {
+		// Nothing to send until received() sees traffic again, just check for expiry
+		return std::max(_lastReceive + ZT_PEER_ACTIVITY_TIMEOUT, now + ZT_PING_CHECK_INTERVAL);
+	}
+
+	// Check at least once per heartbeat period in case a path was learned meanwhile
+	int64_t d = std::min(std::min(_lastSentFullHello + ZT_PEER_PING_PERIOD, _lastNontrivialReceive + ZT_PEER_ACTIVITY_TIMEOUT), now + ZT_PATH_HEARTBEAT_PERIOD);
+	Mutex::Lock _l(_paths_m);
+	for (unsigned int i = 0; i < _paths.size(); ++i) {
+		if (! _paths[i].p) {
+			break;
+		}
+		d = std::min(d, std::min(_paths[i].p->lastOut() + ZT_PATH_HEARTBEAT_PERIOD, _paths[i].lr + ZT_PEER_PATH_EXPIRATION));
+	}
+	return d;
+}
+
 void Peer::clusterRedirect(void* tPtr, const SharedPtr<Path>& originatingPath, const InetAddress& remoteAddress, const int64_t now)
 {
 	SharedPtr<Path> np(RR->topology->getPath(originatingPath->localSocket(), remoteAddress));
@@ -623,10 +696,11 @@ void Peer::clusterRedirect(void* tPtr, const SharedPtr<Path>& originatingPath, c
 
 	{
 		Mutex::Lock _l(_paths_m);
+		_setBestPath((Path*)0, 0);
 
 		// New priority is higher than the priority of the originating path (if known)
 		long newPriority = 1;
-		for (unsigned int i = 0; i < ZT_MAX_PEER_NETWORK_PATHS; ++i) {
+		for (unsigned int i = 0; i < _paths.size(); ++i) {
 			if (_paths[i].p) {
 				if (_paths[i].p == originatingPath) {
 					newPriority = _paths[i].priority;
@@ -642,7 +716,7 @@ void Peer::clusterRedirect(void* tPtr, const SharedPtr<Path>& originatingPath, c
 		// Erase any paths with lower priority than this one or that are duplicate
 		// IPs and add this path.
 		unsigned int j = 0;
-		for (unsigned int i = 0; i < ZT_MAX_PEER_NETWORK_PATHS; ++i) {
+		for (unsigned int i = 0; i < _paths.size(); ++i) {
 			if (_paths[i].p) {
 				if ((_paths[i].priority >= newPriority) && (! _paths[i].p->address().ipsEqual2(remoteAddress))) {
 					if (i != j) {
@@ -652,12 +726,12 @@ void Peer::clusterRedirect(void* tPtr, const SharedPtr<Path>& originatingPath, c
 				}
 			}
 		}
-		if (j < ZT_MAX_PEER_NETWORK_PATHS) {
+		if ((j < _paths.size()) || (_paths.grow())) {
 			_paths[j].lr = now;
 			_paths[j].p = np;
 			_paths[j].priority = newPriority;
 			++j;
-			while (j < ZT_MAX_PEER_NETWORK_PATHS) {
+			while (j < _paths.size()) {
 				_paths[j].lr = 0;
 				_paths[j].p.zero();
 				_paths[j].priority = 1;
@@ -670,12 +744,13 @@ void Peer::clusterRedirect(void* tPtr, const SharedPtr<Path>& originatingPath, c
 void Peer::resetWithinScope(void* tPtr, InetAddress::IpScope scope, int inetAddressFamily, int64_t now)
 {
 	Mutex::Lock _l(_paths_m);
-	for (unsigned int i = 0; i < ZT_MAX_PEER_NETWORK_PATHS; ++i) {
+	for (unsigned int i = 0; i < _paths.size(); ++i) {
 		if (_paths[i].p) {
 			if ((_paths[i].p->address().ss_family == inetAddressFamily) && (_paths[i].p->ipScope() == scope)) {
 				attemptToContactAt(tPtr, _paths[i].p->localSocket(), _paths[i].p->address(), now, false);
 				_paths[i].p->sent(now);
 				_paths[i].lr = 0;	// path will not be used unless it speaks again
+				_setBestPath((Path*)0, 0);
 			}
 		}
 		else {
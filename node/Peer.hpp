@@ -25,6 +25,8 @@
 #include "SharedPtr.hpp"
 #include "Utils.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <list>
 #include <vector>
 
@@ -115,7 +117,7 @@ class Peer {
 	inline bool hasActivePathTo(int64_t now, const InetAddress& addr) const
 	{
 		Mutex::Lock _l(_paths_m);
-		for (unsigned int i = 0; i < ZT_MAX_PEER_NETWORK_PATHS; ++i) {
+		for (unsigned int i = 0; i < _paths.size(); ++i) {
 			if (_paths[i].p) {
 				if (((now - _paths[i].lr) < ZT_PEER_PATH_EXPIRATION) && (_paths[i].p->address() == addr)) {
 					return true;
@@ -183,12 +185,25 @@ class Peer {
 	/**
 	 * Get the most appropriate direct path based on current multipath and QoS configuration
 	 *
+	 * Without a bond the best unexpired path is cached until path state
+	 * changes or the time at which its choice could change by itself, and
+	 * read without locking.
+	 *
 	 * @param now Current time
 	 * @param includeExpired If true, include even expired paths
 	 * @return Best current path or NULL if none
 	 */
 	SharedPtr<Path> getAppropriatePath(int64_t now, bool includeExpired, int32_t flowId = -1);
 
+	/**
+	 * Update the measured latency of one of this peer's paths
+	 *
+	 * @param path Path
+	 * @param l Latency in milliseconds
+	 * @param now Current time
+	 */
+	void updatePathLatency(const SharedPtr<Path>& path, unsigned int l, int64_t now);
+
 	/**
 	 * Send VERB_RENDEZVOUS to this and another peer via the best common IP scope and path
 	 */
@@ -248,6 +263,12 @@ class Peer {
 	 */
 	unsigned int doPingAndKeepalive(void* tPtr, int64_t now);
 
+	/**
+	 * @param now Current time
+	 * @return Time at which doPingAndKeepalive() may next have work to do, or this peer may expire
+	 */
+	int64_t nextPingDeadline(int64_t now);
+
 	/**
 	 * Process a cluster redirect sent by this peer
 	 *
@@ -281,7 +302,7 @@ class Peer {
 	{
 		std::vector<SharedPtr<Path> > pp;
 		Mutex::Lock _l(_paths_m);
-		for (unsigned int i = 0; i < ZT_MAX_PEER_NETWORK_PATHS; ++i) {
+		for (unsigned int i = 0; i < _paths.size(); ++i) {
 			if (! _paths[i].p) {
 				break;
 			}
@@ -542,7 +563,7 @@ class Peer {
 		{
 			Mutex::Lock _l(_paths_m);
 			unsigned int pc = 0;
-			for (unsigned int i = 0; i < ZT_MAX_PEER_NETWORK_PATHS; ++i) {
+			for (unsigned int i = 0; i < _paths.size(); ++i) {
 				if (_paths[i].p) {
 					++pc;
 				}
@@ -701,10 +722,92 @@ class Peer {
 	std::list<std::pair<Path*, int64_t> > _lastTriedPath;
 	Mutex _lastTriedPath_m;
 
-	_PeerPath _paths[ZT_MAX_PEER_NETWORK_PATHS];
+	// Path slots, packed from the front. The first ZT_PEER_INLINE_PATHS are
+	// part of the Peer; more are allocated when a peer actually has more paths.
+	class _PeerPaths {
+	  public:
+		_PeerPaths() : _more((_PeerPath*)0), _size(ZT_PEER_INLINE_PATHS)
+		{
+		}
+		~_PeerPaths()
+		{
+			delete[] _more;
+		}
+
+		/**
+		 * @return Number of slots, used or not
+		 */
+		inline unsigned int size() const
+		{
+			return _size;
+		}
+
+		inline _PeerPath& operator[](const unsigned int i)
+		{
+			return (i < ZT_PEER_INLINE_PATHS) ? _inline[i] : _more[i - ZT_PEER_INLINE_PATHS];
+		}
+		inline const _PeerPath& operator[](const unsigned int i) const
+		{
+			return (i < ZT_PEER_INLINE_PATHS) ? _inline[i] : _more[i - ZT_PEER_INLINE_PATHS];
+		}
+
+		/**
+		 * Double the number of slots, up to ZT_MAX_PEER_NETWORK_PATHS
+		 *
+		 * @return False if there are already ZT_MAX_PEER_NETWORK_PATHS slots
+		 */
+		inline bool grow()
+		{
+			if (_size >= ZT_MAX_PEER_NETWORK_PATHS) {
+				return false;
+			}
+			const unsigned int newSize = std::min(_size * 2, (unsigned int)ZT_MAX_PEER_NETWORK_PATHS);
+			_PeerPath* const more = new _PeerPath[newSize - ZT_PEER_INLINE_PATHS];
+			for (unsigned int i = 0; i < (_size - ZT_PEER_INLINE_PATHS); ++i) {
+				more[i] = _more[i];
+			}
+			delete[] _more;
+			_more = more;
+			_size = newSize;
+			return true;
+		}
+
+	  private:
+		_PeerPaths(const _PeerPaths&)
+		{
+		}
+		const _PeerPaths& operator=(const _PeerPaths&)
+		{
+			return *this;
+		}
+
+		_PeerPath _inline[ZT_PEER_INLINE_PATHS];
+		_PeerPath* _more;
+		unsigned int _size;
+	};
+
+	_PeerPaths _paths;
 	Mutex _paths_m;
 	Mutex _bond_m;
 
+	// Cached result of getAppropriatePath(now, false), written under _paths_m
+	// and read under a seqlock: _bestPathSeq is odd while an update is in
+	// progress. The path is valid while now < _bestPathValidUntil.
+	std::atomic<uint32_t> _bestPathSeq;
+	std::atomic<Path*> _bestPath;
+	std::atomic<int64_t> _bestPathValidUntil;
+
+	// Must be called with _paths_m locked
+	inline void _setBestPath(Path* const p, const int64_t validUntil)
+	{
+		const uint32_t seq = _bestPathSeq.load(std::memory_order_relaxed);
+		_bestPathSeq.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		_bestPath.store(p, std::memory_order_relaxed);
+		_bestPathValidUntil.store(validUntil, std::memory_order_relaxed);
+		_bestPathSeq.store(seq + 2, std::memory_order_release);
+	}
+
 	bool _isLeaf;
 
 	Identity _id;
@@ -0,0 +1,222 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * (c) ZeroTier, Inc.
+ * https://www.zerotier.com/
+ */
+
+#include "QoSQueue.hpp"
+
+#include <math.h>
+
+namespace ZeroTier {
+
+QoSQueue::QoSQueue() : _freeEntries((Entry*)0), _count(0), _activeDefaultSubqueues(0)
+{
+	for (unsigned int i = 0; i < (ZT_AQM_MAX_ENQUEUED_PACKETS + 1); ++i) {
+		_entries[i].next = _freeEntries;
+		_freeEntries = &(_entries[i]);
+	}
+}
+
+bool QoSQueue::enqueue(const SharedPtr<PacketBuffer>& packet, const bool encrypt, const int qosBucket, const uint64_t nwid, const int32_t flowId, const uint64_t now)
+{
+	unsigned int b;
+	if (qosBucket == ZT_AQM_UNCLASSIFIED) {
+		b = ZT_AQM_NUM_BUCKETS + ((flowId == ZT_QOS_NO_FLOW) ? 0 : ((uint32_t)flowId % ZT_AQM_NUM_DEFAULT_SUBQUEUES));
+	}
+	else if ((qosBucket >= 0) && (qosBucket < ZT_AQM_NUM_BUCKETS)) {
+		b = (unsigned int)qosBucket;
+	}
+	else {
+		return false;
+	}
+
+	Mutex::Lock _l(_lock);
+
+	_Bucket* const q = &(_buckets[b]);
+	if (q->list == _BUCKET_INACTIVE) {
+		// move queue to end of NEW queue list
+		if (b >= ZT_AQM_NUM_BUCKETS) {
+			++_activeDefaultSubqueues;
+		}
+		q->byteCredit = _quantum(q);
+		q->list = _BUCKET_NEW;
+		_newBuckets.push_back(q);
+	}
+
+	// The pool holds one entry more than the limit, so one is always free here
+	Entry* const e = _freeEntries;
+	_freeEntries = e->next;
+	e->packet = packet;
+	e->creationTime = now;
+	e->nwid = nwid;
+	e->flowId = flowId;
+	e->encrypt = encrypt;
+	e->next = (Entry*)0;
+	if (q->tail) {
+		q->tail->next = e;
+	}
+	else {
+		q->head = e;
+	}
+	q->tail = e;
+	q->byteLength += (int)packet->payloadLength();
+	++_count;
+
+	// Drop a packet from the head of the largest queue if necessary
+	if (_count > ZT_AQM_MAX_ENQUEUED_PACKETS) {
+		_Bucket* largest = (_Bucket*)0;
+		int maxQueueLength = 0;
+		for (unsigned int i = 0; i < _NUM_BUCKETS; ++i) {
+			if (_buckets[i].byteLength > maxQueueLength) {
+				maxQueueLength = _buckets[i].byteLength;
+				largest = &(_buckets[i]);
+			}
+		}
+		if ((largest) && (largest->head)) {
+			_free(_popHead(largest));
+		}
+	}
+
+	return true;
+}
+
+unsigned int QoSQueue::dequeue(Entry* ready, const uint64_t now)
+{
+	unsigned int n = 0;
+	Mutex::Lock _l(_lock);
+
+	if (! _count) {
+		return 0;
+	}
+
+	// Attempt dequeue from queues in NEW list
+	while (_newBuckets.head) {
+		_Bucket* const q = _newBuckets.head;
+		if (q->byteCredit < 0) {
+			q->byteCredit += _quantum(q);
+			// Move to list of OLD queues
+			q->list = _BUCKET_OLD;
+			_oldBuckets.push_back(_newBuckets.pop_front());
+		}
+		else {
+			if (! CoDelDequeue(q, now)) {
+				// Move to end of list of OLD queues
+				q->list = _BUCKET_OLD;
+				_oldBuckets.push_back(_newBuckets.pop_front());
+			}
+			else {
+				Entry* const e = _popHead(q);
+				q->byteCredit -= (int)e->packet->payloadLength();
+				ready[n].packet.swap(e->packet);
+				ready[n].nwid = e->nwid;
+				ready[n].flowId = e->flowId;
+				ready[n].encrypt = e->encrypt;
+				++n;
+				_free(e);
+			}
+			break;
+		}
+	}
+
+	// Attempt dequeue from queues in OLD list
+	while (_oldBuckets.head) {
+		_Bucket* const q = _oldBuckets.head;
+		if (q->byteCredit < 0) {
+			q->byteCredit += _quantum(q);
+			_oldBuckets.push_back(_oldBuckets.pop_front());
+		}
+		else {
+			if (! CoDelDequeue(q, now)) {
+				// Move to inactive list of queues
+				if (q >= &(_buckets[ZT_AQM_NUM_BUCKETS])) {
+					--_activeDefaultSubqueues;
+				}
+				q->list = _BUCKET_INACTIVE;
+				_oldBuckets.pop_front();
+			}
+			else {
+				Entry* const e = _popHead(q);
+				q->byteCredit -= (int)e->packet->payloadLength();
+				ready[n].packet.swap(e->packet);
+				ready[n].nwid = e->nwid;
+				ready[n].flowId = e->flowId;
+				ready[n].encrypt = e->encrypt;
+				++n;
+				_free(e);
+			}
+			break;
+		}
+	}
+
+	return n;
+}
+
+uint64_t QoSQueue::control_law(uint64_t t, int count)
+{
+	return (uint64_t)(t + ZT_AQM_INTERVAL / sqrt(count));
+}
+
+QoSQueue::dqr QoSQueue::dodequeue(_Bucket* q, const uint64_t now)
+{
+	dqr r;
+	r.ok_to_drop = false;
+	r.p = q->head;
+
+	if (r.p == NULL) {
+		q->first_above_time = 0;
+		return r;
+	}
+	uint64_t sojourn_time = now - r.p->creationTime;
+	if (sojourn_time < ZT_AQM_TARGET || q->byteLength <= ZT_DEFAULT_MTU) {
+		// went below - stay below for at least interval
+		q->first_above_time = 0;
+	}
+	else {
+		if (q->first_above_time == 0) {
+			// just went above from below. if still above at
+			// first_above_time, will say it's ok to drop.
+			q->first_above_time = now + ZT_AQM_INTERVAL;
+		}
+		else if (now >= q->first_above_time) {
+			r.ok_to_drop = true;
+		}
+	}
+	return r;
+}
+
+QoSQueue::Entry* QoSQueue::CoDelDequeue(_Bucket* q, const uint64_t now)
+{
+	dqr r = dodequeue(q, now);
+
+	if (q->dropping) {
+		if (! r.ok_to_drop) {
+			q->dropping = false;
+		}
+		while (now >= q->drop_next && q->dropping) {
+			_free(_popHead(q));	  // drop
+			r = dodequeue(q, now);
+			if (! r.ok_to_drop) {
+				// leave dropping state
+				q->dropping = false;
+			}
+			else {
+				++(q->count);
+				// schedule the next drop.
+				q->drop_next = control_law(q->drop_next, q->count);
+			}
+		}
+	}
+	else if (r.ok_to_drop) {
+		_free(_popHead(q));	  // drop
+		r = dodequeue(q, now);
+		q->dropping = true;
+		q->count = (q->count > 2 && now - q->drop_next < 8 * ZT_AQM_INTERVAL) ? q->count - 2 : 1;
+		q->drop_next = control_law(now, q->count);
+	}
+	return r.p;
+}
+
+}	// namespace ZeroTier
@@ -0,0 +1,216 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * (c) ZeroTier, Inc.
+ * https://www.zerotier.com/
+ */
+
+#ifndef ZT_QOSQUEUE_HPP
+#define ZT_QOSQUEUE_HPP
+
+#include "AtomicCounter.hpp"
+#include "Constants.hpp"
+#include "Mutex.hpp"
+#include "PacketBuffer.hpp"
+#include "SharedPtr.hpp"
+
+#include <stdint.h>
+
+namespace ZeroTier {
+
+/**
+ * Fair queueing scheduler with CoDel for one network's outgoing frames
+ *
+ * This is fq_codel: frames go into ZT_AQM_NUM_BUCKETS buckets chosen by
+ * the network's PRIORITY rules, or into ZT_AQM_NUM_DEFAULT_SUBQUEUES more
+ * chosen by flow if no rule classified them. Buckets with something to send
+ * take turns on the link in deficit round robin order. The default
+ * sub-queues split one quantum between those that are active, so together
+ * they get the share of a single bucket however many flows there are. CoDel
+ * drops from
+ * buckets whose frames have waited too long. When more than
+ * ZT_AQM_MAX_ENQUEUED_PACKETS frames are waiting the head of the longest
+ * bucket is dropped.
+ *
+ * Queue entries come from a fixed pool allocated with the scheduler and
+ * buckets are linked intrusively, so queueing allocates nothing. Each
+ * network has its own scheduler and lock.
+ */
+class QoSQueue {
+	friend class SharedPtr<QoSQueue>;
+
+  public:
+	/**
+	 * A queued frame
+	 */
+	struct Entry {
+		Entry() : creationTime(0), nwid(0), flowId(0), encrypt(false), next((Entry*)0)
+		{
+		}
+
+		SharedPtr<PacketBuffer> packet;	  // unencrypted/unMAC'd packet -- this is done at send time
+		uint64_t creationTime;
+		uint64_t nwid;
+		int32_t flowId;
+		bool encrypt;
+		Entry* next;   // next in bucket or free list
+	};
+
+	QoSQueue();
+
+	/**
+	 * Queue a frame
+	 *
+	 * @param packet Packet to send
+	 * @param encrypt Encrypt packet payload?
+	 * @param qosBucket Bucket the rule system selected for this packet, or ZT_AQM_UNCLASSIFIED
+	 * @param nwid Network ID
+	 * @param flowId Flow ID
+	 * @param now Current time
+	 * @return False if bucket is invalid and packet was dropped
+	 */
+	bool enqueue(const SharedPtr<PacketBuffer>& packet, const bool encrypt, const int qosBucket, const uint64_t nwid, const int32_t flowId, const uint64_t now);
+
+	/**
+	 * Perform one scheduling round
+	 *
+	 * This releases at most one frame from a NEW bucket and one from an OLD
+	 * bucket. Released frames are moved into ready[], whose packet handles
+	 * the caller must clear after sending.
+	 *
+	 * @param ready Array of at least two entries to fill
+	 * @param now Current time
+	 * @return Number of entries filled in ready[]
+	 */
+	unsigned int dequeue(Entry* ready, const uint64_t now);
+
+	/**
+	 * @return Number of frames waiting
+	 */
+	inline unsigned int size() const
+	{
+		Mutex::Lock _l(_lock);
+		return _count;
+	}
+
+	/**
+	 * Determines the next drop schedule for a bucket
+	 *
+	 * @param t Time of previous drop
+	 * @param count Number of packets dropped since the bucket entered the dropping state
+	 */
+	static uint64_t control_law(uint64_t t, int count);
+
+  private:
+	QoSQueue(const QoSQueue&)
+	{
+	}
+	const QoSQueue& operator=(const QoSQueue&)
+	{
+		return *this;
+	}
+
+	enum _List { _BUCKET_INACTIVE = 0, _BUCKET_NEW = 1, _BUCKET_OLD = 2 };
+
+	// Rule-selected buckets first, then the default sub-queues
+	enum { _NUM_BUCKETS = ZT_AQM_NUM_BUCKETS + ZT_AQM_NUM_DEFAULT_SUBQUEUES };
+
+	// One bucket of frames with its CoDel state
+	struct _Bucket {
+		_Bucket() : head((Entry*)0), tail((Entry*)0), next((_Bucket*)0), byteCredit(ZT_AQM_QUANTUM), byteLength(0), first_above_time(0), count(0), drop_next(0), dropping(false), list(_BUCKET_INACTIVE)
+		{
+		}
+		Entry* head;
+		Entry* tail;
+		_Bucket* next;	 // next in NEW or OLD list
+		int byteCredit;
+		int byteLength;
+		uint64_t first_above_time;
+		uint32_t count;
+		uint64_t drop_next;
+		bool dropping;
+		_List list;
+	};
+
+	// FIFO of buckets linked through _Bucket::next
+	struct _BucketList {
+		_BucketList() : head((_Bucket*)0), tail((_Bucket*)0)
+		{
+		}
+		inline void push_back(_Bucket* b)
+		{
+			b->next = (_Bucket*)0;
+			if (tail) {
+				tail->next = b;
+			}
+			else {
+				head = b;
+			}
+			tail = b;
+		}
+		inline _Bucket* pop_front()
+		{
+			_Bucket* const b = head;
+			head = b->next;
+			if (! head) {
+				tail = (_Bucket*)0;
+			}
+			return b;
+		}
+		_Bucket* head;
+		_Bucket* tail;
+	};
+
+	struct dqr {
+		Entry* p;
+		bool ok_to_drop;
+	};
+
+	dqr dodequeue(_Bucket* q, const uint64_t now);
+	Entry* CoDelDequeue(_Bucket* q, const uint64_t now);
+
+	// Unlink a bucket's head frame and take it out of the byte and frame counts
+	inline Entry* _popHead(_Bucket* q)
+	{
+		Entry* const e = q->head;
+		q->head = e->next;
+		if (! q->head) {
+			q->tail = (Entry*)0;
+		}
+		q->byteLength -= (int)e->packet->payloadLength();
+		--_count;
+		return e;
+	}
+
+	// Byte credit a bucket gets per round; the default sub-queues share one quantum
+	inline int _quantum(const _Bucket* q) const
+	{
+		if ((q < &(_buckets[ZT_AQM_NUM_BUCKETS])) || (_activeDefaultSubqueues <= 1)) {
+			return ZT_AQM_QUANTUM;
+		}
+		return ZT_AQM_QUANTUM / (int)_activeDefaultSubqueues;
+	}
+
+	inline void _free(Entry* e)
+	{
+		e->packet.zero();
+		e->next = _freeEntries;
+		_freeEntries = e;
+	}
+
+	Entry _entries[ZT_AQM_MAX_ENQUEUED_PACKETS + 1];
+	_Bucket _buckets[_NUM_BUCKETS];
+	_BucketList _newBuckets;
+	_BucketList _oldBuckets;
+	Entry* _freeEntries;
+	unsigned int _count;
+	unsigned int _activeDefaultSubqueues;	// default sub-queues not INACTIVE
+	Mutex _lock;
+
+	AtomicCounter __refCount;
+};
+
+}	// namespace ZeroTier
+
+#endif
@@ -114,6 +114,43 @@ class Salsa20 {
 		}
 	}
 
+	/**
+	 * Set d to s1 XOR s2
+	 *
+	 * This is memxor() for when the result must go to a different buffer.
+	 *
+	 * @param d Destination
+	 * @param s1 First source
+	 * @param s2 Second source
+	 * @param len Length of d, s1 and s2
+	 */
+	static inline void memxor(uint8_t* d, const uint8_t* s1, const uint8_t* s2, unsigned int len)
+	{
+#ifdef ZT_SALSA20_SSE
+		while (len >= 16) {
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(d), _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s1)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(s2))));
+			s1 += 16;
+			s2 += 16;
+			d += 16;
+			len -= 16;
+		}
+#else
+#ifndef ZT_NO_TYPE_PUNNING
+		while (len >= 8) {
+			(*reinterpret_cast<uint64_t*>(d)) = (*reinterpret_cast<const uint64_t*>(s1)) ^ (*reinterpret_cast<const uint64_t*>(s2));
+			s1 += 8;
+			s2 += 8;
+			d += 8;
+			len -= 8;
+		}
+#endif
+#endif
+		while (len) {
+			--len;
+			*(d++) = *(s1++) ^ *(s2++);
+		}
+	}
+
 	/**
 	 * @param key 256-bit (32 byte) key
 	 * @param iv 64-bit initialization vector
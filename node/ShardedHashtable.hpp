@@ -0,0 +1,578 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * (c) ZeroTier, Inc.
+ * https://www.zerotier.com/
+ */
+
+#ifndef ZT_SHARDEDHASHTABLE_HPP
+#define ZT_SHARDEDHASHTABLE_HPP
+
+#include "Constants.hpp"
+#include "Mutex.hpp"
+#include "SnapshotPtr.hpp"
+#include "Utils.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+/**
+ * Initial and minimum number of slots in each shard
+ */
+#define ZT_SHARDEDHASHTABLE_MIN_SLOTS 8
+
+namespace ZeroTier {
+
+/**
+ * Read-mostly hash table split into independently updated shards
+ *
+ * Each shard is an open addressing array of pointers to immutable entries.
+ * Lookups never lock or wait: they open a SnapshotReaders pass, probe the
+ * array and copy the value out. Writers lock only the shard they change and
+ * update it in place, storing, replacing or clearing one entry pointer. An
+ * entry that is replaced or removed is retired and freed once no reader that
+ * could have seen it is still running, so one update costs the same however
+ * large the table is. Only growing a shard, or clearing out erased slots, copies its
+ * pointer array, which is then published through a SnapshotPtr.
+ *
+ * This suits tables like peers and paths that are read for every packet and
+ * change far less often.
+ *
+ * Iteration visits each shard's slots in turn. It sees every entry that was
+ * present for its whole duration but is not a snapshot of the table.
+ *
+ * Keys must provide hashCode().
+ *
+ * @tparam K Key type
+ * @tparam V Value type
+ * @tparam S Number of shards (power of two)
+ */
+template <typename K, typename V, unsigned int S> class ShardedHashtable {
+  public:
+	ShardedHashtable()
+	{
+		for (unsigned int i = 0; i < S; ++i) {
+			_shards[i].slots.publish(new _Slots(ZT_SHARDEDHASHTABLE_MIN_SLOTS));
+			_shards[i].used = 0;
+			_shards[i].count.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	~ShardedHashtable()
+	{
+		for (unsigned int i = 0; i < S; ++i) {
+			const _Slots* const t = _shards[i].slots.current();
+			for (unsigned long j = 0; j < t->cap; ++j) {
+				_Entry* const e = t->s[j].e.load(std::memory_order_relaxed);
+				if ((e) && (e != _tombstone())) {
+					delete e;
+				}
+			}
+		}
+	}
+
+	/**
+	 * @param k Key
+	 * @param v Set to value if found
+	 * @return True if found
+	 */
+	inline bool get(const K& k, V& v) const
+	{
+		const uint64_t h = _hash(k);
+		const typename SnapshotPtr<_Slots>::Reader t(_shard(k).slots);
+		const _Entry* const e = t->get(k, h);
+		if (e) {
+			v = e->v;
+			return true;
+		}
+		return false;
+	}
+
+	/**
+	 * Look up a value without copying it
+	 *
+	 * The calling thread must be inside a SnapshotReaders::Pass. The value
+	 * stays valid until that Pass ends, even if it is erased meanwhile, and
+	 * values removed from the table are only released once no Pass that saw
+	 * them is still open.
+	 *
+	 * @param k Key
+	 * @return Pointer to value or NULL if not found
+	 */
+	inline const V* borrow(const K& k) const
+	{
+		const _Entry* const e = _shard(k).slots.borrow()->get(k, _hash(k));
+		return (e) ? &(e->v) : (const V*)0;
+	}
+
+	/**
+	 * @param k Key
+	 * @return True if present
+	 */
+	inline bool contains(const K& k) const
+	{
+		const uint64_t h = _hash(k);
+		const typename SnapshotPtr<_Slots>::Reader t(_shard(k).slots);
+		return (t->get(k, h) != (const _Entry*)0);
+	}
+
+	/**
+	 * Insert a value unless the key is already present
+	 *
+	 * @param k Key
+	 * @param v Value to insert
+	 * @return Value now stored under k (existing or v)
+	 */
+	inline V setIfAbsent(const K& k, const V& v)
+	{
+		const uint64_t h = _hash(k);
+		_Shard& s = _shard(k);
+		Mutex::Lock _l(s.lock);
+		const _Entry* const e = s.slots.current()->get(k, h);
+		if (e) {
+			return e->v;
+		}
+		_insert(s, new _Entry(k, v, h));
+		return v;
+	}
+
+	/**
+	 * Insert or replace a value
+	 *
+	 * Readers see either the old or the new value. A replaced value is
+	 * released once no reader can still hold it.
+	 *
+	 * @param k Key
+	 * @param v Value
+	 */
+	inline void set(const K& k, const V& v)
+	{
+		const uint64_t h = _hash(k);
+		_Shard& s = _shard(k);
+		Mutex::Lock _l(s.lock);
+		const _Slots* const t = s.slots.current();
+		_Entry* e = (_Entry*)0;
+		const unsigned long i = t->find(k, h, e);
+		if (i < t->cap) {
+			t->set(i, new _Entry(k, v, h));
+			s.retired.reclaim();
+			s.retired.retire(e);
+		}
+		else {
+			_insert(s, new _Entry(k, v, h));
+		}
+	}
+
+	/**
+	 * @param k Key to remove
+	 */
+	inline void erase(const K& k)
+	{
+		const uint64_t h = _hash(k);
+		_Shard& s = _shard(k);
+		Mutex::Lock _l(s.lock);
+		if (_erase(s, k, h)) {
+			s.retired.reclaim();
+		}
+	}
+
+	/**
+	 * Remove one entry if a predicate is true
+	 *
+	 * The predicate is called with the entry's shard locked against other
+	 * writers. It must not modify this table.
+	 *
+	 * @param k Key to remove
+	 * @param f Function called as f(const K&, const V&) returning true to erase
+	 * @return True if the entry was erased
+	 * @tparam F Function or function object type
+	 */
+	template <typename F> inline bool eraseIf(const K& k, F f)
+	{
+		const uint64_t h = _hash(k);
+		_Shard& s = _shard(k);
+		Mutex::Lock _l(s.lock);
+		const _Slots* const t = s.slots.current();
+		_Entry* e = (_Entry*)0;
+		const unsigned long i = t->find(k, h, e);
+		if ((i < t->cap) && (f(e->k, e->v))) {
+			_unlink(s, i, e);
+			s.retired.reclaim();
+			return true;
+		}
+		return false;
+	}
+
+	/**
+	 * Remove one entry if a predicate holds both before and after it is unlinked
+	 *
+	 * This is for readers that borrow an entry, mark it in use somewhere the
+	 * predicate looks (with a sequentially consistent fence after), and then
+	 * look the key up again. The entry is unlinked, the predicate is checked
+	 * again and the entry is put back if it no longer holds, all with the
+	 * shard locked so no other writer can insert the key meanwhile. Such a
+	 * reader thus either sees the entry gone on its second lookup or keeps it
+	 * in the table.
+	 *
+	 * @param k Key to remove
+	 * @param f Function called as f(const K&, const V&) returning true to erase
+	 * @return True if the entry was erased
+	 * @tparam F Function or function object type
+	 */
+	template <typename F> inline bool eraseIfStill(const K& k, F f)
+	{
+		const uint64_t h = _hash(k);
+		_Shard& s = _shard(k);
+		Mutex::Lock _l(s.lock);
+		const _Slots* const t = s.slots.current();
+		_Entry* e = (_Entry*)0;
+		const unsigned long i = t->find(k, h, e);
+		if ((i < t->cap) && (f(e->k, e->v))) {
+			t->s[i].e.store(_tombstone(), std::memory_order_seq_cst);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (! f(e->k, e->v)) {
+				t->set(i, e);
+				return false;
+			}
+			s.count.fetch_sub(1, std::memory_order_relaxed);
+			s.retired.retire(e);
+			s.retired.reclaim();
+			return true;
+		}
+		return false;
+	}
+
+	/**
+	 * Remove several keys, locking each affected shard only once
+	 *
+	 * @param keys Keys to remove
+	 * @return Number of entries erased
+	 */
+	inline unsigned long eraseAll(const std::vector<K>& keys)
+	{
+		std::vector<std::pair<unsigned int, K> > byShard;
+		byShard.reserve(keys.size());
+		for (typename std::vector<K>::const_iterator k(keys.begin()); k != keys.end(); ++k) {
+			byShard.push_back(std::pair<unsigned int, K>(_shardIndex(*k), *k));
+		}
+		std::sort(byShard.begin(), byShard.end(), _ByShard());
+		unsigned long n = 0;
+		for (typename std::vector<std::pair<unsigned int, K> >::const_iterator i(byShard.begin()); i != byShard.end();) {
+			_Shard& s = _shards[i->first];
+			Mutex::Lock _l(s.lock);
+			const unsigned int si = i->first;
+			for (; (i != byShard.end()) && (i->first == si); ++i) {
+				if (_erase(s, i->second, _hash(i->second))) {
+					++n;
+				}
+			}
+			s.retired.reclaim();
+		}
+		return n;
+	}
+
+	/**
+	 * Remove all entries for which a predicate is true
+	 *
+	 * The predicate is called exactly once per entry, with that entry's
+	 * shard locked against other writers, so it may have side effects such
+	 * as saving the entry. It must not modify this table.
+	 *
+	 * @param f Function called as f(const K&, const V&) returning true to erase
+	 * @return Number of entries erased
+	 * @tparam F Function or function object type
+	 */
+	template <typename F> inline unsigned long eraseIf(F f)
+	{
+		unsigned long n = 0;
+		for (unsigned int i = 0; i < S; ++i) {
+			_Shard& s = _shards[i];
+			Mutex::Lock _l(s.lock);
+			const _Slots* const t = s.slots.current();
+			for (unsigned long j = 0; j < t->cap; ++j) {
+				_Entry* const e = t->s[j].e.load(std::memory_order_relaxed);
+				if ((e) && (e != _tombstone()) && (f(e->k, e->v))) {
+					_unlink(s, j, e);
+					++n;
+				}
+			}
+			s.slots.reclaim();
+			s.retired.reclaim();
+		}
+		return n;
+	}
+
+	/**
+	 * Apply a function to every entry, one shard at a time
+	 *
+	 * @param f Function called as f(const K&, const V&)
+	 * @tparam F Function or function object type
+	 */
+	template <typename F> inline void each(F f) const
+	{
+		for (unsigned int i = 0; i < S; ++i) {
+			const typename SnapshotPtr<_Slots>::Reader t(_shards[i].slots);
+			for (unsigned long j = 0; j < t->cap; ++j) {
+				const _Entry* const e = t->s[j].e.load(std::memory_order_seq_cst);
+				if ((e) && (e != _tombstone())) {
+					f(e->k, e->v);
+				}
+			}
+		}
+	}
+
+	/**
+	 * @return All entries as (key,value) pairs
+	 */
+	inline std::vector<std::pair<K, V> > entries() const
+	{
+		std::vector<std::pair<K, V> > e;
+		e.reserve(size());
+		for (unsigned int i = 0; i < S; ++i) {
+			const typename SnapshotPtr<_Slots>::Reader t(_shards[i].slots);
+			for (unsigned long j = 0; j < t->cap; ++j) {
+				const _Entry* const se = t->s[j].e.load(std::memory_order_seq_cst);
+				if ((se) && (se != _tombstone())) {
+					e.push_back(std::pair<K, V>(se->k, se->v));
+				}
+			}
+		}
+		return e;
+	}
+
+	/**
+	 * @return Number of entries
+	 */
+	inline unsigned long size() const
+	{
+		unsigned long n = 0;
+		for (unsigned int i = 0; i < S; ++i) {
+			n += _shards[i].count.load(std::memory_order_relaxed);
+		}
+		return n;
+	}
+
+	/**
+	 * Free removed entries and replaced slot arrays that no reader can still be using
+	 */
+	inline void reclaim()
+	{
+		for (unsigned int i = 0; i < S; ++i) {
+			Mutex::Lock _l(_shards[i].lock);
+			_shards[i].slots.reclaim();
+			_shards[i].retired.reclaim();
+		}
+	}
+
+  private:
+	ShardedHashtable(const ShardedHashtable&)
+	{
+	}
+	const ShardedHashtable& operator=(const ShardedHashtable&)
+	{
+		return *this;
+	}
+
+	// Never changed once published; replacing a value means a new entry
+	struct _Entry {
+		_Entry(const K& k_, const V& v_, const uint64_t h_) : k(k_), v(v_), h(h_)
+		{
+		}
+		const K k;
+		const V v;
+		const uint64_t h;
+	};
+
+	// Marks an erased slot so probes continue past it
+	static inline _Entry* _tombstone()
+	{
+		static char t;
+		return reinterpret_cast<_Entry*>(&t);
+	}
+
+	// Power of two array of entry pointers, probed linearly, with each
+	// entry's hash kept beside it so probes only dereference likely matches.
+	// Slots go from NULL to an entry and from an entry to a tombstone or
+	// another entry, but never back to NULL, so a probe that reaches NULL has
+	// seen every slot the key could be in. The array does not own its entries.
+	struct _Slot {
+		std::atomic<_Entry*> e;
+		std::atomic<uint64_t> h;   // stored before e, so at least as new as it
+	};
+	struct _Slots {
+		explicit _Slots(const unsigned long c) : cap(c), s(new _Slot[c])
+		{
+			for (unsigned long i = 0; i < c; ++i) {
+				s[i].e.store((_Entry*)0, std::memory_order_relaxed);
+				s[i].h.store(0, std::memory_order_relaxed);
+			}
+		}
+		~_Slots()
+		{
+			delete[] s;
+		}
+
+		inline const _Entry* get(const K& k, const uint64_t h) const
+		{
+			_Entry* e = (_Entry*)0;
+			find(k, h, e);
+			return e;
+		}
+
+		// Returns the slot index and sets e to its entry, or returns cap
+		inline unsigned long find(const K& k, const uint64_t h, _Entry*& e) const
+		{
+			for (unsigned long i = (unsigned long)h & (cap - 1), n = 0; n < cap; ++n, i = (i + 1) & (cap - 1)) {
+				_Entry* const se = s[i].e.load(std::memory_order_seq_cst);
+				if (! se) {
+					break;
+				}
+				if ((se != _tombstone()) && (s[i].h.load(std::memory_order_relaxed) == h) && (se->k == k)) {
+					e = se;
+					return i;
+				}
+			}
+			return cap;
+		}
+
+		// Caller must hold the shard lock, or own an unpublished array
+		inline void set(const unsigned long i, _Entry* const e) const
+		{
+			s[i].h.store(e->h, std::memory_order_relaxed);
+			s[i].e.store(e, std::memory_order_seq_cst);
+		}
+
+		const unsigned long cap;
+		_Slot* const s;
+
+	  private:
+		_Slots(const _Slots&) : cap(0), s((_Slot*)0)
+		{
+		}
+		const _Slots& operator=(const _Slots&)
+		{
+			return *this;
+		}
+	};
+
+	struct _Shard {
+		SnapshotPtr<_Slots> slots;
+		SnapshotRetired<_Entry> retired;   // erased entries not yet freed
+		unsigned long used;				   // slots holding an entry or a tombstone
+		std::atomic<unsigned long> count;   // entries
+		Mutex lock;						   // serializes writers to this shard
+	};
+
+	struct _ByShard {
+		inline bool operator()(const std::pair<unsigned int, K>& a, const std::pair<unsigned int, K>& b) const
+		{
+			return (a.first < b.first);
+		}
+	};
+
+	// Caller must hold s.lock and have checked that the key is absent
+	static inline void _insert(_Shard& s, _Entry* const e)
+	{
+		const _Slots* t = s.slots.current();
+		if (((s.used + 1) * 4) > (t->cap * 3)) {
+			// Grow or just clear out tombstones, keeping the load at most half
+			const unsigned long n = s.count.load(std::memory_order_relaxed) + 1;
+			unsigned long c = ZT_SHARDEDHASHTABLE_MIN_SLOTS;
+			while (c < (n * 2)) {
+				c <<= 1;
+			}
+			_Slots* const nt = new _Slots(c);
+			for (unsigned long i = 0; i < t->cap; ++i) {
+				_Entry* const oe = t->s[i].e.load(std::memory_order_relaxed);
+				if ((oe) && (oe != _tombstone())) {
+					unsigned long j = (unsigned long)oe->h & (c - 1);
+					while (nt->s[j].e.load(std::memory_order_relaxed)) {
+						j = (j + 1) & (c - 1);
+					}
+					nt->set(j, oe);
+				}
+			}
+			s.slots.publish(nt);
+			s.used = n - 1;
+			t = nt;
+		}
+		for (unsigned long i = (unsigned long)e->h & (t->cap - 1);; i = (i + 1) & (t->cap - 1)) {
+			const _Entry* const oe = t->s[i].e.load(std::memory_order_relaxed);
+			if ((! oe) || (oe == _tombstone())) {
+				if (! oe) {
+					++s.used;
+				}
+				t->set(i, e);
+				break;
+			}
+		}
+		s.count.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Caller must hold s.lock
+	static inline bool _erase(_Shard& s, const K& k, const uint64_t h)
+	{
+		const _Slots* const t = s.slots.current();
+		_Entry* e = (_Entry*)0;
+		const unsigned long i = t->find(k, h, e);
+		if (i < t->cap) {
+			_unlink(s, i, e);
+			return true;
+		}
+		return false;
+	}
+
+	// Caller must hold s.lock; e is the entry in slot i of the current array
+	static inline void _unlink(_Shard& s, const unsigned long i, _Entry* const e)
+	{
+		s.slots.current()->s[i].e.store(_tombstone(), std::memory_order_seq_cst);
+		s.count.fetch_sub(1, std::memory_order_relaxed);
+		s.retired.retire(e);
+	}
+
+	// Keyed variant of the MurmurHash3 64-bit finalizer, as in FlatHashtable,
+	// so that slot placement can't be predicted from addresses
+	static inline uint64_t _hash(const K& k)
+	{
+		static const struct _Secret {
+			_Secret()
+			{
+				Utils::getSecureRandom(s, sizeof(s));
+			}
+			uint64_t s[2];
+		} secret;
+		uint64_t h = (uint64_t)k.hashCode() ^ secret.s[0];
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= secret.s[1];
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 33;
+		return h;
+	}
+
+	// Shards use the high bits of a scrambled hashCode(), independent of the
+	// keyed hash used for slot placement.
+	static inline unsigned int _shardIndex(const K& k)
+	{
+		return (unsigned int)(((uint64_t)k.hashCode() * 0x9e3779b97f4a7c15ULL) >> 40) % S;
+	}
+	inline _Shard& _shard(const K& k)
+	{
+		return _shards[_shardIndex(k)];
+	}
+	inline const _Shard& _shard(const K& k) const
+	{
+		return _shards[_shardIndex(k)];
+	}
+
+	_Shard _shards[S];
+};
+
+}	// namespace ZeroTier
+
+#endif
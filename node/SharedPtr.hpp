@@ -121,7 +121,7 @@ template <typename T> class SharedPtr {
 	/**
 	 * @return Number of references according to this object's ref count or 0 if NULL
 	 */
-	inline int references()
+	inline int references() const
 	{
 		if (_ptr) {
 			return _ptr->__refCount.load();
@@ -0,0 +1,345 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * (c) ZeroTier, Inc.
+ * https://www.zerotier.com/
+ */
+
+#ifndef ZT_SNAPSHOTPTR_HPP
+#define ZT_SNAPSHOTPTR_HPP
+
+#include "Constants.hpp"
+
+#include <atomic>
+#include <bitset>
+#include <vector>
+
+/**
+ * Number of reader slots shared by all SnapshotPtr instances
+ *
+ * Each thread that reads a snapshot is given its own slot until these run
+ * out, after which threads share slots. Sharing is correct but can delay
+ * reclamation of old snapshots.
+ */
+#define ZT_SNAPSHOT_READER_SLOTS 128
+
+namespace ZeroTier {
+
+/**
+ * Per-thread counters of in-progress snapshot reads
+ */
+class SnapshotReaders {
+  private:
+	struct _Thread {
+		std::atomic<unsigned int>* slot;
+		unsigned int depth;	  // open Passes and Readers on this thread
+	};
+
+  public:
+	/**
+	 * Read-side critical section covering a whole processing pass
+	 *
+	 * While a Pass is open on a thread, no object published through any
+	 * SnapshotPtr and current at any moment during the pass is freed, so the
+	 * thread may keep plain pointers or references into snapshots until the
+	 * Pass ends. Passes and Readers nest; only the outermost one touches the
+	 * shared reader slot, so Readers opened inside a Pass cost nothing.
+	 */
+	class Pass {
+	  public:
+		Pass() : _t(_thread())
+		{
+			if (_t.depth++ == 0) {
+				_t.slot->fetch_add(1, std::memory_order_seq_cst);
+			}
+		}
+
+		~Pass()
+		{
+			if (--_t.depth == 0) {
+				_t.slot->fetch_sub(1, std::memory_order_release);
+			}
+		}
+
+	  private:
+		Pass(const Pass&) : _t(_thread())
+		{
+		}
+		const Pass& operator=(const Pass&)
+		{
+			return *this;
+		}
+
+		_Thread& _t;
+	};
+
+	/**
+	 * @return True if the calling thread has a Pass or Reader open
+	 */
+	static inline bool inPass()
+	{
+		return (_thread().depth != 0);
+	}
+
+	/**
+	 * @param i Slot index
+	 * @return Number of reads currently in progress in this slot
+	 */
+	static inline unsigned int inProgress(const unsigned int i)
+	{
+		return _slots()[i].n.load(std::memory_order_seq_cst);
+	}
+
+  private:
+	struct alignas(64) _Slot {
+		std::atomic<unsigned int> n;
+	};
+
+	static inline _Thread& _thread()
+	{
+		static thread_local _Thread t = { &(_slots()[_nextSlot().fetch_add(1, std::memory_order_relaxed) % ZT_SNAPSHOT_READER_SLOTS].n), 0 };
+		return t;
+	}
+
+	static inline _Slot* _slots()
+	{
+		static _Slot s[ZT_SNAPSHOT_READER_SLOTS];
+		return s;
+	}
+
+	static inline std::atomic<unsigned int>& _nextSlot()
+	{
+		static std::atomic<unsigned int> n(0);
+		return n;
+	}
+};
+
+/**
+ * Objects unlinked from a lock-free structure, freed once no reader can hold them
+ *
+ * retire() notes which reader slots have a read in progress at that moment.
+ * The object is freed by a later reclaim() once each of those has been seen
+ * idle, or at once if none were busy. The object must already be unreachable
+ * for new readers, via a sequentially consistent store, when it is retired.
+ *
+ * Calls to retire() and reclaim() must be serialized externally.
+ */
+template <typename T> class SnapshotRetired {
+  public:
+	SnapshotRetired()
+	{
+	}
+
+	~SnapshotRetired()
+	{
+		for (typename std::vector<_Retired>::iterator r(_retired.begin()); r != _retired.end(); ++r) {
+			delete r->p;
+		}
+	}
+
+	/**
+	 * @param p Object to free once no reader can still be using it (this takes ownership)
+	 */
+	inline void retire(T* p)
+	{
+		std::bitset<ZT_SNAPSHOT_READER_SLOTS> pending;
+		for (unsigned int i = 0; i < ZT_SNAPSHOT_READER_SLOTS; ++i) {
+			if (SnapshotReaders::inProgress(i) != 0) {
+				pending.set(i);
+			}
+		}
+		if (pending.none()) {
+			delete p;
+		}
+		else {
+			_retired.push_back(_Retired());
+			_retired.back().p = p;
+			_retired.back().pending = pending;
+		}
+	}
+
+	/**
+	 * Free retired objects that no reader can still be using
+	 */
+	inline void reclaim()
+	{
+		for (typename std::vector<_Retired>::iterator r(_retired.begin()); r != _retired.end();) {
+			for (unsigned int i = 0; (i < ZT_SNAPSHOT_READER_SLOTS) && (r->pending.any()); ++i) {
+				if ((r->pending.test(i)) && (SnapshotReaders::inProgress(i) == 0)) {
+					r->pending.reset(i);
+				}
+			}
+			if (r->pending.none()) {
+				delete r->p;
+				r = _retired.erase(r);
+			}
+			else {
+				++r;
+			}
+		}
+	}
+
+	/**
+	 * @return Number of retired objects not yet freed
+	 */
+	inline unsigned long size() const
+	{
+		return (unsigned long)_retired.size();
+	}
+
+  private:
+	SnapshotRetired(const SnapshotRetired&)
+	{
+	}
+	const SnapshotRetired& operator=(const SnapshotRetired&)
+	{
+		return *this;
+	}
+
+	struct _Retired {
+		T* p;
+		std::bitset<ZT_SNAPSHOT_READER_SLOTS> pending;
+	};
+
+	std::vector<_Retired> _retired;
+};
+
+/**
+ * Pointer to an immutable object that readers access without locking
+ *
+ * This is a simple read-copy-update scheme. Writers build a new object and
+ * publish() it, which swaps it in atomically. Readers open a Reader, which
+ * pins whatever object was current at that moment until the Reader goes out
+ * of scope. A replaced object is freed only once every reader slot has been
+ * seen idle after the swap, so publishing never waits for readers.
+ *
+ * Writers must be serialized externally. Readers must not block on anything
+ * a writer may hold while a Reader is open.
+ */
+template <typename T> class SnapshotPtr {
+  public:
+	/**
+	 * Read-side critical section pinning the current object
+	 */
+	class Reader {
+	  public:
+		explicit Reader(const SnapshotPtr& sp) : _pass()
+		{
+			_p = sp._p.load(std::memory_order_seq_cst);
+		}
+
+		inline const T* ptr() const
+		{
+			return _p;
+		}
+		inline const T* operator->() const
+		{
+			return _p;
+		}
+		inline const T& operator*() const
+		{
+			return *_p;
+		}
+		inline operator bool() const
+		{
+			return (_p != (const T*)0);
+		}
+
+	  private:
+		Reader(const Reader&) : _pass()
+		{
+		}
+		const Reader& operator=(const Reader&)
+		{
+			return *this;
+		}
+
+		SnapshotReaders::Pass _pass;
+		const T* _p;
+	};
+
+	SnapshotPtr() : _p((T*)0)
+	{
+	}
+
+	~SnapshotPtr()
+	{
+		delete _p.load();
+	}
+
+	/**
+	 * Replace the current object
+	 *
+	 * The old object is retired and freed by a later publish() or reclaim()
+	 * once no reader can still hold it.
+	 *
+	 * @param n New object (this takes ownership)
+	 */
+	inline void publish(T* n)
+	{
+		T* const old = _p.exchange(n, std::memory_order_seq_cst);
+		_retired.reclaim();
+		if (old) {
+			_retired.retire(old);
+		}
+	}
+
+	/**
+	 * Free retired objects that no reader can still be using
+	 *
+	 * This must be serialized with publish().
+	 */
+	inline void reclaim()
+	{
+		_retired.reclaim();
+	}
+
+	/**
+	 * Current object for a thread inside a SnapshotReaders::Pass
+	 *
+	 * The object stays valid until the calling thread's outermost Pass ends.
+	 *
+	 * @return Current object or NULL if none
+	 */
+	inline const T* borrow() const
+	{
+		return _p.load(std::memory_order_seq_cst);
+	}
+
+	/**
+	 * Writer-side access to the current object
+	 *
+	 * This must be serialized with publish().
+	 *
+	 * @return Current object or NULL if none
+	 */
+	inline const T* current() const
+	{
+		return _p.load(std::memory_order_acquire);
+	}
+
+	/**
+	 * @return Number of replaced objects not yet freed
+	 */
+	inline unsigned long retired() const
+	{
+		return _retired.size();
+	}
+
+  private:
+	SnapshotPtr(const SnapshotPtr&)
+	{
+	}
+	const SnapshotPtr& operator=(const SnapshotPtr&)
+	{
+		return *this;
+	}
+
+	std::atomic<T*> _p;
+	SnapshotRetired<T> _retired;
+};
+
+}	// namespace ZeroTier
+
+#endif
@@ -10,15 +10,18 @@
 
 #include "../include/ZeroTierOne.h"
 #include "Constants.hpp"
+#include "FlowHash.hpp"
 #include "InetAddress.hpp"
 #include "Metrics.hpp"
 #include "Node.hpp"
 #include "Packet.hpp"
+#include "PacketMultiplexer.hpp"
 #include "Peer.hpp"
 #include "RuntimeEnvironment.hpp"
 #include "SelfAwareness.hpp"
 #include "Topology.hpp"
 #include "Trace.hpp"
+#include "WireBatch.hpp"
 
 #include <algorithm>
 #include <stdio.h>
@@ -26,39 +29,17 @@
 
 namespace ZeroTier {
 
-Switch::Switch(const RuntimeEnvironment* renv) : RR(renv), _lastBeaconResponse(0), _lastCheckedQueues(0), _lastUniteAttempt(8)
+Switch::Switch(const RuntimeEnvironment* renv)
+	: RR(renv)
+	, _lastBeaconResponse(0)
+	, _lastCheckedQueues(0)
+	, _lastSentWhoisRequestExpiry(ZT_CORE_TIMER_TASK_GRANULARITY)
+	, _lastWhoisFlush(0)
+	, _whoisFlushDeadline(0)
+	, _lastUniteAttempt(8)
+	, _lastUniteAttemptExpiry(ZT_CORE_TIMER_TASK_GRANULARITY)
 {
-}
-
-// Returns true if packet appears valid; pos and proto will be set
-static bool _ipv6GetPayload(const uint8_t* frameData, unsigned int frameLen, unsigned int& pos, unsigned int& proto)
-{
-	if (frameLen < 40) {
-		return false;
-	}
-	pos = 40;
-	proto = frameData[6];
-	while (pos <= frameLen) {
-		switch (proto) {
-			case 0:		// hop-by-hop options
-			case 43:	// routing
-			case 60:	// destination options
-			case 135:	// mobility options
-				if ((pos + 8) > frameLen) {
-					return false;	// invalid!
-				}
-				proto = frameData[pos];
-				pos += ((unsigned int)frameData[pos + 1] * 8) + 8;
-				break;
-
-			// case 44: // fragment -- we currently can't parse these and they are deprecated in IPv6 anyway
-			// case 50:
-			// case 51: // IPSec ESP and AH -- we have to stop here since this is encrypted stuff
-			default:
-				return true;
-		}
-	}
-	return false;	// overflow == invalid
+	_qosQueues.publish(new _QoSQueueTable());
 }
 
 void Switch::onRemotePacket(void* tPtr, const int64_t localSocket, const InetAddress& fromAddr, const void* data, unsigned int len)
@@ -67,15 +48,15 @@ void Switch::onRemotePacket(void* tPtr, const int64_t localSocket, const InetAdd
 	try {
 		const int64_t now = RR->node->now();
 
-		const SharedPtr<Path> path(RR->topology->getPath(localSocket, fromAddr));
-		path->received(now);
+		const SnapshotReaders::Pass pass;
+		SharedPtr<Path> createdPath;
+		const SharedPtr<Path>& path = RR->topology->borrowPath(localSocket, fromAddr, now, createdPath);
 
 		if (len > ZT_PROTO_MIN_FRAGMENT_LENGTH) {
 			if (reinterpret_cast<const uint8_t*>(data)[ZT_PACKET_FRAGMENT_IDX_FRAGMENT_INDICATOR] == ZT_PACKET_FRAGMENT_INDICATOR) {
 				// Handle fragment ----------------------------------------------------
 
-				Packet::Fragment fragment(data, len);
-				const Address destination(fragment.destination());
+				const Address destination(reinterpret_cast<const uint8_t*>(data) + ZT_PACKET_FRAGMENT_IDX_DEST, ZT_ADDRESS_LENGTH);
 
 				if (destination != RR->identity.address()) {
 					// RELAY: fragment is for a different node, so maybe send it there if we should relay.
@@ -83,24 +64,14 @@ void Switch::onRemotePacket(void* tPtr, const int64_t localSocket, const InetAdd
 						return;
 					}
 
-					if (fragment.hops() < ZT_RELAY_MAX_HOPS) {
-						fragment.incrementHops();
-
-						// Note: we don't bother initiating NAT-t for fragments, since heads will set that off.
-						// It wouldn't hurt anything, just redundant and unnecessary.
-						SharedPtr<Peer> relayTo = RR->topology->getPeer(tPtr, destination);
-						if ((! relayTo) || (! relayTo->sendDirect(tPtr, fragment.data(), fragment.size(), now, false))) {
-							// Don't know peer or no direct path -- so relay via someone upstream
-							relayTo = RR->topology->getUpstreamPeer(0);
-							if (relayTo) {
-								relayTo->sendDirect(tPtr, fragment.data(), fragment.size(), now, true);
-							}
-						}
+					if (reinterpret_cast<const uint8_t*>(data)[ZT_PACKET_FRAGMENT_IDX_HOPS] < ZT_RELAY_MAX_HOPS) {
+						_relay(tPtr, data, len, now);
 					}
 				}
 				else {
 					// RECEIVE: fragment appears to be ours (this is validated in cryptographic auth after assembly)
 
+					Packet::Fragment fragment(data, len);
 					const uint64_t fragmentPacketId = fragment.packetId();
 					const unsigned int fragmentNumber = fragment.fragmentNumber();
 					const unsigned int totalFragments = fragment.totalFragments();
@@ -167,30 +138,8 @@ void Switch::onRemotePacket(void* tPtr, const int64_t localSocket, const InetAdd
 						return;
 					}
 
-					Packet packet(data, len);
-
-					if (packet.hops() < ZT_RELAY_MAX_HOPS) {
-						packet.incrementHops();
-						SharedPtr<Peer> relayTo = RR->topology->getPeer(tPtr, destination);
-						if ((relayTo) && (relayTo->sendDirect(tPtr, packet.data(), packet.size(), now, false))) {
-							if ((source != RR->identity.address()) && (_shouldUnite(now, source, destination))) {
-								const SharedPtr<Peer> sourcePeer(RR->topology->getPeer(tPtr, source));
-								if (sourcePeer) {
-									relayTo->introduce(tPtr, now, sourcePeer);
-								}
-							}
-						}
-						else {
-							relayTo = RR->topology->getUpstreamPeer(0);
-							if ((relayTo) && (relayTo->address() != source)) {
-								if (relayTo->sendDirect(tPtr, packet.data(), packet.size(), now, true)) {
-									const SharedPtr<Peer> sourcePeer(RR->topology->getPeer(tPtr, source));
-									if (sourcePeer) {
-										relayTo->introduce(tPtr, now, sourcePeer);
-									}
-								}
-							}
-						}
+					if ((reinterpret_cast<const uint8_t*>(data)[ZT_PACKET_IDX_FLAGS] & 0x07) < ZT_RELAY_MAX_HOPS) {
+						_relay(tPtr, data, len, now);
 					}
 				}
 				else if ((reinterpret_cast<const uint8_t*>(data)[ZT_PACKET_IDX_FLAGS] & ZT_PROTO_FLAG_FRAGMENTED) != 0) {
@@ -278,75 +227,18 @@ void Switch::onLocalEthernet(void* tPtr, const SharedPtr<Network>& network, cons
 		}
 	}
 
-	uint8_t qosBucket = ZT_AQM_DEFAULT_BUCKET;
+	uint8_t qosBucket = ZT_AQM_UNCLASSIFIED;
 
 	/**
 	 * A pseudo-unique identifier used by balancing and bonding policies to
 	 * categorize individual flows/conversations for assignment to a specific
-	 * physical path. This identifier consists of the source port and
-	 * destination port of the encapsulated frame.
+	 * physical path. This identifier is a keyed hash of the 5-tuple (and VLAN)
+	 * of the encapsulated frame, see FlowHash.
 	 *
 	 * A flowId of -1 will indicate that there is no preference for how this
-	 * packet shall be sent. An example of this would be an ICMP packet.
+	 * packet shall be sent. An example of this would be an ARP packet.
 	 */
-
-	int32_t flowId = ZT_QOS_NO_FLOW;
-
-	if (etherType == ZT_ETHERTYPE_IPV4 && (len >= 20)) {
-		uint16_t srcPort = 0;
-		uint16_t dstPort = 0;
-		uint8_t proto = (reinterpret_cast<const uint8_t*>(data)[9]);
-		const unsigned int headerLen = 4 * (reinterpret_cast<const uint8_t*>(data)[0] & 0xf);
-		switch (proto) {
-			case 0x01:	 // ICMP
-				// flowId = 0x01;
-				break;
-			// All these start with 16-bit source and destination port in that order
-			case 0x06:	 // TCP
-			case 0x11:	 // UDP
-			case 0x84:	 // SCTP
-			case 0x88:	 // UDPLite
-				if (len > (headerLen + 4)) {
-					unsigned int pos = headerLen + 0;
-					srcPort = (reinterpret_cast<const uint8_t*>(data)[pos++]) << 8;
-					srcPort |= (reinterpret_cast<const uint8_t*>(data)[pos]);
-					pos++;
-					dstPort = (reinterpret_cast<const uint8_t*>(data)[pos++]) << 8;
-					dstPort |= (reinterpret_cast<const uint8_t*>(data)[pos]);
-					flowId = dstPort ^ srcPort ^ proto;
-				}
-				break;
-		}
-	}
-
-	if (etherType == ZT_ETHERTYPE_IPV6 && (len >= 40)) {
-		uint16_t srcPort = 0;
-		uint16_t dstPort = 0;
-		unsigned int pos;
-		unsigned int proto;
-		_ipv6GetPayload((const uint8_t*)data, len, pos, proto);
-		switch (proto) {
-			case 0x3A:	 // ICMPv6
-				// flowId = 0x3A;
-				break;
-			// All these start with 16-bit source and destination port in that order
-			case 0x06:	 // TCP
-			case 0x11:	 // UDP
-			case 0x84:	 // SCTP
-			case 0x88:	 // UDPLite
-				if (len > (pos + 4)) {
-					srcPort = (reinterpret_cast<const uint8_t*>(data)[pos++]) << 8;
-					srcPort |= (reinterpret_cast<const uint8_t*>(data)[pos]);
-					pos++;
-					dstPort = (reinterpret_cast<const uint8_t*>(data)[pos++]) << 8;
-					dstPort |= (reinterpret_cast<const uint8_t*>(data)[pos]);
-					flowId = dstPort ^ srcPort ^ proto;
-				}
-				break;
-			default:
-				break;
-		}
-	}
+	const int32_t flowId = FlowHash::compute(etherType, reinterpret_cast<const uint8_t*>(data), len);
 
 	if (to.isMulticast()) {
 		MulticastGroup multicastGroup(to, 0);
@@ -627,313 +519,176 @@ void Switch::onLocalEthernet(void* tPtr, const SharedPtr<Network>& network, cons
 	}
 }
 
-void Switch::aqm_enqueue(void* tPtr, const SharedPtr<Network>& network, Packet& packet, const bool encrypt, const int qosBucket, const uint64_t nwid, const int32_t flowId)
+void Switch::aqm_enqueue(void* tPtr, const SharedPtr<Network>& network, Packet& packet, const bool encrypt, int qosBucket, const uint64_t nwid, const int32_t flowId)
 {
 	if (! network->qosEnabled()) {
-		send(tPtr, packet, encrypt, nwid, flowId);
-		return;
-	}
-	NetworkQoSControlBlock* nqcb = _netQueueControlBlock[network->id()];
-	if (! nqcb) {
-		nqcb = new NetworkQoSControlBlock();
-		_netQueueControlBlock[network->id()] = nqcb;
-		// Initialize ZT_QOS_NUM_BUCKETS queues and place them in the INACTIVE list
-		// These queues will be shuffled between the new/old/inactive lists by the enqueue/dequeue algorithm
-		for (int i = 0; i < ZT_AQM_NUM_BUCKETS; i++) {
-			nqcb->inactiveQueues.push_back(new ManagedQueue(i));
+		// Armor and send on an encrypt worker if they are running, otherwise inline
+		if (! RR->pm->putPacket(tPtr, packet, encrypt, nwid, flowId)) {
+			send(tPtr, packet, encrypt, nwid, flowId);
 		}
+		return;
 	}
+
 	// Don't apply QoS scheduling to ZT protocol traffic
 	if (packet.verb() != Packet::VERB_FRAME && packet.verb() != Packet::VERB_EXT_FRAME) {
 		send(tPtr, packet, encrypt, nwid, flowId);
-	}
-
-	_aqm_m.lock();
-
-	// Enqueue packet and move queue to appropriate list
-
-	const Address dest(packet.destination());
-	TXQueueEntry* txEntry = new TXQueueEntry(dest, nwid, RR->node->now(), packet, encrypt, flowId);
-
-	ManagedQueue* selectedQueue = nullptr;
-	for (size_t i = 0; i < ZT_AQM_NUM_BUCKETS; i++) {
-		if (i < nqcb->oldQueues.size()) {	// search old queues first (I think this is best since old would imply most recent usage of the queue)
-			if (nqcb->oldQueues[i]->id == qosBucket) {
-				selectedQueue = nqcb->oldQueues[i];
-			}
-		}
-		if (i < nqcb->newQueues.size()) {	// search new queues (this would imply not often-used queues)
-			if (nqcb->newQueues[i]->id == qosBucket) {
-				selectedQueue = nqcb->newQueues[i];
-			}
-		}
-		if (i < nqcb->inactiveQueues.size()) {	 // search inactive queues
-			if (nqcb->inactiveQueues[i]->id == qosBucket) {
-				selectedQueue = nqcb->inactiveQueues[i];
-				// move queue to end of NEW queue list
-				selectedQueue->byteCredit = ZT_AQM_QUANTUM;
-				// DEBUG_INFO("moving q=%p from INACTIVE to NEW list", selectedQueue);
-				nqcb->newQueues.push_back(selectedQueue);
-				nqcb->inactiveQueues.erase(nqcb->inactiveQueues.begin() + i);
-			}
-		}
-	}
-	if (! selectedQueue) {
-		_aqm_m.unlock();
 		return;
 	}
 
-	selectedQueue->q.push_back(txEntry);
-	selectedQueue->byteLength += txEntry->packet.payloadLength();
-	nqcb->_currEnqueuedPackets++;
-
-	// DEBUG_INFO("nq=%2lu, oq=%2lu, iq=%2lu, nqcb.size()=%3d, bucket=%2d, q=%p", nqcb->newQueues.size(), nqcb->oldQueues.size(), nqcb->inactiveQueues.size(), nqcb->_currEnqueuedPackets, qosBucket, selectedQueue);
-
-	// Drop a packet if necessary
-	ManagedQueue* selectedQueueToDropFrom = nullptr;
-	if (nqcb->_currEnqueuedPackets > ZT_AQM_MAX_ENQUEUED_PACKETS) {
-		// DEBUG_INFO("too many enqueued packets (%d), finding packet to drop", nqcb->_currEnqueuedPackets);
-		int maxQueueLength = 0;
-		for (size_t i = 0; i < ZT_AQM_NUM_BUCKETS; i++) {
-			if (i < nqcb->oldQueues.size()) {
-				if (nqcb->oldQueues[i]->byteLength > maxQueueLength) {
-					maxQueueLength = nqcb->oldQueues[i]->byteLength;
-					selectedQueueToDropFrom = nqcb->oldQueues[i];
-				}
-			}
-			if (i < nqcb->newQueues.size()) {
-				if (nqcb->newQueues[i]->byteLength > maxQueueLength) {
-					maxQueueLength = nqcb->newQueues[i]->byteLength;
-					selectedQueueToDropFrom = nqcb->newQueues[i];
-				}
-			}
-			if (i < nqcb->inactiveQueues.size()) {
-				if (nqcb->inactiveQueues[i]->byteLength > maxQueueLength) {
-					maxQueueLength = nqcb->inactiveQueues[i]->byteLength;
-					selectedQueueToDropFrom = nqcb->inactiveQueues[i];
-				}
+	{
+		const SnapshotPtr<_QoSQueueTable>::Reader queues(_qosQueues);
+		const SharedPtr<QoSQueue>* q = queues->get(network->id());
+		if (! q) {
+			Mutex::Lock _l(_qosQueues_m);
+			q = _qosQueues.current()->get(network->id());
+			if (! q) {
+				_QoSQueueTable* const t = new _QoSQueueTable(*(_qosQueues.current()));
+				t->set(network->id(), SharedPtr<QoSQueue>(new QoSQueue()));
+				_qosQueues.publish(t);
+				q = t->get(network->id());
 			}
 		}
-		if (selectedQueueToDropFrom) {
-			// DEBUG_INFO("dropping packet from head of largest queue (%d payload bytes)", maxQueueLength);
-			int sizeOfDroppedPacket = selectedQueueToDropFrom->q.front()->packet.payloadLength();
-			delete selectedQueueToDropFrom->q.front();
-			selectedQueueToDropFrom->q.pop_front();
-			selectedQueueToDropFrom->byteLength -= sizeOfDroppedPacket;
-			nqcb->_currEnqueuedPackets--;
-		}
+		(*q)->enqueue(SharedPtr<PacketBuffer>(new PacketBuffer(packet)), encrypt, qosBucket, nwid, flowId, RR->node->now());
 	}
-	_aqm_m.unlock();
+
 	aqm_dequeue(tPtr);
 }
 
-uint64_t Switch::control_law(uint64_t t, int count)
+void Switch::aqm_dequeue(void* tPtr)
 {
-	return (uint64_t)(t + ZT_AQM_INTERVAL / sqrt(count));
+	const uint64_t now = RR->node->now();
+	QoSQueue::Entry ready[2];
+
+	// Cycle through network-specific QoS schedulers
+	const SnapshotPtr<_QoSQueueTable>::Reader queues(_qosQueues);
+	_QoSQueueTable::Iterator i(*const_cast<_QoSQueueTable*>(queues.ptr()));
+	uint64_t* nwid = (uint64_t*)0;
+	SharedPtr<QoSQueue>* q = (SharedPtr<QoSQueue>*)0;
+	while (i.next(nwid, q)) {
+		const unsigned int n = (*q)->dequeue(ready, now);
+		for (unsigned int k = 0; k < n; ++k) {
+			send(tPtr, ready[k].packet, ready[k].encrypt, ready[k].nwid, ready[k].flowId);
+			ready[k].packet.zero();
+		}
+	}
 }
 
-Switch::dqr Switch::dodequeue(ManagedQueue* q, uint64_t now)
+void Switch::removeNetworkQoSControlBlock(uint64_t nwid)
 {
-	dqr r;
-	r.ok_to_drop = false;
-	r.p = q->q.front();
-
-	if (r.p == NULL) {
-		q->first_above_time = 0;
-		return r;
+	Mutex::Lock _l(_qosQueues_m);
+	if (_qosQueues.current()->contains(nwid)) {
+		_QoSQueueTable* const t = new _QoSQueueTable(*(_qosQueues.current()));
+		t->erase(nwid);
+		_qosQueues.publish(t);
 	}
-	uint64_t sojourn_time = now - r.p->creationTime;
-	if (sojourn_time < ZT_AQM_TARGET || q->byteLength <= ZT_DEFAULT_MTU) {
-		// went below - stay below for at least interval
-		q->first_above_time = 0;
+}
+
+void Switch::send(void* tPtr, Packet& packet, const bool encrypt, const uint64_t nwid, const int32_t flowId)
+{
+	const Address dest(packet.destination());
+	if (dest == RR->identity.address()) {
+		return;
 	}
-	else {
-		if (q->first_above_time == 0) {
-			// just went above from below. if still above at
-			// first_above_time, will say it's ok to drop.
-			q->first_above_time = now + ZT_AQM_INTERVAL;
-		}
-		else if (now >= q->first_above_time) {
-			r.ok_to_drop = true;
-		}
+	_recordOutgoingPacketMetrics(packet);
+	if (! _trySend(tPtr, packet, encrypt, nwid, flowId)) {
+		_queueUntilSendable(tPtr, dest, SharedPtr<PacketBuffer>(new PacketBuffer(packet)), encrypt, nwid, flowId);
 	}
-	return r;
 }
 
-Switch::TXQueueEntry* Switch::CoDelDequeue(ManagedQueue* q, bool isNew, uint64_t now)
+void Switch::send(void* tPtr, const SharedPtr<PacketBuffer>& packet, const bool encrypt, const uint64_t nwid, const int32_t flowId)
 {
-	dqr r = dodequeue(q, now);
+	const Address dest(packet->destination());
+	if (dest == RR->identity.address()) {
+		return;
+	}
+	_recordOutgoingPacketMetrics(*packet);
+	if (! _trySend(tPtr, *packet, encrypt, nwid, flowId)) {
+		_queueUntilSendable(tPtr, dest, packet, encrypt, nwid, flowId);
+	}
+}
 
-	if (q->dropping) {
-		if (! r.ok_to_drop) {
-			q->dropping = false;
-		}
-		while (now >= q->drop_next && q->dropping) {
-			q->q.pop_front();	// drop
-			r = dodequeue(q, now);
-			if (! r.ok_to_drop) {
-				// leave dropping state
-				q->dropping = false;
-			}
-			else {
-				++(q->count);
-				// schedule the next drop.
-				q->drop_next = control_law(q->drop_next, q->count);
-			}
-		}
+void Switch::_queueUntilSendable(void* tPtr, const Address& dest, const SharedPtr<PacketBuffer>& packet, const bool encrypt, const uint64_t nwid, const int32_t flowId)
+{
+	const int64_t now = RR->node->now();
+	{
+		Mutex::Lock _l(_txQueue_m);
+		_enqueueTx(dest, TXQueueEntry(nwid, now, packet, encrypt, flowId), now);
 	}
-	else if (r.ok_to_drop) {
-		q->q.pop_front();	// drop
-		r = dodequeue(q, now);
-		q->dropping = true;
-		q->count = (q->count > 2 && now - q->drop_next < 8 * ZT_AQM_INTERVAL) ? q->count - 2 : 1;
-		q->drop_next = control_law(now, q->count);
+	if (! RR->topology->getPeer(tPtr, dest)) {
+		requestWhois(tPtr, now, dest);
 	}
-	return r.p;
 }
 
-void Switch::aqm_dequeue(void* tPtr)
+void Switch::_enqueueTx(const Address& dest, const TXQueueEntry& e, const int64_t now)
 {
-	// Cycle through network-specific QoS control blocks
-	for (std::map<uint64_t, NetworkQoSControlBlock*>::iterator nqcb(_netQueueControlBlock.begin()); nqcb != _netQueueControlBlock.end();) {
-		if (! (*nqcb).second->_currEnqueuedPackets) {
+	TXQueue* q = _txQueues.get(dest);
+	if (! q) {
+		if (_txQueues.size() >= ZT_TX_QUEUE_MAX_DESTINATIONS) {
 			return;
 		}
-
-		uint64_t now = RR->node->now();
-		TXQueueEntry* entryToEmit = nullptr;
-		std::vector<ManagedQueue*>* currQueues = &((*nqcb).second->newQueues);
-		std::vector<ManagedQueue*>* oldQueues = &((*nqcb).second->oldQueues);
-		std::vector<ManagedQueue*>* inactiveQueues = &((*nqcb).second->inactiveQueues);
-
-		_aqm_m.lock();
-
-		// Attempt dequeue from queues in NEW list
-		bool examiningNewQueues = true;
-		while (currQueues->size()) {
-			ManagedQueue* queueAtFrontOfList = currQueues->front();
-			if (queueAtFrontOfList->byteCredit < 0) {
-				queueAtFrontOfList->byteCredit += ZT_AQM_QUANTUM;
-				// Move to list of OLD queues
-				// DEBUG_INFO("moving q=%p from NEW to OLD list", queueAtFrontOfList);
-				oldQueues->push_back(queueAtFrontOfList);
-				currQueues->erase(currQueues->begin());
-			}
-			else {
-				entryToEmit = CoDelDequeue(queueAtFrontOfList, examiningNewQueues, now);
-				if (! entryToEmit) {
-					// Move to end of list of OLD queues
-					// DEBUG_INFO("moving q=%p from NEW to OLD list", queueAtFrontOfList);
-					oldQueues->push_back(queueAtFrontOfList);
-					currQueues->erase(currQueues->begin());
-				}
-				else {
-					int len = entryToEmit->packet.payloadLength();
-					queueAtFrontOfList->byteLength -= len;
-					queueAtFrontOfList->byteCredit -= len;
-					// Send the packet!
-					queueAtFrontOfList->q.pop_front();
-					send(tPtr, entryToEmit->packet, entryToEmit->encrypt, entryToEmit->nwid, entryToEmit->flowId);
-					(*nqcb).second->_currEnqueuedPackets--;
-				}
-				if (queueAtFrontOfList) {
-					// DEBUG_INFO("dequeuing from q=%p, len=%lu in NEW list (byteCredit=%d)", queueAtFrontOfList, queueAtFrontOfList->q.size(), queueAtFrontOfList->byteCredit);
-				}
-				break;
-			}
-		}
-
-		// Attempt dequeue from queues in OLD list
-		examiningNewQueues = false;
-		currQueues = &((*nqcb).second->oldQueues);
-		while (currQueues->size()) {
-			ManagedQueue* queueAtFrontOfList = currQueues->front();
-			if (queueAtFrontOfList->byteCredit < 0) {
-				queueAtFrontOfList->byteCredit += ZT_AQM_QUANTUM;
-				oldQueues->push_back(queueAtFrontOfList);
-				currQueues->erase(currQueues->begin());
-			}
-			else {
-				entryToEmit = CoDelDequeue(queueAtFrontOfList, examiningNewQueues, now);
-				if (! entryToEmit) {
-					// DEBUG_INFO("moving q=%p from OLD to INACTIVE list", queueAtFrontOfList);
-					//  Move to inactive list of queues
-					inactiveQueues->push_back(queueAtFrontOfList);
-					currQueues->erase(currQueues->begin());
-				}
-				else {
-					int len = entryToEmit->packet.payloadLength();
-					queueAtFrontOfList->byteLength -= len;
-					queueAtFrontOfList->byteCredit -= len;
-					queueAtFrontOfList->q.pop_front();
-					send(tPtr, entryToEmit->packet, entryToEmit->encrypt, entryToEmit->nwid, entryToEmit->flowId);
-					(*nqcb).second->_currEnqueuedPackets--;
-				}
-				if (queueAtFrontOfList) {
-					// DEBUG_INFO("dequeuing from q=%p, len=%lu in OLD list (byteCredit=%d)", queueAtFrontOfList, queueAtFrontOfList->q.size(), queueAtFrontOfList->byteCredit);
-				}
-				break;
-			}
-		}
-		nqcb++;
-		_aqm_m.unlock();
+		q = &(_txQueues[dest]);
 	}
+	const unsigned int len = e.packet->size();
+	unsigned int drop = 0;
+	while ((drop < q->entries.size()) && (((q->entries.size() - drop) >= ZT_TX_QUEUE_SIZE) || ((q->bytes + len) > ZT_TX_QUEUE_MAX_BYTES) || ((now - (int64_t)q->entries[drop].creationTime) > ZT_TRANSMIT_QUEUE_TIMEOUT))) {
+		q->bytes -= q->entries[drop++].packet->size();
+	}
+	q->entries.erase(q->entries.begin(), q->entries.begin() + drop);
+	q->entries.push_back(e);
+	q->bytes += len;
 }
 
-void Switch::removeNetworkQoSControlBlock(uint64_t nwid)
+void Switch::requestWhois(void* tPtr, const int64_t now, const Address& addr)
 {
-	NetworkQoSControlBlock* nq = _netQueueControlBlock[nwid];
-	if (nq) {
-		_netQueueControlBlock.erase(nwid);
-		delete nq;
-		nq = NULL;
+	if (_queueWhois(now, addr)) {
+		_flushWhois(tPtr, now);
 	}
 }
 
-void Switch::send(void* tPtr, Packet& packet, const bool encrypt, const uint64_t nwid, const int32_t flowId)
+bool Switch::_queueWhois(const int64_t now, const Address& addr)
 {
-	const Address dest(packet.destination());
-	if (dest == RR->identity.address()) {
-		return;
+	if (addr == RR->identity.address()) {
+		return false;
 	}
-	_recordOutgoingPacketMetrics(packet);
-	if (! _trySend(tPtr, packet, encrypt, nwid, flowId)) {
-		{
-			Mutex::Lock _l(_txQueue_m);
-			if (_txQueue.size() >= ZT_TX_QUEUE_SIZE) {
-				_txQueue.pop_front();
-			}
-			_txQueue.push_back(TXQueueEntry(dest, nwid, RR->node->now(), packet, encrypt, flowId));
-		}
-		if (! RR->topology->getPeer(tPtr, dest)) {
-			requestWhois(tPtr, RR->node->now(), dest);
-		}
+
+	Mutex::Lock _l(_lastSentWhoisRequest_m);
+	int64_t& last = _lastSentWhoisRequest[addr];
+	if ((now - last) < ZT_WHOIS_RETRY_DELAY) {
+		return false;
+	}
+	last = now;
+	_lastSentWhoisRequestExpiry.schedule(addr, now + (ZT_WHOIS_RETRY_DELAY * 2) + 1);
+	_whoisBatch.push_back(addr);
+	if ((_whoisBatch.size() >= ZT_WHOIS_BATCH_MAX) || ((now - _lastWhoisFlush) >= ZT_WHOIS_BATCH_DELAY)) {
+		return true;
 	}
+	_whoisFlushDeadline.store(_lastWhoisFlush + ZT_WHOIS_BATCH_DELAY, std::memory_order_relaxed);
+	return false;
 }
 
-void Switch::requestWhois(void* tPtr, const int64_t now, const Address& addr)
+void Switch::_flushWhois(void* tPtr, const int64_t now)
 {
-	if (addr == RR->identity.address()) {
-		return;
-	}
-
+	std::vector<Address> batch;
 	{
 		Mutex::Lock _l(_lastSentWhoisRequest_m);
-		int64_t& last = _lastSentWhoisRequest[addr];
-		if ((now - last) < ZT_WHOIS_RETRY_DELAY) {
+		if (_whoisBatch.empty()) {
 			return;
 		}
-		else {
-			last = now;
-		}
+		batch.swap(_whoisBatch);
+		_lastWhoisFlush = now;
+		_whoisFlushDeadline.store(0, std::memory_order_relaxed);
 	}
 
 	const SharedPtr<Peer> upstream(RR->topology->getUpstreamPeer(0));
 	if (upstream) {
-		int32_t flowId = ZT_QOS_NO_FLOW;
-		Packet outp(upstream->address(), RR->identity.address(), Packet::VERB_WHOIS);
-		addr.appendTo(outp);
-		send(tPtr, outp, true, 0, flowId);
+		for (std::vector<Address>::const_iterator a(batch.begin()); a != batch.end();) {
+			int32_t flowId = ZT_QOS_NO_FLOW;
+			Packet outp(upstream->address(), RR->identity.address(), Packet::VERB_WHOIS);
+			for (unsigned int n = 0; (n < ZT_WHOIS_BATCH_MAX) && (a != batch.end()); ++n) {
+				(a++)->appendTo(outp);
+			}
+			send(tPtr, outp, true, 0, flowId);
+		}
 	}
 }
 
@@ -942,6 +697,7 @@ void Switch::doAnythingWaitingForPeer(void* tPtr, const SharedPtr<Peer>& peer)
 	{
 		Mutex::Lock _l(_lastSentWhoisRequest_m);
 		_lastSentWhoisRequest.erase(peer->address());
+		_lastSentWhoisRequestExpiry.cancel(peer->address());
 	}
 
 	const int64_t now = RR->node->now();
@@ -955,53 +711,83 @@ void Switch::doAnythingWaitingForPeer(void* tPtr, const SharedPtr<Peer>& peer)
 		}
 	}
 
+	// Only this peer's queue is touched; it is sent outside the lock and
+	// anything that still can't go out is put back in front of newer packets
+	TXQueue waiting;
 	{
 		Mutex::Lock _l(_txQueue_m);
-		for (std::list<TXQueueEntry>::iterator txi(_txQueue.begin()); txi != _txQueue.end();) {
-			if (txi->dest == peer->address()) {
-				if (_trySend(tPtr, txi->packet, txi->encrypt, txi->nwid, txi->flowId)) {
-					_txQueue.erase(txi++);
-				}
-				else {
-					++txi;
-				}
-			}
-			else {
-				++txi;
-			}
+		TXQueue* const q = _txQueues.get(peer->address());
+		if (! q) {
+			return;
+		}
+		waiting.entries.swap(q->entries);
+		_txQueues.erase(peer->address());
+	}
+	std::vector<TXQueueEntry> unsent;
+	for (std::vector<TXQueueEntry>::iterator e(waiting.entries.begin()); e != waiting.entries.end(); ++e) {
+		if (((now - (int64_t)e->creationTime) <= ZT_TRANSMIT_QUEUE_TIMEOUT) && (! _trySend(tPtr, *(e->packet), e->encrypt, e->nwid, e->flowId))) {
+			unsent.push_back(*e);
+		}
+	}
+	if (! unsent.empty()) {
+		// Re-queued ahead of anything queued meanwhile, under the same limits as new sends
+		Mutex::Lock _l(_txQueue_m);
+		TXQueue* const q = _txQueues.get(peer->address());
+		if (q) {
+			unsent.insert(unsent.end(), q->entries.begin(), q->entries.end());
+			_txQueues.erase(peer->address());
+		}
+		for (std::vector<TXQueueEntry>::const_iterator e(unsent.begin()); e != unsent.end(); ++e) {
+			_enqueueTx(peer->address(), *e, now);
 		}
 	}
 }
 
 unsigned long Switch::doTimerTasks(void* tPtr, int64_t now)
 {
+	if (_whoisFlushDeadline.load(std::memory_order_relaxed)) {
+		_flushWhois(tPtr, now);
+	}
+
 	const uint64_t timeSinceLastCheck = now - _lastCheckedQueues;
 	if (timeSinceLastCheck < ZT_WHOIS_RETRY_DELAY) {
 		return (unsigned long)(ZT_WHOIS_RETRY_DELAY - timeSinceLastCheck);
 	}
 	_lastCheckedQueues = now;
 
+	// Expire old packets and retry those whose destination is known. Packets
+	// for unknown destinations are not retried, just re-requested below.
 	std::vector<Address> needWhois;
 	{
 		Mutex::Lock _l(_txQueue_m);
-
-		for (std::list<TXQueueEntry>::iterator txi(_txQueue.begin()); txi != _txQueue.end();) {
-			if (_trySend(tPtr, txi->packet, txi->encrypt, 0, txi->flowId)) {
-				_txQueue.erase(txi++);
+		FlatHashtable<Address, TXQueue>::Iterator i(_txQueues);
+		Address* dest = (Address*)0;
+		TXQueue* q = (TXQueue*)0;
+		while (i.next(dest, q)) {
+			const bool known = (bool)RR->topology->getPeerNoCache(*dest);
+			std::vector<TXQueueEntry>::iterator keep(q->entries.begin());
+			for (std::vector<TXQueueEntry>::iterator e(q->entries.begin()); e != q->entries.end(); ++e) {
+				if (((now - (int64_t)e->creationTime) > ZT_TRANSMIT_QUEUE_TIMEOUT) || ((known) && (_trySend(tPtr, *(e->packet), e->encrypt, e->nwid, e->flowId)))) {
+					q->bytes -= e->packet->size();
+				}
+				else {
+					if (keep != e) {
+						*keep = *e;
+					}
+					++keep;
+				}
 			}
-			else if ((now - txi->creationTime) > ZT_TRANSMIT_QUEUE_TIMEOUT) {
-				_txQueue.erase(txi++);
+			q->entries.erase(keep, q->entries.end());
+			if (q->entries.empty()) {
+				_txQueues.erase(*dest);
 			}
-			else {
-				if (! RR->topology->getPeer(tPtr, txi->dest)) {
-					needWhois.push_back(txi->dest);
-				}
-				++txi;
+			else if (! known) {
+				needWhois.push_back(*dest);
 			}
 		}
 	}
 	for (std::vector<Address>::const_iterator i(needWhois.begin()); i != needWhois.end(); ++i) {
-		requestWhois(tPtr, now, *i);
+		_queueWhois(now, *i);
 	}
 
 	for (unsigned int ptr = 0; ptr < ZT_RX_QUEUE_SIZE; ++ptr) {
@@ -1014,48 +800,176 @@ unsigned long Switch::doTimerTasks(void* tPtr, int64_t now)
 			else {
 				const Address src(rq->frag0.source());
 				if (! RR->topology->getPeer(tPtr, src)) {
-					requestWhois(tPtr, now, src);
+					_queueWhois(now, src);
 				}
 			}
 		}
 	}
 
+	// Old unite and WHOIS times expire on their own deadlines, so only
+	// entries that may be stale are looked at
 	{
+		std::vector<_LastUniteKey> expired;
 		Mutex::Lock _l(_lastUniteAttempt_m);
-		Hashtable<_LastUniteKey, uint64_t>::Iterator i(_lastUniteAttempt);
-		_LastUniteKey* k = (_LastUniteKey*)0;
-		uint64_t* v = (uint64_t*)0;
-		while (i.next(k, v)) {
-			if ((now - *v) >= (ZT_MIN_UNITE_INTERVAL * 8)) {
-				_lastUniteAttempt.erase(*k);
+		_lastUniteAttemptExpiry.expire(now, expired, 0xffffffffUL);
+		for (std::vector<_LastUniteKey>::const_iterator k(expired.begin()); k != expired.end(); ++k) {
+			const uint64_t* const ts = _lastUniteAttempt.get(*k);
+			if (ts) {
+				if ((now - (int64_t)*ts) >= (ZT_MIN_UNITE_INTERVAL * 8)) {
+					_lastUniteAttempt.erase(*k);
+				}
+				else {
+					_lastUniteAttemptExpiry.schedule(*k, (int64_t)*ts + (ZT_MIN_UNITE_INTERVAL * 8));
+				}
 			}
 		}
 	}
 
 	{
+		std::vector<Address> expired;
 		Mutex::Lock _l(_lastSentWhoisRequest_m);
-		Hashtable<Address, int64_t>::Iterator i(_lastSentWhoisRequest);
-		Address* a = (Address*)0;
-		int64_t* ts = (int64_t*)0;
-		while (i.next(a, ts)) {
-			if ((now - *ts) > (ZT_WHOIS_RETRY_DELAY * 2)) {
-				_lastSentWhoisRequest.erase(*a);
+		_lastSentWhoisRequestExpiry.expire(now, expired, 0xffffffffUL);
+		for (std::vector<Address>::const_iterator a(expired.begin()); a != expired.end(); ++a) {
+			const int64_t* const ts = _lastSentWhoisRequest.get(*a);
+			if (ts) {
+				if ((now - *ts) > (ZT_WHOIS_RETRY_DELAY * 2)) {
+					_lastSentWhoisRequest.erase(*a);
+				}
+				else {
+					_lastSentWhoisRequestExpiry.schedule(*a, *ts + (ZT_WHOIS_RETRY_DELAY * 2) + 1);
+				}
 			}
 		}
 	}
 
+	_flushWhois(tPtr, now);
+
 	return ZT_WHOIS_RETRY_DELAY;
 }
 
+void Switch::relay(void* tPtr, uint8_t* const* datagrams, const unsigned int* lens, const unsigned int count, const int64_t now)
+{
+	const Address destination(datagrams[0] + ZT_PACKET_IDX_DEST, ZT_ADDRESS_LENGTH);
+	std::vector<Address> unite;
+	SharedPtr<Peer> relayTo;
+	{
+		_RelayRoute& r = _relayRoutes[(unsigned long)((destination.toInt() * 0x9e3779b97f4a7c15ULL) >> 32) % ZT_RELAY_ROUTE_CACHE_SIZE];
+		Mutex::Lock _l(r.lock);
+
+		if ((r.destination != destination) || (now >= r.expires) || (! r.path) || ((! r.viaUpstream) && (! r.path->alive(now)))) {
+			// Prefer a direct path to the destination, else go via an upstream
+			r.destination = destination;
+			r.expires = now + ZT_RELAY_ROUTE_TTL;
+			r.viaUpstream = false;
+			r.peer = RR->topology->getPeer(tPtr, destination);
+			r.path.zero();
+			if (r.peer) {
+				r.path = r.peer->getAppropriatePath(now, false);
+			}
+			if (! r.path) {
+				r.viaUpstream = true;
+				r.peer = RR->topology->getUpstreamPeer(0);
+				if (r.peer) {
+					r.path = r.peer->getAppropriatePath(now, true);
+				}
+			}
+			if (! r.path) {
+				r.peer.zero();
+				return;
+			}
+		}
+
+		// The slot stays locked while its datagrams go out, so its route can't change under them
+		SharedPtr<Peer> upstream;
+		bool directFailed = false;
+		for (unsigned int i = 0; i < count; ++i) {
+			uint8_t* const d = datagrams[i];
+			if (d[ZT_PACKET_FRAGMENT_IDX_FRAGMENT_INDICATOR] == ZT_PACKET_FRAGMENT_INDICATOR) {
+				// Note: we don't bother initiating NAT-t for fragments, since heads will set that off.
+				// It wouldn't hurt anything, just redundant and unnecessary.
+				d[ZT_PACKET_FRAGMENT_IDX_HOPS] = (d[ZT_PACKET_FRAGMENT_IDX_HOPS] + 1) & ZT_PROTO_MAX_HOPS;
+				if ((! r.path->send(RR, tPtr, d, lens[i], now)) && (! r.viaUpstream)) {
+					// Direct send failed: fall back to an upstream, as for uncached routes
+					if (! directFailed) {
+						upstream = RR->topology->getUpstreamPeer(0);
+						directFailed = true;
+					}
+					if (upstream) {
+						upstream->sendDirect(tPtr, d, lens[i], now, true);
+					}
+				}
+			}
+			else {
+				const Address source(d + ZT_PACKET_IDX_SOURCE, ZT_ADDRESS_LENGTH);
+				if ((r.viaUpstream) && (source == r.peer->address())) {
+					continue;
+				}
+				d[ZT_PACKET_IDX_FLAGS] = (d[ZT_PACKET_IDX_FLAGS] & 0xf8) | ((d[ZT_PACKET_IDX_FLAGS] + 1) & 0x07);
+				if (r.path->send(RR, tPtr, d, lens[i], now)) {
+					if (_shouldUnite(now, source, r.peer->address())) {
+						unite.push_back(source);
+					}
+				}
+				else if (! r.viaUpstream) {
+					if (! directFailed) {
+						upstream = RR->topology->getUpstreamPeer(0);
+						directFailed = true;
+					}
+					if ((upstream) && (upstream->address() != source)) {
+						upstream->sendDirect(tPtr, d, lens[i], now, true);
+					}
+				}
+			}
+		}
+		if (directFailed) {
+			r.expires = now;	// look the route up again next time
+		}
+		if (! unite.empty()) {
+			relayTo = r.peer;
+		}
+	}
+
+	for (std::vector<Address>::const_iterator a(unite.begin()); a != unite.end(); ++a) {
+		const SharedPtr<Peer> sourcePeer(RR->topology->getPeer(tPtr, *a));
+		if (sourcePeer) {
+			relayTo->introduce(tPtr, now, sourcePeer);
+		}
+	}
+}
+
+void Switch::_relay(void* tPtr, const void* data, unsigned int len, const int64_t now)
+{
+	if (RR->pm->putRelay(tPtr, data, len, now)) {
+		return;
+	}
+	if (len > ZT_PROTO_MAX_PACKET_LENGTH) {
+		return;
+	}
+	uint8_t buf[ZT_PROTO_MAX_PACKET_LENGTH];
+	memcpy(buf, data, len);
+	uint8_t* const d = buf;
+	relay(tPtr, &d, &len, 1, now);
+}
+
 bool Switch::_shouldUnite(const int64_t now, const Address& source, const Address& destination)
 {
+	const _LastUniteKey k(source, destination);
+	const unsigned long h = k.hashCode();
+	_RecentUnite& recent = _recentUnites[h % ZT_RELAY_UNITE_FILTER_SIZE];
+	if ((recent.key.load(std::memory_order_relaxed) == h) && ((now - recent.time.load(std::memory_order_relaxed)) < ZT_MIN_UNITE_INTERVAL)) {
+		return false;
+	}
+
 	Mutex::Lock _l(_lastUniteAttempt_m);
-	uint64_t& ts = _lastUniteAttempt[_LastUniteKey(source, destination)];
-	if ((now - ts) >= ZT_MIN_UNITE_INTERVAL) {
+	uint64_t& ts = _lastUniteAttempt[k];
+	const bool unite = ((now - (int64_t)ts) >= ZT_MIN_UNITE_INTERVAL);
+	if (unite) {
 		ts = now;
-		return true;
+		_lastUniteAttemptExpiry.schedule(k, now + (ZT_MIN_UNITE_INTERVAL * 8));
 	}
-	return false;
+	recent.time.store((int64_t)ts, std::memory_order_relaxed);
+	recent.key.store(h, std::memory_order_relaxed);
+	return unite;
 }
 
 bool Switch::_trySend(void* tPtr, Packet& packet, bool encrypt, const uint64_t nwid, const int32_t flowId)
@@ -1064,12 +978,14 @@ bool Switch::_trySend(void* tPtr, Packet& packet, bool encrypt, const uint64_t n
 	const int64_t now = RR->node->now();
 	const Address destination(packet.destination());
 
-	const SharedPtr<Peer> peer(RR->topology->getPeer(tPtr, destination));
+	const SnapshotReaders::Pass pass;
+	SharedPtr<Peer> loadedPeer;
+	const SharedPtr<Peer>& peer = RR->topology->borrowPeer(tPtr, destination, loadedPeer);
 	if (peer) {
 		if ((peer->bondingPolicy() == ZT_BOND_POLICY_BROADCAST) && (packet.verb() == Packet::VERB_FRAME || packet.verb() == Packet::VERB_EXT_FRAME)) {
 			const SharedPtr<Peer> relay(RR->topology->getUpstreamPeer(nwid));
 			Mutex::Lock _l(peer->_paths_m);
-			for (int i = 0; i < ZT_MAX_PEER_NETWORK_PATHS; ++i) {
+			for (unsigned int i = 0; i < peer->_paths.size(); ++i) {
 				if (peer->_paths[i].p && peer->_paths[i].p->alive(now)) {
 					uint16_t userSpecifiedMtu = peer->_paths[i].p->mtu();
 					_sendViaSpecificPath(tPtr, peer, peer->_paths[i].p, userSpecifiedMtu, now, packet, encrypt, flowId);
@@ -1078,16 +994,7 @@ bool Switch::_trySend(void* tPtr, Packet& packet, bool encrypt, const uint64_t n
 			return true;
 		}
 		else {
-			viaPath = peer->getAppropriatePath(now, false, flowId);
-			if (! viaPath) {
-				peer->tryMemorizedPath(tPtr, now);	 // periodically attempt memorized or statically defined paths, if any are known
-				const SharedPtr<Peer> relay(RR->topology->getUpstreamPeer(nwid));
-				if ((! relay) || (! (viaPath = relay->getAppropriatePath(now, false, flowId)))) {
-					if (! (viaPath = peer->getAppropriatePath(now, true, flowId))) {
-						return false;
-					}
-				}
-			}
+			viaPath = _pathTo(tPtr, peer, now, nwid, flowId);
 			if (viaPath) {
 				uint16_t userSpecifiedMtu = viaPath->mtu();
 				_sendViaSpecificPath(tPtr, peer, viaPath, userSpecifiedMtu, now, packet, encrypt, flowId);
@@ -1098,7 +1005,86 @@ bool Switch::_trySend(void* tPtr, Packet& packet, bool encrypt, const uint64_t n
 	return false;
 }
 
-void Switch::_sendViaSpecificPath(void* tPtr, SharedPtr<Peer> peer, SharedPtr<Path> viaPath, uint16_t userSpecifiedMtu, int64_t now, Packet& packet, bool encrypt, int32_t flowId)
+SharedPtr<Path> Switch::_pathTo(void* tPtr, const SharedPtr<Peer>& peer, const int64_t now, const uint64_t nwid, const int32_t flowId)
+{
+	SharedPtr<Path> viaPath(peer->getAppropriatePath(now, false, flowId));
+	if (! viaPath) {
+		peer->tryMemorizedPath(tPtr, now);	 // periodically attempt memorized or statically defined paths, if any are known
+		const SharedPtr<Peer> relay(RR->topology->getUpstreamPeer(nwid));
+		if ((! relay) || (! (viaPath = relay->getAppropriatePath(now, false, flowId)))) {
+			viaPath = peer->getAppropriatePath(now, true, flowId);
+		}
+	}
+	return viaPath;
+}
+
+void Switch::sendCopy(void* tPtr, const Packet& packet, const Address& dest, const bool encrypt, const uint64_t nwid, const int32_t flowId, WireBatch& batch)
+{
+	if (dest == RR->identity.address()) {
+		return;
+	}
+
+	const int64_t now = RR->node->now();
+	{
+		const SnapshotReaders::Pass pass;
+		SharedPtr<Peer> loadedPeer;
+		const SharedPtr<Peer>& peer = RR->topology->borrowPeer(tPtr, dest, loadedPeer);
+		if ((peer) && (peer->bondingPolicy() != ZT_BOND_POLICY_BROADCAST)) {
+			const SharedPtr<Path> viaPath(_pathTo(tPtr, peer, now, nwid, flowId));
+			if (viaPath) {
+				unsigned int mtu = ZT_DEFAULT_PHYSMTU;
+				uint64_t trustedPathId = 0;
+				RR->topology->getOutboundPathInfo(viaPath->address(), mtu, trustedPathId);
+				if (viaPath->mtu() > 0) {
+					mtu = viaPath->mtu();
+				}
+				if (! trustedPathId) {
+					_recordOutgoingPacketMetrics(packet);
+
+					unsigned int chunkSize = std::min(packet.size(), mtu);
+					unsigned int remaining = packet.size() - chunkSize;
+					unsigned int fragsRemaining = (remaining / (mtu - ZT_PROTO_MIN_FRAGMENT_LENGTH));
+					if ((fragsRemaining * (mtu - ZT_PROTO_MIN_FRAGMENT_LENGTH)) < remaining) {
+						++fragsRemaining;
+					}
+					const unsigned int totalFragments = fragsRemaining + 1;
+
+					// Armor straight into the batch, followed by any further fragments
+					uint8_t* const out = batch.reserve(packet.size() + (fragsRemaining * ZT_PROTO_MIN_FRAGMENT_LENGTH), totalFragments);
+					const uint64_t packetId = packet.armorTo(out, dest, (totalFragments > 1), peer->key(), encrypt, peer->aesKeysIfSupported());
+					RR->node->expectReplyTo(packetId);
+					peer->recordOutgoingPacket(viaPath, packetId, packet.payloadLength(), packet.verb(), flowId, now);
+					batch.add(viaPath, out, chunkSize, now);
+
+					unsigned int fragStart = chunkSize;
+					uint8_t* frag = out + packet.size();
+					for (unsigned int fno = 1; fno < totalFragments; ++fno) {
+						chunkSize = std::min(remaining, (unsigned int)(mtu - ZT_PROTO_MIN_FRAGMENT_LENGTH));
+						memcpy(frag + ZT_PACKET_FRAGMENT_IDX_PACKET_ID, out + ZT_PACKET_IDX_IV, 13);   // packet ID and destination
+						frag[ZT_PACKET_FRAGMENT_IDX_FRAGMENT_INDICATOR] = ZT_PACKET_FRAGMENT_INDICATOR;
+						frag[ZT_PACKET_FRAGMENT_IDX_FRAGMENT_NO] = (uint8_t)(((totalFragments & 0xf) << 4) | (fno & 0xf));
+						frag[ZT_PACKET_FRAGMENT_IDX_HOPS] = 0;
+						memcpy(frag + ZT_PACKET_FRAGMENT_IDX_PAYLOAD, out + fragStart, chunkSize);
+						batch.add(viaPath, frag, ZT_PROTO_MIN_FRAGMENT_LENGTH + chunkSize, now);
+						frag += ZT_PROTO_MIN_FRAGMENT_LENGTH + chunkSize;
+						fragStart += chunkSize;
+						remaining -= chunkSize;
+					}
+					return;
+				}
+			}
+		}
+	}
+
+	// Anything that cannot go straight to the wire takes the normal path with its own copy
+	batch.flush();
+	const SharedPtr<PacketBuffer> p(new PacketBuffer(packet));
+	p->setDestination(dest);
+	p->newInitializationVector();
+	send(tPtr, p, encrypt, nwid, flowId);
+}
+
+void Switch::_sendViaSpecificPath(void* tPtr, const SharedPtr<Peer>& peer, const SharedPtr<Path>& viaPath, uint16_t userSpecifiedMtu, int64_t now, Packet& packet, bool encrypt, int32_t flowId)
 {
 	unsigned int mtu = ZT_DEFAULT_PHYSMTU;
 	uint64_t trustedPathId = 0;
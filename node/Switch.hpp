@@ -10,18 +10,21 @@
 #define ZT_N_SWITCH_HPP
 
 #include "Constants.hpp"
-#include "Hashtable.hpp"
+#include "FlatHashtable.hpp"
 #include "IncomingPacket.hpp"
 #include "InetAddress.hpp"
 #include "MAC.hpp"
 #include "Mutex.hpp"
 #include "Network.hpp"
 #include "Packet.hpp"
+#include "PacketBuffer.hpp"
+#include "QoSQueue.hpp"
 #include "SharedPtr.hpp"
+#include "SnapshotPtr.hpp"
+#include "TimerWheel.hpp"
 #include "Topology.hpp"
 
-#include <list>
-#include <map>
+#include <atomic>
 #include <vector>
 
 /* Ethernet frame types that might be relevant to us */
@@ -38,6 +41,7 @@ namespace ZeroTier {
 
 class RuntimeEnvironment;
 class Peer;
+class WireBatch;
 
 /**
  * Core of the distributed Ethernet switch and protocol implementation
@@ -48,16 +52,8 @@ class Peer;
  * wraps/unwraps accordingly. It also handles queues and timeouts and such.
  */
 class Switch {
-	struct ManagedQueue;
-	struct TXQueueEntry;
-
 	friend class SharedPtr<Peer>;
 
-	typedef struct {
-		TXQueueEntry* p;
-		bool ok_to_drop;
-	} dqr;
-
   public:
 	Switch(const RuntimeEnvironment* renv);
 
@@ -91,23 +87,6 @@ class Switch {
 	 */
 	void onLocalEthernet(void* tPtr, const SharedPtr<Network>& network, const MAC& from, const MAC& to, unsigned int etherType, unsigned int vlanId, const void* data, unsigned int len);
 
-	/**
-	 * Determines the next drop schedule for packets in the TX queue
-	 *
-	 * @param t Current time
-	 * @param count Number of packets dropped this round
-	 */
-	uint64_t control_law(uint64_t t, int count);
-
-	/**
-	 * Selects a packet eligible for transmission from a TX queue. According to the control law, multiple packets
-	 * may be intentionally dropped before a packet is returned to the AQM scheduler.
-	 *
-	 * @param q The TX queue that is being dequeued from
-	 * @param now Current time
-	 */
-	dqr dodequeue(ManagedQueue* q, uint64_t now);
-
 	/**
 	 * Presents a packet to the AQM scheduler.
 	 *
@@ -115,9 +94,9 @@ class Switch {
 	 * @param network Network that the packet shall be sent over
 	 * @param packet Packet to be sent
 	 * @param encrypt Encrypt packet payload? (always true except for HELLO)
-	 * @param qosBucket Which bucket the rule-system determined this packet should fall into
+	 * @param qosBucket Which bucket the rule-system determined this packet should fall into, or ZT_AQM_UNCLASSIFIED
 	 */
-	void aqm_enqueue(void* tPtr, const SharedPtr<Network>& network, Packet& packet, const bool encrypt, const int qosBucket, const uint64_t nwid, const int32_t flowId /* = ZT_QOS_NO_FLOW*/);
+	void aqm_enqueue(void* tPtr, const SharedPtr<Network>& network, Packet& packet, const bool encrypt, int qosBucket, const uint64_t nwid, const int32_t flowId /* = ZT_QOS_NO_FLOW*/);
 
 	/**
 	 * Performs a single AQM cycle and dequeues and transmits all eligible packets on all networks
@@ -126,15 +105,6 @@ class Switch {
 	 */
 	void aqm_dequeue(void* tPtr);
 
-	/**
-	 * Calls the dequeue mechanism and adjust queue state variables
-	 *
-	 * @param q The TX queue that is being dequeued from
-	 * @param isNew Whether or not this queue is in the NEW list
-	 * @param now Current time
-	 */
-	Switch::TXQueueEntry* CoDelDequeue(ManagedQueue* q, bool isNew, uint64_t now);
-
 	/**
 	 * Removes QoS Queues and flow state variables for a specific network. These queues are created
 	 * automatically upon the transmission of the first packet from this peer to another peer on the
@@ -166,15 +136,60 @@ class Switch {
 	 */
 	void send(void* tPtr, Packet& packet, const bool encrypt, const uint64_t nwid, const int32_t flowId /* = ZT_QOS_NO_FLOW*/);
 
+	/**
+	 * Send a packet that is already in a shared buffer
+	 *
+	 * This is the same as send() except that if the packet has to wait for
+	 * its destination it is queued by reference instead of being copied.
+	 *
+	 * @param tPtr Thread pointer to be handed through to any callbacks called as a result of this call
+	 * @param packet Packet to send (buffer may be modified)
+	 * @param encrypt Encrypt packet payload? (always true except for HELLO)
+	 * @param nwid Network ID to which this packet is related or 0 if none
+	 */
+	void send(void* tPtr, const SharedPtr<PacketBuffer>& packet, const bool encrypt, const uint64_t nwid, const int32_t flowId /* = ZT_QOS_NO_FLOW*/);
+
+	/**
+	 * Send a copy of a packet to a destination, leaving the packet unchanged
+	 *
+	 * This is for sending the same packet to many peers, and for sending
+	 * many packets from one thread. Each copy is armored straight from the
+	 * packet into the batch, so only its header is written per destination.
+	 * Copies that cannot go straight to the wire (no path yet, trusted
+	 * paths, broadcast bonds) are sent as by send() instead, after the batch
+	 * is flushed so that they stay in order.
+	 *
+	 * @param tPtr Thread pointer to be handed through to any callbacks called as a result of this call
+	 * @param packet Packet to send (its destination and IV are ignored)
+	 * @param dest Destination of this copy
+	 * @param encrypt Encrypt packet payload?
+	 * @param nwid Network ID to which this packet is related or 0 if none
+	 * @param flowId Flow ID
+	 * @param batch Batch to add the armored copy to
+	 */
+	void sendCopy(void* tPtr, const Packet& packet, const Address& dest, const bool encrypt, const uint64_t nwid, const int32_t flowId, WireBatch& batch);
+
 	/**
 	 * Request WHOIS on a given address
 	 *
+	 * Requests are batched: an address requested shortly after a WHOIS went
+	 * out waits until whoisFlushDeadline() to be sent along with others in
+	 * one VERB_WHOIS packet.
+	 *
 	 * @param tPtr Thread pointer to be handed through to any callbacks called as a result of this call
 	 * @param now Current time
 	 * @param addr Address to look up
 	 */
 	void requestWhois(void* tPtr, const int64_t now, const Address& addr);
 
+	/**
+	 * @return Time by which doTimerTasks() should run to send batched WHOIS requests, or 0 if none are waiting
+	 */
+	inline int64_t whoisFlushDeadline() const
+	{
+		return _whoisFlushDeadline.load(std::memory_order_relaxed);
+	}
+
 	/**
 	 * Run any processes that are waiting for this peer's identity
 	 *
@@ -197,18 +212,44 @@ class Switch {
 	 */
 	unsigned long doTimerTasks(void* tPtr, int64_t now);
 
+	/**
+	 * Forward datagrams for another node
+	 *
+	 * All datagrams must be for the same destination and already be checked
+	 * for relaying by onRemotePacket(). The destination's path is looked up
+	 * once for all of them in a small cache. Hop counts are incremented in
+	 * place.
+	 *
+	 * @param tPtr Thread pointer to be handed through to any callbacks called as a result of this call
+	 * @param datagrams Raw packet heads or fragments
+	 * @param lens Length of each datagram
+	 * @param count Number of datagrams
+	 * @param now Current time
+	 */
+	void relay(void* tPtr, uint8_t* const* datagrams, const unsigned int* lens, const unsigned int count, const int64_t now);
+
   private:
+	void _relay(void* tPtr, const void* data, unsigned int len, const int64_t now);
 	bool _shouldUnite(const int64_t now, const Address& source, const Address& destination);
 	bool _trySend(void* tPtr, Packet& packet, bool encrypt, const uint64_t nwid, const int32_t flowId /* = ZT_QOS_NO_FLOW*/);
-	void _sendViaSpecificPath(void* tPtr, SharedPtr<Peer> peer, SharedPtr<Path> viaPath, uint16_t userSpecifiedMtu, int64_t now, Packet& packet, bool encrypt, int32_t flowId);
+	SharedPtr<Path> _pathTo(void* tPtr, const SharedPtr<Peer>& peer, const int64_t now, const uint64_t nwid, const int32_t flowId);
+	void _sendViaSpecificPath(void* tPtr, const SharedPtr<Peer>& peer, const SharedPtr<Path>& viaPath, uint16_t userSpecifiedMtu, int64_t now, Packet& packet, bool encrypt, int32_t flowId);
 	void _recordOutgoingPacketMetrics(const Packet& p);
+	void _queueUntilSendable(void* tPtr, const Address& dest, const SharedPtr<PacketBuffer>& packet, const bool encrypt, const uint64_t nwid, const int32_t flowId);
+	bool _queueWhois(const int64_t now, const Address& addr);
+	void _flushWhois(void* tPtr, const int64_t now);
 
 	const RuntimeEnvironment* const RR;
 	int64_t _lastBeaconResponse;
 	volatile int64_t _lastCheckedQueues;
 
-	// Time we last sent a WHOIS request for each address
-	Hashtable<Address, int64_t> _lastSentWhoisRequest;
+	// Time we last sent a WHOIS request for each address, and addresses
+	// waiting to go out in the next batched WHOIS
+	FlatHashtable<Address, int64_t> _lastSentWhoisRequest;
+	TimerWheel<Address> _lastSentWhoisRequestExpiry;
+	std::vector<Address> _whoisBatch;
+	int64_t _lastWhoisFlush;
+	std::atomic<int64_t> _whoisFlushDeadline;
 	Mutex _lastSentWhoisRequest_m;
 
 	// Packets waiting for WHOIS replies or other decode info or missing fragments
@@ -254,20 +295,31 @@ class Switch {
 		TXQueueEntry()
 		{
 		}
-		TXQueueEntry(Address d, uint64_t nwid, uint64_t ct, const Packet& p, bool enc, int32_t fid) : dest(d), nwid(nwid), creationTime(ct), packet(p), encrypt(enc), flowId(fid)
+		TXQueueEntry(uint64_t nwid, uint64_t ct, const SharedPtr<PacketBuffer>& p, bool enc, int32_t fid) : nwid(nwid), creationTime(ct), packet(p), encrypt(enc), flowId(fid)
 		{
 		}
 
-		Address dest;
 		uint64_t nwid;
 		uint64_t creationTime;
-		Packet packet;	 // unencrypted/unMAC'd packet -- this is done at send time
+		SharedPtr<PacketBuffer> packet;	  // unencrypted/unMAC'd packet -- this is done at send time
 		bool encrypt;
 		int32_t flowId;
 	};
-	std::list<TXQueueEntry> _txQueue;
+
+	// Packets waiting for one destination's identity or a path to it, oldest first
+	struct TXQueue {
+		TXQueue() : bytes(0)
+		{
+		}
+		std::vector<TXQueueEntry> entries;
+		unsigned long bytes;
+	};
+	FlatHashtable<Address, TXQueue> _txQueues;
 	Mutex _txQueue_m;
-	Mutex _aqm_m;
+
+	// Append to a destination's queue within the size, byte and destination
+	// limits, dropping its oldest entries to make room (_txQueue_m must be held)
+	void _enqueueTx(const Address& dest, const TXQueueEntry& e, const int64_t now);
 
 	// Tracks sending of VERB_RENDEZVOUS to relaying peers
 	struct _LastUniteKey {
@@ -287,7 +339,7 @@ class Switch {
 		}
 		inline unsigned long hashCode() const
 		{
-			return ((unsigned long)x ^ (unsigned long)y);
+			return (unsigned long)((x * 0x9e3779b97f4a7c15ULL) ^ y);
 		}
 		inline bool operator==(const _LastUniteKey& k) const
 		{
@@ -295,32 +347,38 @@ class Switch {
 		}
 		uint64_t x, y;
 	};
-	Hashtable<_LastUniteKey, uint64_t> _lastUniteAttempt;	// key is always sorted in ascending order, for set-like behavior
+	FlatHashtable<_LastUniteKey, uint64_t> _lastUniteAttempt;	// key is always sorted in ascending order, for set-like behavior
+	TimerWheel<_LastUniteKey> _lastUniteAttemptExpiry;
 	Mutex _lastUniteAttempt_m;
 
-	// Queue with additional flow state variables
-	struct ManagedQueue {
-		ManagedQueue(int id) : id(id), byteCredit(ZT_AQM_QUANTUM), byteLength(0), dropping(false)
+	// Recently checked unites, so relaying usually skips _lastUniteAttempt_m
+	struct _RecentUnite {
+		_RecentUnite() : key(0), time(0)
 		{
 		}
-		int id;
-		int byteCredit;
-		int byteLength;
-		uint64_t first_above_time;
-		uint32_t count;
-		uint64_t drop_next;
-		bool dropping;
-		uint64_t drop_next_time;
-		std::list<TXQueueEntry*> q;
+		std::atomic<unsigned long> key;	  // _LastUniteKey::hashCode()
+		std::atomic<int64_t> time;
 	};
-	// To implement fq_codel we need to maintain a queue of queues
-	struct NetworkQoSControlBlock {
-		int _currEnqueuedPackets;
-		std::vector<ManagedQueue*> newQueues;
-		std::vector<ManagedQueue*> oldQueues;
-		std::vector<ManagedQueue*> inactiveQueues;
+	_RecentUnite _recentUnites[ZT_RELAY_UNITE_FILTER_SIZE];
+
+	// Direct mapped cache of where relayed packets for a destination go
+	struct _RelayRoute {
+		_RelayRoute() : expires(0), viaUpstream(false)
+		{
+		}
+		Address destination;
+		SharedPtr<Peer> peer;	// destination, or upstream if destination has no direct path
+		SharedPtr<Path> path;
+		int64_t expires;
+		bool viaUpstream;
+		Mutex lock;
 	};
-	std::map<uint64_t, NetworkQoSControlBlock*> _netQueueControlBlock;
+	_RelayRoute _relayRoutes[ZT_RELAY_ROUTE_CACHE_SIZE];
+
+	// Per-network fq_codel schedulers, looked up without locking
+	typedef FlatHashtable<uint64_t, SharedPtr<QoSQueue> > _QoSQueueTable;
+	SnapshotPtr<_QoSQueueTable> _qosQueues;
+	Mutex _qosQueues_m;	  // serializes changes to _qosQueues
 };
 
 }	// namespace ZeroTier
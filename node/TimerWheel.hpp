@@ -0,0 +1,249 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * (c) ZeroTier, Inc.
+ * https://www.zerotier.com/
+ */
+
+#ifndef ZT_TIMERWHEEL_HPP
+#define ZT_TIMERWHEEL_HPP
+
+#include "Constants.hpp"
+#include "FlatHashtable.hpp"
+
+#include <stdint.h>
+#include <vector>
+
+/**
+ * log2 of number of slots per level of a TimerWheel
+ */
+#define ZT_TIMER_WHEEL_SLOT_BITS 6
+
+/**
+ * Number of levels in a TimerWheel
+ *
+ * With 6-bit levels and ZT_CORE_TIMER_TASK_GRANULARITY ticks the wheel
+ * covers about 11 days. Later deadlines are parked in the last level.
+ */
+#define ZT_TIMER_WHEEL_LEVELS 4
+
+namespace ZeroTier {
+
+/**
+ * Hierarchical timing wheel of keys, each with its own deadline
+ *
+ * Level 0 has one slot per tick. Each higher level has slots that span a
+ * whole turn of the level below, and a slot is redistributed into lower
+ * levels when the wheel reaches it. Scheduling and expiring are O(1) per
+ * key, so periodic work only touches the keys that are actually due
+ * instead of scanning a whole table.
+ *
+ * Each key has at most one deadline. Scheduling a key that is already
+ * scheduled earlier does nothing, so callers can schedule freely whenever
+ * something might need attention and recheck the real state when the key
+ * expires. Keys expire up to one tick after their deadline, never before.
+ *
+ * This class is not thread safe.
+ *
+ * @tparam K Key type (must provide hashCode() and operator==)
+ */
+template <typename K> class TimerWheel {
+  public:
+	/**
+	 * @param tick Length of a tick in milliseconds
+	 */
+	TimerWheel(const unsigned int tick) : _tick((tick) ? tick : 1), _cur(0), _dueHead(0)
+	{
+	}
+
+	/**
+	 * Schedule a key, unless it is already scheduled at or before deadline
+	 *
+	 * @param k Key
+	 * @param deadline Time at which k should expire
+	 */
+	inline void schedule(const K& k, const int64_t deadline)
+	{
+		int64_t* const d = _deadlines.get(k);
+		if (d) {
+			if (*d <= deadline) {
+				return;
+			}
+			*d = deadline;
+		}
+		else {
+			_deadlines.set(k, deadline);
+		}
+		_insert(_Entry(k, deadline));
+	}
+
+	/**
+	 * @param k Key to unschedule
+	 */
+	inline void cancel(const K& k)
+	{
+		_deadlines.erase(k);
+	}
+
+	/**
+	 * @param k Key
+	 * @return True if k is scheduled
+	 */
+	inline bool scheduled(const K& k) const
+	{
+		return _deadlines.contains(k);
+	}
+
+	/**
+	 * Advance to now and take keys whose deadlines have passed
+	 *
+	 * Returned keys are no longer scheduled. If more than max keys are due
+	 * the rest are returned by the next call.
+	 *
+	 * @param now Current time
+	 * @param expired Expired keys are appended here
+	 * @param max Maximum number of keys to return
+	 * @return Number of keys returned
+	 */
+	inline unsigned long expire(const int64_t now, std::vector<K>& expired, const unsigned long max)
+	{
+		_advance(now);
+		unsigned long n = 0;
+		while ((n < max) && (_dueHead < _due.size())) {
+			const _Entry& e = _due[_dueHead++];
+			const int64_t* const d = _deadlines.get(e.k);
+			if ((d) && (*d == e.deadline)) {   // skip entries superseded by an earlier schedule() or cancel()
+				_deadlines.erase(e.k);
+				expired.push_back(e.k);
+				++n;
+			}
+		}
+		if (_dueHead >= _due.size()) {
+			_due.clear();
+			_dueHead = 0;
+		}
+		return n;
+	}
+
+	/**
+	 * @param now Current time
+	 * @return Time at or before which the next key may expire
+	 */
+	inline int64_t nextDeadline(const int64_t now) const
+	{
+		if (_dueHead < _due.size()) {
+			return now;
+		}
+		for (uint64_t t = _cur + 1; t < (_cur + _SLOTS); ++t) {
+			if (! _slots[0][t & _MASK].empty()) {
+				return _dueAt(t);
+			}
+		}
+		return _dueAt(_cur + _SLOTS);	// next cascade from level 1
+	}
+
+	/**
+	 * @return Number of scheduled keys
+	 */
+	inline unsigned long size() const
+	{
+		return _deadlines.size();
+	}
+
+  private:
+	enum { _SLOTS = 1 << ZT_TIMER_WHEEL_SLOT_BITS, _MASK = _SLOTS - 1 };
+
+	struct _Entry {
+		_Entry(const K& k, const int64_t d) : k(k), deadline(d)
+		{
+		}
+		K k;
+		int64_t deadline;
+	};
+
+	// A tick is fully due once its last millisecond has passed
+	inline int64_t _dueAt(const uint64_t t) const
+	{
+		return (int64_t)(((t + 1) * (uint64_t)_tick) - 1);
+	}
+
+	inline void _insert(const _Entry& e)
+	{
+		const uint64_t t = (e.deadline > 0) ? ((uint64_t)e.deadline / (uint64_t)_tick) : 0;
+		if (t <= _cur) {
+			_due.push_back(e);
+			return;
+		}
+		uint64_t delta = t - _cur;
+		for (unsigned int l = 0; l < ZT_TIMER_WHEEL_LEVELS; ++l) {
+			const unsigned int shift = l * ZT_TIMER_WHEEL_SLOT_BITS;
+			if ((delta >> shift) < (uint64_t)_SLOTS) {
+				_slots[l][(t >> shift) & _MASK].push_back(e);
+				return;
+			}
+		}
+		// Beyond the last level: park in its farthest slot to be redistributed later
+		const unsigned int shift = (ZT_TIMER_WHEEL_LEVELS - 1) * ZT_TIMER_WHEEL_SLOT_BITS;
+		_slots[ZT_TIMER_WHEEL_LEVELS - 1][((_cur >> shift) + _MASK) & _MASK].push_back(e);
+	}
+
+	inline void _advance(const int64_t now)
+	{
+		if (now < (int64_t)_tick) {
+			return;
+		}
+		const uint64_t target = (((uint64_t)now + 1) / (uint64_t)_tick) - 1;
+		if (target <= _cur) {
+			return;
+		}
+
+		// On the first call or after a long sleep, re-place everything rather than step through every tick
+		if ((target - _cur) >= ((uint64_t)1 << (ZT_TIMER_WHEEL_SLOT_BITS * ZT_TIMER_WHEEL_LEVELS))) {
+			std::vector<_Entry> all;
+			for (unsigned int l = 0; l < ZT_TIMER_WHEEL_LEVELS; ++l) {
+				for (unsigned int s = 0; s < _SLOTS; ++s) {
+					all.insert(all.end(), _slots[l][s].begin(), _slots[l][s].end());
+					_slots[l][s].clear();
+				}
+			}
+			_cur = target;
+			for (typename std::vector<_Entry>::const_iterator e(all.begin()); e != all.end(); ++e) {
+				_insert(*e);
+			}
+			return;
+		}
+
+		while (_cur < target) {
+			++_cur;
+			// When a level wraps, spread the next slot of the level above into the levels below
+			for (unsigned int l = 1; l < ZT_TIMER_WHEEL_LEVELS; ++l) {
+				const unsigned int shift = l * ZT_TIMER_WHEEL_SLOT_BITS;
+				if ((_cur & (((uint64_t)1 << shift) - 1)) != 0) {
+					break;
+				}
+				std::vector<_Entry> cascade;
+				cascade.swap(_slots[l][(_cur >> shift) & _MASK]);
+				for (typename std::vector<_Entry>::const_iterator e(cascade.begin()); e != cascade.end(); ++e) {
+					_insert(*e);
+				}
+			}
+			std::vector<_Entry>& s = _slots[0][_cur & _MASK];
+			if (! s.empty()) {
+				_due.insert(_due.end(), s.begin(), s.end());
+				s.clear();
+			}
+		}
+	}
+
+	const unsigned int _tick;
+	uint64_t _cur;	 // last tick that has been fully expired
+	std::vector<_Entry> _slots[ZT_TIMER_WHEEL_LEVELS][_SLOTS];
+	std::vector<_Entry> _due;
+	unsigned long _dueHead;
+	FlatHashtable<K, int64_t> _deadlines;
+};
+
+}	// namespace ZeroTier
+
+#endif
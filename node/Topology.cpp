@@ -36,7 +36,7 @@ static const unsigned char ZT_DEFAULT_WORLD[ZT_DEFAULT_WORLD_LENGTH] = {
 	0x39, 0x7c, 0xc8, 0xa5, 0xd9, 0xd1, 0x52, 0x85, 0xa8, 0x7f, 0x00, 0x02, 0x04, 0x54, 0x11, 0x35, 0x9b, 0x27, 0x09, 0x06, 0x2a, 0x02, 0x6e, 0xa0, 0xd4, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x99, 0x93, 0x27, 0x09
 };
 
-Topology::Topology(const RuntimeEnvironment* renv, void* tPtr) : RR(renv), _numConfiguredPhysicalPaths(0), _amUpstream(false)
+Topology::Topology(const RuntimeEnvironment* renv, void* tPtr) : RR(renv), _numConfiguredPhysicalPaths(0), _peerTimers(ZT_CORE_TIMER_TASK_GRANULARITY), _pathTimers(ZT_CORE_TIMER_TASK_GRANULARITY), _amUpstream(false)
 {
 	uint8_t tmp[ZT_WORLD_MAX_SERIALIZED_LENGTH];
 	uint64_t idtmp[2];
@@ -63,24 +63,21 @@ Topology::Topology(const RuntimeEnvironment* renv, void* tPtr) : RR(renv), _numC
 
 Topology::~Topology()
 {
-	Hashtable<Address, SharedPtr<Peer> >::Iterator i(_peers);
-	Address* a = (Address*)0;
-	SharedPtr<Peer>* p = (SharedPtr<Peer>*)0;
-	while (i.next(a, p)) {
-		_savePeer((void*)0, *p);
+	const std::vector<std::pair<Address, SharedPtr<Peer> > > peers(_peers.entries());
+	for (std::vector<std::pair<Address, SharedPtr<Peer> > >::const_iterator p(peers.begin()); p != peers.end(); ++p) {
+		_savePeer((void*)0, p->second);
 	}
 }
 
 SharedPtr<Peer> Topology::addPeer(void* tPtr, const SharedPtr<Peer>& peer)
 {
 	SharedPtr<Peer> np;
-	{
-		Mutex::Lock _l(_peers_m);
-		SharedPtr<Peer>& hp = _peers[peer->address()];
-		if (! hp) {
-			hp = peer;
+	if (! _peers.get(peer->address(), np)) {
+		np = _peers.setIfAbsent(peer->address(), peer);
+		if (np == peer) {
+			_saveIdentity(tPtr, peer->identity());
+			schedulePeer(peer->address(), 0);
 		}
-		np = hp;
 	}
 	return np;
 }
@@ -92,10 +89,9 @@ SharedPtr<Peer> Topology::getPeer(void* tPtr, const Address& zta)
 	}
 
 	{
-		Mutex::Lock _l(_peers_m);
-		const SharedPtr<Peer>* const ap = _peers.get(zta);
-		if (ap) {
-			return *ap;
+		SharedPtr<Peer> ap;
+		if (_peers.get(zta, ap)) {
+			return ap;
 		}
 	}
 
@@ -107,14 +103,15 @@ SharedPtr<Peer> Topology::getPeer(void* tPtr, const Address& zta)
 		int len = RR->node->stateObjectGet(tPtr, ZT_STATE_OBJECT_PEER, idbuf, buf.unsafeData(), ZT_PEER_MAX_SERIALIZED_STATE_SIZE);
 		if (len > 0) {
 			buf.setSize(len);
-			Mutex::Lock _l(_peers_m);
-			SharedPtr<Peer>& ap = _peers[zta];
-			if (ap) {
+			SharedPtr<Peer> ap;
+			if (_peers.get(zta, ap)) {
 				return ap;
 			}
 			ap = Peer::deserializeFromCache(RR->node->now(), tPtr, buf, RR);
-			if (! ap) {
-				_peers.erase(zta);
+			if (ap) {
+				if (_peers.setIfAbsent(zta, ap) == ap) {
+					schedulePeer(zta, 0);
+				}
 			}
 			return SharedPtr<Peer>();
 		}
@@ -131,12 +128,30 @@ Identity Topology::getIdentity(void* tPtr, const Address& zta)
 		return RR->identity;
 	}
 	else {
-		Mutex::Lock _l(_peers_m);
-		const SharedPtr<Peer>* const ap = _peers.get(zta);
-		if (ap) {
-			return (*ap)->identity();
+		SharedPtr<Peer> ap;
+		if (_peers.get(zta, ap)) {
+			return ap->identity();
 		}
 	}
+
+	try {
+		Buffer<ZT_IDENTITY_MAX_BINARY_SERIALIZED_LENGTH> buf;
+		uint64_t idbuf[2];
+		idbuf[0] = zta.toInt();
+		idbuf[1] = 0;
+		const int len = RR->node->stateObjectGet(tPtr, ZT_STATE_OBJECT_PEER_IDENTITY, idbuf, buf.unsafeData(), ZT_IDENTITY_MAX_BINARY_SERIALIZED_LENGTH);
+		if (len > 0) {
+			buf.setSize(len);
+			Identity id;
+			id.deserialize(buf, 0);
+			if (id.address() == zta) {
+				return id;
+			}
+		}
+	}
+	catch (...) {
+	}	// ignore invalid identities or other strange failures
+
 	return Identity();
 }
 
@@ -144,7 +159,7 @@ SharedPtr<Peer> Topology::getUpstreamPeer(const uint64_t nwid)
 {
 	const int64_t now = RR->node->now();
 	unsigned int bestq = ~((unsigned int)0);
-	const SharedPtr<Peer>* best = (const SharedPtr<Peer>*)0;
+	SharedPtr<Peer> best;
 
 	/*
 	// If this is related to a network, check for a network specific relay.
@@ -158,12 +173,11 @@ SharedPtr<Peer> Topology::getUpstreamPeer(const uint64_t nwid)
 
 	// If this is unrelated to a network OR there is no network-specific relay, send via a root.
 	{
-		Mutex::Lock _l2(_peers_m);
 		Mutex::Lock _l1(_upstreams_m);
 		for (std::vector<Address>::const_iterator a(_upstreamAddresses.begin()); a != _upstreamAddresses.end(); ++a) {
-			const SharedPtr<Peer>* p = _peers.get(*a);
-			if (p) {
-				const unsigned int q = (*p)->relayQuality(now);
+			SharedPtr<Peer> p;
+			if (_peers.get(*a, p)) {
+				const unsigned int q = p->relayQuality(now);
 				if (q <= bestq) {
 					bestq = q;
 					best = p;
@@ -171,7 +185,7 @@ SharedPtr<Peer> Topology::getUpstreamPeer(const uint64_t nwid)
 			}
 		}
 		if (best) {
-			return *best;
+			return best;
 		}
 	}
 
@@ -289,7 +303,6 @@ bool Topology::addWorld(void* tPtr, const World& newWorld, bool alwaysAcceptNew)
 		return false;
 	}
 
-	Mutex::Lock _l2(_peers_m);
 	Mutex::Lock _l1(_upstreams_m);
 
 	World* existing = (World*)0;
@@ -393,7 +406,6 @@ void Topology::addMoon(void* tPtr, const uint64_t id, const Address& seed)
 
 void Topology::removeMoon(void* tPtr, const uint64_t id)
 {
-	Mutex::Lock _l2(_peers_m);
 	Mutex::Lock _l1(_upstreams_m);
 
 	std::vector<World> nm;
@@ -421,38 +433,70 @@ void Topology::removeMoon(void* tPtr, const uint64_t id)
 	_memoizeUpstreams(tPtr);
 }
 
-void Topology::doPeriodicTasks(void* tPtr, int64_t now)
+void Topology::takeDuePeers(void* tPtr, int64_t now, std::vector<SharedPtr<Peer> >& due, unsigned long max)
 {
+	std::vector<Address> expired;
 	{
-		Mutex::Lock _l1(_peers_m);
-		Mutex::Lock _l2(_upstreams_m);
-		Hashtable<Address, SharedPtr<Peer> >::Iterator i(_peers);
-		Address* a = (Address*)0;
-		SharedPtr<Peer>* p = (SharedPtr<Peer>*)0;
-		while (i.next(a, p)) {
-			if ((! (*p)->isAlive(now)) && (std::find(_upstreamAddresses.begin(), _upstreamAddresses.end(), *a) == _upstreamAddresses.end())) {
-				_savePeer(tPtr, *p);
-				_peers.erase(*a);
+		Mutex::Lock _l(_peerTimers_m);
+		_peerTimers.expire(now, expired, max);
+	}
+	std::vector<Address> dead;
+	for (std::vector<Address>::const_iterator a(expired.begin()); a != expired.end(); ++a) {
+		SharedPtr<Peer> p;
+		if (! _peers.get(*a, p)) {
+			continue;
+		}
+		if (! p->isAlive(now)) {
+			Mutex::Lock _l(_upstreams_m);
+			if (std::find(_upstreamAddresses.begin(), _upstreamAddresses.end(), *a) == _upstreamAddresses.end()) {
+				_savePeer(tPtr, p);
+				dead.push_back(*a);
+				continue;
 			}
 		}
+		due.push_back(p);
 	}
+	if (! dead.empty()) {
+		_peers.eraseAll(dead);
+	}
+}
 
+unsigned long Topology::expirePaths(int64_t now, unsigned long max)
+{
+	std::vector<Path::HashKey> due;
 	{
-		Mutex::Lock _l(_paths_m);
-		Hashtable<Path::HashKey, SharedPtr<Path> >::Iterator i(_paths);
-		Path::HashKey* k = (Path::HashKey*)0;
-		SharedPtr<Path>* p = (SharedPtr<Path>*)0;
-		while (i.next(k, p)) {
-			if (p->references() <= 1) {
-				_paths.erase(*k);
-			}
+		Mutex::Lock _l(_pathTimers_m);
+		_pathTimers.expire(now, due, max);
+	}
+	unsigned long n = 0;
+	for (std::vector<Path::HashKey>::const_iterator k(due.begin()); k != due.end(); ++k) {
+		if (_paths.eraseIfStill(*k, _EraseUnusedPath(now))) {
+			++n;
+		}
+		else if (_paths.contains(*k)) {
+			Mutex::Lock _l(_pathTimers_m);
+			_pathTimers.schedule(*k, now + ZT_PATH_UNUSED_CHECK_INTERVAL);
 		}
 	}
+	return n;
+}
+
+void Topology::doPeriodicTasks(void* tPtr, int64_t now)
+{
+	// Unused paths are dropped by expirePaths(); this just frees replaced
+	// shard arrays and erased entries no reader can still be using
+	_paths.reclaim();
+}
+
+void Topology::_schedulePath(const Path::HashKey& k)
+{
+	Mutex::Lock _l(_pathTimers_m);
+	_pathTimers.schedule(k, RR->node->now() + ZT_PATH_UNUSED_CHECK_INTERVAL);
 }
 
 void Topology::_memoizeUpstreams(void* tPtr)
 {
-	// assumes _upstreams_m and _peers_m are locked
+	// assumes _upstreams_m is locked
 	_upstreamAddresses.clear();
 	_amUpstream = false;
 
@@ -463,9 +507,9 @@ void Topology::_memoizeUpstreams(void* tPtr)
 		}
 		else if (std::find(_upstreamAddresses.begin(), _upstreamAddresses.end(), id.address()) == _upstreamAddresses.end()) {
 			_upstreamAddresses.push_back(id.address());
-			SharedPtr<Peer>& hp = _peers[id.address()];
-			if (! hp) {
-				hp = new Peer(RR, RR->identity, id);
+			if (! _peers.contains(id.address())) {
+				_peers.setIfAbsent(id.address(), SharedPtr<Peer>(new Peer(RR, RR->identity, id)));
+				schedulePeer(id.address(), 0);
 			}
 		}
 	}
@@ -477,9 +521,9 @@ void Topology::_memoizeUpstreams(void* tPtr)
 			}
 			else if (std::find(_upstreamAddresses.begin(), _upstreamAddresses.end(), i->identity.address()) == _upstreamAddresses.end()) {
 				_upstreamAddresses.push_back(i->identity.address());
-				SharedPtr<Peer>& hp = _peers[i->identity.address()];
-				if (! hp) {
-					hp = new Peer(RR, RR->identity, i->identity);
+				if (! _peers.contains(i->identity.address())) {
+					_peers.setIfAbsent(i->identity.address(), SharedPtr<Peer>(new Peer(RR, RR->identity, i->identity)));
+					schedulePeer(i->identity.address(), 0);
 				}
 			}
 		}
@@ -488,6 +532,20 @@ void Topology::_memoizeUpstreams(void* tPtr)
 	std::sort(_upstreamAddresses.begin(), _upstreamAddresses.end());
 }
 
+void Topology::_saveIdentity(void* tPtr, const Identity& id)
+{
+	try {
+		Buffer<ZT_IDENTITY_MAX_BINARY_SERIALIZED_LENGTH> buf;
+		id.serialize(buf, false);
+		uint64_t tmpid[2];
+		tmpid[0] = id.address().toInt();
+		tmpid[1] = 0;
+		RR->node->stateObjectPut(tPtr, ZT_STATE_OBJECT_PEER_IDENTITY, tmpid, buf.data(), buf.size());
+	}
+	catch (...) {
+	}	// sanity check, discard invalid entries
+}
+
 void Topology::_savePeer(void* tPtr, const SharedPtr<Peer>& peer)
 {
 	try {
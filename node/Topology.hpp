@@ -17,6 +17,8 @@
 #include "Mutex.hpp"
 #include "Path.hpp"
 #include "Peer.hpp"
+#include "ShardedHashtable.hpp"
+#include "TimerWheel.hpp"
 #include "World.hpp"
 
 #include <algorithm>
@@ -24,6 +26,16 @@
 #include <utility>
 #include <vector>
 
+/**
+ * Number of independently updated shards of the peer table
+ */
+#define ZT_TOPOLOGY_PEER_SHARDS 256
+
+/**
+ * Number of independently updated shards of the path table
+ */
+#define ZT_TOPOLOGY_PATH_SHARDS 256
+
 namespace ZeroTier {
 
 class RuntimeEnvironment;
@@ -40,7 +52,7 @@ class Topology {
 	 * Add a peer to database
 	 *
 	 * This will not replace existing peers. In that case the existing peer
-	 * record is returned.
+	 * record is returned. A new peer's identity is handed to the host to store.
 	 *
 	 * @param tPtr Thread pointer to be handed through to any callbacks called as a result of this call
 	 * @param peer Peer to add
@@ -58,6 +70,31 @@ class Topology {
 	SharedPtr<Peer> getPeer(void* tPtr, const Address& zta);
 
 	/**
+	 * Get a peer without touching its reference count
+	 *
+	 * The calling thread must be inside a SnapshotReaders::Pass. A peer found
+	 * in memory is returned by reference into the peer table and stays valid
+	 * until the Pass ends; copy it to keep it longer. Otherwise this falls
+	 * back to getPeer() and the result is held in 'loaded'.
+	 *
+	 * @param tPtr Thread pointer to be handed through to any callbacks called as a result of this call
+	 * @param zta ZeroTier address of peer
+	 * @param loaded Holds the peer if it had to be looked up by getPeer()
+	 * @return Peer or NULL if not found
+	 */
+	inline const SharedPtr<Peer>& borrowPeer(void* tPtr, const Address& zta, SharedPtr<Peer>& loaded)
+	{
+		const SharedPtr<Peer>* const p = _peers.borrow(zta);
+		if (p) {
+			return *p;
+		}
+		loaded = getPeer(tPtr, zta);
+		return loaded;
+	}
+
+	/**
+	 * Get a peer's identity from memory or, failing that, from the host's identity store
+	 *
 	 * @param tPtr Thread pointer to be handed through to any callbacks called as a result of this call
 	 * @param zta ZeroTier address of peer
 	 * @return Identity or NULL identity if not found
@@ -76,12 +113,9 @@ class Topology {
 	 */
 	inline SharedPtr<Peer> getPeerNoCache(const Address& zta)
 	{
-		Mutex::Lock _l(_peers_m);
-		const SharedPtr<Peer>* const ap = _peers.get(zta);
-		if (ap) {
-			return *ap;
-		}
-		return SharedPtr<Peer>();
+		SharedPtr<Peer> p;
+		_peers.get(zta, p);
+		return p;
 	}
 
 	/**
@@ -93,14 +127,52 @@ class Topology {
 	 */
 	inline SharedPtr<Path> getPath(const int64_t l, const InetAddress& r)
 	{
-		Mutex::Lock _l(_paths_m);
-		SharedPtr<Path>& p = _paths[Path::HashKey(l, r)];
-		if (! p) {
-			p.set(new Path(l, r));
+		const Path::HashKey k(l, r);
+		SharedPtr<Path> p;
+		if ((! _paths.get(k, p)) || (! _stillHeld(k, p))) {
+			const SharedPtr<Path> n(new Path(l, r));
+			p = _paths.setIfAbsent(k, n);
+			if (p == n) {
+				_schedulePath(k);
+			}
 		}
 		return p;
 	}
 
+	/**
+	 * Get a Path object for a received packet without touching its reference count
+	 *
+	 * The calling thread must be inside a SnapshotReaders::Pass. The path is
+	 * marked as having received a packet at 'now', which keeps expirePaths()
+	 * from erasing it for the rest of the pass. An existing path is returned
+	 * by reference into the path table and stays valid until the Pass ends.
+	 * A newly created one is held in 'created'.
+	 *
+	 * @param l Local socket
+	 * @param r Remote address
+	 * @param now Current time
+	 * @param created Holds the path if it had to be created
+	 * @return Canonicalized Path object
+	 */
+	inline const SharedPtr<Path>& borrowPath(const int64_t l, const InetAddress& r, const int64_t now, SharedPtr<Path>& created)
+	{
+		const Path::HashKey k(l, r);
+		const SharedPtr<Path>* const p = _paths.borrow(k);
+		if (p) {
+			(*p)->received(now);
+			if (_stillHeld(k, *p)) {
+				return *p;
+			}
+		}
+		const SharedPtr<Path> n(new Path(l, r));
+		created = _paths.setIfAbsent(k, n);
+		if (created == n) {
+			_schedulePath(k);
+		}
+		created->received(now);
+		return created;
+	}
+
 	/**
 	 * Get the current best upstream peer
 	 *
@@ -242,41 +314,91 @@ class Topology {
 	 */
 	void doPeriodicTasks(void* tPtr, int64_t now);
 
+	/**
+	 * Schedule background work (pings, expiry) for a peer
+	 *
+	 * This does nothing if the peer is already scheduled at or before deadline.
+	 *
+	 * @param zta ZeroTier address of peer
+	 * @param deadline Time at which the peer needs attention
+	 */
+	inline void schedulePeer(const Address& zta, const int64_t deadline)
+	{
+		Mutex::Lock _l(_peerTimers_m);
+		_peerTimers.schedule(zta, deadline);
+	}
+
+	/**
+	 * Take peers whose scheduled deadlines have passed
+	 *
+	 * Peers that are no longer alive, other than upstreams, are saved and
+	 * removed instead of being returned. Returned peers are no longer
+	 * scheduled, so the caller must schedule them again with schedulePeer().
+	 *
+	 * @param tPtr Thread pointer to be handed through to any callbacks called as a result of this call
+	 * @param now Current time
+	 * @param due Due peers are appended here
+	 * @param max Maximum number of peers to take
+	 */
+	void takeDuePeers(void* tPtr, int64_t now, std::vector<SharedPtr<Peer> >& due, unsigned long max);
+
+	/**
+	 * Drop paths that nothing but the path table refers to
+	 *
+	 * Each path is checked once every ZT_PATH_UNUSED_CHECK_INTERVAL, as its
+	 * own timer comes due, so this only visits paths that are due. A path is
+	 * kept if it sent or received anything within the last interval.
+	 *
+	 * @param now Current time
+	 * @param max Maximum number of paths to check
+	 * @return Number of paths dropped
+	 */
+	unsigned long expirePaths(int64_t now, unsigned long max);
+
+	/**
+	 * @param now Current time
+	 * @return Time at or before which another path may be due for a check
+	 */
+	inline int64_t nextPathDeadline(const int64_t now) const
+	{
+		Mutex::Lock _l(_pathTimers_m);
+		return _pathTimers.nextDeadline(now);
+	}
+
+	/**
+	 * @param now Current time
+	 * @return Time at or before which another peer may be due
+	 */
+	inline int64_t nextPeerDeadline(const int64_t now) const
+	{
+		Mutex::Lock _l(_peerTimers_m);
+		return _peerTimers.nextDeadline(now);
+	}
+
 	/**
 	 * @param now Current time
 	 * @return Number of peers with active direct paths
 	 */
 	inline unsigned long countActive(int64_t now) const
 	{
-		unsigned long cnt = 0;
-		Mutex::Lock _l(_peers_m);
-		Hashtable<Address, SharedPtr<Peer> >::Iterator i(const_cast<Topology*>(this)->_peers);
-		Address* a = (Address*)0;
-		SharedPtr<Peer>* p = (SharedPtr<Peer>*)0;
-		while (i.next(a, p)) {
-			const SharedPtr<Path> pp((*p)->getAppropriatePath(now, false));
-			if (pp) {
-				++cnt;
-			}
-		}
-		return cnt;
+		_CountActive c(now);
+		_peers.each<_CountActive&>(c);
+		return c.cnt;
 	}
 
 	/**
 	 * Apply a function or function object to all peers
 	 *
+	 * Peers are visited one shard snapshot at a time without locking, so
+	 * peers added or removed meanwhile may or may not be visited.
+	 *
 	 * @param f Function to apply
 	 * @tparam F Function or function object type
 	 */
 	template <typename F> inline void eachPeer(F f)
 	{
-		Mutex::Lock _l(_peers_m);
-		Hashtable<Address, SharedPtr<Peer> >::Iterator i(_peers);
-		Address* a = (Address*)0;
-		SharedPtr<Peer>* p = (SharedPtr<Peer>*)0;
-		while (i.next(a, p)) {
-			f(*this, *((const SharedPtr<Peer>*)p));
-		}
+		_EachPeer<F> ep(*this, f);
+		_peers.each<_EachPeer<F>&>(ep);
 	}
 
 	/**
@@ -284,10 +406,25 @@ class Topology {
 	 */
 	inline std::vector<std::pair<Address, SharedPtr<Peer> > > allPeers() const
 	{
-		Mutex::Lock _l(_peers_m);
 		return _peers.entries();
 	}
 
+	/**
+	 * @return Number of peers in memory
+	 */
+	inline unsigned long peerCount() const
+	{
+		return _peers.size();
+	}
+
+	/**
+	 * @return Number of paths in memory
+	 */
+	inline unsigned long pathCount() const
+	{
+		return _paths.size();
+	}
+
 	/**
 	 * @return True if I am a root server in a planet or moon
 	 */
@@ -410,18 +547,77 @@ class Topology {
   private:
 	Identity _getIdentity(void* tPtr, const Address& zta);
 	void _memoizeUpstreams(void* tPtr);
+	void _saveIdentity(void* tPtr, const Identity& id);
 	void _savePeer(void* tPtr, const SharedPtr<Peer>& peer);
+	void _schedulePath(const Path::HashKey& k);
+
+	// Looks k up again after the caller has marked p as in use, to catch
+	// expirePaths() having erased it in between
+	inline bool _stillHeld(const Path::HashKey& k, const SharedPtr<Path>& p) const
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		const SnapshotReaders::Pass pass;
+		const SharedPtr<Path>* const c = _paths.borrow(k);
+		return ((c) && (*c == p));
+	}
 
 	const RuntimeEnvironment* const RR;
 
 	std::pair<InetAddress, ZT_PhysicalPathConfiguration> _physicalPathConfig[ZT_MAX_CONFIGURABLE_PATHS];
 	volatile unsigned int _numConfiguredPhysicalPaths;
 
-	Hashtable<Address, SharedPtr<Peer> > _peers;
-	Mutex _peers_m;
+	template <typename F> struct _EachPeer {
+		_EachPeer(Topology& t, F& f) : t(t), f(f)
+		{
+		}
+		inline void operator()(const Address& a, const SharedPtr<Peer>& p)
+		{
+			f(t, p);
+		}
+		Topology& t;
+		F& f;
+	};
+
+	struct _CountActive {
+		_CountActive(const int64_t n) : now(n), cnt(0)
+		{
+		}
+		inline void operator()(const Address& a, const SharedPtr<Peer>& p)
+		{
+			const SharedPtr<Path> pp(p->getAppropriatePath(now, false));
+			if (pp) {
+				++cnt;
+			}
+		}
+		const int64_t now;
+		unsigned long cnt;
+	};
+
+	// Erases paths referenced only by the path table and idle for a full
+	// check interval. Paths borrowed for a packet hold no reference but are
+	// marked received, so the second test keeps them (see eraseIfStill()).
+	struct _EraseUnusedPath {
+		_EraseUnusedPath(const int64_t n) : now(n)
+		{
+		}
+		inline bool operator()(const Path::HashKey& k, const SharedPtr<Path>& p) const
+		{
+			return ((p.references() <= 1) && ((now - std::max(p->lastIn(), p->lastOut())) >= ZT_PATH_UNUSED_CHECK_INTERVAL));
+		}
+		const int64_t now;
+	};
+
+	// Looked up for every packet, so reads take no locks (see ShardedHashtable)
+	ShardedHashtable<Address, SharedPtr<Peer>, ZT_TOPOLOGY_PEER_SHARDS> _peers;
+	ShardedHashtable<Path::HashKey, SharedPtr<Path>, ZT_TOPOLOGY_PATH_SHARDS> _paths;
+
+	// Each peer's next ping or expiry check
+	TimerWheel<Address> _peerTimers;
+	Mutex _peerTimers_m;
 
-	Hashtable<Path::HashKey, SharedPtr<Path> > _paths;
-	Mutex _paths_m;
+	// Each path's next check for being unused
+	TimerWheel<Path::HashKey> _pathTimers;
+	Mutex _pathTimers_m;
 
 	World _planet;
 	std::vector<World> _moons;
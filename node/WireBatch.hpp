@@ -0,0 +1,150 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * (c) ZeroTier, Inc.
+ * https://www.zerotier.com/
+ */
+
+#ifndef ZT_WIREBATCH_HPP
+#define ZT_WIREBATCH_HPP
+
+#include "../include/ZeroTierOne.h"
+#include "Constants.hpp"
+#include "Node.hpp"
+#include "Packet.hpp"
+#include "Path.hpp"
+#include "RuntimeEnvironment.hpp"
+#include "SharedPtr.hpp"
+
+#include <stdint.h>
+
+/**
+ * Maximum number of packets handed to the host in one batch
+ */
+#define ZT_WIRE_BATCH_MAX_PACKETS 64
+
+/**
+ * Size of a batch's packet buffer (must hold at least one fragmented packet)
+ */
+#define ZT_WIRE_BATCH_MAX_BYTES (ZT_WIRE_BATCH_MAX_PACKETS * ZT_DEFAULT_PHYSMTU)
+
+namespace ZeroTier {
+
+/**
+ * Packets collected for the wire and sent to the host in one call
+ *
+ * When one packet is sent to many peers, as for multicast, each copy is
+ * armored straight into this buffer. flush() passes them all to the
+ * host's batch send callback so it can send them with e.g. sendmmsg(), or
+ * to the single packet callback one by one if it has no batch callback.
+ * The batch is flushed when it is full and when it is destroyed.
+ *
+ * Paths are marked as sent to when packets are added, since failures of
+ * batched sends are not reported back.
+ *
+ * This class is not thread safe. It is meant to live on the stack for the
+ * duration of one fan-out, or for the life of a worker thread.
+ */
+class WireBatch {
+  public:
+	WireBatch(const RuntimeEnvironment* renv, void* tPtr) : RR(renv), _tPtr(tPtr), _buf((uint8_t*)0), _used(0), _count(0)
+	{
+	}
+
+	~WireBatch()
+	{
+		flush();
+		delete[] _buf;
+	}
+
+	/**
+	 * Get space to write packets to, flushing first if there is not enough
+	 *
+	 * @param len Number of bytes that will be written (at most ZT_WIRE_BATCH_MAX_BYTES)
+	 * @param packets Number of packets that will be added
+	 * @return Pointer to at least len bytes of free space
+	 */
+	inline uint8_t* reserve(const unsigned int len, const unsigned int packets)
+	{
+		if (! _buf) {
+			_buf = new uint8_t[ZT_WIRE_BATCH_MAX_BYTES];
+		}
+		if (((_used + len) > ZT_WIRE_BATCH_MAX_BYTES) || ((_count + packets) > ZT_WIRE_BATCH_MAX_PACKETS)) {
+			flush();
+		}
+		return _buf + _used;
+	}
+
+	/**
+	 * Add a packet written to the space returned by the last reserve()
+	 *
+	 * @param path Path to send packet via
+	 * @param data Packet data
+	 * @param len Packet length
+	 * @param now Current time
+	 */
+	inline void add(const SharedPtr<Path>& path, const uint8_t* data, const unsigned int len, const int64_t now)
+	{
+		const unsigned int end = (unsigned int)(data - _buf) + len;
+		if (end > _used) {
+			_used = end;
+		}
+		_paths[_count] = path;
+		ZT_WirePacket& p = _packets[_count++];
+		p.localSocket = path->localSocket();
+		p.address = reinterpret_cast<const struct sockaddr_storage*>(&(path->address()));
+		p.data = data;
+		p.len = len;
+		path->sent(now);
+	}
+
+	/**
+	 * Send all packets in the batch
+	 */
+	inline void flush()
+	{
+		if (_count) {
+			RR->node->putPackets(_tPtr, _packets, _count);
+			for (unsigned int i = 0; i < _count; ++i) {
+				_paths[i].zero();
+			}
+			_count = 0;
+		}
+		_used = 0;
+	}
+
+	/**
+	 * Send later packets with a different thread pointer, flushing first if it changes
+	 *
+	 * @param tPtr Thread pointer to be handed through to the host's send callbacks
+	 */
+	inline void setThreadPtr(void* tPtr)
+	{
+		if (tPtr != _tPtr) {
+			flush();
+			_tPtr = tPtr;
+		}
+	}
+
+	/**
+	 * @return Number of packets waiting to be sent
+	 */
+	inline unsigned int count() const
+	{
+		return _count;
+	}
+
+  private:
+	const RuntimeEnvironment* const RR;
+	void* _tPtr;
+	uint8_t* _buf;
+	unsigned int _used;
+	unsigned int _count;
+	ZT_WirePacket _packets[ZT_WIRE_BATCH_MAX_PACKETS];
+	SharedPtr<Path> _paths[ZT_WIRE_BATCH_MAX_PACKETS];
+};
+
+}	// namespace ZeroTier
+
+#endif
@@ -6,6 +6,7 @@ CORE_OBJS=\
 	node/Capability.o \
 	node/CertificateOfMembership.o \
 	node/CertificateOfOwnership.o \
+	node/CompiledRules.o \
 	node/Identity.o \
 	node/IncomingPacket.o \
 	node/InetAddress.o \
@@ -20,6 +21,7 @@ CORE_OBJS=\
 	node/Path.o \
 	node/Peer.o \
 	node/Poly1305.o \
+	node/QoSQueue.o \
 	node/Revocation.o \
 	node/Salsa20.o \
 	node/SelfAwareness.o \
@@ -37,4 +39,7 @@ ONE_OBJS=\
 	osdep/EthernetTap.o \
 	osdep/ManagedRoute.o \
 	osdep/Http.o \
+	osdep/IdentityStore.o \
+	osdep/PeerStateStore.o \
+	osdep/StateWriter.o \
 	service/OneService.o
@@ -36,21 +36,41 @@ template <class T> class BlockingQueue {
 		c.notify_one();
 	}
 
-	inline void postLimit(T t, const unsigned long limit)
+	/**
+	 * Post, waiting while the queue holds limit items
+	 *
+	 * @return True if posted, false if the queue was stopped
+	 */
+	inline bool postLimit(T t, const unsigned long limit)
 	{
 		std::unique_lock<std::mutex> lock(m);
 		for (;;) {
+			if (! r)
+				return false;
 			if (q.size() < limit) {
 				q.push(t);
 				c.notify_one();
-				break;
+				return true;
 			}
-			if (! r)
-				break;
 			gc.wait(lock);
 		}
 	}
 
+	/**
+	 * Post unless the queue already holds limit items
+	 *
+	 * @return True if posted
+	 */
+	inline bool tryPost(T t, const unsigned long limit)
+	{
+		std::lock_guard<std::mutex> lock(m);
+		if ((! r) || (q.size() >= limit))
+			return false;
+		q.push(t);
+		c.notify_one();
+		return true;
+	}
+
 	inline void stop(void)
 	{
 		std::lock_guard<std::mutex> lock(m);
@@ -77,8 +97,36 @@ template <class T> class BlockingQueue {
 		return true;
 	}
 
+	/**
+	 * Wait for at least one item, then take up to max items in one lock
+	 *
+	 * @return Number of items appended to values, or 0 if stopped
+	 */
+	inline unsigned long getBatch(std::vector<T>& values, const unsigned long max)
+	{
+		std::unique_lock<std::mutex> lock(m);
+		if (! r)
+			return 0;
+		while (q.empty()) {
+			c.wait(lock);
+			if (! r) {
+				gc.notify_all();
+				return 0;
+			}
+		}
+		unsigned long n = 0;
+		while ((! q.empty()) && (n < max)) {
+			values.push_back(q.front());
+			q.pop();
+			++n;
+		}
+		gc.notify_all();
+		return n;
+	}
+
 	inline std::vector<T> drain()
 	{
+		std::lock_guard<std::mutex> lock(m);
 		std::vector<T> v;
 		while (! q.empty()) {
 			v.push_back(q.front());
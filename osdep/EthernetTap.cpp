@@ -156,6 +156,12 @@ bool EthernetTap::addIps(std::vector<InetAddress> ips)
 	return true;
 }
 
+void EthernetTap::putBatch(const ZT_VirtualNetworkFrame* frames, unsigned int count)
+{
+	for (unsigned int i = 0; i < count; ++i)
+		put(MAC(frames[i].sourceMac), MAC(frames[i].destMac), frames[i].etherType, frames[i].data, frames[i].len);
+}
+
 std::string EthernetTap::friendlyName() const
 {
 	// Most platforms do not have this.
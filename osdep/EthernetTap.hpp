@@ -47,6 +47,7 @@ class EthernetTap {
 	virtual bool removeIp(const InetAddress& ip) = 0;
 	virtual std::vector<InetAddress> ips() const = 0;
 	virtual void put(const MAC& from, const MAC& to, unsigned int etherType, const void* data, unsigned int len) = 0;
+	virtual void putBatch(const ZT_VirtualNetworkFrame* frames, unsigned int count);	 // uses put() unless overridden
 	virtual std::string deviceName() const = 0;
 	virtual void setFriendlyName(const char* friendlyName) = 0;
 	virtual std::string friendlyName() const;
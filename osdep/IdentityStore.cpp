@@ -0,0 +1,437 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * (c) ZeroTier, Inc.
+ * https://www.zerotier.com/
+ */
+
+#include "../node/Constants.hpp"
+
+#ifndef __WINDOWS__
+
+#include "IdentityStore.hpp"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Log and index are grown in multiples of these
+#define ZT_IDENTITY_STORE_LOG_INITIAL_CAPACITY 1048576ULL
+#define ZT_IDENTITY_STORE_INDEX_INITIAL_SLOTS  4096ULL
+
+// Record: 5-byte big-endian address, 1-byte value length, value
+#define ZT_IDENTITY_STORE_RECORD_HEADER 6
+
+namespace ZeroTier {
+
+namespace {
+
+static const char LOG_MAGIC[8] = { 'Z', 'T', 'I', 'D', 'L', 'O', 'G', '1' };
+static const char INDEX_MAGIC[8] = { 'Z', 'T', 'I', 'D', 'I', 'D', 'X', '1' };
+
+struct LogHeader {
+	char magic[8];
+	uint64_t end;	// first byte after last complete record
+};
+
+struct IndexHeader {
+	char magic[8];
+	uint64_t slotCount;	  // always a power of two
+	uint64_t used;
+	uint64_t indexedTo;	  // log offset up to which records are indexed
+};
+
+// Fibonacci hashing into a power of two sized table
+static inline uint64_t slotFor(const uint64_t address, const uint64_t slotCount)
+{
+	return (address * 0x9e3779b97f4a7c15ULL) >> (64 - __builtin_ctzll(slotCount));
+}
+
+static inline uint64_t recordAddress(const uint8_t* r)
+{
+	return (((uint64_t)r[0] << 32) | ((uint64_t)r[1] << 24) | ((uint64_t)r[2] << 16) | ((uint64_t)r[3] << 8) | (uint64_t)r[4]);
+}
+
+}	// anonymous namespace
+
+IdentityStore::IdentityStore() : _logFd(-1), _log((uint8_t*)0), _logCapacity(0), _indexFd(-1), _index((uint8_t*)0), _indexSize(0)
+{
+}
+
+IdentityStore::~IdentityStore()
+{
+	Mutex::Lock _l(_lock);
+	_close();
+}
+
+bool IdentityStore::open(const char* path)
+{
+	Mutex::Lock _l(_lock);
+	_close();
+
+	_logPath = path;
+	_logPath.append(".db");
+	_indexPath = path;
+	_indexPath.append(".idx");
+
+	_logFd = ::open(_logPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (_logFd < 0) {
+		fprintf(stderr, "WARNING: unable to open identity store %s" ZT_EOL_S, _logPath.c_str());
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(_logFd, &st) != 0) {
+		_close();
+		return false;
+	}
+	bool fresh = false;
+	if ((uint64_t)st.st_size < sizeof(LogHeader)) {
+		if (ftruncate(_logFd, (off_t)ZT_IDENTITY_STORE_LOG_INITIAL_CAPACITY) != 0) {
+			_close();
+			return false;
+		}
+		_logCapacity = ZT_IDENTITY_STORE_LOG_INITIAL_CAPACITY;
+		fresh = true;
+	}
+	else {
+		_logCapacity = (uint64_t)st.st_size;
+	}
+
+	void* const m = mmap((void*)0, (size_t)_logCapacity, PROT_READ | PROT_WRITE, MAP_SHARED, _logFd, 0);
+	if (m == MAP_FAILED) {
+		_log = (uint8_t*)0;
+		_close();
+		return false;
+	}
+	_log = reinterpret_cast<uint8_t*>(m);
+
+	LogHeader* const lh = reinterpret_cast<LogHeader*>(_log);
+	if (fresh) {
+		memcpy(lh->magic, LOG_MAGIC, 8);
+		lh->end = sizeof(LogHeader);
+	}
+	else if ((memcmp(lh->magic, LOG_MAGIC, 8) != 0) || (lh->end < sizeof(LogHeader)) || (lh->end > _logCapacity)) {
+		fprintf(stderr, "WARNING: identity store %s is not valid, ignoring it" ZT_EOL_S, _logPath.c_str());
+		_close();
+		return false;
+	}
+
+	if (! _openIndex(fresh)) {
+		_close();
+		return false;
+	}
+	return true;
+}
+
+void IdentityStore::close()
+{
+	Mutex::Lock _l(_lock);
+	_close();
+}
+
+bool IdentityStore::isOpen() const
+{
+	Mutex::Lock _l(_lock);
+	return (_log != (uint8_t*)0);
+}
+
+int IdentityStore::get(uint64_t address, void* data, unsigned int maxlen) const
+{
+	address &= 0xffffffffffULL;
+	Mutex::Lock _l(_lock);
+	if ((! _log) || (! address)) {
+		return -1;
+	}
+	const uint8_t* const r = _record(_find(address));
+	if (! r) {
+		return -1;
+	}
+	const unsigned int len = r[5];
+	if (len > maxlen) {
+		return -1;
+	}
+	memcpy(data, r + ZT_IDENTITY_STORE_RECORD_HEADER, len);
+	return (int)len;
+}
+
+bool IdentityStore::put(uint64_t address, const void* data, unsigned int len)
+{
+	address &= 0xffffffffffULL;
+	if ((! address) || (len > ZT_IDENTITY_STORE_MAX_VALUE)) {
+		return false;
+	}
+
+	Mutex::Lock _l(_lock);
+	if (! _log) {
+		return false;
+	}
+
+	const uint8_t* const existing = _record(_find(address));
+	if ((existing) && (existing[5] == len) && (memcmp(existing + ZT_IDENTITY_STORE_RECORD_HEADER, data, len) == 0)) {
+		return true;
+	}
+
+	LogHeader* lh = reinterpret_cast<LogHeader*>(_log);
+	const uint64_t offset = lh->end;
+	if (! _growLog(offset + ZT_IDENTITY_STORE_RECORD_HEADER + len)) {
+		return false;
+	}
+	lh = reinterpret_cast<LogHeader*>(_log);
+
+	uint8_t* const r = _log + offset;
+	r[0] = (uint8_t)(address >> 32);
+	r[1] = (uint8_t)(address >> 24);
+	r[2] = (uint8_t)(address >> 16);
+	r[3] = (uint8_t)(address >> 8);
+	r[4] = (uint8_t)address;
+	r[5] = (uint8_t)len;
+	memcpy(r + ZT_IDENTITY_STORE_RECORD_HEADER, data, len);
+	lh->end = offset + ZT_IDENTITY_STORE_RECORD_HEADER + len;
+
+	// Catches this record, and any left unindexed by a failed index resize
+	_indexLog();
+	return true;
+}
+
+unsigned long IdentityStore::count() const
+{
+	Mutex::Lock _l(_lock);
+	return (_index) ? (unsigned long)reinterpret_cast<const IndexHeader*>(_index)->used : 0;
+}
+
+void IdentityStore::_close()
+{
+	if (_index) {
+		munmap(_index, (size_t)_indexSize);
+		_index = (uint8_t*)0;
+	}
+	_indexSize = 0;
+	if (_indexFd >= 0) {
+		::close(_indexFd);
+		_indexFd = -1;
+	}
+	if (_log) {
+		munmap(_log, (size_t)_logCapacity);
+		_log = (uint8_t*)0;
+	}
+	_logCapacity = 0;
+	if (_logFd >= 0) {
+		::close(_logFd);
+		_logFd = -1;
+	}
+}
+
+bool IdentityStore::_growLog(uint64_t needed)
+{
+	if (needed <= _logCapacity) {
+		return true;
+	}
+	uint64_t newCapacity = _logCapacity;
+	while (newCapacity < needed) {
+		newCapacity <<= 1;
+	}
+	if (ftruncate(_logFd, (off_t)newCapacity) != 0) {
+		return false;
+	}
+	void* const m = mmap((void*)0, (size_t)newCapacity, PROT_READ | PROT_WRITE, MAP_SHARED, _logFd, 0);
+	if (m == MAP_FAILED) {
+		return false;
+	}
+	munmap(_log, (size_t)_logCapacity);
+	_log = reinterpret_cast<uint8_t*>(m);
+	_logCapacity = newCapacity;
+	return true;
+}
+
+bool IdentityStore::_openIndex(bool rebuild)
+{
+	if (! rebuild) {
+		_indexFd = ::open(_indexPath.c_str(), O_RDWR | O_CLOEXEC);
+		if (_indexFd >= 0) {
+			struct stat st;
+			if ((fstat(_indexFd, &st) == 0) && ((uint64_t)st.st_size >= sizeof(IndexHeader))) {
+				_indexSize = (uint64_t)st.st_size;
+				void* const m = mmap((void*)0, (size_t)_indexSize, PROT_READ | PROT_WRITE, MAP_SHARED, _indexFd, 0);
+				if (m != MAP_FAILED) {
+					_index = reinterpret_cast<uint8_t*>(m);
+					const IndexHeader* const ih = reinterpret_cast<const IndexHeader*>(_index);
+					if ((memcmp(ih->magic, INDEX_MAGIC, 8) == 0) && (ih->slotCount >= ZT_IDENTITY_STORE_INDEX_INITIAL_SLOTS) && ((ih->slotCount & (ih->slotCount - 1)) == 0)
+						&& (_indexSize == (sizeof(IndexHeader) + (ih->slotCount * sizeof(_Slot)))) && (ih->used < ih->slotCount)
+						&& (ih->indexedTo >= sizeof(LogHeader)) && (ih->indexedTo <= reinterpret_cast<const LogHeader*>(_log)->end) && (_slotsValid())) {
+						_indexLog();
+						return true;
+					}
+					munmap(_index, (size_t)_indexSize);
+					_index = (uint8_t*)0;
+				}
+			}
+			::close(_indexFd);
+			_indexFd = -1;
+			_indexSize = 0;
+		}
+	}
+
+	// Missing, damaged or ahead of the log (e.g. after a crash): rebuild
+	if (! _resizeIndex(ZT_IDENTITY_STORE_INDEX_INITIAL_SLOTS)) {
+		return false;
+	}
+	_indexLog();
+	return true;
+}
+
+bool IdentityStore::_resizeIndex(uint64_t slotCount)
+{
+	// Built beside the current index and renamed over it when complete
+	const std::string tmpPath(_indexPath + ".tmp");
+	const uint64_t size = sizeof(IndexHeader) + (slotCount * sizeof(_Slot));
+	const int fd = ::open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return false;
+	}
+	if (ftruncate(fd, (off_t)size) != 0) {
+		::close(fd);
+		unlink(tmpPath.c_str());
+		return false;
+	}
+	void* const m = mmap((void*)0, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (m == MAP_FAILED) {
+		::close(fd);
+		unlink(tmpPath.c_str());
+		return false;
+	}
+	uint8_t* const index = reinterpret_cast<uint8_t*>(m);
+
+	IndexHeader* const ih = reinterpret_cast<IndexHeader*>(index);
+	memcpy(ih->magic, INDEX_MAGIC, 8);
+	ih->slotCount = slotCount;
+	ih->used = 0;
+	ih->indexedTo = sizeof(LogHeader);
+
+	if (_index) {
+		const IndexHeader* const oh = reinterpret_cast<const IndexHeader*>(_index);
+		const _Slot* const os = reinterpret_cast<const _Slot*>(_index + sizeof(IndexHeader));
+		_Slot* const ns = reinterpret_cast<_Slot*>(index + sizeof(IndexHeader));
+		for (uint64_t i = 0; i < oh->slotCount; ++i) {
+			if (os[i].address) {
+				uint64_t j = slotFor(os[i].address, slotCount);
+				while (ns[j].address) {
+					j = (j + 1) & (slotCount - 1);
+				}
+				ns[j] = os[i];
+			}
+		}
+		ih->used = oh->used;
+		ih->indexedTo = oh->indexedTo;
+	}
+
+	if (rename(tmpPath.c_str(), _indexPath.c_str()) != 0) {
+		munmap(m, (size_t)size);
+		::close(fd);
+		unlink(tmpPath.c_str());
+		return false;
+	}
+
+	if (_index) {
+		munmap(_index, (size_t)_indexSize);
+	}
+	if (_indexFd >= 0) {
+		::close(_indexFd);
+	}
+	_index = index;
+	_indexSize = size;
+	_indexFd = fd;
+	return true;
+}
+
+void IdentityStore::_indexLog()
+{
+	const uint64_t end = reinterpret_cast<const LogHeader*>(_log)->end;
+	for (;;) {
+		IndexHeader* const ih = reinterpret_cast<IndexHeader*>(_index);
+		if ((ih->indexedTo + ZT_IDENTITY_STORE_RECORD_HEADER) > end) {
+			break;
+		}
+		const uint8_t* const r = _log + ih->indexedTo;
+		const uint64_t next = ih->indexedTo + ZT_IDENTITY_STORE_RECORD_HEADER + r[5];
+		if (next > end) {
+			break;
+		}
+
+		// Keep load at or below one half
+		if (((ih->used + 1) * 2) > ih->slotCount) {
+			if (! _resizeIndex(ih->slotCount * 2)) {
+				break;
+			}
+			continue;
+		}
+
+		const uint64_t address = recordAddress(r);
+		if (address) {
+			_Slot* const s = _find(address);
+			if (! s->address) {
+				s->address = address;
+				++ih->used;
+			}
+			s->offset = ih->indexedTo;
+		}
+		ih->indexedTo = next;
+	}
+}
+
+bool IdentityStore::_slotsValid() const
+{
+	const IndexHeader* const ih = reinterpret_cast<const IndexHeader*>(_index);
+	if (ih->indexedTo < (sizeof(LogHeader) + ZT_IDENTITY_STORE_RECORD_HEADER)) {
+		return (ih->used == 0);
+	}
+	const uint64_t maxOffset = ih->indexedTo - ZT_IDENTITY_STORE_RECORD_HEADER;
+	const _Slot* const slots = reinterpret_cast<const _Slot*>(_index + sizeof(IndexHeader));
+	uint64_t used = 0;
+	for (uint64_t i = 0; i < ih->slotCount; ++i) {
+		if (slots[i].address) {
+			if ((slots[i].offset < sizeof(LogHeader)) || (slots[i].offset > maxOffset)) {
+				return false;
+			}
+			++used;
+		}
+	}
+	return (used == ih->used);
+}
+
+const uint8_t* IdentityStore::_record(const _Slot* s) const
+{
+	if (! s->address) {
+		return (const uint8_t*)0;
+	}
+	// Written so that a damaged offset cannot wrap around past the end of the log
+	const uint64_t end = reinterpret_cast<const LogHeader*>(_log)->end;
+	if ((s->offset < sizeof(LogHeader)) || (end < ZT_IDENTITY_STORE_RECORD_HEADER) || (s->offset > (end - ZT_IDENTITY_STORE_RECORD_HEADER))) {
+		return (const uint8_t*)0;
+	}
+	const uint8_t* const r = _log + s->offset;
+	if ((r[5] > ((end - ZT_IDENTITY_STORE_RECORD_HEADER) - s->offset)) || (recordAddress(r) != s->address)) {
+		return (const uint8_t*)0;
+	}
+	return r;
+}
+
+IdentityStore::_Slot* IdentityStore::_find(uint64_t address) const
+{
+	const uint64_t slotCount = reinterpret_cast<const IndexHeader*>(_index)->slotCount;
+	_Slot* const slots = reinterpret_cast<_Slot*>(_index + sizeof(IndexHeader));
+	uint64_t i = slotFor(address, slotCount);
+	while ((slots[i].address) && (slots[i].address != address)) {
+		i = (i + 1) & (slotCount - 1);
+	}
+	return slots + i;
+}
+
+}	// namespace ZeroTier
+
+#endif	 // !__WINDOWS__
@@ -0,0 +1,130 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * (c) ZeroTier, Inc.
+ * https://www.zerotier.com/
+ */
+
+#ifndef ZT_IDENTITYSTORE_HPP
+#define ZT_IDENTITYSTORE_HPP
+
+#include "../node/Constants.hpp"
+
+#ifndef __WINDOWS__
+
+#include "../node/Mutex.hpp"
+
+#include <stdint.h>
+#include <string>
+
+/**
+ * Maximum size of one stored value (a binary serialized public identity)
+ */
+#define ZT_IDENTITY_STORE_MAX_VALUE 255
+
+namespace ZeroTier {
+
+/**
+ * Append-only, memory-mapped store of peer identities keyed by 40-bit address
+ *
+ * Values live in a log file (<path>.db) that is only ever appended to and is
+ * mapped into memory. A separate open addressing hash index (<path>.idx),
+ * also mapped, maps each address to the offset of its most recent record.
+ * A lookup is a hash probe plus a copy out of the mapping, with no system
+ * calls.
+ *
+ * The log is authoritative. The index records how much of the log it covers
+ * and is extended or rebuilt from the log when it is behind, missing or
+ * damaged, so it does not need to be synced to survive a crash.
+ *
+ * Values are opaque to the store. Both files are in host byte order and are
+ * not meant to be copied between machines of different endianness.
+ *
+ * All methods are thread safe.
+ */
+class IdentityStore {
+  public:
+	IdentityStore();
+	~IdentityStore();
+
+	/**
+	 * Open or create a store
+	 *
+	 * @param path Path prefix; .db and .idx are appended
+	 * @return True on success
+	 */
+	bool open(const char* path);
+
+	/**
+	 * Unmap and close the store if it is open
+	 */
+	void close();
+
+	/**
+	 * @return True if the store is open
+	 */
+	bool isOpen() const;
+
+	/**
+	 * Get the most recent value stored for an address
+	 *
+	 * @param address 40-bit address
+	 * @param data Buffer to receive value
+	 * @param maxlen Size of buffer
+	 * @return Length of value or -1 if not found or larger than maxlen
+	 */
+	int get(uint64_t address, void* data, unsigned int maxlen) const;
+
+	/**
+	 * Store a value for an address
+	 *
+	 * Nothing is written if the address already maps to an identical value.
+	 *
+	 * @param address 40-bit address (must not be zero)
+	 * @param data Value
+	 * @param len Length of value, at most ZT_IDENTITY_STORE_MAX_VALUE
+	 * @return True if value is now stored
+	 */
+	bool put(uint64_t address, const void* data, unsigned int len);
+
+	/**
+	 * @return Number of distinct addresses in store
+	 */
+	unsigned long count() const;
+
+  private:
+	struct _Slot {
+		uint64_t address;	// 0 if empty
+		uint64_t offset;	// of record in log
+	};
+
+	// Must be called with _lock held
+	void _close();
+	bool _growLog(uint64_t needed);
+	bool _openIndex(bool rebuild);
+	bool _resizeIndex(uint64_t slotCount);
+	void _indexLog();
+	bool _slotsValid() const;
+	const uint8_t* _record(const _Slot* s) const;	// record for a slot, or NULL if none or out of range
+	_Slot* _find(uint64_t address) const;
+
+	std::string _logPath;
+	std::string _indexPath;
+
+	int _logFd;
+	uint8_t* _log;
+	uint64_t _logCapacity;
+
+	int _indexFd;
+	uint8_t* _index;
+	uint64_t _indexSize;
+
+	Mutex _lock;
+};
+
+}	// namespace ZeroTier
+
+#endif	 // !__WINDOWS__
+
+#endif
@@ -19,6 +19,7 @@
 #include "../node/Utils.hpp"
 #include "LinuxEthernetTap.hpp"
 #include "LinuxNetLink.hpp"
+#include "LinuxTapReactor.hpp"
 #include "OSUtils.hpp"
 
 #include <algorithm>
@@ -40,9 +41,9 @@
 #include <string.h>
 #include <string>
 #include <sys/ioctl.h>
-#include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/utsname.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -124,6 +125,7 @@ LinuxEthernetTap::LinuxEthernetTap(
 	, _enabled(true)
 	, _run(true)
 	, _lastIfAddrsUpdate(0)
+	, _reactorId(0)
 {
 	static std::mutex s_tapCreateLock;
 	char procpath[128], nwids[32];
@@ -216,155 +218,127 @@ LinuxEthernetTap::LinuxEthernetTap(
 	_dev = ifr.ifr_name;
 	::fcntl(_fd, F_SETFD, fcntl(_fd, F_GETFD) | FD_CLOEXEC);
 
-	(void)::pipe(_shutdownSignalPipe);
-
-	for (unsigned int i = 0; i < concurrency; ++i) {
-		_rxThreads.push_back(std::thread([this, i, concurrency, pinning] {
-			if (pinning) {
-				int pinCore = i % concurrency;
-				fprintf(stderr, "Pinning tap thread %d to core %d\n", i, pinCore);
-				pthread_t self = pthread_self();
-				cpu_set_t cpuset;
-				CPU_ZERO(&cpuset);
-				CPU_SET(pinCore, &cpuset);
-				int rc = pthread_setaffinity_np(self, sizeof(cpu_set_t), &cpuset);
-				if (rc != 0) {
-					fprintf(stderr, "Failed to pin tap thread %d to core %d: %s\n", i, pinCore, strerror(errno));
-					exit(1);
-				}
-			}
+	// Bring the interface up off the caller's thread (this involves several
+	// sleeps to work around kernel quirks), then hand the descriptor to the
+	// shared reactor which reads frames from all taps.
+	_initThread = std::thread([this, concurrency, pinning] {
+		_bringUp();
+		::fcntl(_fd, F_SETFL, ::fcntl(_fd, F_GETFL) | O_NONBLOCK);
+		std::lock_guard<std::mutex> l(_reactor_m);
+		if (_run) {
+			_reactorId = LinuxTapReactor::getInstance().add(_fd, this, concurrency, pinning);
+			if (! _reactorId)
+				fprintf(stderr, "WARNING: unable to register tap device %s with reactor" ZT_EOL_S, _dev.c_str());
+		}
+	});
+}
 
-			uint8_t b[ZT_TAP_BUF_SIZE];
-			fd_set readfds, nullfds;
-			int n, nfds, r;
-			if (i == 0) {
-				struct ifreq ifr;
-				memset(&ifr, 0, sizeof(ifr));
-				strcpy(ifr.ifr_name, _dev.c_str());
-
-				const int sock = socket(AF_INET, SOCK_DGRAM, 0);
-				if (sock <= 0)
-					return;
-
-				if (ioctl(sock, SIOCGIFFLAGS, (void*)&ifr) < 0) {
-					::close(sock);
-					printf("WARNING: ioctl() failed setting up Linux tap device (bring interface up)\n");
-					return;
-				}
+void LinuxEthernetTap::_bringUp()
+{
+	struct ifreq ifr;
+	memset(&ifr, 0, sizeof(ifr));
+	strcpy(ifr.ifr_name, _dev.c_str());
 
-				ifr.ifr_ifru.ifru_hwaddr.sa_family = ARPHRD_ETHER;
-				_mac.copyTo(ifr.ifr_ifru.ifru_hwaddr.sa_data, 6);
-				if (ioctl(sock, SIOCSIFHWADDR, (void*)&ifr) < 0) {
-					::close(sock);
-					printf("WARNING: ioctl() failed setting up Linux tap device (set MAC)\n");
-					return;
-				}
+	const int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock <= 0)
+		return;
 
-				usleep(100000);
+	if (ioctl(sock, SIOCGIFFLAGS, (void*)&ifr) < 0) {
+		::close(sock);
+		printf("WARNING: ioctl() failed setting up Linux tap device (bring interface up)\n");
+		return;
+	}
 
-				if (isOldLinuxKernel()) {
-					ifr.ifr_ifru.ifru_mtu = (int)_mtu;
-					if (ioctl(sock, SIOCSIFMTU, (void*)&ifr) < 0) {
-						::close(sock);
-						printf("WARNING: ioctl() failed setting up Linux tap device (set MTU)\n");
-						return;
-					}
+	ifr.ifr_ifru.ifru_hwaddr.sa_family = ARPHRD_ETHER;
+	_mac.copyTo(ifr.ifr_ifru.ifru_hwaddr.sa_data, 6);
+	if (ioctl(sock, SIOCSIFHWADDR, (void*)&ifr) < 0) {
+		::close(sock);
+		printf("WARNING: ioctl() failed setting up Linux tap device (set MAC)\n");
+		return;
+	}
 
-					usleep(100000);
-				}
+	usleep(100000);
 
-				ifr.ifr_flags |= IFF_MULTICAST;
-				ifr.ifr_flags |= IFF_UP;
-				if (ioctl(sock, SIOCSIFFLAGS, (void*)&ifr) < 0) {
-					::close(sock);
-					printf("WARNING: ioctl() failed setting up Linux tap device (bring interface up)\n");
-					return;
-				}
+	if (isOldLinuxKernel()) {
+		ifr.ifr_ifru.ifru_mtu = (int)_mtu;
+		if (ioctl(sock, SIOCSIFMTU, (void*)&ifr) < 0) {
+			::close(sock);
+			printf("WARNING: ioctl() failed setting up Linux tap device (set MTU)\n");
+			return;
+		}
 
-				usleep(100000);
-
-				if (! isOldLinuxKernel()) {
-					ifr.ifr_ifru.ifru_hwaddr.sa_family = ARPHRD_ETHER;
-					_mac.copyTo(ifr.ifr_ifru.ifru_hwaddr.sa_data, 6);
-					if (ioctl(sock, SIOCSIFHWADDR, (void*)&ifr) < 0) {
-						::close(sock);
-						printf("WARNING: ioctl() failed setting up Linux tap device (set MAC)\n");
-						return;
-					}
-
-					ifr.ifr_ifru.ifru_mtu = (int)_mtu;
-					if (ioctl(sock, SIOCSIFMTU, (void*)&ifr) < 0) {
-						::close(sock);
-						printf("WARNING: ioctl() failed setting up Linux tap device (set MTU)\n");
-						return;
-					}
-				}
+		usleep(100000);
+	}
 
-				fcntl(_fd, F_SETFL, O_NONBLOCK);
+	ifr.ifr_flags |= IFF_MULTICAST;
+	ifr.ifr_flags |= IFF_UP;
+	if (ioctl(sock, SIOCSIFFLAGS, (void*)&ifr) < 0) {
+		::close(sock);
+		printf("WARNING: ioctl() failed setting up Linux tap device (bring interface up)\n");
+		return;
+	}
 
-				::close(sock);
-			}
+	usleep(100000);
 
-			if (! _run) {
-				return;
-			}
+	if (! isOldLinuxKernel()) {
+		ifr.ifr_ifru.ifru_hwaddr.sa_family = ARPHRD_ETHER;
+		_mac.copyTo(ifr.ifr_ifru.ifru_hwaddr.sa_data, 6);
+		if (ioctl(sock, SIOCSIFHWADDR, (void*)&ifr) < 0) {
+			::close(sock);
+			printf("WARNING: ioctl() failed setting up Linux tap device (set MAC)\n");
+			return;
+		}
 
-			FD_ZERO(&readfds);
-			FD_ZERO(&nullfds);
-			nfds = (int)std::max(_shutdownSignalPipe[0], _fd) + 1;
+		ifr.ifr_ifru.ifru_mtu = (int)_mtu;
+		if (ioctl(sock, SIOCSIFMTU, (void*)&ifr) < 0) {
+			::close(sock);
+			printf("WARNING: ioctl() failed setting up Linux tap device (set MTU)\n");
+			return;
+		}
+	}
 
-			r = 0;
-			for (;;) {
-				FD_SET(_shutdownSignalPipe[0], &readfds);
-				FD_SET(_fd, &readfds);
-				select(nfds, &readfds, &nullfds, &nullfds, (struct timeval*)0);
+	::close(sock);
+}
 
-				if (FD_ISSET(_shutdownSignalPipe[0], &readfds)) {
-					break;
-				}
-				if (FD_ISSET(_fd, &readfds)) {
-					for (;;) {
-						// read until there are no more packets, then return to outer select() loop
-						n = (int)::read(_fd, b + r, ZT_TAP_BUF_SIZE - r);
-						if (n > 0) {
-							// Some tap drivers like to send the ethernet frame and the
-							// payload in two chunks, so handle that by accumulating
-							// data until we have at least a frame.
-							r += n;
-							if (r > 14) {
-								if (r > ((int)_mtu + 14))	// sanity check for weird TAP behavior on some platforms
-									r = _mtu + 14;
-
-								if (_enabled) {
-									MAC to(b, 6), from(b + 6, 6);
-									unsigned int etherType = Utils::ntoh(((const uint16_t*)b)[6]);
-									_handler(_arg, nullptr, _nwid, from, to, etherType, 0, (const void*)(b + 14), (unsigned int)(r - 14));
-								}
-
-								r = 0;
-							}
-						}
-						else {
-							r = 0;
-							break;
-						}
-					}
-				}
+bool LinuxEthernetTap::fdReadable(int fd, unsigned int budget)
+{
+	uint8_t b[ZT_TAP_BUF_SIZE];
+	for (unsigned int k = 0; k < budget; ++k) {
+		// Linux taps return exactly one frame per read(). Read until the
+		// descriptor is drained (edge-triggered epoll) or the budget is spent.
+		int n = (int)::read(fd, b, ZT_TAP_BUF_SIZE);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (n == 0)
+			return false;
+		if (n > 14) {
+			if (n > ((int)_mtu + 14))	// sanity check for weird TAP behavior on some platforms
+				n = _mtu + 14;
+
+			if (_enabled) {
+				MAC to(b, 6), from(b + 6, 6);
+				unsigned int etherType = Utils::ntoh(((const uint16_t*)b)[6]);
+				_handler(_arg, nullptr, _nwid, from, to, etherType, 0, (const void*)(b + 14), (unsigned int)(n - 14));
 			}
-		}));
+		}
 	}
+	return true;
 }
 
 LinuxEthernetTap::~LinuxEthernetTap()
 {
-	_run = false;
-	(void)::write(_shutdownSignalPipe[1], "\0", 1);
-	::close(_fd);
-	::close(_shutdownSignalPipe[0]);
-	::close(_shutdownSignalPipe[1]);
-	for (std::thread& t : _rxThreads) {
-		t.join();
+	{
+		std::lock_guard<std::mutex> l(_reactor_m);
+		_run = false;
 	}
+	if (_initThread.joinable())
+		_initThread.join();
+	if (_reactorId)
+		LinuxTapReactor::getInstance().remove(_reactorId);
+	::close(_fd);
 }
 
 void LinuxEthernetTap::setEnabled(bool en)
@@ -500,16 +474,39 @@ std::vector<InetAddress> LinuxEthernetTap::ips() const
 	return r;
 }
 
+// The tap expects a complete Ethernet frame per write(), so the 14-byte header
+// and the payload are handed to the kernel as two iovecs instead of being
+// copied into one contiguous buffer first.
+static inline void _writeFrame(int fd, uint64_t from, uint64_t to, unsigned int etherType, const void* data, unsigned int len)
+{
+	uint8_t hdr[14];
+	MAC(to).copyTo(hdr, 6);
+	MAC(from).copyTo(hdr + 6, 6);
+	hdr[12] = (uint8_t)((etherType >> 8) & 0xff);
+	hdr[13] = (uint8_t)(etherType & 0xff);
+	struct iovec iov[2];
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = const_cast<void*>(data);
+	iov[1].iov_len = len;
+	(void)::writev(fd, iov, 2);
+}
+
 void LinuxEthernetTap::put(const MAC& from, const MAC& to, unsigned int etherType, const void* data, unsigned int len)
 {
-	char putBuf[ZT_MAX_MTU + 64];
 	if ((_fd > 0) && (len <= _mtu) && (_enabled)) {
-		to.copyTo(putBuf, 6);
-		from.copyTo(putBuf + 6, 6);
-		*((uint16_t*)(putBuf + 12)) = htons((uint16_t)etherType);
-		memcpy(putBuf + 14, data, len);
-		len += 14;
-		(void)::write(_fd, putBuf, len);
+		_writeFrame(_fd, from.toInt(), to.toInt(), etherType, data, len);
+	}
+}
+
+void LinuxEthernetTap::putBatch(const ZT_VirtualNetworkFrame* frames, unsigned int count)
+{
+	if ((_fd <= 0) || (! _enabled))
+		return;
+	const unsigned int mtu = _mtu;
+	for (unsigned int i = 0; i < count; ++i) {
+		if (frames[i].len <= mtu)
+			_writeFrame(_fd, frames[i].sourceMac, frames[i].destMac, frames[i].etherType, frames[i].data, frames[i].len);
 	}
 }
 
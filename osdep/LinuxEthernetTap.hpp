@@ -12,6 +12,7 @@
 #include "../node/MulticastGroup.hpp"
 #include "BlockingQueue.hpp"
 #include "EthernetTap.hpp"
+#include "LinuxTapReactor.hpp"
 
 #include <array>
 #include <atomic>
@@ -25,7 +26,9 @@
 
 namespace ZeroTier {
 
-class LinuxEthernetTap : public EthernetTap {
+class LinuxEthernetTap
+	: public EthernetTap
+	, public LinuxTapReactor::Handler {
   public:
 	LinuxEthernetTap(
 		const char* homePath,
@@ -48,6 +51,7 @@ class LinuxEthernetTap : public EthernetTap {
 	virtual bool removeIp(const InetAddress& ip);
 	virtual std::vector<InetAddress> ips() const;
 	virtual void put(const MAC& from, const MAC& to, unsigned int etherType, const void* data, unsigned int len);
+	virtual void putBatch(const ZT_VirtualNetworkFrame* frames, unsigned int count);
 	virtual std::string deviceName() const;
 	virtual void setFriendlyName(const char* friendlyName);
 	virtual void scanMulticastGroups(std::vector<MulticastGroup>& added, std::vector<MulticastGroup>& removed);
@@ -57,7 +61,11 @@ class LinuxEthernetTap : public EthernetTap {
 		fprintf(stderr, "WARNING: ignoring call to LinuxEthernetTap::setDns on Linux. This is not implemented yet. See https://github.com/zerotier/ZeroTierOne/issues/2492 for details" ZT_EOL_S);
 	}
 
+	virtual bool fdReadable(int fd, unsigned int budget);
+
   private:
+	void _bringUp();
+
 	void (*_handler)(void*, void*, uint64_t, const MAC&, const MAC&, unsigned int, unsigned int, const void*, unsigned int);
 	void* _arg;
 	uint64_t _nwid;
@@ -67,12 +75,13 @@ class LinuxEthernetTap : public EthernetTap {
 	std::vector<MulticastGroup> _multicastGroups;
 	unsigned int _mtu;
 	int _fd;
-	int _shutdownSignalPipe[2];
 	std::atomic_bool _enabled;
 	std::atomic_bool _run;
 	mutable std::vector<InetAddress> _ifaddrs;
 	mutable uint64_t _lastIfAddrsUpdate;
-	std::vector<std::thread> _rxThreads;
+	std::thread _initThread;
+	std::mutex _reactor_m;
+	uint64_t _reactorId;
 };
 
 }	// namespace ZeroTier
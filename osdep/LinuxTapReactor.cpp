@@ -0,0 +1,221 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * (c) ZeroTier, Inc.
+ * https://www.zerotier.com/
+ */
+
+#include "../node/Constants.hpp"
+
+#ifdef __LINUX__
+
+#include "LinuxTapReactor.hpp"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define ZT_TAP_REACTOR_MAX_EVENTS 64
+
+namespace ZeroTier {
+
+LinuxTapReactor::LinuxTapReactor() : _epfd(-1), _wakeFd(-1), _nextId(1)
+{
+	_epfd = epoll_create1(EPOLL_CLOEXEC);
+	_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if ((_epfd >= 0) && (_wakeFd >= 0)) {
+		// Level-triggered so that every thread sees the wakeup and exits.
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u64 = 0;
+		epoll_ctl(_epfd, EPOLL_CTL_ADD, _wakeFd, &ev);
+	}
+	else {
+		fprintf(stderr, "WARNING: unable to create epoll reactor for tap devices: %s" ZT_EOL_S, strerror(errno));
+	}
+}
+
+LinuxTapReactor::~LinuxTapReactor()
+{
+	{
+		std::lock_guard<std::mutex> l(_lifecycle_m);
+		_stop();
+	}
+	if (_wakeFd >= 0)
+		::close(_wakeFd);
+	if (_epfd >= 0)
+		::close(_epfd);
+}
+
+uint64_t LinuxTapReactor::add(int fd, Handler* h, unsigned int threads, bool pinning)
+{
+	if ((_epfd < 0) || (_wakeFd < 0))
+		return 0;
+
+	std::lock_guard<std::mutex> ll(_lifecycle_m);
+
+	uint64_t id;
+	{
+		std::lock_guard<std::mutex> l(_entries_m);
+		id = _nextId++;
+		_Entry& e = _entries[id];
+		e.fd = fd;
+		e.handler = h;
+		e.busy = 0;
+		e.dead = false;
+	}
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.u64 = id;
+	if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		std::lock_guard<std::mutex> l(_entries_m);
+		_entries.erase(id);
+		return 0;
+	}
+
+	if (_threads.empty())
+		_start((threads > 0) ? threads : 1, pinning);
+
+	return id;
+}
+
+void LinuxTapReactor::remove(uint64_t id)
+{
+	std::lock_guard<std::mutex> ll(_lifecycle_m);
+
+	bool empty;
+	{
+		std::unique_lock<std::mutex> l(_entries_m);
+		std::map<uint64_t, _Entry>::iterator e(_entries.find(id));
+		if (e == _entries.end())
+			return;
+		e->second.dead = true;
+		epoll_ctl(_epfd, EPOLL_CTL_DEL, e->second.fd, (struct epoll_event*)0);
+		while (e->second.busy > 0)
+			_idle.wait(l);
+		_entries.erase(e);
+		empty = _entries.empty();
+	}
+
+	if (empty)
+		_stop();
+}
+
+unsigned int LinuxTapReactor::threadCount() const
+{
+	std::lock_guard<std::mutex> ll(_lifecycle_m);
+	return (unsigned int)_threads.size();
+}
+
+void LinuxTapReactor::_start(unsigned int threads, bool pinning)
+{
+	for (unsigned int i = 0; i < threads; ++i)
+		_threads.push_back(std::thread([this, i, pinning] { _threadMain(i, pinning); }));
+}
+
+void LinuxTapReactor::_stop()
+{
+	if (_threads.empty())
+		return;
+	const uint64_t one = 1;
+	(void)::write(_wakeFd, &one, sizeof(one));
+	for (std::thread& t : _threads)
+		t.join();
+	_threads.clear();
+	uint64_t drain;
+	(void)::read(_wakeFd, &drain, sizeof(drain));
+}
+
+void LinuxTapReactor::_threadMain(unsigned int tn, bool pinning)
+{
+	if (pinning) {
+		fprintf(stderr, "Pinning tap thread %u to core %u\n", tn, tn);
+		cpu_set_t cpuset;
+		CPU_ZERO(&cpuset);
+		CPU_SET(tn, &cpuset);
+		int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+		if (rc != 0) {
+			fprintf(stderr, "Failed to pin tap thread %u to core %u: %s\n", tn, tn, strerror(errno));
+			exit(1);
+		}
+	}
+
+	struct epoll_event evs[ZT_TAP_REACTOR_MAX_EVENTS];
+	std::vector<uint64_t> work;
+	work.reserve(ZT_TAP_REACTOR_MAX_EVENTS * 2);
+	for (;;) {
+		bool backlog;
+		{
+			std::lock_guard<std::mutex> l(_entries_m);
+			backlog = ! _ready.empty();
+		}
+
+		// Don't sleep in epoll_wait() while descriptors are waiting for another turn
+		const int n = epoll_wait(_epfd, evs, ZT_TAP_REACTOR_MAX_EVENTS, backlog ? 0 : -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		work.clear();
+		for (int i = 0; i < n; ++i) {
+			if (evs[i].data.u64 == 0)
+				return;	  // shutdown signalled via _wakeFd
+			work.push_back(evs[i].data.u64);
+		}
+		if (backlog) {
+			std::lock_guard<std::mutex> l(_entries_m);
+			for (unsigned int i = 0; (i < ZT_TAP_REACTOR_MAX_EVENTS) && (! _ready.empty()); ++i) {
+				work.push_back(_ready.front());
+				_ready.pop_front();
+			}
+		}
+
+		for (std::vector<uint64_t>::const_iterator id(work.begin()); id != work.end(); ++id) {
+			if (_service(*id)) {
+				std::lock_guard<std::mutex> l(_entries_m);
+				_ready.push_back(*id);
+			}
+		}
+	}
+}
+
+bool LinuxTapReactor::_service(uint64_t id)
+{
+	int fd;
+	Handler* h;
+	{
+		std::lock_guard<std::mutex> l(_entries_m);
+		std::map<uint64_t, _Entry>::iterator e(_entries.find(id));
+		if ((e == _entries.end()) || (e->second.dead))
+			return false;
+		++e->second.busy;
+		fd = e->second.fd;
+		h = e->second.handler;
+	}
+
+	const bool more = h->fdReadable(fd, ZT_TAP_REACTOR_BUDGET);
+
+	std::lock_guard<std::mutex> l(_entries_m);
+	std::map<uint64_t, _Entry>::iterator e(_entries.find(id));
+	if (e == _entries.end())
+		return false;
+	if ((--e->second.busy == 0) && (e->second.dead))
+		_idle.notify_all();
+	return ((more) && (! e->second.dead));
+}
+
+}	// namespace ZeroTier
+
+#endif	 // __LINUX__
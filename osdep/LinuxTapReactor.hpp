@@ -0,0 +1,140 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * (c) ZeroTier, Inc.
+ * https://www.zerotier.com/
+ */
+
+#ifndef ZT_LINUXTAPREACTOR_HPP
+#define ZT_LINUXTAPREACTOR_HPP
+
+#include "../node/Constants.hpp"
+
+#ifdef __LINUX__
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+/**
+ * Maximum frames read from one descriptor before yielding to others
+ */
+#define ZT_TAP_REACTOR_BUDGET 64
+
+namespace ZeroTier {
+
+/**
+ * Shared epoll reactor that services the file descriptors of all Linux taps
+ *
+ * A fixed set of threads waits on one edge-triggered epoll instance, so the
+ * number of reader threads no longer grows with the number of joined
+ * networks. Threads are started when the first descriptor is added and are
+ * stopped and joined when the last one is removed.
+ *
+ * Each descriptor gets at most ZT_TAP_REACTOR_BUDGET frames per turn. A busy
+ * descriptor is then put at the back of a shared ready queue so that one
+ * saturated network cannot starve the others serviced by the same threads.
+ */
+class LinuxTapReactor {
+  private:
+	LinuxTapReactor();
+	~LinuxTapReactor();
+
+  public:
+	/**
+	 * Receiver of readiness events
+	 */
+	class Handler {
+	  public:
+		virtual ~Handler()
+		{
+		}
+
+		/**
+		 * Called from a reactor thread when fd becomes readable
+		 *
+		 * Descriptors are edge-triggered. The handler should read until
+		 * EAGAIN or until it has handled budget frames, whichever comes
+		 * first. If it stops because of the budget it must return true so
+		 * the descriptor is requeued behind other ready descriptors.
+		 *
+		 * @param fd File descriptor
+		 * @param budget Maximum number of frames to handle in this call
+		 * @return True if fd may still have data pending
+		 */
+		virtual bool fdReadable(int fd, unsigned int budget) = 0;
+	};
+
+	static LinuxTapReactor& getInstance()
+	{
+		static LinuxTapReactor instance;
+		return instance;
+	}
+
+	LinuxTapReactor(LinuxTapReactor const&) = delete;
+	void operator=(LinuxTapReactor const&) = delete;
+
+	/**
+	 * Start watching a non-blocking descriptor
+	 *
+	 * If no threads are running they are started with the given settings,
+	 * otherwise the existing threads are shared.
+	 *
+	 * @param fd Non-blocking file descriptor
+	 * @param h Handler to call when fd is readable
+	 * @param threads Number of reactor threads to start if none are running
+	 * @param pinning If true pin reactor thread N to core N
+	 * @return Registration ID or 0 on failure
+	 */
+	uint64_t add(int fd, Handler* h, unsigned int threads, bool pinning);
+
+	/**
+	 * Stop watching a descriptor
+	 *
+	 * This blocks until no reactor thread is still inside the handler for
+	 * this registration, after which the handler may be safely destroyed.
+	 * It must not be called from within a handler.
+	 *
+	 * @param id Registration ID returned by add()
+	 */
+	void remove(uint64_t id);
+
+	/**
+	 * @return Number of reactor threads currently running
+	 */
+	unsigned int threadCount() const;
+
+  private:
+	struct _Entry {
+		int fd;
+		Handler* handler;
+		unsigned int busy;
+		bool dead;
+	};
+
+	bool _service(uint64_t id);
+	void _threadMain(unsigned int tn, bool pinning);
+	void _start(unsigned int threads, bool pinning);
+	void _stop();
+
+	int _epfd;
+	int _wakeFd;
+	uint64_t _nextId;
+	std::map<uint64_t, _Entry> _entries;
+	std::deque<uint64_t> _ready;
+	mutable std::mutex _entries_m;
+	std::condition_variable _idle;
+	mutable std::mutex _lifecycle_m;
+	std::vector<std::thread> _threads;
+};
+
+}	// namespace ZeroTier
+
+#endif	 // __LINUX__
+
+#endif
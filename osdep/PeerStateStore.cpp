@@ -0,0 +1,456 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * (c) ZeroTier, Inc.
+ * https://www.zerotier.com/
+ */
+
+#include "../node/Constants.hpp"
+
+#ifndef __WINDOWS__
+
+#include "PeerStateStore.hpp"
+
+#include "../node/Metrics.hpp"
+#include "OSUtils.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Record: 5-byte address, 8-byte timestamp, 2-byte length (0 to erase), data
+#define ZT_PEER_STATE_STORE_RECORD_HEADER 15
+
+namespace ZeroTier {
+
+namespace {
+
+static const char STORE_MAGIC[8] = { 'Z', 'T', 'P', 'E', 'E', 'R', 'S', '1' };
+
+static void appendRecord(std::string& b, const uint64_t address, const int64_t ts, const void* data, const unsigned int len)
+{
+	uint8_t h[ZT_PEER_STATE_STORE_RECORD_HEADER];
+	for (unsigned int i = 0; i < 5; ++i) {
+		h[i] = (uint8_t)(address >> (32 - (i * 8)));
+	}
+	for (unsigned int i = 0; i < 8; ++i) {
+		h[5 + i] = (uint8_t)((uint64_t)ts >> (56 - (i * 8)));
+	}
+	h[13] = (uint8_t)(len >> 8);
+	h[14] = (uint8_t)len;
+	b.append((const char*)h, sizeof(h));
+	b.append((const char*)data, len);
+}
+
+static bool writeAll(const int fd, const char* p, size_t len)
+{
+	while (len > 0) {
+		const ssize_t n = ::write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		p += n;
+		len -= (size_t)n;
+	}
+	return true;
+}
+
+static inline int syncData(const int fd)
+{
+#ifdef __APPLE__
+	return fsync(fd);
+#else
+	return fdatasync(fd);
+#endif
+}
+
+}	// anonymous namespace
+
+PeerStateStore::PeerStateStore() : _fd(-1), _logSize(0), _liveSize(0), _syncRun(false), _flushRequested(false), _compactRequested(false), _compactOlderThan(0)
+{
+}
+
+PeerStateStore::~PeerStateStore()
+{
+	close();
+}
+
+bool PeerStateStore::open(const char* path)
+{
+	_stopSyncThread();
+	Mutex::Lock _io(_ioLock);
+	_flush();
+	Mutex::Lock _l(_lock);
+	_close();
+
+	const int64_t start = OSUtils::now();
+	_path = path;
+	_fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (_fd < 0) {
+		fprintf(stderr, "WARNING: unable to open peer state store %s" ZT_EOL_S, path);
+		return false;
+	}
+
+	// One sequential read of the whole log
+	std::string log;
+	struct stat st;
+	if (fstat(_fd, &st) != 0) {
+		_close();
+		return false;
+	}
+	log.resize((size_t)st.st_size);
+	size_t got = 0;
+	while (got < log.size()) {
+		const ssize_t n = ::read(_fd, &(log[got]), log.size() - got);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			_close();
+			return false;
+		}
+		if (n == 0) {
+			break;
+		}
+		got += (size_t)n;
+	}
+	log.resize(got);
+
+	if ((log.size() < sizeof(STORE_MAGIC)) || (memcmp(log.data(), STORE_MAGIC, sizeof(STORE_MAGIC)) != 0)) {
+		if (! log.empty()) {
+			fprintf(stderr, "WARNING: peer state store %s is not valid, starting a new one" ZT_EOL_S, path);
+		}
+		if ((ftruncate(_fd, 0) != 0) || (lseek(_fd, 0, SEEK_SET) != 0) || (! writeAll(_fd, STORE_MAGIC, sizeof(STORE_MAGIC)))) {
+			_close();
+			return false;
+		}
+		_logSize = sizeof(STORE_MAGIC);
+	}
+	else {
+		const uint8_t* const b = reinterpret_cast<const uint8_t*>(log.data());
+		uint64_t p = sizeof(STORE_MAGIC);
+		while ((p + ZT_PEER_STATE_STORE_RECORD_HEADER) <= log.size()) {
+			const uint8_t* const r = b + p;
+			const unsigned int len = ((unsigned int)r[13] << 8) | (unsigned int)r[14];
+			if ((p + ZT_PEER_STATE_STORE_RECORD_HEADER + len) > log.size()) {
+				break;
+			}
+			uint64_t address = 0;
+			for (unsigned int i = 0; i < 5; ++i) {
+				address = (address << 8) | (uint64_t)r[i];
+			}
+			uint64_t ts = 0;
+			for (unsigned int i = 0; i < 8; ++i) {
+				ts = (ts << 8) | (uint64_t)r[5 + i];
+			}
+			if (len) {
+				_Entry& e = _entries[address];
+				e.ts = (int64_t)ts;
+				e.data.assign((const char*)(r + ZT_PEER_STATE_STORE_RECORD_HEADER), len);
+			}
+			else {
+				_entries.erase(address);
+			}
+			p += ZT_PEER_STATE_STORE_RECORD_HEADER + len;
+		}
+
+		// Drop a torn record left at the end by a crash
+		if (p < log.size()) {
+			if (ftruncate(_fd, (off_t)p) != 0) {
+				_close();
+				return false;
+			}
+		}
+		_logSize = p;
+	}
+	if (lseek(_fd, (off_t)_logSize, SEEK_SET) != (off_t)_logSize) {
+		_close();
+		return false;
+	}
+
+	_liveSize = sizeof(STORE_MAGIC);
+	for (std::unordered_map<uint64_t, _Entry>::const_iterator e(_entries.begin()); e != _entries.end(); ++e) {
+		_liveSize += ZT_PEER_STATE_STORE_RECORD_HEADER + e->second.data.size();
+	}
+
+	Metrics::peer_store_load_time = (double)(OSUtils::now() - start);
+	Metrics::peer_store_peers = (double)_entries.size();
+
+	{
+		std::lock_guard<std::mutex> l(_syncLock);
+		_syncRun = true;
+		_flushRequested = false;
+		_compactRequested = false;
+	}
+	_syncThread = std::thread([this]() { _syncThreadMain(); });
+	return true;
+}
+
+void PeerStateStore::close()
+{
+	_stopSyncThread();
+	Mutex::Lock _io(_ioLock);
+	_flush();
+	Mutex::Lock _l(_lock);
+	_close();
+}
+
+bool PeerStateStore::isOpen() const
+{
+	Mutex::Lock _l(_lock);
+	return (_fd >= 0);
+}
+
+int PeerStateStore::get(uint64_t address, void* data, unsigned int maxlen) const
+{
+	Mutex::Lock _l(_lock);
+	const std::unordered_map<uint64_t, _Entry>::const_iterator e(_entries.find(address & 0xffffffffffULL));
+	if ((e == _entries.end()) || (e->second.data.size() > maxlen)) {
+		return -1;
+	}
+	memcpy(data, e->second.data.data(), e->second.data.size());
+	return (int)e->second.data.size();
+}
+
+void PeerStateStore::put(uint64_t address, const void* data, unsigned int len, int64_t now)
+{
+	address &= 0xffffffffffULL;
+	if ((len == 0) || (len > 0xffff)) {
+		return;
+	}
+	Mutex::Lock _l(_lock);
+	if (_fd < 0) {
+		return;
+	}
+	_Entry& e = _entries[address];
+	if ((e.data.size() == len) && (memcmp(e.data.data(), data, len) == 0) && ((now - e.ts) < 86400000LL)) {
+		return;	  // unchanged and not about to expire
+	}
+	_liveSize -= (e.data.empty()) ? 0 : (ZT_PEER_STATE_STORE_RECORD_HEADER + e.data.size());
+	_liveSize += ZT_PEER_STATE_STORE_RECORD_HEADER + len;
+	e.ts = now;
+	e.data.assign((const char*)data, len);
+	appendRecord(_pending, address, now, data, len);
+	if (_pending.size() >= ZT_PEER_STATE_STORE_MAX_PENDING) {
+		requestFlush();
+	}
+}
+
+void PeerStateStore::erase(uint64_t address)
+{
+	address &= 0xffffffffffULL;
+	Mutex::Lock _l(_lock);
+	if (_fd < 0) {
+		return;
+	}
+	const std::unordered_map<uint64_t, _Entry>::iterator e(_entries.find(address));
+	if (e != _entries.end()) {
+		_liveSize -= ZT_PEER_STATE_STORE_RECORD_HEADER + e->second.data.size();
+		_entries.erase(e);
+		appendRecord(_pending, address, 0, (const void*)0, 0);
+	}
+}
+
+bool PeerStateStore::flush()
+{
+	Mutex::Lock _io(_ioLock);
+	return _flush();
+}
+
+bool PeerStateStore::compact(int64_t olderThan)
+{
+	Mutex::Lock _io(_ioLock);
+	return _compact(olderThan);
+}
+
+void PeerStateStore::requestFlush()
+{
+	{
+		std::lock_guard<std::mutex> l(_syncLock);
+		if (! _syncRun) {
+			return;
+		}
+		_flushRequested = true;
+	}
+	_syncWake.notify_one();
+}
+
+void PeerStateStore::requestCompact(int64_t olderThan)
+{
+	{
+		std::lock_guard<std::mutex> l(_syncLock);
+		if (! _syncRun) {
+			return;
+		}
+		// The latest cutoff wins if a compaction is already waiting
+		_compactRequested = true;
+		_compactOlderThan = olderThan;
+	}
+	_syncWake.notify_one();
+}
+
+bool PeerStateStore::shouldCompact() const
+{
+	Mutex::Lock _l(_lock);
+	return ((_fd >= 0) && ((_logSize + _pending.size()) > ((_liveSize * 2) + ZT_PEER_STATE_STORE_MAX_PENDING)));
+}
+
+unsigned long PeerStateStore::count() const
+{
+	Mutex::Lock _l(_lock);
+	return (unsigned long)_entries.size();
+}
+
+bool PeerStateStore::_flush()
+{
+	// Take what is pending so puts can go on while it is written
+	std::string out;
+	int fd;
+	uint64_t logSize;
+	{
+		Mutex::Lock _l(_lock);
+		if ((_fd < 0) || (_pending.empty())) {
+			return true;
+		}
+		out.swap(_pending);
+		fd = _fd;
+		logSize = _logSize;
+	}
+
+	const int64_t start = OSUtils::now();
+	if ((! writeAll(fd, out.data(), out.size())) || (syncData(fd) != 0)) {
+		const int err = errno;
+		// Cut back to the last good record so the log stays parseable
+		if (ftruncate(fd, (off_t)logSize) == 0) {
+			lseek(fd, (off_t)logSize, SEEK_SET);
+		}
+		fprintf(stderr, "WARNING: unable to write peer state store %s: %s" ZT_EOL_S, _path.c_str(), strerror(err));
+		// Keep the records for the next attempt, ahead of anything put since
+		Mutex::Lock _l(_lock);
+		_pending.insert(0, out);
+		return false;
+	}
+
+	Mutex::Lock _l(_lock);
+	_logSize += out.size();
+	Metrics::peer_store_save_time = (double)(OSUtils::now() - start);
+	Metrics::peer_store_peers = (double)_entries.size();
+	return true;
+}
+
+bool PeerStateStore::_compact(int64_t olderThan)
+{
+	const int64_t start = OSUtils::now();
+
+	// Snapshot live state; it includes everything pending, so that is taken too
+	std::string snapshot;
+	std::string taken;
+	{
+		Mutex::Lock _l(_lock);
+		if (_fd < 0) {
+			return false;
+		}
+		snapshot.reserve((size_t)_liveSize);
+		snapshot.append(STORE_MAGIC, sizeof(STORE_MAGIC));
+		for (std::unordered_map<uint64_t, _Entry>::iterator e(_entries.begin()); e != _entries.end();) {
+			if (e->second.ts < olderThan) {
+				_entries.erase(e++);
+			}
+			else {
+				appendRecord(snapshot, e->first, e->second.ts, e->second.data.data(), (unsigned int)e->second.data.size());
+				++e;
+			}
+		}
+		_liveSize = snapshot.size();
+		taken.swap(_pending);
+	}
+
+	const std::string tmpPath(_path + ".tmp");
+	const int fd = ::open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if ((fd < 0) || (! writeAll(fd, snapshot.data(), snapshot.size())) || (fsync(fd) != 0) || (rename(tmpPath.c_str(), _path.c_str()) != 0)) {
+		if (fd >= 0) {
+			::close(fd);
+			unlink(tmpPath.c_str());
+		}
+		fprintf(stderr, "WARNING: unable to compact peer state store %s" ZT_EOL_S, _path.c_str());
+		// The old log is still in place and still needs what was pending
+		Mutex::Lock _l(_lock);
+		_pending.insert(0, taken);
+		return false;
+	}
+
+	// The snapshot is now the log; puts made while it was written stay pending
+	Mutex::Lock _l(_lock);
+	::close(_fd);
+	_fd = fd;
+	_logSize = snapshot.size();
+
+	Metrics::peer_store_save_time = (double)(OSUtils::now() - start);
+	Metrics::peer_store_peers = (double)_entries.size();
+	return true;
+}
+
+void PeerStateStore::_syncThreadMain()
+{
+	std::unique_lock<std::mutex> l(_syncLock);
+	for (;;) {
+		_syncWake.wait(l, [this] { return ((! _syncRun) || (_flushRequested) || (_compactRequested)); });
+		if (! _syncRun) {
+			return;
+		}
+		const bool doCompact = _compactRequested;
+		const int64_t olderThan = _compactOlderThan;
+		_flushRequested = false;
+		_compactRequested = false;
+		l.unlock();
+
+		{
+			Mutex::Lock _io(_ioLock);
+			if (doCompact) {
+				_compact(olderThan);
+			}
+			else {
+				_flush();
+			}
+		}
+
+		l.lock();
+	}
+}
+
+void PeerStateStore::_stopSyncThread()
+{
+	{
+		std::lock_guard<std::mutex> l(_syncLock);
+		if (! _syncRun) {
+			return;
+		}
+		_syncRun = false;
+	}
+	_syncWake.notify_all();
+	_syncThread.join();
+}
+
+void PeerStateStore::_close()
+{
+	if (_fd >= 0) {
+		::close(_fd);
+		_fd = -1;
+	}
+	_entries.clear();
+	_pending.clear();
+	_logSize = 0;
+	_liveSize = 0;
+}
+
+}	// namespace ZeroTier
+
+#endif	 // !__WINDOWS__
@@ -0,0 +1,179 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * (c) ZeroTier, Inc.
+ * https://www.zerotier.com/
+ */
+
+#ifndef ZT_PEERSTATESTORE_HPP
+#define ZT_PEERSTATESTORE_HPP
+
+#include "../node/Constants.hpp"
+
+#ifndef __WINDOWS__
+
+#include "../node/Mutex.hpp"
+
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+/**
+ * Pending writes are flushed early once they reach this many bytes
+ */
+#define ZT_PEER_STATE_STORE_MAX_PENDING 1048576
+
+namespace ZeroTier {
+
+/**
+ * Log-structured, single-file store for cached peer state
+ *
+ * This replaces the one-file-per-peer peers.d directory. The whole file is
+ * read sequentially into memory when the store is opened, so gets never
+ * touch the disk. Puts and erases update memory at once and are appended to
+ * a pending buffer. flush() writes the buffer with one write and makes it
+ * durable with one fdatasync, no matter how many peers changed.
+ *
+ * Newer records for an address supersede older ones, so the file keeps
+ * growing. compact() writes a snapshot of the live records to a new file
+ * and renames it over the log. A torn record at the end of the log (e.g.
+ * after a crash) is dropped when the store is opened.
+ *
+ * Disk I/O never happens with the lock that get(), put() and erase() take
+ * held: pending records are handed off under it and written without it. An
+ * open store has a sync thread, and requestFlush() and requestCompact() run
+ * a flush or compaction there so that callers on the I/O loop never wait
+ * for the disk. put() also wakes it once ZT_PEER_STATE_STORE_MAX_PENDING
+ * bytes are pending.
+ *
+ * All methods are thread safe.
+ */
+class PeerStateStore {
+  public:
+	PeerStateStore();
+	~PeerStateStore();
+
+	/**
+	 * Open or create a store and load it
+	 *
+	 * @param path Path of store file
+	 * @return True on success
+	 */
+	bool open(const char* path);
+
+	/**
+	 * Flush pending writes and close the store if it is open
+	 */
+	void close();
+
+	/**
+	 * @return True if the store is open
+	 */
+	bool isOpen() const;
+
+	/**
+	 * @param address Peer address
+	 * @param data Buffer to receive state
+	 * @param maxlen Size of buffer
+	 * @return Length of state or -1 if not found or larger than maxlen
+	 */
+	int get(uint64_t address, void* data, unsigned int maxlen) const;
+
+	/**
+	 * Store peer state (written at the next flush)
+	 *
+	 * @param address Peer address
+	 * @param data State
+	 * @param len Length of state, 1 to 65535 bytes
+	 * @param now Current time, used by compact() to expire old state
+	 */
+	void put(uint64_t address, const void* data, unsigned int len, int64_t now);
+
+	/**
+	 * Remove peer state (written at the next flush)
+	 *
+	 * @param address Peer address
+	 */
+	void erase(uint64_t address);
+
+	/**
+	 * Write and sync all pending puts and erases
+	 *
+	 * @return True on success or if nothing was pending
+	 */
+	bool flush();
+
+	/**
+	 * Replace the log with a snapshot of its live records
+	 *
+	 * @param olderThan Drop state last written before this time (ms since epoch)
+	 * @return True on success
+	 */
+	bool compact(int64_t olderThan);
+
+	/**
+	 * Flush on the sync thread without waiting for it
+	 */
+	void requestFlush();
+
+	/**
+	 * Compact on the sync thread without waiting for it
+	 *
+	 * @param olderThan Drop state last written before this time (ms since epoch)
+	 */
+	void requestCompact(int64_t olderThan);
+
+	/**
+	 * @return True if the log is large enough relative to live state to be worth compacting
+	 */
+	bool shouldCompact() const;
+
+	/**
+	 * @return Number of peers in store
+	 */
+	unsigned long count() const;
+
+  private:
+	struct _Entry {
+		int64_t ts;
+		std::string data;
+	};
+
+	// Must be called with _ioLock held and _lock not held
+	bool _flush();
+	bool _compact(int64_t olderThan);
+
+	// Must be called with _lock held
+	void _close();
+
+	void _syncThreadMain();
+	void _stopSyncThread();
+
+	std::string _path;
+	int _fd;
+	uint64_t _logSize;	 // bytes of valid log on disk
+	uint64_t _liveSize;	 // bytes a snapshot of current entries would take
+	std::unordered_map<uint64_t, _Entry> _entries;
+	std::string _pending;
+	Mutex _lock;	 // guards everything above
+	Mutex _ioLock;	 // serializes writers to the file, always taken before _lock
+
+	// Work for the sync thread
+	std::thread _syncThread;
+	std::mutex _syncLock;
+	std::condition_variable _syncWake;
+	bool _syncRun;
+	bool _flushRequested;
+	bool _compactRequested;
+	int64_t _compactOlderThan;
+};
+
+}	// namespace ZeroTier
+
+#endif	 // !__WINDOWS__
+
+#endif
@@ -9,6 +9,7 @@
 #ifndef ZT_PHY_HPP
 #define ZT_PHY_HPP
 
+#include <algorithm>
 #include <list>
 #include <stdexcept>
 #include <stdio.h>
@@ -62,6 +63,11 @@
 
 #endif	 // Windows or not
 
+/**
+ * Maximum number of packets passed to one sendmmsg() call
+ */
+#define ZT_PHY_SENDMMSG_WINDOW 64
+
 namespace ZeroTier {
 
 /**
@@ -493,6 +499,68 @@ template <typename HANDLER_PTR_TYPE> class Phy {
 		return sent;
 	}
 
+	/**
+	 * Send several UDP packets from the same socket
+	 *
+	 * On Linux this uses sendmmsg() to send up to ZT_PHY_SENDMMSG_WINDOW
+	 * packets per system call. Elsewhere each is sent with udpSend().
+	 *
+	 * @param sock UDP socket
+	 * @param remoteAddresses Destination address of each packet
+	 * @param data Data of each packet
+	 * @param lens Length of each packet
+	 * @param count Number of packets
+	 * @return Number of packets sent
+	 */
+	inline unsigned int udpSendBatch(PhySocket* sock, const struct sockaddr* const* remoteAddresses, const void* const* data, const unsigned int* lens, unsigned int count)
+	{
+#if (defined(__linux__) || defined(linux) || defined(__linux)) && defined(MSG_WAITFORONE)
+		PhySocketImpl& sws = *(reinterpret_cast<PhySocketImpl*>(sock));
+		iovec iovs[ZT_PHY_SENDMMSG_WINDOW];
+		mmsghdr mm[ZT_PHY_SENDMMSG_WINDOW];
+		memset(mm, 0, sizeof(mm));
+		unsigned int sent = 0, i = 0;
+		while (i < count) {
+			const unsigned int n = std::min(count - i, (unsigned int)ZT_PHY_SENDMMSG_WINDOW);
+			for (unsigned int k = 0; k < n; ++k) {
+				iovs[k].iov_base = const_cast<void*>(data[i + k]);
+				iovs[k].iov_len = lens[i + k];
+				mm[k].msg_hdr.msg_name = const_cast<struct sockaddr*>(remoteAddresses[i + k]);
+				mm[k].msg_hdr.msg_namelen = (remoteAddresses[i + k]->sa_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+				mm[k].msg_hdr.msg_iov = &(iovs[k]);
+				mm[k].msg_hdr.msg_iovlen = 1;
+			}
+			unsigned int k = 0;
+			while (k < n) {
+				const int r = sendmmsg(sws.sock, mm + k, n - k, 0);
+				if (r > 0) {
+					for (int j = 0; j < r; ++j) {
+						Metrics::udp_send += lens[i + k + (unsigned int)j];
+					}
+					sent += (unsigned int)r;
+					k += (unsigned int)r;
+				}
+				else if ((r < 0) && (errno == EINTR)) {
+					continue;
+				}
+				else {
+					++k;   // skip the packet that failed, as udpSend() would
+				}
+			}
+			i += n;
+		}
+		return sent;
+#else
+		unsigned int sent = 0;
+		for (unsigned int i = 0; i < count; ++i) {
+			if (udpSend(sock, remoteAddresses[i], data[i], lens[i])) {
+				++sent;
+			}
+		}
+		return sent;
+#endif
+	}
+
 #ifdef __UNIX_LIKE__
 	/**
 	 * Listen for connections on a Unix domain socket
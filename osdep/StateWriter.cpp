@@ -0,0 +1,203 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * (c) ZeroTier, Inc.
+ * https://www.zerotier.com/
+ */
+
+#include "StateWriter.hpp"
+
+#include "../node/Metrics.hpp"
+#include "OSUtils.hpp"
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __WINDOWS__
+#include <windows.h>
+#endif
+
+namespace ZeroTier {
+
+StateWriter::StateWriter() : _busy(false), _run(false)
+{
+}
+
+StateWriter::~StateWriter()
+{
+	stop();
+}
+
+void StateWriter::start()
+{
+	std::lock_guard<std::mutex> l(_lock);
+	if (! _run) {
+		_run = true;
+		_thread = std::thread([this]() { _threadMain(); });
+	}
+}
+
+void StateWriter::stop()
+{
+	{
+		std::lock_guard<std::mutex> l(_lock);
+		if (! _run) {
+			return;
+		}
+		_run = false;
+	}
+	_work.notify_all();
+	_thread.join();
+	_space.notify_all();
+	_idle.notify_all();
+}
+
+void StateWriter::write(const std::string& path, const std::string& dirname, const void* data, int len, bool secure)
+{
+	_Entry n;
+	n.dirname = dirname;
+	n.remove = ((len < 0) || (! data));
+	if (! n.remove) {
+		n.data.assign((const char*)data, (size_t)len);
+	}
+	n.secure = secure;
+
+	std::unique_lock<std::mutex> l(_lock);
+	std::unordered_map<std::string, _Entry>::iterator e(_entries.find(path));
+	if (e == _entries.end()) {
+		_space.wait(l, [this] { return ((! _run) || (_entries.size() < ZT_STATE_WRITER_MAX_PENDING)); });
+		if (! _run) {
+			l.unlock();
+			_write(path, n);
+			return;
+		}
+		e = _entries.emplace(path, _Entry()).first;
+		_order.push_back(path);
+	}
+	e->second.swap(n);
+	Metrics::state_write_queue_depth = (double)_entries.size();
+	l.unlock();
+	_work.notify_one();
+}
+
+bool StateWriter::get(const std::string& path, void* data, unsigned int maxlen, int& len) const
+{
+	std::lock_guard<std::mutex> l(_lock);
+	const _Entry* e;
+	std::unordered_map<std::string, _Entry>::const_iterator i(_entries.find(path));
+	if (i != _entries.end()) {
+		e = &(i->second);
+	}
+	else if ((_busy) && (_inFlightPath == path)) {
+		e = &_inFlight;
+	}
+	else {
+		return false;
+	}
+	if (e->remove) {
+		len = -1;
+	}
+	else {
+		len = (int)std::min((size_t)maxlen, e->data.size());
+		memcpy(data, e->data.data(), (size_t)len);
+	}
+	return true;
+}
+
+void StateWriter::flush()
+{
+	std::unique_lock<std::mutex> l(_lock);
+	_idle.wait(l, [this] { return ((! _run) || ((_order.empty()) && (! _busy))); });
+}
+
+unsigned long StateWriter::pending() const
+{
+	std::lock_guard<std::mutex> l(_lock);
+	return (unsigned long)_entries.size();
+}
+
+bool StateWriter::writeFile(const std::string& path, const std::string& dirname, const void* data, unsigned int len, bool secure)
+{
+	// Skip the write if the file is already current
+	std::string old;
+	if ((OSUtils::readFile(path.c_str(), old)) && (old.length() == len) && (memcmp(old.data(), data, len) == 0)) {
+		return true;
+	}
+
+	const std::string tmp(path + ".tmp");
+	FILE* f = fopen(tmp.c_str(), "wb");
+	if ((! f) && (! dirname.empty())) {	  // create subdirectory if it does not exist
+		OSUtils::mkdir(dirname);
+		f = fopen(tmp.c_str(), "wb");
+	}
+	if (! f) {
+		fprintf(stderr, "WARNING: unable to write to file: %s (unable to open)" ZT_EOL_S, path.c_str());
+		return false;
+	}
+	bool ok = ((len == 0) || (fwrite(data, len, 1, f) == 1));
+	ok &= (fclose(f) == 0);
+	if (! ok) {
+		fprintf(stderr, "WARNING: unable to write to file: %s (I/O error)" ZT_EOL_S, path.c_str());
+		OSUtils::rm(tmp);
+		return false;
+	}
+	if (secure) {
+		OSUtils::lockDownFile(tmp.c_str(), false);
+	}
+#ifdef __WINDOWS__
+	ok = (MoveFileExA(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != FALSE);
+#else
+	ok = (rename(tmp.c_str(), path.c_str()) == 0);
+#endif
+	if (! ok) {
+		fprintf(stderr, "WARNING: unable to write to file: %s (unable to rename)" ZT_EOL_S, path.c_str());
+		OSUtils::rm(tmp);
+	}
+	return ok;
+}
+
+void StateWriter::_threadMain()
+{
+	std::unique_lock<std::mutex> l(_lock);
+	for (;;) {
+		_work.wait(l, [this] { return ((! _run) || (! _order.empty())); });
+		if (_order.empty()) {
+			break;	 // stopped and drained
+		}
+
+		_inFlightPath.swap(_order.front());
+		_order.pop_front();
+		std::unordered_map<std::string, _Entry>::iterator e(_entries.find(_inFlightPath));
+		_inFlight.swap(e->second);
+		_entries.erase(e);
+		_busy = true;
+		Metrics::state_write_queue_depth = (double)_entries.size();
+		l.unlock();
+		_space.notify_one();
+
+		const int64_t start = OSUtils::now();
+		_write(_inFlightPath, _inFlight);
+		Metrics::state_write_latency.Observe((uint64_t)(OSUtils::now() - start));
+
+		l.lock();
+		_busy = false;
+		if (_order.empty()) {
+			_idle.notify_all();
+		}
+	}
+	_idle.notify_all();
+}
+
+void StateWriter::_write(const std::string& path, const _Entry& e)
+{
+	if (e.remove) {
+		OSUtils::rm(path);
+	}
+	else {
+		writeFile(path, e.dirname, e.data.data(), (unsigned int)e.data.size(), e.secure);
+	}
+}
+
+}	// namespace ZeroTier
@@ -0,0 +1,142 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * (c) ZeroTier, Inc.
+ * https://www.zerotier.com/
+ */
+
+#ifndef ZT_STATEWRITER_HPP
+#define ZT_STATEWRITER_HPP
+
+#include "../node/Constants.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+/**
+ * Maximum number of distinct files waiting to be written before write() blocks
+ */
+#define ZT_STATE_WRITER_MAX_PENDING 1024
+
+namespace ZeroTier {
+
+/**
+ * Background writer for state object files
+ *
+ * Node state puts (identities, planet, moons, network configs, peers) are
+ * often made from the core packet processing thread. This moves the disk
+ * I/O to a single writer thread so a slow disk cannot stall the caller.
+ *
+ * Writes are queued per file. If a file is written again before the
+ * writer gets to it only the newest data is kept, so bursts of updates to
+ * the same object cost one write. Files are written to a temporary file
+ * and renamed into place so readers never see a partial file. get() returns
+ * data that is still queued so state reads always see the latest put.
+ *
+ * The queue is bounded by ZT_STATE_WRITER_MAX_PENDING files. When it is
+ * full write() blocks until the writer catches up. If the writer is not
+ * running, write() writes synchronously.
+ */
+class StateWriter {
+  public:
+	StateWriter();
+	~StateWriter();
+
+	/**
+	 * Start the writer thread if it is not running
+	 */
+	void start();
+
+	/**
+	 * Write everything that is queued and stop the writer thread
+	 */
+	void stop();
+
+	/**
+	 * Queue a file to be written or removed
+	 *
+	 * @param path Full path of file
+	 * @param dirname Directory to create if it does not exist, or empty
+	 * @param data File contents
+	 * @param len Length of data or -1 to remove the file
+	 * @param secure If true lock down permissions of the file
+	 */
+	void write(const std::string& path, const std::string& dirname, const void* data, int len, bool secure);
+
+	/**
+	 * Get the contents of a file that has not been written yet
+	 *
+	 * @param path Full path of file
+	 * @param data Buffer to receive data
+	 * @param maxlen Size of buffer
+	 * @param len Set to length copied or -1 if the file is queued for removal
+	 * @return True if the file is queued, false if it should be read from disk
+	 */
+	bool get(const std::string& path, void* data, unsigned int maxlen, int& len) const;
+
+	/**
+	 * Block until the queue is empty and no write is in progress
+	 */
+	void flush();
+
+	/**
+	 * @return Number of files waiting to be written
+	 */
+	unsigned long pending() const;
+
+	/**
+	 * Write a file atomically via a temporary file and rename
+	 *
+	 * Nothing is written if the file already has this content.
+	 *
+	 * @param path Full path of file
+	 * @param dirname Directory to create if it does not exist, or empty
+	 * @param data File contents
+	 * @param len Length of data
+	 * @param secure If true lock down permissions of the file
+	 * @return True on success
+	 */
+	static bool writeFile(const std::string& path, const std::string& dirname, const void* data, unsigned int len, bool secure);
+
+  private:
+	struct _Entry {
+		std::string dirname;
+		std::string data;
+		bool remove;
+		bool secure;
+
+		void swap(_Entry& e)
+		{
+			dirname.swap(e.dirname);
+			data.swap(e.data);
+			std::swap(remove, e.remove);
+			std::swap(secure, e.secure);
+		}
+	};
+
+	void _threadMain();
+	static void _write(const std::string& path, const _Entry& e);
+
+	std::unordered_map<std::string, _Entry> _entries;
+	std::deque<std::string> _order;
+	std::string _inFlightPath;
+	_Entry _inFlight;
+	bool _busy;
+	bool _run;
+	std::thread _thread;
+	mutable std::mutex _lock;
+	std::condition_variable _work;
+	std::condition_variable _space;
+	std::condition_variable _idle;
+};
+
+}	// namespace ZeroTier
+
+#endif
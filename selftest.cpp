@@ -8,29 +8,56 @@
 
 #include "node/Buffer.hpp"
 #include "node/CertificateOfMembership.hpp"
+#include "node/CompiledRules.hpp"
 #include "node/Constants.hpp"
 #include "node/Dictionary.hpp"
 #include "node/ECC.hpp"
+#include "node/FlatHashtable.hpp"
+#include "node/FlowHash.hpp"
 #include "node/Hashtable.hpp"
 #include "node/Identity.hpp"
 #include "node/IncomingPacket.hpp"
 #include "node/InetAddress.hpp"
 #include "node/MAC.hpp"
+#include "node/Metrics.hpp"
+#include "node/Multicaster.hpp"
+#include "node/Network.hpp"
 #include "node/NetworkConfig.hpp"
 #include "node/Node.hpp"
 #include "node/Packet.hpp"
+#include "node/PacketBuffer.hpp"
+#include "node/PacketMultiplexer.hpp"
 #include "node/Peer.hpp"
 #include "node/Poly1305.hpp"
+#include "node/QoSQueue.hpp"
 #include "node/RuntimeEnvironment.hpp"
 #include "node/SHA512.hpp"
 #include "node/Salsa20.hpp"
+#include "node/ShardedHashtable.hpp"
+#include "node/Switch.hpp"
+#include "node/TimerWheel.hpp"
+#include "node/Topology.hpp"
 #include "node/Utils.hpp"
+#include "node/WireBatch.hpp"
+#include "node/World.hpp"
+#include "osdep/IdentityStore.hpp"
 #include "osdep/OSUtils.hpp"
+#include "osdep/PeerStateStore.hpp"
 #include "osdep/Phy.hpp"
 #include "osdep/PortMapper.hpp"
+#include "osdep/StateWriter.hpp"
 #include "osdep/Thread.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <list>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <map>
+#include <set>
 #include <stdexcept>
 #include <stdio.h>
 #include <stdlib.h>
@@ -1192,160 +1219,3500 @@ static int testPacket()
 	return 0;
 }
 
-static int testOther()
+// Builds a minimal IPv4 or IPv6 (optionally with a hop-by-hop header) TCP/UDP packet for flow hashing tests
+static unsigned int makeFlowTestPacket(uint8_t* b, bool v6, bool hopByHop, unsigned int proto, const uint8_t* sa, const uint8_t* da, unsigned int sp, unsigned int dp)
 {
-	char buf[1024];
-	char buf2[4096];
-	char buf3[1024];
-
-	std::cout << "[other] Testing hex/unhex... ";
-	std::cout.flush();
-	Utils::getSecureRandom(buf, (unsigned int)sizeof(buf));
-	Utils::hex(buf, (unsigned int)sizeof(buf), buf2);
-	Utils::unhex(buf2, buf3, (unsigned int)sizeof(buf3));
-	if (memcmp(buf, buf3, sizeof(buf)) == 0) {
-		std::cout << "PASS" << std::endl;
+	unsigned int l4;
+	memset(b, 0, 128);
+	if (v6) {
+		b[0] = 0x60;
+		b[6] = (uint8_t)(hopByHop ? 0 : proto);
+		memcpy(b + 8, sa, 16);
+		memcpy(b + 24, da, 16);
+		l4 = 40;
+		if (hopByHop) {
+			b[40] = (uint8_t)proto;
+			b[41] = 0;	 // 8 byte extension header
+			l4 = 48;
+		}
 	}
 	else {
-		std::cout << "FAIL!" << std::endl;
-		buf2[78] = 0;
-		std::cout << buf2 << std::endl;
-		Utils::hex(buf3, (unsigned int)sizeof(buf3), buf2);
-		buf2[78] = 0;
-		std::cout << buf2 << std::endl;
+		b[0] = 0x45;
+		b[9] = (uint8_t)proto;
+		memcpy(b + 12, sa, 4);
+		memcpy(b + 16, da, 4);
+		l4 = 20;
+	}
+	b[l4] = (uint8_t)(sp >> 8);
+	b[l4 + 1] = (uint8_t)sp;
+	b[l4 + 2] = (uint8_t)(dp >> 8);
+	b[l4 + 3] = (uint8_t)dp;
+	return l4 + 20;
+}
+
+static int testFlowHash()
+{
+	uint8_t pkt[256], rev[256], sa[16], da[16];
+
+	std::cout << "[flowhash] Testing SipHash-2-4 test vector... ";
+	{
+		uint64_t key[2] = { 0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL };
+		uint8_t in[15];
+		for (unsigned int i = 0; i < 15; ++i)
+			in[i] = (uint8_t)i;
+		if (FlowHash::sipHash24(key, in, 15) != 0xa129ca6149be45e5ULL) {
+			std::cout << "FAIL" << std::endl;
+			return -1;
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	std::cout << "[flowhash] Testing direction symmetry, VLAN and IPv6 extension headers... ";
+	for (unsigned int i = 0; i < 1000; ++i) {
+		const bool v6 = ((i & 1) != 0);
+		Utils::getSecureRandom(sa, sizeof(sa));
+		Utils::getSecureRandom(da, sizeof(da));
+		const unsigned int sp = (unsigned int)rand() & 0xffff, dp = (unsigned int)rand() & 0xffff;
+		const unsigned int len = makeFlowTestPacket(pkt, v6, (i & 2) != 0, 6, sa, da, sp, dp);
+		makeFlowTestPacket(rev, v6, (i & 2) != 0, 6, da, sa, dp, sp);
+		const unsigned int et = v6 ? 0x86dd : 0x0800;
+		const int32_t f = FlowHash::compute(et, pkt, len);
+		if ((f < 0) || (f != FlowHash::compute(et, rev, len))) {
+			std::cout << "FAIL (symmetry)" << std::endl;
+			return -1;
+		}
+		uint8_t tagged[260];
+		tagged[0] = 0x00;
+		tagged[1] = 0x2a;	// VLAN 42
+		tagged[2] = (uint8_t)(et >> 8);
+		tagged[3] = (uint8_t)et;
+		memcpy(tagged + 4, pkt, len);
+		const int32_t fv = FlowHash::compute(0x8100, tagged, len + 4);
+		if ((fv < 0) || (fv == f)) {
+			std::cout << "FAIL (VLAN)" << std::endl;
+			return -1;
+		}
+	}
+	if (FlowHash::compute(0x0806, pkt, 28) != ZT_QOS_NO_FLOW) {
+		std::cout << "FAIL (non-IP)" << std::endl;
 		return -1;
 	}
+	std::cout << "PASS" << std::endl;
 
-	std::cout << "[other] Testing InetAddress encode/decode...";
+	// Traffic mixes: many clients to one HTTPS server, a few hosts with many
+	// sequential ephemeral ports, UDP tunnels using the same port pair between
+	// many sites, and IPv6 with extension headers.
+	static const char* mixNames[4] = { "clients->server:443", "4 hosts, sequential ports", "site tunnels udp/51820", "ipv6+hbh udp" };
+	static const unsigned int workerCounts[3] = { 4, 8, 16 };
+	const unsigned int flowsPerMix = 20000;
+	std::vector<int32_t> legacy, hashed;
+	for (unsigned int mix = 0; mix < 4; ++mix) {
+		legacy.clear();
+		hashed.clear();
+		for (unsigned int i = 0; i < flowsPerMix; ++i) {
+			memset(sa, 0, sizeof(sa));
+			memset(da, 0, sizeof(da));
+			unsigned int sp = 0, dp = 0, proto = 6, len = 0;
+			bool v6 = false;
+			switch (mix) {
+				case 0:
+					sa[0] = 10;
+					sa[1] = (uint8_t)(i >> 8);
+					sa[2] = (uint8_t)i;
+					sa[3] = (uint8_t)rand();
+					da[0] = 10;
+					da[3] = 1;
+					sp = 32768 + ((unsigned int)rand() % 28232);
+					dp = 443;
+					break;
+				case 1:
+					sa[0] = 10;
+					sa[3] = (uint8_t)(1 + (i & 3));
+					da[0] = 10;
+					da[3] = 100;
+					sp = 32768 + (i >> 2);
+					dp = 5201;
+					break;
+				case 2:
+					proto = 17;
+					sa[0] = 172;
+					sa[1] = 16;
+					sa[2] = (uint8_t)(i >> 8);
+					sa[3] = (uint8_t)i;
+					da[0] = 172;
+					da[1] = 31;
+					da[3] = 1;
+					sp = 51820;
+					dp = 51820;
+					break;
+				case 3:
+					proto = 17;
+					v6 = true;
+					Utils::getSecureRandom(sa, sizeof(sa));
+					da[0] = 0xfd;
+					da[15] = 1;
+					sp = 32768 + ((unsigned int)rand() % 28232);
+					dp = 53;
+					break;
+			}
+			len = makeFlowTestPacket(pkt, v6, v6, proto, sa, da, sp, dp);
+			legacy.push_back((int32_t)(sp ^ dp ^ proto));
+			hashed.push_back(FlowHash::compute(v6 ? 0x86dd : 0x0800, pkt, len));
+		}
+
+		std::cout << "[flowhash] Worker spread for " << flowsPerMix << " flows (" << mixNames[mix] << "), max/mean load (1.00 is perfect):";
+		for (unsigned int w = 0; w < 3; ++w) {
+			const unsigned int workers = workerCounts[w];
+			std::vector<unsigned int> lc(workers, 0), hc(workers, 0);
+			for (unsigned int i = 0; i < flowsPerMix; ++i) {
+				++lc[(unsigned int)legacy[i] % workers];
+				++hc[(unsigned int)hashed[i] % workers];
+			}
+			const double mean = (double)flowsPerMix / (double)workers;
+			char tmp[128];
+			OSUtils::ztsnprintf(tmp, sizeof(tmp), " %u workers: xor %.2f, FlowHash %.2f;", workers, (double)*std::max_element(lc.begin(), lc.end()) / mean, (double)*std::max_element(hc.begin(), hc.end()) / mean);
+			std::cout << tmp;
+		}
+		std::cout << std::endl;
+	}
+
+	std::cout << "[flowhash] Benchmarking FlowHash::compute()... ";
 	std::cout.flush();
-	std::cout << " " << InetAddress("127.0.0.1/9993").toString(buf);
-	std::cout << " " << InetAddress("feed:dead:babe:dead:beef:f00d:1234:5678/12345").toString(buf);
-	std::cout << " " << InetAddress("0/9993").toString(buf);
-	std::cout << " " << InetAddress("").toString(buf);
-	std::cout << std::endl;
+	{
+		Utils::getSecureRandom(sa, sizeof(sa));
+		Utils::getSecureRandom(da, sizeof(da));
+		const unsigned int len = makeFlowTestPacket(pkt, true, true, 6, sa, da, 12345, 443);
+		uint32_t acc = 0;
+		const int64_t start = OSUtils::now();
+		for (unsigned int i = 0; i < 10000000; ++i) {
+			pkt[51] = (uint8_t)i;
+			acc += (uint32_t)FlowHash::compute(0x86dd, pkt, len);
+		}
+		const int64_t end = OSUtils::now();
+		std::cout << ((double)(end - start) * 1000000.0 / 10000000.0) << " ns/frame (" << (acc & 0xff) << ")" << std::endl;
+	}
 
-#if 0
-	std::cout << "[other] Testing Hashtable... "; std::cout.flush();
+	return 0;
+}
+
+// Minimal in-memory host callbacks for running a Node inside selftest
+#ifndef __WINDOWS__
+// If set, selftest nodes keep peer identities here
+static IdentityStore* selftestIdentityStore = (IdentityStore*)0;
+#endif
+static int selftestNodeStateGet(ZT_Node*, void*, void*, enum ZT_StateObjectType type, const uint64_t id[2], void* data, unsigned int maxlen)
+{
+#ifndef __WINDOWS__
+	if ((type == ZT_STATE_OBJECT_PEER_IDENTITY) && (selftestIdentityStore)) {
+		return selftestIdentityStore->get(id[0], data, maxlen);
+	}
+#endif
+	return -1;
+}
+static void selftestNodeStatePut(ZT_Node*, void*, void*, enum ZT_StateObjectType type, const uint64_t id[2], const void* data, int len)
+{
+#ifndef __WINDOWS__
+	if ((type == ZT_STATE_OBJECT_PEER_IDENTITY) && (selftestIdentityStore) && (len > 0)) {
+		selftestIdentityStore->put(id[0], data, (unsigned int)len);
+	}
+#endif
+}
+static std::atomic<unsigned long> selftestWirePacketsSent(0);
+static Mutex selftestLastWirePacket_m;
+static InetAddress selftestLastWirePacketTo;
+static uint8_t selftestLastWirePacket[ZT_PROTO_MIN_PACKET_LENGTH];
+static InetAddress selftestWireSendFailTo;	// sends to this address fail
+static int selftestNodeWirePacketSend(ZT_Node*, void*, void*, int64_t, const struct sockaddr_storage* addr, const void* data, unsigned int len, unsigned int)
+{
+	if ((selftestWireSendFailTo) && (selftestWireSendFailTo == *reinterpret_cast<const InetAddress*>(addr))) {
+		return -1;
+	}
+	++selftestWirePacketsSent;
+	Mutex::Lock _l(selftestLastWirePacket_m);
+	selftestLastWirePacketTo = *reinterpret_cast<const InetAddress*>(addr);
+	memcpy(selftestLastWirePacket, data, std::min(len, (unsigned int)ZT_PROTO_MIN_PACKET_LENGTH));
+	return 0;
+}
+static unsigned long selftestWireBatches = 0;
+static std::vector<std::string>* selftestWireBatchCapture = (std::vector<std::string>*)0;
+static void selftestNodeWirePacketSendBatch(ZT_Node*, void*, void*, const ZT_WirePacket* packets, unsigned int count)
+{
+	++selftestWireBatches;
+	selftestWirePacketsSent += count;
+	Mutex::Lock _l(selftestLastWirePacket_m);
+	if (selftestWireBatchCapture) {
+		for (unsigned int i = 0; i < count; ++i) {
+			selftestWireBatchCapture->push_back(std::string((const char*)packets[i].data, packets[i].len));
+		}
+	}
+	if (count) {
+		selftestLastWirePacketTo = *reinterpret_cast<const InetAddress*>(packets[count - 1].address);
+		memcpy(selftestLastWirePacket, packets[count - 1].data, std::min(packets[count - 1].len, (unsigned int)ZT_PROTO_MIN_PACKET_LENGTH));
+	}
+}
+static void selftestNodeVirtualNetworkFrame(ZT_Node*, void*, void*, uint64_t, void**, uint64_t, uint64_t, unsigned int, unsigned int, const void*, unsigned int)
+{
+}
+static int selftestNodeVirtualNetworkConfig(ZT_Node*, void*, void*, uint64_t, void**, enum ZT_VirtualNetworkConfigOperation, const ZT_VirtualNetworkConfig*)
+{
+	return 0;
+}
+static void selftestNodeEvent(ZT_Node*, void*, void*, enum ZT_Event, const void*)
+{
+}
+
+static Node* newSelftestNode(ZT_WirePacketSendBatchFunction wirePacketSendBatch = (ZT_WirePacketSendBatchFunction)0)
+{
+	ZT_Node_Callbacks cb;
+	memset(&cb, 0, sizeof(cb));
+	cb.version = 2;
+	cb.wirePacketSendBatchFunction = wirePacketSendBatch;
+	cb.statePutFunction = selftestNodeStatePut;
+	cb.stateGetFunction = selftestNodeStateGet;
+	cb.wirePacketSendFunction = selftestNodeWirePacketSend;
+	cb.virtualNetworkFrameFunction = selftestNodeVirtualNetworkFrame;
+	cb.virtualNetworkConfigFunction = selftestNodeVirtualNetworkConfig;
+	cb.eventCallback = selftestNodeEvent;
+	ZT_Node_Config conf;
+	memset(&conf, 0, sizeof(conf));
+	return new Node((void*)0, (void*)0, &conf, &cb, OSUtils::now());
+}
+
+// Typical small rule set: allow IPv4/ARP/IPv6, drop SSH, accept everything else
+static void makeSelftestNetworkConfig(NetworkConfig& nc, const uint64_t nwid, const Address& issuedTo, const uint64_t revision)
+{
+	nc.networkId = nwid;
+	nc.issuedTo = issuedTo;
+	nc.timestamp = OSUtils::now();
+	nc.revision = revision;
+	nc.credentialTimeMaxDelta = ZT_NETWORKCONFIG_DEFAULT_CREDENTIAL_TIME_MAX_MAX_DELTA;
+	nc.type = ZT_NETWORK_TYPE_PUBLIC;
+	nc.mtu = ZT_DEFAULT_MTU;
+	nc.multicastLimit = 32;
+	nc.ruleCount = 0;
+	const unsigned int allowedEtherTypes[3] = { ZT_ETHERTYPE_IPV4, ZT_ETHERTYPE_ARP, ZT_ETHERTYPE_IPV6 };
+	for (unsigned int i = 0; i < 3; ++i) {
+		nc.rules[nc.ruleCount].t = (uint8_t)ZT_NETWORK_RULE_MATCH_ETHERTYPE | 0x80;
+		nc.rules[nc.ruleCount++].v.etherType = (uint16_t)allowedEtherTypes[i];
+	}
+	nc.rules[nc.ruleCount++].t = (uint8_t)ZT_NETWORK_RULE_ACTION_DROP;
+	nc.rules[nc.ruleCount].t = (uint8_t)ZT_NETWORK_RULE_MATCH_IP_PROTOCOL;
+	nc.rules[nc.ruleCount++].v.ipProtocol = 6;
+	nc.rules[nc.ruleCount].t = (uint8_t)ZT_NETWORK_RULE_MATCH_IP_DEST_PORT_RANGE;
+	nc.rules[nc.ruleCount].v.port[0] = 22;
+	nc.rules[nc.ruleCount++].v.port[1] = 22;
+	nc.rules[nc.ruleCount++].t = (uint8_t)ZT_NETWORK_RULE_ACTION_DROP;
+	nc.rules[nc.ruleCount++].t = (uint8_t)ZT_NETWORK_RULE_ACTION_ACCEPT;
+}
+
+static int testNetworkFilterContention()
+{
+	Node* const node = newSelftestNode();
+	const uint64_t nwid = 0x8056c2e21c000001ULL;
+	node->join(nwid, (void*)0, (void*)0);
+	SharedPtr<Network> network(node->network(nwid));
+	const Address self(node->address());
+
+	NetworkConfig* const configs = new NetworkConfig[2];
+	makeSelftestNetworkConfig(configs[0], nwid, self, 1);
+	makeSelftestNetworkConfig(configs[1], nwid, self, 2);
+	network->setConfiguration((void*)0, configs[0], false);
+
+	// IPv4 TCP frame to port 443
+	uint8_t frame[1400];
+	memset(frame, 0, sizeof(frame));
+	frame[0] = 0x45;
+	frame[9] = 6;
+	frame[12] = 10;
+	frame[15] = 1;
+	frame[16] = 10;
+	frame[19] = 2;
+	frame[22] = 0x01;
+	frame[23] = 0xbb;
+	const Address dest(0x0102030405ULL);
+	const MAC fromMac(self, nwid), toMac(dest, nwid);
+
+	std::cout << "[filter] Testing filter verdicts from config snapshots... ";
 	{
-		Hashtable<uint64_t,std::string> ht;
-		std::map<uint64_t,std::string> ref; // assume std::map works correctly :)
-		for(int x=0;x<2;++x) {
-			for(int i=0;i<77777;++i) {
-				uint64_t k = rand();
-				while ((k == 0)||(ref.count(k) > 0))
-					++k;
-				std::string v("!");
-				for(int j=0;j<(int)(k % 64);++j)
-					v.push_back("0123456789"[rand() % 10]);
-				ref[k] = v;
-				ht.set(0xffffffffffffffffULL,v);
-				std::string &vref = ht[k];
-				vref = v;
-				ht.erase(0xffffffffffffffffULL);
-			}
-			if (ht.size() != ref.size()) {
-				std::cout << "FAILED! (size mismatch, original)" << std::endl;
-				return -1;
+		uint8_t qos = 0;
+		if (! network->filterOutgoingPacket((void*)0, false, self, dest, fromMac, toMac, frame, sizeof(frame), ZT_ETHERTYPE_IPV4, 0, qos)) {
+			std::cout << "FAIL (accept)" << std::endl;
+			return -1;
+		}
+		frame[22] = 0;
+		frame[23] = 22;
+		if (network->filterOutgoingPacket((void*)0, false, self, dest, fromMac, toMac, frame, sizeof(frame), ZT_ETHERTYPE_IPV4, 0, qos)) {
+			std::cout << "FAIL (drop ssh)" << std::endl;
+			return -1;
+		}
+		frame[22] = 0x01;
+		frame[23] = 0xbb;
+		if (network->filterOutgoingPacket((void*)0, false, self, dest, fromMac, toMac, frame, sizeof(frame), 0x88b5, 0, qos)) {
+			std::cout << "FAIL (drop ethertype)" << std::endl;
+			return -1;
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	// Emulates the network-wide lock every frame used to take
+	Mutex oldNetworkLock;
+	static const unsigned int threadCounts[3] = { 8, 16, 32 };
+	const unsigned long totalFrames = 2000000;
+	for (unsigned int mode = 0; mode < 3; ++mode) {
+		for (unsigned int tc = 0; tc < 3; ++tc) {
+			const unsigned int threads = threadCounts[tc];
+			const unsigned long framesPerThread = totalFrames / threads;
+			volatile bool writerRunning = (mode == 2);
+			unsigned long configUpdates = 0;
+			std::thread writer;
+			if (mode == 2) {
+				writer = std::thread([&]() {
+					while (writerRunning) {
+						network->setConfiguration((void*)0, configs[configUpdates & 1], false);
+						++configUpdates;
+						std::this_thread::sleep_for(std::chrono::microseconds(500));
+					}
+				});
 			}
-			{
-				Hashtable<uint64_t,std::string>::Iterator i(ht);
-				uint64_t *k = (uint64_t *)0;
-				std::string *v = (std::string *)0;
-				while(i.next(k,v)) {
-					if (ref.find(*k)->second != *v) {
-						std::cout << "FAILED! (data mismatch!)" << std::endl;
-						return -1;
+
+			std::vector<std::thread> workers;
+			const int64_t start = OSUtils::now();
+			for (unsigned int t = 0; t < threads; ++t) {
+				workers.push_back(std::thread([&, mode]() {
+					uint8_t qos = 0;
+					for (unsigned long i = 0; i < framesPerThread; ++i) {
+						if (mode == 0) {
+							Mutex::Lock _l(oldNetworkLock);
+							network->filterOutgoingPacket((void*)0, false, self, dest, fromMac, toMac, frame, sizeof(frame), ZT_ETHERTYPE_IPV4, 0, qos);
+						}
+						else {
+							network->filterOutgoingPacket((void*)0, false, self, dest, fromMac, toMac, frame, sizeof(frame), ZT_ETHERTYPE_IPV4, 0, qos);
+						}
 					}
-				}
+				}));
 			}
-			for(std::map<uint64_t,std::string>::const_iterator i(ref.begin());i!=ref.end();++i) {
-				if (ht[i->first] != i->second) {
-					std::cout << "FAILED! (data mismatch!)" << std::endl;
-					return -1;
-				}
+			for (std::vector<std::thread>::iterator w(workers.begin()); w != workers.end(); ++w) {
+				w->join();
 			}
-
-			Hashtable<uint64_t,std::string> ht2;
-			ht2 = ht;
-			Hashtable<uint64_t,std::string> ht3(ht2);
-			if (ht2.size() != ref.size()) {
-				std::cout << "FAILED! (size mismatch, assigned)" << std::endl;
-				return -1;
+			const int64_t end = OSUtils::now();
+			writerRunning = false;
+			if (writer.joinable()) {
+				writer.join();
 			}
-			if (ht3.size() != ref.size()) {
-				std::cout << "FAILED! (size mismatch, copied)" << std::endl;
-				return -1;
+
+			char tmp[256];
+			OSUtils::ztsnprintf(
+				tmp,
+				sizeof(tmp),
+				"[filter] %2u threads, %s: %.2f Mframes/sec",
+				threads,
+				(mode == 0) ? "network-wide lock (previous)     " : ((mode == 1) ? "lock-free snapshots               " : "lock-free snapshots + config churn"),
+				((double)(framesPerThread * threads) / ((double)((end > start) ? (end - start) : 1) / 1000.0)) / 1000000.0);
+			std::cout << tmp;
+			if (mode == 2) {
+				std::cout << " (" << configUpdates << " config updates)";
 			}
+			std::cout << std::endl;
+		}
+	}
 
-			for(std::map<uint64_t,std::string>::iterator i(ref.begin());i!=ref.end();++i) {
-				std::string *v = ht.get(i->first);
-				if (!v) {
-					std::cout << "FAILED! (key " << i->first << " not found, original)" << std::endl;
-					return -1;
-				}
-				if (*v != i->second) {
-					std::cout << "FAILED! (key " << i->first << "  not equal, original)" << std::endl;
-					return -1;
-				}
-				v = ht2.get(i->first);
-				if (!v) {
-					std::cout << "FAILED! (key " << i->first << "  not found, assigned)" << std::endl;
-					return -1;
+	delete[] configs;
+	network.zero();
+	delete node;
+	return 0;
+}
+
+static uint64_t rulesTestRandom(uint64_t& s)
+{
+	s ^= s << 13;
+	s ^= s >> 7;
+	s ^= s << 17;
+	return s;
+}
+
+// Random MATCH of a given type drawing values from small pools so that rules hit often
+static void makeRandomMatchRule(ZT_VirtualNetworkRule& r, const unsigned int rt, uint64_t& rs, const uint64_t* ztPool, const uint64_t* macPool)
+{
+	static const uint16_t etherTypes[4] = { ZT_ETHERTYPE_IPV4, ZT_ETHERTYPE_ARP, ZT_ETHERTYPE_IPV6, 0x88b5 };
+	static const uint8_t protocols[5] = { 6, 17, 1, 0x3a, 0x84 };
+	static const uint16_t ports[6] = { 0, 22, 53, 80, 443, 8080 };
+	static const uint8_t v4Masks[6] = { 0, 8, 16, 24, 31, 32 };
+	static const uint8_t v6Masks[7] = { 0, 8, 16, 64, 72, 120, 128 };
+	memset(&r, 0, sizeof(r));
+	r.t = (uint8_t)rt;
+	switch (rt) {
+		case ZT_NETWORK_RULE_MATCH_SOURCE_ZEROTIER_ADDRESS:
+		case ZT_NETWORK_RULE_MATCH_DEST_ZEROTIER_ADDRESS:
+			r.v.zt = ztPool[rulesTestRandom(rs) % 4];
+			break;
+		case ZT_NETWORK_RULE_MATCH_VLAN_ID:
+			r.v.vlanId = (uint16_t)(rulesTestRandom(rs) % 3);
+			break;
+		case ZT_NETWORK_RULE_MATCH_MAC_SOURCE:
+		case ZT_NETWORK_RULE_MATCH_MAC_DEST:
+			MAC(macPool[rulesTestRandom(rs) % 4]).copyTo(r.v.mac, 6);
+			break;
+		case ZT_NETWORK_RULE_MATCH_IPV4_SOURCE:
+		case ZT_NETWORK_RULE_MATCH_IPV4_DEST: {
+			uint8_t ip[4] = { 10, 0, (uint8_t)(rulesTestRandom(rs) % 3), (uint8_t)(rulesTestRandom(rs) % 3) };
+			memcpy(&(r.v.ipv4.ip), ip, 4);
+			r.v.ipv4.mask = v4Masks[rulesTestRandom(rs) % 6];
+		} break;
+		case ZT_NETWORK_RULE_MATCH_IPV6_SOURCE:
+		case ZT_NETWORK_RULE_MATCH_IPV6_DEST:
+			r.v.ipv6.ip[0] = 0xfd;
+			r.v.ipv6.ip[8] = (uint8_t)(rulesTestRandom(rs) % 2);
+			r.v.ipv6.ip[15] = (uint8_t)(rulesTestRandom(rs) % 3);
+			r.v.ipv6.mask = v6Masks[rulesTestRandom(rs) % 7];
+			break;
+		case ZT_NETWORK_RULE_MATCH_IP_TOS:
+			r.v.ipTos.mask = 0xfc;
+			r.v.ipTos.value[1] = (uint8_t)(rulesTestRandom(rs) % 64);
+			break;
+		case ZT_NETWORK_RULE_MATCH_IP_PROTOCOL:
+			r.v.ipProtocol = protocols[rulesTestRandom(rs) % 5];
+			break;
+		case ZT_NETWORK_RULE_MATCH_ETHERTYPE:
+			r.v.etherType = etherTypes[rulesTestRandom(rs) % 4];
+			break;
+		case ZT_NETWORK_RULE_MATCH_ICMP:
+			r.v.icmp.type = (uint8_t)(rulesTestRandom(rs) % 2);
+			r.v.icmp.flags = (uint8_t)(rulesTestRandom(rs) % 2);
+			break;
+		case ZT_NETWORK_RULE_MATCH_IP_SOURCE_PORT_RANGE:
+		case ZT_NETWORK_RULE_MATCH_IP_DEST_PORT_RANGE:
+			r.v.port[0] = ports[rulesTestRandom(rs) % 6];
+			r.v.port[1] = (rulesTestRandom(rs) & 1) ? r.v.port[0] : ports[rulesTestRandom(rs) % 6];
+			break;
+		case ZT_NETWORK_RULE_MATCH_CHARACTERISTICS:
+			r.v.characteristics = 1ULL << (rulesTestRandom(rs) % 12);
+			if (rulesTestRandom(rs) & 1)
+				r.v.characteristics |= ZT_RULE_PACKET_CHARACTERISTICS_INBOUND | ZT_RULE_PACKET_CHARACTERISTICS_MULTICAST;
+			break;
+		case ZT_NETWORK_RULE_MATCH_FRAME_SIZE_RANGE:
+			r.v.frameSize[0] = (uint16_t)(rulesTestRandom(rs) % 70);
+			r.v.frameSize[1] = (uint16_t)(r.v.frameSize[0] + (rulesTestRandom(rs) % 40));
+			break;
+		case ZT_NETWORK_RULE_MATCH_RANDOM:
+			r.v.randomProbability = 0xffffffff;	  // always, so results are deterministic
+			break;
+		case ZT_NETWORK_RULE_MATCH_TAGS_DIFFERENCE:
+		case ZT_NETWORK_RULE_MATCH_TAGS_BITWISE_AND:
+		case ZT_NETWORK_RULE_MATCH_TAGS_EQUAL:
+		case ZT_NETWORK_RULE_MATCH_TAG_SENDER:
+		case ZT_NETWORK_RULE_MATCH_TAG_RECEIVER:
+			r.v.tag.id = (rulesTestRandom(rs) & 1) ? 1000 : 2000;
+			r.v.tag.value = (uint32_t)(rulesTestRandom(rs) % 3) * 100;
+			break;
+		case ZT_NETWORK_RULE_MATCH_INTEGER_RANGE:
+			r.v.intRange.start = rulesTestRandom(rs) % 4;
+			r.v.intRange.end = (uint32_t)(rulesTestRandom(rs) % 2);
+			r.v.intRange.idx = (uint16_t)(rulesTestRandom(rs) % 48);
+			r.v.intRange.format = (uint8_t)((rulesTestRandom(rs) % 16) | ((rulesTestRandom(rs) & 1) << 7));
+			break;
+		default:
+			break;
+	}
+}
+
+static void makeRandomActionRule(ZT_VirtualNetworkRule& r, const bool terminal, uint64_t& rs, const uint64_t* ztPool)
+{
+	static const unsigned int terminalActions[4] = { ZT_NETWORK_RULE_ACTION_DROP, ZT_NETWORK_RULE_ACTION_ACCEPT, ZT_NETWORK_RULE_ACTION_BREAK, ZT_NETWORK_RULE_ACTION_PRIORITY };
+	static const unsigned int forwardActions[3] = { ZT_NETWORK_RULE_ACTION_TEE, ZT_NETWORK_RULE_ACTION_WATCH, ZT_NETWORK_RULE_ACTION_REDIRECT };
+	memset(&r, 0, sizeof(r));
+	if ((terminal) || (rulesTestRandom(rs) % 3)) {
+		r.t = (uint8_t)terminalActions[rulesTestRandom(rs) % 4];
+		r.v.qosBucket = (uint8_t)(rulesTestRandom(rs) % 10);
+	}
+	else {
+		r.t = (uint8_t)forwardActions[rulesTestRandom(rs) % 3];
+		r.v.fwd.address = ztPool[rulesTestRandom(rs) % 4];
+		r.v.fwd.length = (uint16_t)((rulesTestRandom(rs) & 1) ? 0 : 32);
+	}
+}
+
+// Builds a rule set of about the given size from the example rule set in
+// rule-compiler/examples: an ethertype whitelist, then long blocks of
+// network drops, port accepts and two-match protocol/port accepts.
+static unsigned int makeBenchmarkRules(ZT_VirtualNetworkRule* rules, const unsigned int target)
+{
+	unsigned int n = 0;
+	const uint16_t allowed[3] = { ZT_ETHERTYPE_IPV4, ZT_ETHERTYPE_ARP, ZT_ETHERTYPE_IPV6 };
+	memset(rules, 0, sizeof(ZT_VirtualNetworkRule) * target);
+	for (unsigned int i = 0; i < 3; ++i) {
+		rules[n].t = (uint8_t)ZT_NETWORK_RULE_MATCH_ETHERTYPE | 0x80;
+		rules[n++].v.etherType = allowed[i];
+	}
+	rules[n++].t = (uint8_t)ZT_NETWORK_RULE_ACTION_DROP;
+	const unsigned int body = (target > 5) ? (target - 5) : 0;
+	for (unsigned int i = 0; (n + 2) <= (4 + (body * 2) / 5); ++i) {
+		rules[n].t = (uint8_t)ZT_NETWORK_RULE_MATCH_IPV4_DEST;
+		const uint8_t ip[4] = { 172, 16, (uint8_t)i, 0 };
+		memcpy(&(rules[n].v.ipv4.ip), ip, 4);
+		rules[n++].v.ipv4.mask = 24;
+		rules[n++].t = (uint8_t)ZT_NETWORK_RULE_ACTION_DROP;
+	}
+	for (unsigned int i = 0; (n + 2) <= (4 + (body * 4) / 5); ++i) {
+		rules[n].t = (uint8_t)ZT_NETWORK_RULE_MATCH_IP_DEST_PORT_RANGE;
+		rules[n].v.port[0] = (uint16_t)(10000 + i);
+		rules[n++].v.port[1] = (uint16_t)(10000 + i);
+		rules[n++].t = (uint8_t)ZT_NETWORK_RULE_ACTION_ACCEPT;
+	}
+	for (unsigned int i = 0; (n + 3) <= (4 + body); ++i) {
+		rules[n].t = (uint8_t)ZT_NETWORK_RULE_MATCH_IP_PROTOCOL;
+		rules[n++].v.ipProtocol = 17;
+		rules[n].t = (uint8_t)ZT_NETWORK_RULE_MATCH_IP_DEST_PORT_RANGE;
+		rules[n].v.port[0] = (uint16_t)(20000 + i);
+		rules[n++].v.port[1] = (uint16_t)(20000 + i);
+		rules[n++].t = (uint8_t)ZT_NETWORK_RULE_ACTION_ACCEPT;
+	}
+	rules[n++].t = (uint8_t)ZT_NETWORK_RULE_ACTION_ACCEPT;
+	return n;
+}
+
+static int testCompiledRules()
+{
+	Node* const node = newSelftestNode();
+	const RuntimeEnvironment* const RR = node->RR;
+	const uint64_t nwid = 0x8056c2e21c000001ULL;
+	const Address self(node->address());
+	const uint64_t ztPool[4] = { self.toInt(), 0x0102030405ULL, 0x0a0b0c0d0eULL, 0x1112131415ULL };
+	const uint64_t macPool[4] = { MAC(Address(ztPool[1]), nwid).toInt(), MAC(Address(ztPool[2]), nwid).toInt(), 0x333300000001ULL, 0xffffffffffffULL };
+
+	NetworkConfig* const nconf = new NetworkConfig();
+	makeSelftestNetworkConfig(*nconf, nwid, self, 1);
+	nconf->tags[0] = Tag(nwid, nconf->timestamp, self, 1000, 100);
+	nconf->tagCount = 1;
+	const Membership* const emptyMembership = new Membership();
+
+	std::cout << "[rules] Testing compiled rules against interpreter... ";
+	{
+		static const unsigned int matchTypes[23] = { ZT_NETWORK_RULE_MATCH_SOURCE_ZEROTIER_ADDRESS,
+													 ZT_NETWORK_RULE_MATCH_DEST_ZEROTIER_ADDRESS,
+													 ZT_NETWORK_RULE_MATCH_VLAN_ID,
+													 ZT_NETWORK_RULE_MATCH_MAC_SOURCE,
+													 ZT_NETWORK_RULE_MATCH_MAC_DEST,
+													 ZT_NETWORK_RULE_MATCH_IPV4_SOURCE,
+													 ZT_NETWORK_RULE_MATCH_IPV4_DEST,
+													 ZT_NETWORK_RULE_MATCH_IPV6_SOURCE,
+													 ZT_NETWORK_RULE_MATCH_IPV6_DEST,
+													 ZT_NETWORK_RULE_MATCH_IP_TOS,
+													 ZT_NETWORK_RULE_MATCH_IP_PROTOCOL,
+													 ZT_NETWORK_RULE_MATCH_ETHERTYPE,
+													 ZT_NETWORK_RULE_MATCH_ICMP,
+													 ZT_NETWORK_RULE_MATCH_IP_SOURCE_PORT_RANGE,
+													 ZT_NETWORK_RULE_MATCH_IP_DEST_PORT_RANGE,
+													 ZT_NETWORK_RULE_MATCH_CHARACTERISTICS,
+													 ZT_NETWORK_RULE_MATCH_FRAME_SIZE_RANGE,
+													 ZT_NETWORK_RULE_MATCH_RANDOM,
+													 ZT_NETWORK_RULE_MATCH_TAGS_DIFFERENCE,
+													 ZT_NETWORK_RULE_MATCH_TAGS_EQUAL,
+													 ZT_NETWORK_RULE_MATCH_TAG_SENDER,
+													 ZT_NETWORK_RULE_MATCH_TAG_RECEIVER,
+													 ZT_NETWORK_RULE_MATCH_INTEGER_RANGE };
+		static const unsigned int groupTypes[10] = { ZT_NETWORK_RULE_MATCH_SOURCE_ZEROTIER_ADDRESS,
+													 ZT_NETWORK_RULE_MATCH_MAC_DEST,
+													 ZT_NETWORK_RULE_MATCH_ETHERTYPE,
+													 ZT_NETWORK_RULE_MATCH_IP_PROTOCOL,
+													 ZT_NETWORK_RULE_MATCH_IPV4_SOURCE,
+													 ZT_NETWORK_RULE_MATCH_IPV4_DEST,
+													 ZT_NETWORK_RULE_MATCH_IPV6_DEST,
+													 ZT_NETWORK_RULE_MATCH_IP_SOURCE_PORT_RANGE,
+													 ZT_NETWORK_RULE_MATCH_IP_DEST_PORT_RANGE,
+													 ZT_NETWORK_RULE_MATCH_FRAME_SIZE_RANGE };
+		static const unsigned int frameEtherTypes[4] = { ZT_ETHERTYPE_IPV4, ZT_ETHERTYPE_IPV6, ZT_ETHERTYPE_ARP, 0x88b5 };
+		static const unsigned int framePorts[6] = { 0, 22, 53, 80, 443, 8080 };
+		static const unsigned int frameProtocols[5] = { 6, 17, 1, 0x3a, 0x84 };
+
+		uint64_t rs = 0x9e3779b97f4a7c15ULL;
+		ZT_VirtualNetworkRule rules[128];
+		uint8_t frame[256];
+		unsigned long compared = 0, grouped = 0;
+		for (unsigned int set = 0; set < 3000; ++set) {
+			unsigned int rc = 0;
+			const unsigned int target = 1 + (unsigned int)(rulesTestRandom(rs) % 100);
+			while (rc < target) {
+				if ((rulesTestRandom(rs) % 3) == 0) {
+					// A run of single-match sets that the compiler merges into one lookup
+					const unsigned int rt = groupTypes[rulesTestRandom(rs) % 10];
+					const unsigned int sets = 3 + (unsigned int)(rulesTestRandom(rs) % 8);
+					for (unsigned int k = 0; k < sets; ++k) {
+						makeRandomMatchRule(rules[rc++], rt, rs, ztPool, macPool);
+						makeRandomActionRule(rules[rc++], true, rs, ztPool);
+					}
 				}
-				if (*v != i->second) {
-					std::cout << "FAILED! (key " << i->first << "  not equal, assigned)" << std::endl;
-					return -1;
+				else {
+					const unsigned int matches = (unsigned int)(rulesTestRandom(rs) % 4);
+					for (unsigned int k = 0; k < matches; ++k) {
+						ZT_VirtualNetworkRule& r = rules[rc++];
+						if ((rulesTestRandom(rs) % 20) == 0) {
+							memset(&r, 0, sizeof(r));
+							r.t = 60;	// unsupported MATCH
+						}
+						else {
+							makeRandomMatchRule(r, matchTypes[rulesTestRandom(rs) % 23], rs, ztPool, macPool);
+						}
+						if ((rulesTestRandom(rs) % 4) == 0)
+							r.t |= 0x80;   // NOT
+						if ((k > 0) && ((rulesTestRandom(rs) % 5) == 0))
+							r.t |= 0x40;   // OR
+					}
+					makeRandomActionRule(rules[rc++], false, rs, ztPool);
 				}
-				v = ht3.get(i->first);
-				if (!v) {
-					std::cout << "FAILED! (key " << i->first << "  not found, copied)" << std::endl;
-					return -1;
+			}
+			nconf->flags = (rulesTestRandom(rs) & 1) ? ZT_NETWORKCONFIG_FLAG_RULES_RESULT_OF_UNSUPPORTED_MATCH : 0;
+
+			const CompiledRules compiled(rules, rc);
+			grouped += compiled.groupedSetCount();
+
+			for (unsigned int f = 0; f < 100; ++f) {
+				const unsigned int et = frameEtherTypes[rulesTestRandom(rs) % 4];
+				unsigned int len;
+				uint8_t sa[16], da[16];
+				memset(sa, 0, sizeof(sa));
+				memset(da, 0, sizeof(da));
+				if (et == ZT_ETHERTYPE_IPV6) {
+					sa[0] = da[0] = 0xfd;
+					sa[8] = (uint8_t)(rulesTestRandom(rs) % 2);
+					sa[15] = (uint8_t)(rulesTestRandom(rs) % 3);
+					da[15] = (uint8_t)(rulesTestRandom(rs) % 3);
 				}
-				if (*v != i->second) {
-					std::cout << "FAILED! (key " << i->first << "  not equal, copied)" << std::endl;
-					return -1;
+				else {
+					sa[0] = da[0] = 10;
+					sa[2] = (uint8_t)(rulesTestRandom(rs) % 3);
+					sa[3] = (uint8_t)(rulesTestRandom(rs) % 3);
+					da[3] = (uint8_t)(rulesTestRandom(rs) % 3);
 				}
-			}
-			{
-				uint64_t *k;
-				std::string *v;
-				Hashtable<uint64_t,std::string>::Iterator i(ht);
-				unsigned long ic = 0;
-				while (i.next(k,v)) {
-					if (ref[*k] != *v) {
-						std::cout << "FAILED! (iterate)" << std::endl;
+				memset(frame, 0, sizeof(frame));
+				len = makeFlowTestPacket(frame, et == ZT_ETHERTYPE_IPV6, (rulesTestRandom(rs) & 3) == 0, frameProtocols[rulesTestRandom(rs) % 5], sa, da, framePorts[rulesTestRandom(rs) % 6], framePorts[rulesTestRandom(rs) % 6]);
+				frame[len - 7] = (uint8_t)rulesTestRandom(rs);	  // TCP flags when present
+				if ((rulesTestRandom(rs) % 6) == 0)
+					len = (unsigned int)(rulesTestRandom(rs) % len);   // truncated headers
+				const unsigned int vlanId = (unsigned int)(rulesTestRandom(rs) % 3);
+				const MAC macSource(macPool[rulesTestRandom(rs) % 4]), macDest(macPool[rulesTestRandom(rs) % 4]);
+				const CompiledRules::Frame parsed(frame, len, et, vlanId);
+
+				for (unsigned int inbound = 0; inbound < 2; ++inbound) {
+					const Address ztSource((inbound) ? ztPool[1 + (rulesTestRandom(rs) % 3)] : self.toInt());
+					const Address ztDest((inbound) ? self.toInt() : ztPool[1 + (rulesTestRandom(rs) % 3)]);
+					const Membership* const membership = ((inbound) || (rulesTestRandom(rs) & 1)) ? emptyMembership : (const Membership*)0;
+
+					Trace::RuleResultLog rrl;
+					Address d1(ztDest), d2(ztDest), cc1, cc2;
+					unsigned int ccl1 = 0, ccl2 = 0;
+					bool ccw1 = false, ccw2 = false;
+					uint8_t q1 = 0, q2 = 0;
+					const ZtFilterResult r1 = doZtFilter(RR, rrl, *nconf, membership, inbound != 0, ztSource, d1, macSource, macDest, frame, len, et, vlanId, rules, rc, cc1, ccl1, ccw1, q1);
+					const ZtFilterResult r2 = compiled.filter(RR, *nconf, membership, inbound != 0, ztSource, d2, macSource, macDest, parsed, cc2, ccl2, ccw2, q2);
+					if ((r1 != r2) || (d1 != d2) || (cc1 != cc2) || (ccl1 != ccl2) || (ccw1 != ccw2) || (q1 != q2)) {
+						std::cout << "FAIL (rule set " << set << ", frame " << f << ", inbound " << inbound << ": " << (int)r1 << " != " << (int)r2 << ")" << std::endl;
 						return -1;
 					}
-					++ic;
-				}
-				if (ic != ht.size()) {
-					std::cout << "FAILED! (iterate coverage)" << std::endl;
-					return -1;
+					++compared;
 				}
 			}
-			for(std::map<uint64_t,std::string>::iterator i(ref.begin());i!=ref.end();) {
-				if (!ht.get(i->first)) {
-					std::cout << "FAILED! (erase, check if exists)" << std::endl;
-					return -1;
-				}
-				ht.erase(i->first);
-				if (ht.get(i->first)) {
-					std::cout << "FAILED! (erase, check if erased)" << std::endl;
-					return -1;
-				}
-				ref.erase(i++);
-				if (ht.size() != ref.size()) {
-					std::cout << "FAILED! (erase, size)" << std::endl;
-					return -1;
-				}
+		}
+		std::cout << "PASS (" << compared << " verdicts, " << grouped << " sets merged into lookups)" << std::endl;
+	}
+
+	{
+		static const unsigned int sizes[3] = { 10, 100, 1000 };
+		ZT_VirtualNetworkRule* const rules = new ZT_VirtualNetworkRule[ZT_MAX_NETWORK_RULES];
+		uint8_t frame[256], sa[4] = { 10, 1, 2, 3 }, da[4] = { 10, 9, 9, 9 };
+		const unsigned int len = makeFlowTestPacket(frame, false, false, 6, sa, da, 40000, 443);
+		const MAC macSource(macPool[0]), macDest(macPool[1]);
+		for (unsigned int s = 0; s < 3; ++s) {
+			const unsigned int rc = makeBenchmarkRules(rules, sizes[s]);
+			const unsigned int iterations = 20000000 / rc;
+			Trace::RuleResultLog rrl;
+			Address cc, d;
+			unsigned int ccl = 0;
+			bool ccw = false;
+			uint8_t q = 0;
+			unsigned long accepted = 0;
+
+			int64_t start = OSUtils::now();
+			for (unsigned int i = 0; i < iterations; ++i) {
+				d = ztPool[1];
+				accepted += (unsigned long)(doZtFilter(RR, rrl, *nconf, (const Membership*)0, false, self, d, macSource, macDest, frame, len, ZT_ETHERTYPE_IPV4, 0, rules, rc, cc, ccl, ccw, q) == DOZTFILTER_ACCEPT);
 			}
-			if (!ht.empty()) {
-				std::cout << "FAILED! (erase, empty)" << std::endl;
+			const int64_t interpreted = OSUtils::now() - start;
+
+			start = OSUtils::now();
+			const CompiledRules compiled(rules, rc);
+			const int64_t compileTime = OSUtils::now() - start;
+			start = OSUtils::now();
+			for (unsigned int i = 0; i < iterations; ++i) {
+				d = ztPool[1];
+				const CompiledRules::Frame parsed(frame, len, ZT_ETHERTYPE_IPV4, 0);
+				accepted += (unsigned long)(compiled.filter(RR, *nconf, (const Membership*)0, false, self, d, macSource, macDest, parsed, cc, ccl, ccw, q) == DOZTFILTER_ACCEPT);
+			}
+			const int64_t compiledTime = OSUtils::now() - start;
+
+			if (accepted != ((unsigned long)iterations * 2)) {
+				std::cout << "[rules] FAIL (benchmark verdict)" << std::endl;
 				return -1;
 			}
-			for(int i=0;i<10000;++i) {
-				uint64_t k = rand();
-				while ((k == 0)||(ref.count(k) > 0))
+			char tmp[256];
+			OSUtils::ztsnprintf(
+				tmp,
+				sizeof(tmp),
+				"[rules] %4u rules: interpreter %9.1f ns/frame, compiled %7.1f ns/frame (%u sets merged, compiled in %d ms)",
+				rc,
+				((double)interpreted * 1000000.0) / (double)iterations,
+				((double)compiledTime * 1000000.0) / (double)iterations,
+				compiled.groupedSetCount(),
+				(int)compileTime);
+			std::cout << tmp << std::endl;
+		}
+		delete[] rules;
+	}
+
+	delete emptyMembership;
+	delete nconf;
+	delete node;
+	return 0;
+}
+
+static int testFlowCache()
+{
+	Node* const node = newSelftestNode();
+	const uint64_t nwid = 0x8056c2e21c000002ULL;
+	node->join(nwid, (void*)0, (void*)0);
+	SharedPtr<Network> network(node->network(nwid));
+	const Address self(node->address());
+	const Address dest(0x0102030405ULL);
+	const MAC fromMac(self, nwid), toMac(dest, nwid);
+
+	NetworkConfig* const nconf = new NetworkConfig();
+	makeSelftestNetworkConfig(*nconf, nwid, self, 1);
+	nconf->ruleCount = makeBenchmarkRules(nconf->rules, 100);
+	network->setConfiguration((void*)0, *nconf, false);
+
+	// Flows that hit the network drops, port accepts, protocol/port accepts and the final accept
+	static const unsigned int flowCount = 64;
+	uint8_t frames[flowCount][128];
+	unsigned int lens[flowCount];
+	for (unsigned int f = 0; f < flowCount; ++f) {
+		const uint8_t sa[4] = { 10, 1, 2, (uint8_t)f };
+		const uint8_t da[4] = { (uint8_t)((f & 3) ? 10 : 172), 16, (uint8_t)(f % 5), 9 };
+		memset(frames[f], 0, sizeof(frames[f]));
+		lens[f] = makeFlowTestPacket(frames[f], false, false, (f & 1) ? 17 : 6, sa, da, 40000 + f, ((f % 3) == 0) ? (10000 + f) : (20000 + f));
+	}
+
+	std::cout << "[flowcache] Testing cached verdicts against uncached... ";
+	{
+		bool verdicts[flowCount];
+		uint8_t qos = 0;
+		node->setFlowCacheEnabled(false);
+		for (unsigned int f = 0; f < flowCount; ++f) {
+			verdicts[f] = network->filterOutgoingPacket((void*)0, false, self, dest, fromMac, toMac, frames[f], lens[f], ZT_ETHERTYPE_IPV4, 0, qos);
+		}
+		if ((network->flowCacheHits() != 0) || (network->flowCacheMisses() != 0)) {
+			std::cout << "FAIL (cache used while disabled)" << std::endl;
+			return -1;
+		}
+		node->setFlowCacheEnabled(true);
+		for (unsigned int pass = 0; pass < 3; ++pass) {
+			for (unsigned int f = 0; f < flowCount; ++f) {
+				if (network->filterOutgoingPacket((void*)0, false, self, dest, fromMac, toMac, frames[f], lens[f], ZT_ETHERTYPE_IPV4, 0, qos) != verdicts[f]) {
+					std::cout << "FAIL (flow " << f << ", pass " << pass << ")" << std::endl;
+					return -1;
+				}
+			}
+		}
+		// Direct-mapped slots can collide, so a few repeats may still miss
+		if (((network->flowCacheHits() + network->flowCacheMisses()) != (flowCount * 3)) || (network->flowCacheHits() < ((flowCount * 3) / 2))) {
+			std::cout << "FAIL (" << network->flowCacheHits() << " hits, " << network->flowCacheMisses() << " misses)" << std::endl;
+			return -1;
+		}
+		std::cout << "PASS" << std::endl;
+
+		std::cout << "[flowcache] Testing invalidation on config change... ";
+		// Prepend a rule dropping everything to flow 1's destination port
+		memmove(nconf->rules + 2, nconf->rules, sizeof(ZT_VirtualNetworkRule) * nconf->ruleCount);
+		memset(nconf->rules, 0, sizeof(ZT_VirtualNetworkRule) * 2);
+		nconf->rules[0].t = (uint8_t)ZT_NETWORK_RULE_MATCH_IP_DEST_PORT_RANGE;
+		nconf->rules[0].v.port[0] = nconf->rules[0].v.port[1] = 20001;
+		nconf->rules[1].t = (uint8_t)ZT_NETWORK_RULE_ACTION_DROP;
+		nconf->ruleCount += 2;
+		nconf->revision = 2;
+		network->setConfiguration((void*)0, *nconf, false);
+		if ((! verdicts[1]) || (network->filterOutgoingPacket((void*)0, false, self, dest, fromMac, toMac, frames[1], lens[1], ZT_ETHERTYPE_IPV4, 0, qos))) {
+			std::cout << "FAIL (stale verdict)" << std::endl;
+			return -1;
+		}
+		std::cout << "PASS" << std::endl;
+
+		std::cout << "[flowcache] Testing that per-packet matches are never cached... ";
+		static const unsigned int uncacheable[2] = { ZT_NETWORK_RULE_MATCH_RANDOM, ZT_NETWORK_RULE_MATCH_CHARACTERISTICS };
+		for (unsigned int u = 0; u < 2; ++u) {
+			nconf->rules[0].t = (uint8_t)uncacheable[u];
+			if (uncacheable[u] == ZT_NETWORK_RULE_MATCH_RANDOM) {
+				nconf->rules[0].v.randomProbability = 0x7fffffff;
+			}
+			else {
+				nconf->rules[0].v.characteristics = ZT_RULE_PACKET_CHARACTERISTICS_TCP_SYN;
+			}
+			nconf->revision = 3 + u;
+			network->setConfiguration((void*)0, *nconf, false);
+			const uint64_t hits = network->flowCacheHits(), misses = network->flowCacheMisses();
+			for (unsigned int f = 0; f < (flowCount * 4); ++f) {
+				network->filterOutgoingPacket((void*)0, false, self, dest, fromMac, toMac, frames[f % flowCount], lens[f % flowCount], ZT_ETHERTYPE_IPV4, 0, qos);
+			}
+			if ((network->flowCacheHits() != hits) || (network->flowCacheMisses() != misses)) {
+				std::cout << "FAIL (rule type " << uncacheable[u] << " cached)" << std::endl;
+				return -1;
+			}
+		}
+		std::cout << "PASS" << std::endl;
+	}
+
+	{
+		static const unsigned int sizes[3] = { 10, 100, 1000 };
+		for (unsigned int s = 0; s < 3; ++s) {
+			nconf->ruleCount = makeBenchmarkRules(nconf->rules, sizes[s]);
+			nconf->revision = 10 + s;
+			network->setConfiguration((void*)0, *nconf, false);
+			const unsigned int iterations = 2000000;
+			double ns[2];
+			for (unsigned int enabled = 0; enabled < 2; ++enabled) {
+				node->setFlowCacheEnabled(enabled != 0);
+				uint8_t qos = 0;
+				const int64_t start = OSUtils::now();
+				for (unsigned int i = 0; i < iterations; ++i) {
+					const unsigned int f = i % flowCount;
+					network->filterOutgoingPacket((void*)0, false, self, dest, fromMac, toMac, frames[f], lens[f], ZT_ETHERTYPE_IPV4, 0, qos);
+				}
+				ns[enabled] = ((double)(OSUtils::now() - start) * 1000000.0) / (double)iterations;
+			}
+			char tmp[256];
+			OSUtils::ztsnprintf(tmp, sizeof(tmp), "[flowcache] %4u rules, %u flows: uncached %7.1f ns/frame, cached %7.1f ns/frame", nconf->ruleCount, flowCount, ns[0], ns[1]);
+			std::cout << tmp << std::endl;
+		}
+	}
+
+	delete nconf;
+	network.zero();
+	delete node;
+	return 0;
+}
+
+static int testNetworkTable()
+{
+	Node* const node = newSelftestNode();
+	const Address self(node->address());
+	static const unsigned int networkCount = 8;
+	const uint64_t nwidBase = 0x8056c2e21c000100ULL;
+	NetworkConfig* const nconf = new NetworkConfig();
+	for (unsigned int n = 0; n < networkCount; ++n) {
+		node->join(nwidBase + n, (void*)0, (void*)0);
+		makeSelftestNetworkConfig(*nconf, nwidBase + n, self, 1);
+		node->network(nwidBase + n)->setConfiguration((void*)0, *nconf, false);
+	}
+	delete nconf;
+
+	std::cout << "[networks] Testing lock-free network table across join and leave... ";
+	{
+		const uint64_t churnNwid = nwidBase + networkCount;
+		volatile bool running = true;
+		unsigned long lookups = 0, missing = 0;
+		std::thread reader([&]() {
+			while (running) {
+				for (unsigned int n = 0; n < networkCount; ++n) {
+					const Node::NetworkReader nr(*node, nwidBase + n);
+					if ((! nr.network()) || (nr.network()->id() != (nwidBase + n))) {
+						++missing;
+					}
+					++lookups;
+				}
+				const Node::NetworkReader nr(*node, churnNwid);
+				if ((nr.network()) && (nr.network()->id() != churnNwid)) {
+					++missing;
+				}
+			}
+		});
+		for (unsigned int i = 0; i < 200; ++i) {
+			node->join(churnNwid, (void*)0, (void*)0);
+			if (! node->belongsToNetwork(churnNwid)) {
+				++missing;
+			}
+			node->leave(churnNwid, (void**)0, (void*)0);
+			if (node->belongsToNetwork(churnNwid)) {
+				++missing;
+			}
+		}
+		running = false;
+		reader.join();
+		if ((missing != 0) || (node->allNetworks().size() != networkCount)) {
+			std::cout << "FAIL (" << missing << " bad lookups of " << lookups << ")" << std::endl;
+			return -1;
+		}
+		std::cout << "PASS (" << lookups << " lookups during 200 joins and leaves)" << std::endl;
+	}
+
+	// Unicast frames with an ethertype the rules drop, so the cost measured
+	// is mostly network lookup and filtering rather than sending
+	uint8_t frame[1400];
+	memset(frame, 0, sizeof(frame));
+	const MAC toMac(Address(0x0102030405ULL), nwidBase);
+
+	// Emulates the previous lookup: a node-wide lock and a SharedPtr copy per frame
+	Mutex oldNetworksLock;
+	static const unsigned int threadCounts[4] = { 1, 8, 16, 32 };
+	const unsigned long totalFrames = 4000000;
+	for (unsigned int mode = 0; mode < 2; ++mode) {
+		for (unsigned int tc = 0; tc < 4; ++tc) {
+			const unsigned int threads = threadCounts[tc];
+			const unsigned long framesPerThread = totalFrames / threads;
+			std::vector<std::thread> workers;
+			const int64_t start = OSUtils::now();
+			for (unsigned int t = 0; t < threads; ++t) {
+				workers.push_back(std::thread([&, mode, t]() {
+					volatile int64_t nextDeadline = 0;
+					for (unsigned long i = 0; i < framesPerThread; ++i) {
+						const uint64_t nwid = nwidBase + ((t + i) % networkCount);
+						const MAC fromMac(self, nwid);
+						if (mode == 0) {
+							SharedPtr<Network> nw;
+							{
+								Mutex::Lock _l(oldNetworksLock);
+								nw = node->network(nwid);
+							}
+							node->RR->sw->onLocalEthernet((void*)0, nw, fromMac, toMac, 0x88b5, 0, frame, sizeof(frame));
+						}
+						else {
+							node->processVirtualNetworkFrame((void*)0, OSUtils::now(), nwid, fromMac.toInt(), toMac.toInt(), 0x88b5, 0, frame, sizeof(frame), &nextDeadline);
+						}
+					}
+				}));
+			}
+			for (std::vector<std::thread>::iterator w(workers.begin()); w != workers.end(); ++w) {
+				w->join();
+			}
+			const int64_t end = OSUtils::now();
+
+			char tmp[256];
+			OSUtils::ztsnprintf(
+				tmp,
+				sizeof(tmp),
+				"[networks] %2u threads, %s: %.2f Mframes/sec",
+				threads,
+				(mode == 0) ? "locked lookup + SharedPtr copy (previous)" : "processVirtualNetworkFrame (lock-free)   ",
+				((double)(framesPerThread * threads) / ((double)((end > start) ? (end - start) : 1) / 1000.0)) / 1000000.0);
+			std::cout << tmp << std::endl;
+		}
+	}
+
+	delete node;
+	return 0;
+}
+
+struct ShardedTableCounter {
+	ShardedTableCounter() : n(0), sum(0)
+	{
+	}
+	inline void operator()(const Address& a, const SharedPtr<Path>& p)
+	{
+		++n;
+		sum += a.toInt();
+	}
+	unsigned long n;
+	uint64_t sum;
+};
+
+static int testTopologyTables()
+{
+	static const unsigned long entryCount = 100000;
+
+	std::cout << "[topology] Testing sharded table under concurrent updates... ";
+	{
+		ShardedHashtable<Address, SharedPtr<Path>, ZT_TOPOLOGY_PEER_SHARDS> t;
+		const SharedPtr<Path> value(new Path());
+		volatile bool running = true;
+		unsigned long bad = 0, reads = 0;
+		std::thread reader([&]() {
+			while (running) {
+				for (unsigned long i = 1; i <= 1000; ++i) {
+					SharedPtr<Path> v;
+					if ((t.get(Address(i), v)) && (v != value)) {
+						++bad;
+					}
+					++reads;
+				}
+			}
+		});
+		uint64_t expectedSum = 0;
+		const int64_t fillStart = OSUtils::now();
+		for (unsigned long i = 1; i <= entryCount; ++i) {
+			if (t.setIfAbsent(Address(i), value) != value) {
+				++bad;
+			}
+			expectedSum += i;
+		}
+		const int64_t fillTime = OSUtils::now() - fillStart;
+		running = false;
+		reader.join();
+		ShardedTableCounter c;
+		t.each<ShardedTableCounter&>(c);
+		if ((bad != 0) || (c.n != entryCount) || (c.sum != expectedSum) || (t.size() != entryCount)) {
+			std::cout << "FAIL (" << bad << " bad reads, " << c.n << " entries)" << std::endl;
+			return -1;
+		}
+		struct {
+			inline bool operator()(const Address& a, const SharedPtr<Path>& p) const
+			{
+				return ((a.toInt() & 1) != 0);
+			}
+		} odd;
+		if ((t.eraseIf(odd) != (entryCount / 2)) || (t.size() != (entryCount / 2)) || (t.contains(Address(1))) || (! t.contains(Address(2)))) {
+			std::cout << "FAIL (eraseIf)" << std::endl;
+			return -1;
+		}
+		// Churn reuses erased slots and rebuilds shards without growing them
+		std::vector<Address> evens;
+		for (unsigned long i = 2; i <= entryCount; i += 2) {
+			evens.push_back(Address(i));
+		}
+		for (unsigned int round = 0; round < 4; ++round) {
+			for (unsigned long i = 1; i <= entryCount; i += 2) {
+				t.setIfAbsent(Address(i), value);
+			}
+			if ((t.eraseAll(evens) != (entryCount / 2)) || (t.size() != (entryCount / 2)) || (! t.contains(Address(1))) || (t.contains(Address(2)))) {
+				std::cout << "FAIL (churn)" << std::endl;
+				return -1;
+			}
+			for (std::vector<Address>::const_iterator a(evens.begin()); a != evens.end(); ++a) {
+				t.setIfAbsent(*a, value);
+			}
+			if (t.eraseIf(odd) != (entryCount / 2)) {
+				std::cout << "FAIL (churn)" << std::endl;
+				return -1;
+			}
+		}
+		std::cout << "PASS (" << entryCount << " inserts in " << fillTime << "ms with " << reads << " concurrent reads)" << std::endl;
+	}
+
+	// Lookups of existing entries in a 100k entry table: the previous mutex
+	// and Hashtable against the sharded table, for peers (by Address) and for
+	// paths via Topology::getPath()
+	Node* const node = newSelftestNode();
+	Topology* const topology = node->RR->topology;
+	std::vector<InetAddress> pathAddresses;
+	uint64_t addressRng = 0x243f6a8885a308d3ULL;
+	for (unsigned long i = 0; i < entryCount; ++i) {
+		addressRng ^= addressRng << 13;
+		addressRng ^= addressRng >> 7;
+		addressRng ^= addressRng << 17;
+		const uint32_t ip = (uint32_t)addressRng;
+		pathAddresses.push_back(InetAddress(&ip, 4, (unsigned int)((addressRng >> 32) & 0xffff)));
+		topology->getPath(1, pathAddresses.back());
+	}
+	Hashtable<Address, SharedPtr<Path> > oldPeers;
+	Mutex oldPeersLock;
+	ShardedHashtable<Address, SharedPtr<Path>, ZT_TOPOLOGY_PEER_SHARDS> peers;
+	for (unsigned long i = 1; i <= entryCount; ++i) {
+		const SharedPtr<Path> p(new Path());
+		oldPeers.set(Address(i * 0x9e3779b1ULL), p);
+		peers.setIfAbsent(Address(i * 0x9e3779b1ULL), p);
+	}
+
+	static const unsigned int threadCounts[3] = { 1, 8, 32 };
+	const unsigned long totalLookups = 4000000;
+	for (unsigned int mode = 0; mode < 3; ++mode) {
+		for (unsigned int tc = 0; tc < 3; ++tc) {
+			const unsigned int threads = threadCounts[tc];
+			const unsigned long perThread = totalLookups / threads;
+			std::vector<std::thread> workers;
+			unsigned long found[32];
+			const int64_t start = OSUtils::now();
+			for (unsigned int t = 0; t < threads; ++t) {
+				found[t] = 0;
+				workers.push_back(std::thread([&, mode, t]() {
+					uint64_t x = 0x9e3779b97f4a7c15ULL ^ t;
+					for (unsigned long i = 0; i < perThread; ++i) {
+						x ^= x << 13;
+						x ^= x >> 7;
+						x ^= x << 17;
+						const unsigned long e = (unsigned long)(x % entryCount);
+						if (mode == 0) {
+							Mutex::Lock _l(oldPeersLock);
+							const SharedPtr<Path>* const p = oldPeers.get(Address((e + 1) * 0x9e3779b1ULL));
+							if (p) {
+								const SharedPtr<Path> copy(*p);
+								++found[t];
+							}
+						}
+						else if (mode == 1) {
+							SharedPtr<Path> p;
+							if (peers.get(Address((e + 1) * 0x9e3779b1ULL), p)) {
+								++found[t];
+							}
+						}
+						else {
+							if (topology->getPath(1, pathAddresses[e])) {
+								++found[t];
+							}
+						}
+					}
+				}));
+			}
+			for (std::vector<std::thread>::iterator w(workers.begin()); w != workers.end(); ++w) {
+				w->join();
+			}
+			const int64_t end = OSUtils::now();
+			for (unsigned int t = 0; t < threads; ++t) {
+				if (found[t] != perThread) {
+					std::cout << "[topology] FAIL (lookup missed)" << std::endl;
+					return -1;
+				}
+			}
+
+			char tmp[256];
+			OSUtils::ztsnprintf(
+				tmp,
+				sizeof(tmp),
+				"[topology] %2u threads, 100k entries, %s: %.2f Mlookups/sec",
+				threads,
+				(mode == 0) ? "single mutex (previous)   " : ((mode == 1) ? "sharded peer table        " : "Topology::getPath()       "),
+				((double)(perThread * threads) / ((double)((end > start) ? (end - start) : 1) / 1000.0)) / 1000000.0);
+			std::cout << tmp << std::endl;
+		}
+	}
+
+	std::cout << "[topology] Testing expiry of unused paths as their timers come due... ";
+	{
+		// Of the 100k benchmark paths, keep every tenth one in use
+		std::vector<SharedPtr<Path> > held;
+		for (unsigned long i = 0; i < entryCount; i += 10) {
+			held.push_back(topology->getPath(1, pathAddresses[i]));
+		}
+		const int64_t now = node->now();
+		bool ok = (topology->pathCount() == entryCount);
+		ok &= (topology->expirePaths(now + ZT_PATH_UNUSED_CHECK_INTERVAL - 1000, 0xffffffff) == 0);
+		unsigned long expired = 0, calls = 0;
+		const int64_t start = OSUtils::now();
+		do {
+			expired += topology->expirePaths(now + ZT_PATH_UNUSED_CHECK_INTERVAL + 1000, ZT_PATH_TIMER_BUDGET);
+			++calls;
+		} while ((topology->nextPathDeadline(now + ZT_PATH_UNUSED_CHECK_INTERVAL + 1000) <= (now + ZT_PATH_UNUSED_CHECK_INTERVAL + 1000)) && (calls < 1000));
+		const int64_t elapsed = OSUtils::now() - start;
+		ok &= (expired == (entryCount - held.size())) && (topology->pathCount() == held.size());
+		ok &= (topology->getPath(1, pathAddresses[0]) == held[0]);
+		// Paths still in use are checked again one interval later
+		held.resize(held.size() / 2);
+		ok &= (topology->expirePaths(now + (2 * ZT_PATH_UNUSED_CHECK_INTERVAL) + 2000, 0xffffffff) == held.size());
+		ok &= (topology->pathCount() == held.size());
+		if (! ok) {
+			std::cout << "FAIL (" << expired << " expired, " << topology->pathCount() << " left)" << std::endl;
+			return -1;
+		}
+		std::cout << "PASS (" << expired << " paths in " << calls << " calls, " << elapsed << "ms)" << std::endl;
+	}
+
+	delete node;
+	return 0;
+}
+
+class BorrowTarget {
+	friend class SharedPtr<BorrowTarget>;
+
+  public:
+	BorrowTarget(bool& destroyed) : _destroyed(destroyed)
+	{
+		_destroyed = false;
+	}
+	~BorrowTarget()
+	{
+		_destroyed = true;
+	}
+
+  private:
+	bool& _destroyed;
+	AtomicCounter __refCount;
+};
+
+// Path and peer handling as done before borrowing: SharedPtr copies of the
+// path, of the packet's path and of the peer, then both passed by value to
+// the send routine (10 shared refcount RMWs per packet)
+static inline uint64_t borrowBenchmarkSend(SharedPtr<Peer> peer, SharedPtr<Path> path)
+{
+	return peer->address().toInt() ^ (uint64_t)path->localSocket();
+}
+static inline uint64_t borrowBenchmarkSendBorrowed(const SharedPtr<Peer>& peer, const SharedPtr<Path>& path)
+{
+	return peer->address().toInt() ^ (uint64_t)path->localSocket();
+}
+
+static int testBorrowedPointers()
+{
+	std::cout << "[borrow] Testing deferred release of borrowed table entries... ";
+	{
+		ShardedHashtable<Address, SharedPtr<BorrowTarget>, 4> t;
+		bool destroyed = false;
+		t.setIfAbsent(Address(1), SharedPtr<BorrowTarget>(new BorrowTarget(destroyed)));
+		{
+			const SnapshotReaders::Pass pass;
+			const SharedPtr<BorrowTarget>* const b = t.borrow(Address(1));
+			if ((! b) || (b->references() != 1)) {
+				std::cout << "FAIL (borrow)" << std::endl;
+				return -1;
+			}
+			{
+				const SnapshotReaders::Pass nested;
+			}
+			t.erase(Address(1));
+			t.reclaim();
+			if ((destroyed) || (t.borrow(Address(1))) || (! SnapshotReaders::inPass())) {
+				std::cout << "FAIL (released while borrowed)" << std::endl;
+				return -1;
+			}
+		}
+		t.reclaim();
+		if ((! destroyed) || (SnapshotReaders::inPass())) {
+			std::cout << "FAIL (not released after pass)" << std::endl;
+			return -1;
+		}
+		std::cout << "PASS" << std::endl;
+	}
+
+	Node* const node = newSelftestNode();
+	Topology* const topology = node->RR->topology;
+	Identity peerId;
+	peerId.generate();
+	const SharedPtr<Peer> peer(topology->addPeer((void*)0, SharedPtr<Peer>(new Peer(node->RR, node->RR->identity, peerId))));
+	const uint32_t ip = Utils::hton((uint32_t)0xc0a80101);
+	const InetAddress physical(&ip, 4, 9993);
+
+	std::cout << "[borrow] Testing borrowed peer and path lookups from Topology... ";
+	{
+		const int peerRefs = peer.references();
+		const SharedPtr<Path> path(topology->getPath(1, physical));
+		const int pathRefs = path.references();
+		const SnapshotReaders::Pass pass;
+		SharedPtr<Peer> loadedPeer;
+		SharedPtr<Path> createdPath;
+		const SharedPtr<Peer>& bp = topology->borrowPeer((void*)0, peerId.address(), loadedPeer);
+		const SharedPtr<Path>& bpath = topology->borrowPath(1, physical, node->now(), createdPath);
+		if ((bp != peer) || (bpath != path) || (loadedPeer) || (createdPath) || (peer.references() != peerRefs) || (path.references() != pathRefs)) {
+			std::cout << "FAIL" << std::endl;
+			return -1;
+		}
+		std::cout << "PASS (no reference count changes)" << std::endl;
+	}
+
+	std::cout << "[borrow] Testing path expiry while other threads borrow paths... ";
+	{
+		// Each round moves the clock a quarter of the check interval on, so a
+		// path not borrowed for four rounds is due and idle. A path a reader
+		// has borrowed must stay the canonical one for a whole interval.
+		std::vector<InetAddress> addrs;
+		for (unsigned int i = 0; i < 64; ++i) {
+			const uint32_t aip = Utils::hton((uint32_t)(0xc0a80200 + i));
+			addrs.push_back(InetAddress(&aip, 4, 9993));
+		}
+		std::atomic<int64_t> clock(node->now());
+		std::atomic<bool> run(true);
+		std::atomic<unsigned long> borrows(0), replaced(0);
+		std::vector<std::thread> readers;
+		for (unsigned int t = 0; t < 4; ++t) {
+			readers.push_back(std::thread([&, t]() {
+				for (unsigned long i = t; run.load(); ++i) {
+					// Keep four paths busy and wander over the rest, which expire
+					const InetAddress& addr = addrs[(i & 1) ? (i % 4) : (4 + ((i / 2) % (addrs.size() - 4)))];
+					const int64_t now = clock.load();
+					const SnapshotReaders::Pass pass;
+					SharedPtr<Path> createdPath;
+					const SharedPtr<Path>& path = topology->borrowPath(1, addr, now, createdPath);
+					std::this_thread::yield();
+					if ((topology->getPath(1, addr) != path) && (clock.load() < (now + ZT_PATH_UNUSED_CHECK_INTERVAL))) {
+						++replaced;
+					}
+					++borrows;
+				}
+			}));
+		}
+		// A one byte datagram is ignored, but moves the node's clock along so
+		// that recreated paths are scheduled relative to the same time
+		const uint32_t tickIp = Utils::hton((uint32_t)0xc0a803ff);
+		const InetAddress tickAddr(&tickIp, 4, 9993);
+		const uint8_t tickData = 0;
+		unsigned long expired = 0;
+		for (unsigned int round = 0; round < 20000; ++round) {
+			const int64_t now = (clock += (ZT_PATH_UNUSED_CHECK_INTERVAL / 4));
+			volatile int64_t deadline = 0;
+			node->processWirePacket((void*)0, now, 1, reinterpret_cast<const struct sockaddr_storage*>(&tickAddr), &tickData, 1, &deadline);
+			expired += topology->expirePaths(now, 0xffffffff);
+			std::this_thread::yield();
+		}
+		run = false;
+		for (std::vector<std::thread>::iterator r(readers.begin()); r != readers.end(); ++r) {
+			r->join();
+		}
+		if ((replaced) || (! expired)) {
+			std::cout << "FAIL (" << replaced << " borrowed paths replaced, " << expired << " expired)" << std::endl;
+			return -1;
+		}
+		std::cout << "PASS (" << borrows << " borrows, " << expired << " paths expired)" << std::endl;
+	}
+
+	// One popular peer and path shared by every thread, the worst case for
+	// refcount cache line bouncing
+	static const unsigned int threadCounts[3] = { 1, 8, 32 };
+	const unsigned long totalPackets = 4000000;
+	for (unsigned int mode = 0; mode < 2; ++mode) {
+		for (unsigned int tc = 0; tc < 3; ++tc) {
+			const unsigned int threads = threadCounts[tc];
+			const unsigned long perThread = totalPackets / threads;
+			std::vector<std::thread> workers;
+			volatile uint64_t sink = 0;
+			const int64_t start = OSUtils::now();
+			for (unsigned int t = 0; t < threads; ++t) {
+				workers.push_back(std::thread([&, mode]() {
+					uint64_t x = 0;
+					for (unsigned long i = 0; i < perThread; ++i) {
+						if (mode == 0) {
+							const SharedPtr<Path> path(topology->getPath(1, physical));
+							const SharedPtr<Path> packetPath(path);
+							const SharedPtr<Peer> p(topology->getPeer((void*)0, peerId.address()));
+							x += borrowBenchmarkSend(p, packetPath);
+						}
+						else {
+							const SnapshotReaders::Pass pass;
+							SharedPtr<Path> createdPath;
+							SharedPtr<Peer> loadedPeer;
+							const SharedPtr<Path>& path = topology->borrowPath(1, physical, start, createdPath);
+							const SharedPtr<Path> packetPath(path);
+							const SharedPtr<Peer>& p = topology->borrowPeer((void*)0, peerId.address(), loadedPeer);
+							x += borrowBenchmarkSendBorrowed(p, packetPath);
+						}
+					}
+					sink = sink + x;
+				}));
+			}
+			for (std::vector<std::thread>::iterator w(workers.begin()); w != workers.end(); ++w) {
+				w->join();
+			}
+			const int64_t end = OSUtils::now();
+
+			// Shared refcount RMWs per packet: before, path/packet/peer copies
+			// plus two by-value arguments; after, only the packet's own path
+			// reference. The Pass adds one RMW pair on a per-thread slot.
+			char tmp[256];
+			OSUtils::ztsnprintf(
+				tmp,
+				sizeof(tmp),
+				"[borrow] %2u threads, %s: %2u shared atomic RMWs/packet, %.2f Mpackets/sec",
+				threads,
+				(mode == 0) ? "SharedPtr copies (previous)" : "borrowed in a Pass         ",
+				(mode == 0) ? 10 : 2,
+				((double)(perThread * threads) / ((double)((end > start) ? (end - start) : 1) / 1000.0)) / 1000000.0);
+			std::cout << tmp << std::endl;
+		}
+	}
+
+	delete node;
+	return 0;
+}
+
+static int testPeerBestPath()
+{
+	Node* const node = newSelftestNode();
+	const RuntimeEnvironment* const RR = node->RR;
+	Identity peerId;
+	peerId.generate();
+	const SharedPtr<Peer> peer(RR->topology->addPeer((void*)0, SharedPtr<Peer>(new Peer(RR, RR->identity, peerId))));
+
+	static const unsigned int pathCount = 8;
+	std::vector<SharedPtr<Path> > paths;
+	int64_t now = OSUtils::now();
+	for (unsigned int i = 0; i < pathCount; ++i) {
+		const uint32_t ip = Utils::hton((uint32_t)(0xc0a80101 + i));
+		paths.push_back(RR->topology->getPath(1, InetAddress(&ip, 4, 9993)));
+		paths.back()->received(now);
+		paths.back()->updateLatency(50 + i, now);
+		peer->received((void*)0, paths.back(), 0, i + 1, 0, Packet::VERB_OK, 0, Packet::VERB_HELLO, false, 0, ZT_QOS_NO_FLOW);
+	}
+
+	std::cout << "[peer] Testing cached best path selection... ";
+	{
+		bool ok = (peer->paths(now).size() == pathCount);
+		// includeExpired bypasses the cache but selects identically while all paths are unexpired
+		for (unsigned int i = 0; i < 3; ++i) {
+			ok &= (peer->getAppropriatePath(now, false) == peer->getAppropriatePath(now, true));
+		}
+		ok &= (peer->getAppropriatePath(now, false) == paths[0]);
+		peer->updatePathLatency(paths[5], 1, now);
+		ok &= (peer->getAppropriatePath(now, false) == paths[5]);
+		ok &= (peer->getAppropriatePath(now, false) == peer->getAppropriatePath(now, true));
+
+		// Once every path stops being alive, quality depends on age and is recomputed
+		now += ZT_PATH_HEARTBEAT_PERIOD + 5000;
+		paths[2]->received(now);
+		ok &= (peer->getAppropriatePath(now, false) == paths[2]);
+		ok &= (peer->getAppropriatePath(now, false) == peer->getAppropriatePath(now, true));
+
+		// Paths that have not received anything for long enough expire
+		now += ZT_PEER_PATH_EXPIRATION;
+		ok &= (! peer->getAppropriatePath(now, false));
+		ok &= (peer->getAppropriatePath(now, true));
+		if (! ok) {
+			std::cout << "FAIL" << std::endl;
+			return -1;
+		}
+		std::cout << "PASS" << std::endl;
+	}
+
+	now = OSUtils::now();
+	for (unsigned int i = 0; i < pathCount; ++i) {
+		paths[i]->received(now);
+		peer->received((void*)0, paths[i], 0, 100 + i, 0, Packet::VERB_OK, 0, Packet::VERB_HELLO, false, 0, ZT_QOS_NO_FLOW);
+	}
+
+	// includeExpired=true takes the previous route: both locks and a scan of every path
+	static const unsigned int threadCounts[3] = { 1, 8, 32 };
+	const unsigned long totalLookups = 4000000;
+	for (unsigned int mode = 0; mode < 2; ++mode) {
+		for (unsigned int tc = 0; tc < 3; ++tc) {
+			const unsigned int threads = threadCounts[tc];
+			const unsigned long perThread = totalLookups / threads;
+			std::vector<std::thread> workers;
+			unsigned long found[32];
+			const int64_t start = OSUtils::now();
+			for (unsigned int t = 0; t < threads; ++t) {
+				found[t] = 0;
+				workers.push_back(std::thread([&, mode, t]() {
+					for (unsigned long i = 0; i < perThread; ++i) {
+						if (peer->getAppropriatePath(now, (mode == 0))) {
+							++found[t];
+						}
+					}
+				}));
+			}
+			for (std::vector<std::thread>::iterator w(workers.begin()); w != workers.end(); ++w) {
+				w->join();
+			}
+			const int64_t end = OSUtils::now();
+			for (unsigned int t = 0; t < threads; ++t) {
+				if (found[t] != perThread) {
+					std::cout << "[peer] FAIL (no path)" << std::endl;
+					return -1;
+				}
+			}
+
+			char tmp[256];
+			OSUtils::ztsnprintf(
+				tmp,
+				sizeof(tmp),
+				"[peer] %2u threads, %u paths, %s: %.2f Mlookups/sec",
+				threads,
+				pathCount,
+				(mode == 0) ? "locked scan (previous)" : "cached best path      ",
+				((double)(perThread * threads) / ((double)((end > start) ? (end - start) : 1) / 1000.0)) / 1000000.0);
+			std::cout << tmp << std::endl;
+		}
+	}
+
+	delete node;
+	return 0;
+}
+
+static uint64_t hashtableBenchmarkRandom(uint64_t& x)
+{
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return x;
+}
+
+template <typename T, typename K> static void benchmarkHashtable(const char* name, const std::vector<K>& keys, const std::vector<K>& absent)
+{
+	static const unsigned int lookupPasses = 50;
+	unsigned long sink = 0;
+	T t;
+
+	int64_t start = OSUtils::now();
+	for (typename std::vector<K>::const_iterator k(keys.begin()); k != keys.end(); ++k) {
+		t.set(*k, 1);
+	}
+	const int64_t insertTime = OSUtils::now() - start;
+
+	start = OSUtils::now();
+	for (unsigned int p = 0; p < lookupPasses; ++p) {
+		for (typename std::vector<K>::const_iterator k(keys.begin()); k != keys.end(); ++k) {
+			sink += (unsigned long)*(t.get(*k));
+		}
+	}
+	const int64_t hitTime = OSUtils::now() - start;
+
+	start = OSUtils::now();
+	for (unsigned int p = 0; p < lookupPasses; ++p) {
+		for (typename std::vector<K>::const_iterator k(absent.begin()); k != absent.end(); ++k) {
+			sink += (unsigned long)t.contains(*k);
+		}
+	}
+	const int64_t missTime = OSUtils::now() - start;
+
+	start = OSUtils::now();
+	for (typename std::vector<K>::const_iterator k(keys.begin()); k != keys.end(); ++k) {
+		sink += (unsigned long)t.erase(*k);
+	}
+	const int64_t eraseTime = OSUtils::now() - start;
+
+	const double n = (double)keys.size();
+	char tmp[256];
+	OSUtils::ztsnprintf(
+		tmp,
+		sizeof(tmp),
+		"[hashtable] %s: insert %6.2f  hit %6.2f  miss %6.2f  erase %6.2f Mops/sec%s",
+		name,
+		(n / ((double)std::max(insertTime, (int64_t)1) / 1000.0)) / 1000000.0,
+		((n * lookupPasses) / ((double)std::max(hitTime, (int64_t)1) / 1000.0)) / 1000000.0,
+		((n * lookupPasses) / ((double)std::max(missTime, (int64_t)1) / 1000.0)) / 1000000.0,
+		(n / ((double)std::max(eraseTime, (int64_t)1) / 1000.0)) / 1000000.0,
+		(sink == ((unsigned long)keys.size() * (lookupPasses + 1))) ? "" : " (FAIL)");
+	std::cout << tmp << std::endl;
+}
+
+static int testFlatHashtable()
+{
+	std::cout << "[hashtable] Testing FlatHashtable against std::map... ";
+	{
+		FlatHashtable<uint64_t, std::string> ht;
+		std::map<uint64_t, std::string> ref;
+		uint64_t x = 0x243f6a8885a308d3ULL;
+		for (unsigned int i = 0; i < 200000; ++i) {
+			// Small key space so that inserts, overwrites and erases all hit
+			const uint64_t k = hashtableBenchmarkRandom(x) % 5000;
+			switch ((unsigned int)(x >> 60) & 3) {
+				case 0:
+					ht.set(k, std::string(1 + (k % 40), (char)('a' + (k % 26))));
+					ref[k] = std::string(1 + (k % 40), (char)('a' + (k % 26)));
+					break;
+				case 1:
+					ht[k] += "!";
+					ref[k] += "!";
+					break;
+				case 2:
+					if (ht.erase(k) != (ref.erase(k) != 0)) {
+						std::cout << "FAIL (erase)" << std::endl;
+						return -1;
+					}
+					break;
+				default: {
+					const std::string* const v = ht.get(k);
+					const std::map<uint64_t, std::string>::const_iterator r(ref.find(k));
+					if ((v == (const std::string*)0) != (r == ref.end()) || ((v) && (*v != r->second))) {
+						std::cout << "FAIL (get)" << std::endl;
+						return -1;
+					}
+				} break;
+			}
+		}
+		FlatHashtable<uint64_t, std::string> copied(ht);
+		FlatHashtable<uint64_t, std::string> assigned;
+		assigned.set(1234567, "x");
+		assigned = ht;
+		if ((ht.size() != ref.size()) || (copied.size() != ref.size()) || (assigned.size() != ref.size())) {
+			std::cout << "FAIL (size)" << std::endl;
+			return -1;
+		}
+		unsigned long iterated = 0;
+		uint64_t* k = (uint64_t*)0;
+		std::string* v = (std::string*)0;
+		FlatHashtable<uint64_t, std::string>::Iterator i(ht);
+		while (i.next(k, v)) {
+			std::string cv, av;
+			if ((ref[*k] != *v) || (! copied.get(*k, cv)) || (cv != *v) || (! assigned.get(*k, av)) || (av != *v)) {
+				std::cout << "FAIL (iterate)" << std::endl;
+				return -1;
+			}
+			if ((*k & 1) != 0) {
+				ht.erase(*k);
+			}
+			++iterated;
+		}
+		for (std::map<uint64_t, std::string>::iterator r(ref.begin()); r != ref.end(); ++r) {
+			if (ht.contains(r->first) == ((r->first & 1) != 0)) {
+				std::cout << "FAIL (erase during iteration)" << std::endl;
+				return -1;
+			}
+		}
+		ht.clear();
+		if ((iterated != ref.size()) || (! ht.empty()) || (ht.get(ref.begin()->first)) || (copied.keys().size() != ref.size()) || (copied.entries().size() != ref.size())) {
+			std::cout << "FAIL (clear)" << std::endl;
+			return -1;
+		}
+		std::cout << "PASS (" << ref.size() << " entries)" << std::endl;
+	}
+
+	// Keys as they occur: random addresses, network IDs from one controller
+	// (same high 40 bits) and IPv4 physical paths
+	static const unsigned int keyCount = 100000;
+	uint64_t x = 0x13198a2e03707344ULL;
+	std::vector<Address> addresses, absentAddresses;
+	std::vector<uint64_t> nwids, absentNwids;
+	std::vector<Path::HashKey> paths, absentPaths;
+	std::set<uint64_t> seen;
+	for (unsigned int i = 0; i < keyCount; ++i) {
+		uint64_t a;
+		do {
+			a = hashtableBenchmarkRandom(x) & 0x7fffffffffULL;
+		} while (! seen.insert(a).second);
+		addresses.push_back(Address(a));
+		absentAddresses.push_back(Address(a | 0x8000000000ULL));
+		nwids.push_back(0x8056c2e21c000000ULL + i);
+		absentNwids.push_back(0x8056c2e21c000000ULL + keyCount + i);
+		uint32_t ip;
+		do {
+			ip = (uint32_t)hashtableBenchmarkRandom(x);
+		} while (! seen.insert(0x10000000000ULL | ip).second);
+		paths.push_back(Path::HashKey(1, InetAddress(&ip, 4, (unsigned int)((x >> 32) & 0xffff))));
+		absentPaths.push_back(Path::HashKey(2, InetAddress(&ip, 4, (unsigned int)((x >> 32) & 0xffff))));
+	}
+	benchmarkHashtable<Hashtable<Address, unsigned long> >("Address       Hashtable    ", addresses, absentAddresses);
+	benchmarkHashtable<FlatHashtable<Address, unsigned long> >("Address       FlatHashtable", addresses, absentAddresses);
+	benchmarkHashtable<Hashtable<uint64_t, unsigned long> >("uint64_t      Hashtable    ", nwids, absentNwids);
+	benchmarkHashtable<FlatHashtable<uint64_t, unsigned long> >("uint64_t      FlatHashtable", nwids, absentNwids);
+	benchmarkHashtable<Hashtable<Path::HashKey, unsigned long> >("Path::HashKey Hashtable    ", paths, absentPaths);
+	benchmarkHashtable<FlatHashtable<Path::HashKey, unsigned long> >("Path::HashKey FlatHashtable", paths, absentPaths);
+
+	return 0;
+}
+
+// Shape of a queued packet before packets were held in shared buffers
+struct PacketByValueQueueEntry {
+	PacketByValueQueueEntry(const Address& d, const Packet& p) : dest(d)
+	{
+		memcpy(packet, (const void*)&p, sizeof(Packet));
+	}
+	Address dest;
+	unsigned char packet[sizeof(Packet)];
+};
+
+struct PacketBufferQueueEntry {
+	PacketBufferQueueEntry(const Address& d, const SharedPtr<PacketBuffer>& p) : dest(d), packet(p)
+	{
+	}
+	Address dest;
+	SharedPtr<PacketBuffer> packet;
+};
+
+static int testPacketBuffers()
+{
+	std::cout << "[packetbuf] Testing pooled packet buffers... ";
+	{
+		Packet p(Address(0x1111111111ULL), Address(0x2222222222ULL), Packet::VERB_FRAME);
+		for (unsigned int i = 0; i < 1000; ++i) {
+			p.append((uint8_t)i);
+		}
+		Packet copied(p);
+		Packet assigned;
+		assigned = p;
+		Packet::Fragment frag(p, ZT_PROTO_MIN_PACKET_LENGTH, 500, 1, 3);
+		Packet::Fragment fragCopy;
+		fragCopy = frag;
+		if ((copied != p) || (assigned != p) || (fragCopy != frag) || (fragCopy.payloadLength() != 500)) {
+			std::cout << "FAIL (copy)" << std::endl;
+			return -1;
+		}
+
+		void* first;
+		{
+			SharedPtr<PacketBuffer> b(new PacketBuffer(p));
+			SharedPtr<PacketBuffer> b2(b);
+			first = (void*)b.ptr();
+			b->setDestination(Address(0x3333333333ULL));
+			if ((b2->destination() != Address(0x3333333333ULL)) || (b->size() != p.size()) || (memcmp(b->field(ZT_PACKET_IDX_PAYLOAD, 1000), p.field(ZT_PACKET_IDX_PAYLOAD, 1000), 1000) != 0)) {
+				std::cout << "FAIL (shared buffer)" << std::endl;
+				return -1;
+			}
+		}
+		const unsigned long pooled = PacketBuffer::pooled();
+		SharedPtr<PacketBuffer> reused(new PacketBuffer(p));
+		if ((pooled == 0) || ((void*)reused.ptr() != first) || (PacketBuffer::pooled() != (pooled - 1)) || (*reused != p)) {
+			std::cout << "FAIL (pool reuse)" << std::endl;
+			return -1;
+		}
+		std::cout << "PASS" << std::endl;
+	}
+
+	// Bytes copied into queues for one forwarded frame. Previously every copy
+	// moved the packet object's whole capacity; now a copy moves what is in use
+	// and queues share one copy.
+	const unsigned int frameSizes[2] = { 100, 1400 };
+	for (unsigned int fs = 0; fs < 2; ++fs) {
+		Packet p(Address(0x1111111111ULL), Address(0x2222222222ULL), Packet::VERB_FRAME);
+		while (p.size() < frameSizes[fs]) {
+			p.append((uint8_t)0);
+		}
+		char tmp[256];
+		OSUtils::ztsnprintf(
+			tmp,
+			sizeof(tmp),
+			"[packetbuf] %4u byte frame: waiting for WHOIS %6lu -> %4u bytes copied, AQM queue %6lu -> %4u, RX reassembly %6lu -> %4u",
+			p.size(),
+			(unsigned long)(2 * sizeof(Packet)),	// temporary TXQueueEntry, then its copy into the list
+			p.size(),
+			(unsigned long)sizeof(Packet),
+			p.size(),
+			(unsigned long)sizeof(IncomingPacket),
+			p.size());
+		std::cout << tmp << std::endl;
+
+		static const unsigned int iterations = 200000;
+		std::list<PacketByValueQueueEntry> byValue;
+		int64_t start = OSUtils::now();
+		for (unsigned int i = 0; i < iterations; ++i) {
+			byValue.push_back(PacketByValueQueueEntry(p.destination(), p));
+			byValue.pop_front();
+		}
+		const int64_t byValueTime = OSUtils::now() - start;
+
+		std::list<PacketBufferQueueEntry> byRef;
+		start = OSUtils::now();
+		for (unsigned int i = 0; i < iterations; ++i) {
+			byRef.push_back(PacketBufferQueueEntry(p.destination(), SharedPtr<PacketBuffer>(new PacketBuffer(p))));
+			byRef.pop_front();
+		}
+		const int64_t byRefTime = OSUtils::now() - start;
+
+		OSUtils::ztsnprintf(
+			tmp,
+			sizeof(tmp),
+			"[packetbuf] %4u byte frame: queue and release %.2f Mpackets/sec by value (previous), %.2f Mpackets/sec in pooled buffers",
+			p.size(),
+			((double)iterations / ((double)std::max(byValueTime, (int64_t)1) / 1000.0)) / 1000000.0,
+			((double)iterations / ((double)std::max(byRefTime, (int64_t)1) / 1000.0)) / 1000000.0);
+		std::cout << tmp << std::endl;
+	}
+
+	return 0;
+}
+
+// Shape of the AQM before per-network schedulers: one lock for all networks,
+// a heap entry holding a full packet copy and a std::list node per frame
+struct PreviousAQMEntry {
+	uint64_t creationTime;
+	unsigned char packet[sizeof(Packet)];
+};
+struct PreviousAQM {
+	Mutex lock;
+	std::map<uint64_t, std::vector<std::list<PreviousAQMEntry*> > > networks;
+};
+
+static void qosBenchmarkThread(PreviousAQM* previous, QoSQueue* q, const Packet* p, const unsigned int count, unsigned long* sent)
+{
+	const uint64_t nwid = (uint64_t)((uintptr_t)q);
+	QoSQueue::Entry ready[2];
+	unsigned long n = 0;
+	for (unsigned int i = 0; i < count; ++i) {
+		if (previous) {
+			Mutex::Lock _l(previous->lock);
+			std::vector<std::list<PreviousAQMEntry*> >& buckets = previous->networks[nwid];
+			if (buckets.empty()) {
+				buckets.resize(ZT_AQM_NUM_BUCKETS);
+			}
+			PreviousAQMEntry* const e = new PreviousAQMEntry();
+			memcpy(e->packet, (const void*)p, sizeof(Packet));
+			buckets[i % 8].push_back(e);
+			for (unsigned int b = 0; b < ZT_AQM_NUM_BUCKETS; ++b) {
+				if (! buckets[(i + b) % ZT_AQM_NUM_BUCKETS].empty()) {
+					delete buckets[(i + b) % ZT_AQM_NUM_BUCKETS].front();
+					buckets[(i + b) % ZT_AQM_NUM_BUCKETS].pop_front();
+					++n;
+					break;
+				}
+			}
+		}
+		else {
+			q->enqueue(SharedPtr<PacketBuffer>(new PacketBuffer(*p)), true, (int)(i % 8), nwid, ZT_QOS_NO_FLOW, 0);
+			const unsigned int r = q->dequeue(ready, 0);
+			for (unsigned int k = 0; k < r; ++k) {
+				ready[k].packet.zero();
+			}
+			n += r;
+		}
+	}
+	*sent = n;
+}
+
+static int testQoSQueue()
+{
+	Packet frame(Address(0x1111111111ULL), Address(0x2222222222ULL), Packet::VERB_FRAME);
+	while (frame.size() < 1400) {
+		frame.append((uint8_t)0);
+	}
+	const SharedPtr<PacketBuffer> pb(new PacketBuffer(frame));
+
+	std::cout << "[aqm] Testing fq_codel scheduler... ";
+	{
+		QoSQueue q;
+		QoSQueue::Entry ready[2];
+		if (q.enqueue(pb, true, ZT_AQM_NUM_BUCKETS, 1, ZT_QOS_NO_FLOW, 0) || q.enqueue(pb, true, -1, 1, ZT_QOS_NO_FLOW, 0)) {
+			std::cout << "FAIL (invalid bucket)" << std::endl;
+			return -1;
+		}
+
+		// Without queueing delay everything comes out and buckets take turns
+		unsigned int perBucket[ZT_AQM_NUM_BUCKETS];
+		memset(perBucket, 0, sizeof(perBucket));
+		for (unsigned int i = 0; i < 800; ++i) {
+			q.enqueue(pb, true, (int)(i % 8), (uint64_t)(i % 8), ZT_QOS_NO_FLOW, 1000);
+		}
+		unsigned int out = 0;
+		for (unsigned int round = 0; round < 10000; ++round) {
+			const unsigned int n = q.dequeue(ready, 1000);
+			for (unsigned int k = 0; k < n; ++k) {
+				if (out < 64) {
+					++perBucket[ready[k].nwid];
+				}
+				ready[k].packet.zero();
+				++out;
+			}
+		}
+		bool fair = true;
+		for (unsigned int b = 0; b < 8; ++b) {
+			fair &= (perBucket[b] > 0);
+		}
+		if ((out != 800) || (q.size() != 0) || (! fair)) {
+			std::cout << "FAIL (dequeue " << out << ")" << std::endl;
+			return -1;
+		}
+
+		// Unclassified flows get sub-queues of their own and never share a
+		// rule-selected bucket. Together they weigh as one bucket, so a rule
+		// bucket still gets half the link against any number of them.
+		for (unsigned int i = 0; i < 900; ++i) {
+			if ((i % 9) == 0) {
+				q.enqueue(pb, true, 3, 1, ZT_QOS_NO_FLOW, 1000);
+			}
+			else {
+				q.enqueue(pb, true, ZT_AQM_UNCLASSIFIED, 0, (int32_t)(i % 9), 1000);
+			}
+		}
+		unsigned int prioritized = 0, flows = 0;
+		out = 0;
+		while (out < 90) {
+			const unsigned int n = q.dequeue(ready, 1000);
+			for (unsigned int k = 0; k < n; ++k) {
+				prioritized += (unsigned int)ready[k].nwid;
+				if (ready[k].flowId != ZT_QOS_NO_FLOW) {
+					flows |= 1U << ready[k].flowId;
+				}
+				ready[k].packet.zero();
+				++out;
+			}
+		}
+		while (q.size() > 0) {
+			const unsigned int n = q.dequeue(ready, 1000);
+			for (unsigned int k = 0; k < n; ++k) {
+				ready[k].packet.zero();
+			}
+		}
+		if (((prioritized + 2) * 2 < out) || ((prioritized - 2) * 2 > out) || (flows != 0x1fe)) {
+			std::cout << "FAIL (rule bucket got " << prioritized << " of " << out << ")" << std::endl;
+			return -1;
+		}
+
+		// Overflow drops from the longest bucket and never runs out of entries
+		for (unsigned int i = 0; i < (ZT_AQM_MAX_ENQUEUED_PACKETS * 2); ++i) {
+			q.enqueue(pb, true, (i < ZT_AQM_MAX_ENQUEUED_PACKETS) ? 1 : 2, 1, ZT_QOS_NO_FLOW, 1000);
+		}
+		if (q.size() != ZT_AQM_MAX_ENQUEUED_PACKETS) {
+			std::cout << "FAIL (overflow)" << std::endl;
+			return -1;
+		}
+
+		// Frames that waited too long make CoDel drop some of them
+		out = 0;
+		for (uint64_t now = 1000 + (ZT_AQM_INTERVAL * 2); q.size() > 0; now += 1) {
+			const unsigned int n = q.dequeue(ready, now);
+			for (unsigned int k = 0; k < n; ++k) {
+				ready[k].packet.zero();
+				++out;
+			}
+		}
+		if ((out == 0) || (out >= ZT_AQM_MAX_ENQUEUED_PACKETS)) {
+			std::cout << "FAIL (codel " << out << ")" << std::endl;
+			return -1;
+		}
+		std::cout << "PASS (" << (ZT_AQM_MAX_ENQUEUED_PACKETS - out) << " CoDel drops)" << std::endl;
+	}
+
+	// Enqueue then dequeue one round per frame over 8 buckets, as Switch does
+	static const unsigned int perThread = 50000;
+	const unsigned int threadCounts[2] = { 1, 8 };
+	for (unsigned int tc = 0; tc < 2; ++tc) {
+		const unsigned int threads = threadCounts[tc];
+		for (unsigned int mode = 0; mode < 3; ++mode) {
+			PreviousAQM previous;
+			QoSQueue* queues[8];
+			for (unsigned int t = 0; t < threads; ++t) {
+				queues[t] = ((mode == 2) || (t == 0)) ? new QoSQueue() : queues[0];
+			}
+			unsigned long sent[8];
+			std::vector<std::thread> workers;
+			const int64_t start = OSUtils::now();
+			for (unsigned int t = 0; t < threads; ++t) {
+				workers.push_back(std::thread(qosBenchmarkThread, (mode == 0) ? &previous : (PreviousAQM*)0, queues[t], &frame, perThread, &(sent[t])));
+			}
+			unsigned long total = 0;
+			for (unsigned int t = 0; t < threads; ++t) {
+				workers[t].join();
+				total += sent[t];
+			}
+			const int64_t elapsed = OSUtils::now() - start;
+			for (unsigned int t = 0; t < threads; ++t) {
+				if ((mode == 2) || (t == 0)) {
+					delete queues[t];
+				}
+			}
+			for (std::map<uint64_t, std::vector<std::list<PreviousAQMEntry*> > >::iterator n(previous.networks.begin()); n != previous.networks.end(); ++n) {
+				for (unsigned int b = 0; b < n->second.size(); ++b) {
+					for (std::list<PreviousAQMEntry*>::iterator e(n->second[b].begin()); e != n->second[b].end(); ++e) {
+						delete *e;
+					}
+				}
+			}
+			static const char* modeNames[3] = { "single lock, heap entries (previous)", "QoSQueue, one network", "QoSQueue, network per thread" };
+			char tmp[256];
+			OSUtils::ztsnprintf(
+				tmp,
+				sizeof(tmp),
+				"[aqm] %u threads, 8 buckets, %-36s: %.2f Mframes/sec",
+				threads,
+				modeNames[mode],
+				((double)total / ((double)std::max(elapsed, (int64_t)1) / 1000.0)) / 1000000.0);
+			std::cout << tmp << std::endl;
+		}
+	}
+
+	return 0;
+}
+
+// Cheap stand-in peer identities: the same public key under different addresses
+static Identity selftestIdentityAt(const Identity& base, const Address& a)
+{
+	char tmp[ZT_IDENTITY_STRING_BUFFER_LENGTH];
+	base.toString(false, tmp);
+	a.toString(tmp);
+	tmp[ZT_ADDRESS_LENGTH_HEX] = ':';
+	return Identity(tmp);
+}
+
+static int testTxQueues()
+{
+	Node* const node = newSelftestNode();
+	const RuntimeEnvironment* const RR = node->RR;
+	Identity base;
+	base.generate();
+	const uint32_t ip = Utils::hton((uint32_t)0x0a000001);
+	const SharedPtr<Path> path(RR->topology->getPath(1, InetAddress(&ip, 4, 9993)));
+
+	// Learning a peer gives it a live path, as processing its OK(WHOIS) and HELLO would
+	const SharedPtr<Path>* pathPtr = &path;
+	auto learn = [RR, &base, pathPtr](const Address& a) {
+		const SharedPtr<Peer> peer(RR->topology->addPeer((void*)0, SharedPtr<Peer>(new Peer(RR, RR->identity, selftestIdentityAt(base, a)))));
+		(*pathPtr)->received(RR->node->now());
+		peer->received((void*)0, *pathPtr, 0, 1, 0, Packet::VERB_OK, 0, Packet::VERB_HELLO, false, 0, ZT_QOS_NO_FLOW);
+		return peer;
+	};
+	auto queue = [RR](const Address& dest, const unsigned int count, const unsigned int len) {
+		for (unsigned int i = 0; i < count; ++i) {
+			Packet p(dest, RR->identity.address(), Packet::VERB_ECHO);
+			while (p.size() < len) {
+				p.append((uint8_t)i);
+			}
+			RR->sw->send((void*)0, p, true, 0, ZT_QOS_NO_FLOW);
+		}
+	};
+
+	std::cout << "[txqueue] Testing per-destination pending sends... ";
+	{
+		const Address a(0x0a0a0a0a01ULL), b(0x0a0a0a0a02ULL), c(0x0a0a0a0a03ULL);
+		queue(a, ZT_TX_QUEUE_SIZE + 10, 100);
+		queue(b, 5, 100);
+		queue(c, ZT_TX_QUEUE_SIZE, 4000);
+		const unsigned long before = selftestWirePacketsSent;
+		RR->sw->doAnythingWaitingForPeer((void*)0, learn(a));
+		const unsigned long sentA = selftestWirePacketsSent - before;
+		RR->sw->doAnythingWaitingForPeer((void*)0, learn(a));
+		const unsigned long sentAgain = selftestWirePacketsSent - before - sentA;
+		RR->sw->doAnythingWaitingForPeer((void*)0, learn(b));
+		const unsigned long sentB = selftestWirePacketsSent - before - sentA;
+		RR->sw->doAnythingWaitingForPeer((void*)0, learn(c));
+		const unsigned long sentC = selftestWirePacketsSent - before - sentA - sentB;
+		// Large packets go out in fragments; the byte cap is reached before the count cap
+		queue(c, 1, 4000);
+		const unsigned long fragments = selftestWirePacketsSent - before - sentA - sentB - sentC;
+		if ((sentA != ZT_TX_QUEUE_SIZE) || (sentAgain != 0) || (sentB != 5) || (sentC != (fragments * (ZT_TX_QUEUE_MAX_BYTES / 4000)))) {
+			std::cout << "FAIL (" << sentA << "," << sentAgain << "," << sentB << "," << sentC << ")" << std::endl;
+			return -1;
+		}
+
+		// A known peer with no path yet keeps its queue, still within the limits
+		const Address d(0x0a0a0a0a04ULL);
+		queue(d, ZT_TX_QUEUE_SIZE, 100);
+		RR->sw->doAnythingWaitingForPeer((void*)0, RR->topology->addPeer((void*)0, SharedPtr<Peer>(new Peer(RR, RR->identity, selftestIdentityAt(base, d)))));
+		queue(d, ZT_TX_QUEUE_SIZE, 100);
+		const unsigned long beforeD = selftestWirePacketsSent;
+		RR->sw->doAnythingWaitingForPeer((void*)0, learn(d));
+		if ((selftestWirePacketsSent - beforeD) != ZT_TX_QUEUE_SIZE) {
+			std::cout << "FAIL (re-queued " << (selftestWirePacketsSent - beforeD) << ")" << std::endl;
+			return -1;
+		}
+		std::cout << "PASS" << std::endl;
+	}
+
+	std::cout << "[txqueue] Testing WHOIS coalescing... ";
+	{
+		// The first request after a quiet period goes out at once, later ones
+		// wait for the batch and pull in the background task deadline
+		const int64_t now = RR->node->now() + ZT_WHOIS_BATCH_DELAY;
+		RR->sw->requestWhois((void*)0, now, Address(0x0b0b0b0b01ULL));
+		const bool first = (RR->sw->whoisFlushDeadline() == 0);
+		RR->sw->requestWhois((void*)0, now, Address(0x0b0b0b0b02ULL));
+		RR->sw->requestWhois((void*)0, now, Address(0x0b0b0b0b02ULL));
+		const int64_t deadline = RR->sw->whoisFlushDeadline();
+		RR->sw->doTimerTasks((void*)0, deadline);
+		if ((! first) || (deadline != (now + ZT_WHOIS_BATCH_DELAY)) || (RR->sw->whoisFlushDeadline() != 0)) {
+			std::cout << "FAIL" << std::endl;
+			return -1;
+		}
+		std::cout << "PASS" << std::endl;
+	}
+
+	// Learning peers while packets wait for many destinations. Previously
+	// each learned peer scanned one global list of pending packets. (At most
+	// ZT_TX_QUEUE_MAX_DESTINATIONS destinations can have packets waiting.)
+	static const unsigned int destCounts[3] = { 1000, 2000, 4000 };
+	for (unsigned int dc = 0; dc < 3; ++dc) {
+		const unsigned int dests = destCounts[dc];
+		std::vector<Address> addrs;
+		for (unsigned int i = 0; i < dests; ++i) {
+			addrs.push_back(Address(0x0c00000000ULL + ((uint64_t)dc << 24) + i));
+		}
+		std::vector<SharedPtr<Peer> > peers;
+		for (unsigned int i = 0; i < dests; ++i) {
+			queue(addrs[i], 2, 200);
+		}
+		for (unsigned int i = 0; i < dests; ++i) {
+			peers.push_back(learn(addrs[i]));
+		}
+		const unsigned long before = selftestWirePacketsSent;
+		int64_t start = OSUtils::now();
+		for (unsigned int i = 0; i < dests; ++i) {
+			RR->sw->doAnythingWaitingForPeer((void*)0, peers[i]);
+		}
+		const int64_t perDestination = OSUtils::now() - start;
+		const unsigned long sent = selftestWirePacketsSent - before;
+
+		std::list<std::pair<Address, SharedPtr<PacketBuffer> > > global;
+		const SharedPtr<PacketBuffer> pb(new PacketBuffer(Packet(addrs[0], RR->identity.address(), Packet::VERB_ECHO)));
+		for (unsigned int i = 0; i < dests; ++i) {
+			global.push_back(std::pair<Address, SharedPtr<PacketBuffer> >(addrs[i], pb));
+			global.push_back(std::pair<Address, SharedPtr<PacketBuffer> >(addrs[i], pb));
+		}
+		unsigned long found = 0;
+		start = OSUtils::now();
+		for (unsigned int i = 0; i < dests; ++i) {
+			for (std::list<std::pair<Address, SharedPtr<PacketBuffer> > >::iterator e(global.begin()); e != global.end();) {
+				if (e->first == addrs[i]) {
+					++found;
+					global.erase(e++);
+				}
+				else {
+					++e;
+				}
+			}
+		}
+		const int64_t scanned = OSUtils::now() - start;
+
+		if ((sent != (dests * 2)) || (found != (dests * 2))) {
+			std::cout << "[txqueue] Learning peers with pending sends... FAIL (" << sent << ")" << std::endl;
+			return -1;
+		}
+		char tmp[256];
+		OSUtils::ztsnprintf(
+			tmp,
+			sizeof(tmp),
+			"[txqueue] %5u destinations: global list scan (previous, no sending) %lldms, per-destination queues %lldms",
+			dests,
+			(long long)scanned,
+			(long long)perDestination);
+		std::cout << tmp << std::endl;
+	}
+
+	delete node;
+	return 0;
+}
+
+static int testRelay()
+{
+	Node* const node = newSelftestNode();
+	const RuntimeEnvironment* const RR = node->RR;
+	Identity base;
+	base.generate();
+	int64_t now = node->now();
+
+	// Peers each with one live, trusted path at 10.1.x.y
+	std::vector<SharedPtr<Peer> > peers;
+	std::vector<InetAddress> peerAddrs;
+	for (unsigned int i = 0; i < 1001; ++i) {
+		const uint32_t ip = Utils::hton((uint32_t)(0x0a010000 + i));
+		peerAddrs.push_back(InetAddress(&ip, 4, 9993));
+		const SharedPtr<Path> path(RR->topology->getPath(1, peerAddrs.back()));
+		path->received(now);
+		path->trustedPacketReceived(now);
+		peers.push_back(RR->topology->addPeer((void*)0, SharedPtr<Peer>(new Peer(RR, RR->identity, selftestIdentityAt(base, Address(0x0d00000000ULL + i))))));
+		peers.back()->received((void*)0, path, 0, 1, 0, Packet::VERB_OK, 0, Packet::VERB_HELLO, false, 0, ZT_QOS_NO_FLOW);
+	}
+	const Address source(peers[0]->address());
+
+	Packet head(peers[1]->address(), source, Packet::VERB_FRAME);
+	while (head.size() < 1000) {
+		head.append((uint8_t)head.size());
+	}
+	Packet::Fragment frag(head, ZT_PROTO_MIN_PACKET_LENGTH, 500, 1, 2);
+
+	// Relay one datagram from the source's path, returning how many went out
+	auto relay = [node, &peerAddrs](const void* data, const unsigned int len, const int64_t now) {
+		const unsigned long before = selftestWirePacketsSent;
+		volatile int64_t deadline = 0;
+		node->processWirePacket((void*)0, now, 1, reinterpret_cast<const struct sockaddr_storage*>(&(peerAddrs[0])), data, len, &deadline);
+		return selftestWirePacketsSent - before;
+	};
+
+	std::cout << "[relay] Testing relay forwarding... ";
+	{
+		// The first relayed head also introduces source and destination
+		bool ok = (relay(head.data(), head.size(), now) >= 1);
+		ok &= (relay(head.data(), head.size(), now) == 1);
+		ok &= (selftestLastWirePacketTo == peerAddrs[1]);
+		ok &= ((selftestLastWirePacket[ZT_PACKET_IDX_FLAGS] & 0x07) == 1);
+		ok &= (relay(frag.data(), frag.size(), now) == 1);
+		ok &= (selftestLastWirePacket[ZT_PACKET_FRAGMENT_IDX_HOPS] == 1);
+
+		// Too many hops, unknown destinations with no upstream, and packets
+		// claiming to be from this node are not relayed
+		Packet tooFar(head);
+		for (unsigned int h = 0; h < ZT_RELAY_MAX_HOPS; ++h) {
+			tooFar.incrementHops();
+		}
+		ok &= (relay(tooFar.data(), tooFar.size(), now) == 0);
+		Packet unknown(head);
+		unknown.setDestination(Address(0x0e0e0e0e0eULL));
+		ok &= (relay(unknown.data(), unknown.size(), now) == 0);
+		Packet spoofed(head);
+		spoofed.setSource(RR->identity.address());
+		ok &= (relay(spoofed.data(), spoofed.size(), now) == 0);
+
+		// Nor is anything arriving over a path without established trust
+		const uint32_t ip = Utils::hton((uint32_t)0x0a020001);
+		const InetAddress stranger(&ip, 4, 9993);
+		const unsigned long before = selftestWirePacketsSent;
+		volatile int64_t deadline = 0;
+		node->processWirePacket((void*)0, now, 1, reinterpret_cast<const struct sockaddr_storage*>(&stranger), head.data(), head.size(), &deadline);
+		ok &= (selftestWirePacketsSent == before);
+		if (! ok) {
+			std::cout << "FAIL" << std::endl;
+			return -1;
+		}
+		std::cout << "PASS" << std::endl;
+	}
+
+	std::cout << "[relay] Testing fallback to upstream when the direct path fails... ";
+	{
+		// A moon whose one root is a peer with its own live path
+		const uint32_t ip = Utils::hton((uint32_t)0x0a03ffff);
+		const InetAddress rootAddr(&ip, 4, 9993);
+		const SharedPtr<Path> rootPath(RR->topology->getPath(1, rootAddr));
+		rootPath->received(now);
+		rootPath->trustedPacketReceived(now);
+		const SharedPtr<Peer> root(RR->topology->addPeer((void*)0, SharedPtr<Peer>(new Peer(RR, RR->identity, selftestIdentityAt(base, Address(0x0d000fffffULL))))));
+		root->received((void*)0, rootPath, 0, 1, 0, Packet::VERB_OK, 0, Packet::VERB_HELLO, false, 0, ZT_QOS_NO_FLOW);
+		std::vector<World::Root> roots;
+		roots.push_back(World::Root());
+		roots.back().identity = root->identity();
+		const uint64_t moonId = 0x0d000fffffULL;
+		RR->topology->addWorld((void*)0, World::make(World::TYPE_MOON, moonId, 1, base.publicKey(), roots, base.privateKeyPair()), true);
+
+		Packet toFailing(head);
+		toFailing.setDestination(peers[2]->address());
+		Packet::Fragment fragToFailing(toFailing, ZT_PROTO_MIN_PACKET_LENGTH, 500, 1, 2);
+		// The first relay also introduces the pair, in random order
+		bool ok = (relay(toFailing.data(), toFailing.size(), now) >= 1);
+		ok &= (relay(toFailing.data(), toFailing.size(), now) == 1) && (selftestLastWirePacketTo == peerAddrs[2]);
+		selftestWireSendFailTo = peerAddrs[2];
+		ok &= (relay(toFailing.data(), toFailing.size(), now) == 1) && (selftestLastWirePacketTo == rootAddr);
+		ok &= (relay(fragToFailing.data(), fragToFailing.size(), now) == 1) && (selftestLastWirePacketTo == rootAddr);
+		selftestWireSendFailTo = InetAddress();
+		ok &= (relay(toFailing.data(), toFailing.size(), now) == 1) && (selftestLastWirePacketTo == peerAddrs[2]);
+		RR->topology->removeMoon((void*)0, moonId);
+		if (! ok) {
+			std::cout << "FAIL" << std::endl;
+			return -1;
+		}
+		std::cout << "PASS" << std::endl;
+	}
+
+	// Relayed packets per second through processWirePacket, to one
+	// destination and spread over a thousand, relayed by the receiving
+	// thread and then by a relay worker
+	static const unsigned int destCounts[2] = { 1, 1000 };
+	std::vector<Packet> packets[2];
+	for (unsigned int dc = 0; dc < 2; ++dc) {
+		for (unsigned int d = 0; d < destCounts[dc]; ++d) {
+			packets[dc].push_back(head);
+			packets[dc].back().setDestination(peers[1 + d]->address());
+			relay(packets[dc].back().data(), packets[dc].back().size(), now);
+		}
+	}
+	for (unsigned int mode = 0; mode < 2; ++mode) {
+		if (mode == 1) {
+			RR->pm->setUpRelayThreads(1, false);
+		}
+		for (unsigned int dc = 0; dc < 2; ++dc) {
+			const unsigned int dests = destCounts[dc];
+			const unsigned long count = 2000000;
+			const unsigned long before = selftestWirePacketsSent;
+			const uint64_t dropsBefore = Metrics::relay_queue_drops.value();
+			const int64_t start = OSUtils::now();
+			for (unsigned long i = 0; i < count; ++i) {
+				const Packet& p = packets[dc][i % dests];
+				volatile int64_t deadline = 0;
+				node->processWirePacket((void*)0, now, 1, reinterpret_cast<const struct sockaddr_storage*>(&(peerAddrs[0])), p.data(), p.size(), &deadline);
+			}
+			// Workers drop rather than stall the receiving thread when they fall behind
+			for (unsigned int w = 0; (((selftestWirePacketsSent - before) + (Metrics::relay_queue_drops.value() - dropsBefore)) < count) && (w < 10000); ++w) {
+				Thread::sleep(1);
+			}
+			const int64_t elapsed = OSUtils::now() - start;
+			const unsigned long sent = selftestWirePacketsSent - before;
+			const unsigned long dropped = (unsigned long)(Metrics::relay_queue_drops.value() - dropsBefore);
+			if (((sent + dropped) != count) || ((mode == 0) && (dropped != 0))) {
+				std::cout << "[relay] Relaying to " << dests << " destinations... FAIL (" << sent << " sent, " << dropped << " dropped)" << std::endl;
+				return -1;
+			}
+			char tmp[256];
+			OSUtils::ztsnprintf(
+				tmp,
+				sizeof(tmp),
+				"[relay] 1000 byte heads to %4u destinations, %-16s: %.2f Mpkt/sec relayed, %.1f%% dropped",
+				dests,
+				(mode == 0) ? "receiving thread" : "relay worker",
+				((double)sent / ((double)std::max(elapsed, (int64_t)1) / 1000.0)) / 1000000.0,
+				((double)dropped * 100.0) / (double)count);
+			std::cout << tmp << std::endl;
+		}
+	}
+
+	delete node;
+	return 0;
+}
+
+// Heap bytes in use, where the C library can tell us
+static int64_t selftestHeapInUse()
+{
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 33)))
+	return (int64_t)mallinfo2().uordblks;
+#else
+	return -1;
+#endif
+}
+
+static int testPeerFootprint()
+{
+	// Fill a topology the way a root's fills: peers with one path each
+	static const unsigned long peerCount = 100000;
+	Node* const node = newSelftestNode();
+	const RuntimeEnvironment* const RR = node->RR;
+	Identity base;
+	base.generate();
+	const int64_t now = node->now();
+	std::vector<SharedPtr<Path> > paths;
+	for (unsigned long i = 0; i < 256; ++i) {
+		const uint32_t ip = Utils::hton((uint32_t)(0x0a030000 + i));
+		paths.push_back(RR->topology->getPath(1, InetAddress(&ip, 4, 9993)));
+		paths.back()->received(now);
+	}
+
+	const int64_t heapBefore = selftestHeapInUse();
+	const int64_t start = OSUtils::now();
+	for (unsigned long i = 0; i < peerCount; ++i) {
+		const SharedPtr<Peer> peer(RR->topology->addPeer((void*)0, SharedPtr<Peer>(new Peer(RR, RR->identity, selftestIdentityAt(base, Address(0x0f00000000ULL + i))))));
+		peer->received((void*)0, paths[i % paths.size()], 0, 1, 0, Packet::VERB_OK, 0, Packet::VERB_HELLO, false, 0, ZT_QOS_NO_FLOW);
+	}
+	const int64_t elapsed = OSUtils::now() - start;
+	const int64_t heapAfter = selftestHeapInUse();
+
+	std::cout << "[peer] Testing topology fill with " << peerCount << " single-path peers... ";
+	if ((! RR->topology->getPeerNoCache(Address(0x0f00000000ULL + (peerCount / 2)))) || (RR->topology->getPeerNoCache(Address(0x0f00000000ULL + (peerCount / 2)))->paths(now).size() != 1)) {
+		std::cout << "FAIL" << std::endl;
+		return -1;
+	}
+	std::cout << "PASS" << std::endl;
+
+	char tmp[256];
+	if ((heapBefore >= 0) && (heapAfter >= 0)) {
+		OSUtils::ztsnprintf(
+			tmp,
+			sizeof(tmp),
+			"[peer] sizeof(Peer) %u bytes, %.0f heap bytes per peer (%.2f GiB per million), %.1fs to fill",
+			(unsigned int)sizeof(Peer),
+			(double)(heapAfter - heapBefore) / (double)peerCount,
+			((double)(heapAfter - heapBefore) / (double)peerCount) * 1000000.0 / 1073741824.0,
+			(double)elapsed / 1000.0);
+	}
+	else {
+		OSUtils::ztsnprintf(tmp, sizeof(tmp), "[peer] sizeof(Peer) %u bytes, %.1fs to fill", (unsigned int)sizeof(Peer), (double)elapsed / 1000.0);
+	}
+	std::cout << tmp << std::endl;
+
+	delete node;
+	return 0;
+}
+
+static int testTimerWheel()
+{
+	std::cout << "[timerwheel] Testing expiry of 100000 keys over 3 weeks... ";
+	{
+		static const unsigned long keyCount = 100000;
+		static const unsigned int tick = ZT_CORE_TIMER_TASK_GRANULARITY;
+		const int64_t base = OSUtils::now();
+		TimerWheel<Address> wheel(tick);
+		std::vector<int64_t> deadlines(keyCount);
+		for (unsigned long i = 0; i < keyCount; ++i) {
+			// Mostly within a few hours, some past the end of the last level
+			const uint64_t r = (uint64_t)rand();
+			deadlines[i] = base + (int64_t)((i % 10) ? (r % 14400000ULL) : (r % 1814400000ULL));
+			wheel.schedule(Address(i + 1), deadlines[i]);
+		}
+		bool ok = (wheel.size() == keyCount);
+		for (unsigned long i = 0; i < keyCount; i += 7) {
+			wheel.schedule(Address(i + 1), deadlines[i] + 1000000);   // later: ignored
+			deadlines[i] = std::max(base, deadlines[i] - (int64_t)((uint64_t)rand() % 1000000ULL));	// earlier: takes effect
+			wheel.schedule(Address(i + 1), deadlines[i]);
+		}
+		unsigned long cancelled = 0;
+		for (unsigned long i = 3; i < keyCount; i += 101) {
+			wheel.cancel(Address(i + 1));
+			deadlines[i] = -1;
+			++cancelled;
+		}
+		ok &= (wheel.size() == (keyCount - cancelled));
+
+		std::vector<Address> expired;
+		unsigned long fired = 0;
+		int64_t prev = base - 1;
+		for (int64_t now = base; (ok) && (now < (base + 1900000000LL)); now += 1 + (int64_t)((uint64_t)rand() % 10000ULL)) {
+			ok &= (wheel.nextDeadline(prev) <= std::max(prev, (int64_t)0) + 1900000000LL);
+			expired.clear();
+			wheel.expire(now, expired, 0xffffffff);
+			for (std::vector<Address>::const_iterator a(expired.begin()); a != expired.end(); ++a) {
+				const int64_t d = deadlines[a->toInt() - 1];
+				// Never early, and never more than a tick after the previous call
+				ok &= ((d >= 0) && (d <= now) && ((d + (int64_t)tick) > prev));
+				deadlines[a->toInt() - 1] = -1;
+				++fired;
+			}
+			prev = now;
+		}
+		ok &= ((fired + cancelled) == keyCount);
+		ok &= (wheel.size() == 0);
+
+		// Expiry is spread over calls when more than max keys are due
+		for (unsigned long i = 0; i < 5000; ++i) {
+			wheel.schedule(Address(i + 1), prev + 1000);
+		}
+		for (unsigned int c = 0; c < 5; ++c) {
+			expired.clear();
+			ok &= (wheel.expire(prev + 2000, expired, 1000) == 1000);
+		}
+		expired.clear();
+		ok &= ((wheel.expire(prev + 2000, expired, 1000) == 0) && (wheel.size() == 0));
+
+		if (! ok) {
+			std::cout << "FAIL" << std::endl;
+			return -1;
+		}
+		std::cout << "PASS" << std::endl;
+	}
+
+	// Forwarding latency for relayed packets that arrive as background work
+	// starts, with the previous full pass over all peers every ping check and
+	// with peers pinged at their own deadlines from the wheel.
+	static const unsigned long peerCount = 20000;
+	static const unsigned int burst = 64;
+	Node* const node = newSelftestNode();
+	const RuntimeEnvironment* const RR = node->RR;
+	Identity base;
+	base.generate();
+	const int64_t start = node->now();
+	std::vector<SharedPtr<Path> > paths;
+	for (unsigned long i = 0; i < 256; ++i) {
+		const uint32_t ip = Utils::hton((uint32_t)(0x0a040000 + i));
+		paths.push_back(RR->topology->getPath(1, InetAddress(&ip, 4, 9993)));
+		paths.back()->received(start);
+		paths.back()->trustedPacketReceived(start);
+	}
+	std::vector<SharedPtr<Peer> > peers;
+	for (unsigned long i = 0; i < peerCount; ++i) {
+		peers.push_back(RR->topology->addPeer((void*)0, SharedPtr<Peer>(new Peer(RR, RR->identity, selftestIdentityAt(base, Address(0x0c00000000ULL + i))))));
+		peers.back()->received((void*)0, paths[i % paths.size()], 0, 1, 0, Packet::VERB_OK, 0, Packet::VERB_HELLO, false, 0, ZT_QOS_NO_FLOW);
+		peers.back()->received((void*)0, paths[i % paths.size()], 0, 2, 0, Packet::VERB_FRAME, 0, Packet::VERB_NOP, false, 0, ZT_QOS_NO_FLOW);   // active
+	}
+	Packet head(peers[1]->address(), peers[0]->address(), Packet::VERB_FRAME);
+	while (head.size() < 1000) {
+		head.append((uint8_t)head.size());
+	}
+	const InetAddress sourceAddr(paths[0]->address());
+
+	int64_t now = start;
+	for (unsigned int mode = 0; mode < 2; ++mode) {
+		std::vector<double> latencies;
+		double worstPass = 0.0;
+		int64_t lastPingCheck = 0;
+		const unsigned long sentBefore = selftestWirePacketsSent;
+		for (const int64_t end = now + 60000; now < end; now += ZT_CORE_TIMER_TASK_GRANULARITY) {
+			for (unsigned long i = 0; i < paths.size(); ++i) {
+				paths[i]->received(now);
+			}
+			const std::chrono::steady_clock::time_point t0(std::chrono::steady_clock::now());
+			if (mode == 0) {
+				if ((now - lastPingCheck) >= ZT_PING_CHECK_INTERVAL) {
+					lastPingCheck = now;
+					RR->topology->eachPeer([now](Topology&, const SharedPtr<Peer>& p) {
+						if (p->isActive(now)) {
+							p->doPingAndKeepalive((void*)0, now);
+						}
+					});
+				}
+			}
+			else {
+				volatile int64_t deadline = 0;
+				node->processBackgroundTasks((void*)0, now, &deadline);
+			}
+			worstPass = std::max(worstPass, std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count());
+			for (unsigned int k = 0; k < burst; ++k) {
+				volatile int64_t deadline = 0;
+				node->processWirePacket((void*)0, now, 1, reinterpret_cast<const struct sockaddr_storage*>(&sourceAddr), head.data(), head.size(), &deadline);
+				latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count());
+			}
+		}
+		if ((selftestWirePacketsSent - sentBefore) < (unsigned long)latencies.size()) {
+			std::cout << "[timerwheel] Relaying during background passes... FAIL" << std::endl;
+			return -1;
+		}
+		std::sort(latencies.begin(), latencies.end());
+		char tmp[256];
+		OSUtils::ztsnprintf(
+			tmp,
+			sizeof(tmp),
+			"[timerwheel] %lu active peers, %-22s: forwarding latency p50 %.0f us, p99 %.0f us, longest pass %.1f ms",
+			peerCount,
+			(mode == 0) ? "full pass (previous)" : "timer wheel",
+			latencies[latencies.size() / 2],
+			latencies[(latencies.size() * 99) / 100],
+			worstPass / 1000.0);
+		std::cout << tmp << std::endl;
+	}
+
+	delete node;
+	return 0;
+}
+
+static int testIncrementalClean()
+{
+	Node* const node = newSelftestNode();
+	const RuntimeEnvironment* const RR = node->RR;
+	const uint64_t nwid = 0x8056c2e21c000002ULL;
+	const int64_t start = node->now();
+
+	// Two identical multicast databases: 1000 groups of 100 members, half of
+	// the groups refreshed halfway through the subscription lifetime
+	static const unsigned int groupCount = 1000;
+	static const unsigned int membersPerGroup = 100;
+	Multicaster* const mc[2] = { new Multicaster(RR), new Multicaster(RR) };
+	for (unsigned int g = 0; g < groupCount; ++g) {
+		const MulticastGroup mg(MAC(0x010000000000ULL + g), 0);
+		for (unsigned int i = 0; i < membersPerGroup; ++i) {
+			const Address a(0x0b00000000ULL + ((uint64_t)g * membersPerGroup) + i);
+			for (unsigned int k = 0; k < 2; ++k) {
+				mc[k]->add((void*)0, start, nwid, mg, a);
+				if ((g & 1) == 0) {
+					mc[k]->add((void*)0, start + (ZT_MULTICAST_LIKE_EXPIRE / 2), nwid, mg, a);
+				}
+			}
+		}
+	}
+	const int64_t later = start + ZT_MULTICAST_LIKE_EXPIRE + 1;
+
+	std::cout << "[housekeeping] Testing incremental multicast cleaning... ";
+	int64_t fullPass = 0, longestSlice = 0;
+	unsigned int slices = 0;
+	{
+		std::chrono::steady_clock::time_point t0(std::chrono::steady_clock::now());
+		bool ok = (! mc[0]->clean(later, 0xffffffff));
+		fullPass = (int64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count();
+		for (bool more = true; (more) && (slices < 100000); ++slices) {
+			t0 = std::chrono::steady_clock::now();
+			more = mc[1]->clean(later, ZT_HOUSEKEEPING_CLEAN_BUDGET);
+			longestSlice = std::max(longestSlice, (int64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count());
+		}
+		ok &= (slices >= ((groupCount + ((groupCount / 2) * membersPerGroup)) / (ZT_HOUSEKEEPING_CLEAN_BUDGET + membersPerGroup + 1)));	// groups and expired members, may overrun by a group
+		for (unsigned int g = 0; g < groupCount; ++g) {
+			const MulticastGroup mg(MAC(0x010000000000ULL + g), 0);
+			for (unsigned int k = 0; k < 2; ++k) {
+				ok &= (mc[k]->getMembers(nwid, mg, 0xffffffff).size() == (((g & 1) == 0) ? membersPerGroup : 0));
+			}
+		}
+		// No new pass until the housekeeping period has passed
+		ok &= (! mc[1]->clean(later + 1, ZT_HOUSEKEEPING_CLEAN_BUDGET));
+		if (! ok) {
+			std::cout << "FAIL" << std::endl;
+			return -1;
+		}
+		std::cout << "PASS" << std::endl;
+	}
+	char tmp[256];
+	OSUtils::ztsnprintf(
+		tmp,
+		sizeof(tmp),
+		"[housekeeping] %u multicast members: full pass holds the lock %lld us, incremental pass %u calls of at most %lld us",
+		groupCount * membersPerGroup,
+		(long long)fullPass,
+		slices,
+		(long long)longestSlice);
+	std::cout << tmp << std::endl;
+	delete mc[0];
+	delete mc[1];
+
+	// Memberships of peers no longer in the topology are dropped
+	std::cout << "[housekeeping] Testing incremental network cleaning... ";
+	{
+		static const unsigned int peerCount = 4000;
+		static const unsigned long budget = 256;
+		node->join(nwid, (void*)0, (void*)0);
+		const SharedPtr<Network> network(node->network(nwid));
+		NetworkConfig* const nc = new NetworkConfig();
+		makeSelftestNetworkConfig(*nc, nwid, node->address(), 1);
+		network->setConfiguration((void*)0, *nc, false);
+		delete nc;
+		Identity base;
+		base.generate();
+		bool ok = true;
+		std::vector<SharedPtr<Peer> > peers;
+		for (unsigned int i = 0; i < peerCount; ++i) {
+			SharedPtr<Peer> p(new Peer(RR, RR->identity, selftestIdentityAt(base, Address(0x0a00000000ULL + i))));
+			if (i & 1) {
+				p = RR->topology->addPeer((void*)0, p);
+			}
+			ok &= network->gate((void*)0, p);
+			peers.push_back(p);
+		}
+
+		// Each member's first frame publishes its membership snapshot, which
+		// should cost the same for the last member as for the first
+		uint8_t frame[64];
+		memset(frame, 0, sizeof(frame));
+		frame[0] = 0x45;
+		frame[9] = 17;
+		const Address self(node->address());
+		int64_t firstQuarter = 0, lastQuarter = 0;
+		for (unsigned int i = 0; i < peerCount; ++i) {
+			const std::chrono::steady_clock::time_point t0(std::chrono::steady_clock::now());
+			network->filterIncomingPacket((void*)0, peers[i], self, MAC(peers[i]->address(), nwid), MAC(self, nwid), frame, sizeof(frame), ZT_ETHERTYPE_IPV4, 0);
+			const int64_t t = (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+			if (i < (peerCount / 4)) {
+				firstQuarter += t;
+			}
+			else if (i >= (peerCount - (peerCount / 4))) {
+				lastQuarter += t;
+			}
+		}
+		peers.clear();
+		// The last pass is done in one call for comparison
+		unsigned int passSlices[3] = { 0, 0, 0 };
+		int64_t longest[3] = { 0, 0, 0 };
+		for (unsigned int pass = 0; pass < 3; ++pass) {
+			const int64_t now = start + ((int64_t)(pass + 1) * ZT_HOUSEKEEPING_PERIOD);
+			for (bool more = true; (more) && (passSlices[pass] < 100000);) {
+				const std::chrono::steady_clock::time_point t0(std::chrono::steady_clock::now());
+				more = network->clean(now, (pass < 2) ? budget : 0xffffffff);
+				longest[pass] = std::max(longest[pass], (int64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count());
+				passSlices[pass] += (more) ? 1 : 0;
+			}
+		}
+		ok &= (passSlices[0] == ((peerCount - 1) / budget));
+		ok &= (passSlices[1] == (((peerCount / 2) - 1) / budget));
+		ok &= (passSlices[2] == 0);
+		if (! ok) {
+			std::cout << "FAIL (" << passSlices[0] << ", " << passSlices[1] << ")" << std::endl;
+			return -1;
+		}
+		std::cout << "PASS" << std::endl;
+		OSUtils::ztsnprintf(
+			tmp,
+			sizeof(tmp),
+			"[housekeeping] %u network memberships: full pass holds the lock %lld us, incremental pass %u calls of at most %lld us",
+			peerCount / 2,
+			(long long)longest[2],
+			passSlices[1] + 1,
+			(long long)longest[1]);
+		std::cout << tmp << std::endl;
+		OSUtils::ztsnprintf(
+			tmp,
+			sizeof(tmp),
+			"[housekeeping] first frame from each of %u new members: %.1f us per member for the first %u, %.1f us for the last %u",
+			peerCount,
+			(double)firstQuarter / (double)(peerCount / 4) / 1000.0,
+			peerCount / 4,
+			(double)lastQuarter / (double)(peerCount / 4) / 1000.0,
+			peerCount / 4);
+		std::cout << tmp << std::endl;
+	}
+
+	delete node;
+	return 0;
+}
+
+static int testMulticaster()
+{
+	Node* const node = newSelftestNode();
+	const RuntimeEnvironment* const RR = node->RR;
+	const uint64_t nwid = 0x8056c2e21c000003ULL;
+	node->join(nwid, (void*)0, (void*)0);
+	SharedPtr<Network> network(node->network(nwid));
+	{
+		NetworkConfig* const nc = new NetworkConfig();
+		makeSelftestNetworkConfig(*nc, nwid, node->address(), 1);
+		network->setConfiguration((void*)0, *nc, false);
+		delete nc;
+	}
+	const int64_t now = node->now();
+	const MulticastGroup mg(MAC(0x333300000001ULL), 0);
+
+	std::cout << "[multicast] Testing group membership index... ";
+	{
+		Multicaster mc(RR);
+		for (unsigned int i = 0; i < 1000; ++i) {
+			mc.add((void*)0, now, nwid, mg, Address(0x0a00000000ULL + i));
+			mc.add((void*)0, now, nwid, mg, Address(0x0a00000000ULL + (i / 2)));	// refresh
+		}
+		bool ok = (mc.getMembers(nwid, mg, 0xffffffff).size() == 1000);
+		for (unsigned int i = 0; i < 1000; i += 3) {
+			mc.remove(nwid, mg, Address(0x0a00000000ULL + i));
+		}
+		ok &= (mc.getMembers(nwid, mg, 0xffffffff).size() == 666);
+
+		// Gather returns distinct current members and never the querying peer
+		const unsigned int limits[2] = { 100, 0xffff };
+		for (unsigned int l = 0; l < 2; ++l) {
+			const Address querying(0x0a00000001ULL);
+			Buffer<ZT_PROTO_MAX_PACKET_LENGTH> b;
+			const unsigned int n = mc.gather(querying, nwid, mg, b, limits[l]);
+			ok &= (n == std::min(limits[l], 665U));
+			ok &= ((b.at<uint32_t>(0) == 666) && (b.at<uint16_t>(4) == n) && (b.size() == (6 + (n * ZT_ADDRESS_LENGTH))));
+			std::set<uint64_t> seen;
+			for (unsigned int i = 0; i < n; ++i) {
+				const uint64_t a = Address(b.field(6 + (i * ZT_ADDRESS_LENGTH), ZT_ADDRESS_LENGTH), ZT_ADDRESS_LENGTH).toInt();
+				ok &= ((a != querying.toInt()) && (((a - 0x0a00000000ULL) % 3) != 0) && ((a - 0x0a00000000ULL) < 1000));
+				seen.insert(a);
+			}
+			ok &= (seen.size() == n);
+		}
+		if (! ok) {
+			std::cout << "FAIL" << std::endl;
+			return -1;
+		}
+		std::cout << "PASS" << std::endl;
+	}
+
+	// Filling groups from gather replies, and gather and send with them
+	uint8_t frame[1000];
+	memset(frame, 0, sizeof(frame));
+	static const unsigned long groupSizes[3] = { 10, 1000, 100000 };
+	for (unsigned int gsi = 0; gsi < 3; ++gsi) {
+		const unsigned long members = groupSizes[gsi];
+		std::vector<uint8_t> addresses(members * ZT_ADDRESS_LENGTH);
+		for (unsigned long i = 0; i < members; ++i) {
+			Address(0x0a00000000ULL + ((uint64_t)(i * 2654435761UL) & 0xffffffffULL)).copyTo(&(addresses[i * ZT_ADDRESS_LENGTH]), ZT_ADDRESS_LENGTH);
+		}
+
+		Multicaster* const mc = new Multicaster(RR);
+		std::chrono::steady_clock::time_point t0(std::chrono::steady_clock::now());
+		for (unsigned long i = 0; i < members; i += 200) {
+			mc->addMultiple((void*)0, now, nwid, mg, &(addresses[i * ZT_ADDRESS_LENGTH]), (unsigned int)std::min(members - i, 200UL), (unsigned int)members);
+		}
+		const double fillTime = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+
+		// What the sorted member vector used to cost for the same inserts
+		t0 = std::chrono::steady_clock::now();
+		{
+			std::vector<Address> sorted;
+			for (unsigned long i = 0; i < members; ++i) {
+				const Address a(&(addresses[i * ZT_ADDRESS_LENGTH]), ZT_ADDRESS_LENGTH);
+				sorted.insert(std::lower_bound(sorted.begin(), sorted.end(), a), a);
+			}
+		}
+		const double previousFillTime = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+
+		static const unsigned int gatherCount = 10000;
+		t0 = std::chrono::steady_clock::now();
+		for (unsigned int i = 0; i < gatherCount; ++i) {
+			Buffer<ZT_PROTO_MAX_PACKET_LENGTH> b;
+			mc->gather(Address(0x0e00000000ULL), nwid, mg, b, 100);
+		}
+		const double gatherTime = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count() / (double)gatherCount;
+
+		static const unsigned int sendCount = 1000;
+		t0 = std::chrono::steady_clock::now();
+		for (unsigned int i = 0; i < sendCount; ++i) {
+			mc->send((void*)0, now, network, Address(), mg, MAC(), ZT_ETHERTYPE_IPV4, frame, sizeof(frame));
+		}
+		const double sendTime = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count() / (double)sendCount;
+
+		// What the random permutation of all members every send used to cost
+		t0 = std::chrono::steady_clock::now();
+		for (unsigned int i = 0; i < sendCount; ++i) {
+			std::vector<unsigned long> indexes(members);
+			for (unsigned long k = 0; k < members; ++k) {
+				indexes[k] = k;
+			}
+			for (unsigned long k = members - 1; k > 0; --k) {
+				std::swap(indexes[k], indexes[(unsigned long)node->prng() % (k + 1)]);
+			}
+		}
+		const double previousPermutationTime = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count() / (double)sendCount;
+
+		if (mc->getMembers(nwid, mg, 0xffffffff).size() != members) {
+			std::cout << "[multicast] Filling a group of " << members << " members... FAIL" << std::endl;
+			return -1;
+		}
+		delete mc;
+
+		char tmp[256];
+		OSUtils::ztsnprintf(
+			tmp,
+			sizeof(tmp),
+			"[multicast] %6lu members: fill %.0f us (sorted vector %.0f us), gather of 100 %.2f us, send to 32 %.1f us (previous permutation alone %.1f us)",
+			members,
+			fillTime,
+			previousFillTime,
+			gatherTime,
+			sendTime,
+			previousPermutationTime);
+		std::cout << tmp << std::endl;
+	}
+
+	network.zero();
+	delete node;
+	return 0;
+}
+
+static int testMulticastFanout()
+{
+	Node* const node = newSelftestNode(selftestNodeWirePacketSendBatch);
+	const RuntimeEnvironment* const RR = node->RR;
+	const uint64_t nwid = 0x8056c2e21c000004ULL;
+	static const unsigned int recipients = 1000;
+	node->join(nwid, (void*)0, (void*)0);
+	SharedPtr<Network> network(node->network(nwid));
+	{
+		NetworkConfig* const nc = new NetworkConfig();
+		makeSelftestNetworkConfig(*nc, nwid, node->address(), 1);
+		nc->multicastLimit = recipients;
+		network->setConfiguration((void*)0, *nc, false);
+		delete nc;
+	}
+
+	// Recipients each have their own direct path
+	const int64_t now = node->now();
+	const MulticastGroup mg(MAC(0xffffffffffffULL), 0);
+	const uint64_t firstAddress = 0x0b00000000ULL;
+	Identity base;
+	base.generate();
+	std::vector<SharedPtr<Peer> > peers;
+	for (unsigned int i = 0; i < recipients; ++i) {
+		const Address a(firstAddress + i);
+		peers.push_back(RR->topology->addPeer((void*)0, SharedPtr<Peer>(new Peer(RR, RR->identity, selftestIdentityAt(base, a)))));
+		const uint32_t ip = Utils::hton((uint32_t)(0x0a010000 + i));
+		const SharedPtr<Path> path(RR->topology->getPath(1, InetAddress(&ip, 4, 9993)));
+		path->received(now);
+		peers.back()->received((void*)0, path, 0, 1, 0, Packet::VERB_OK, 0, Packet::VERB_HELLO, false, 0, ZT_QOS_NO_FLOW);
+		RR->mc->add((void*)0, now, nwid, mg, a);
+	}
+
+	uint8_t frame[1000];
+	Utils::getSecureRandom(frame, sizeof(frame));	// incompressible, like most traffic
+
+	std::cout << "[multicast] Testing armoring copies of a packet... ";
+	{
+		const SharedPtr<Peer>& peer = peers[0];
+		Packet packet(Address(), RR->identity.address(), Packet::VERB_MULTICAST_FRAME);
+		packet.append(frame, sizeof(frame));
+		const Packet original(packet);
+		bool ok = true;
+		for (unsigned int k = 0; k < 4; ++k) {
+			const bool aes = ((k & 1) != 0), encrypt = ((k & 2) != 0);
+			uint8_t out[ZT_PROTO_MAX_PACKET_LENGTH];
+			const uint64_t packetId = packet.armorTo(out, peer->address(), false, peer->key(), encrypt, (aes) ? peer->aesKeys() : (const AES*)0);
+			Packet p(out, packet.size());
+			ok &= ((p.packetId() == packetId) && (p.destination() == peer->address()) && (p.source() == RR->identity.address()));
+			ok &= (p.cipher() == (unsigned int)((aes && encrypt) ? ZT_PROTO_CIPHER_SUITE__AES_GMAC_SIV : ((encrypt) ? ZT_PROTO_CIPHER_SUITE__C25519_POLY1305_SALSA2012 : ZT_PROTO_CIPHER_SUITE__C25519_POLY1305_NONE)));
+			ok &= ((encrypt) == (memcmp(out + ZT_PACKET_IDX_VERB, packet.field(ZT_PACKET_IDX_VERB, packet.size() - ZT_PACKET_IDX_VERB), packet.size() - ZT_PACKET_IDX_VERB) != 0));
+			ok &= ((p.dearmor(peer->key(), peer->aesKeys(), peer->identity())) && (memcmp(p.field(ZT_PACKET_IDX_VERB, p.size() - ZT_PACKET_IDX_VERB), packet.field(ZT_PACKET_IDX_VERB, packet.size() - ZT_PACKET_IDX_VERB), packet.size() - ZT_PACKET_IDX_VERB) == 0));
+		}
+		ok &= (packet == original);
+		if (! ok) {
+			std::cout << "FAIL" << std::endl;
+			return -1;
+		}
+		std::cout << "PASS" << std::endl;
+	}
+
+	std::cout << "[multicast] Testing batched fan-out to " << recipients << " recipients... ";
+	{
+		std::vector<std::string> captured;
+		selftestWireBatchCapture = &captured;
+		const unsigned long batchesBefore = selftestWireBatches;
+		RR->mc->send((void*)0, now, network, Address(), mg, MAC(), ZT_ETHERTYPE_IPV4, frame, sizeof(frame));
+		selftestWireBatchCapture = (std::vector<std::string>*)0;
+
+		bool ok = ((captured.size() == recipients) && ((selftestWireBatches - batchesBefore) == ((recipients + ZT_WIRE_BATCH_MAX_PACKETS - 1) / ZT_WIRE_BATCH_MAX_PACKETS)));
+		std::set<uint64_t> seen;
+		for (std::vector<std::string>::const_iterator c(captured.begin()); (ok) && (c != captured.end()); ++c) {
+			Packet p(c->data(), (unsigned int)c->size());
+			const uint64_t dest = p.destination().toInt();
+			ok &= ((dest >= firstAddress) && (dest < (firstAddress + recipients)) && (seen.insert(dest).second));
+			if (ok) {
+				const SharedPtr<Peer>& peer = peers[dest - firstAddress];
+				ok &= ((p.dearmor(peer->key(), peer->aesKeys(), peer->identity())) && (p.uncompress()) && (p.verb() == Packet::VERB_MULTICAST_FRAME));
+				ok &= ((p.size() > sizeof(frame)) && (memcmp(p.field(p.size() - sizeof(frame), sizeof(frame)), frame, sizeof(frame)) == 0));
+			}
+		}
+		if (! ok) {
+			std::cout << "FAIL (" << captured.size() << " packets in " << (selftestWireBatches - batchesBefore) << " batches)" << std::endl;
+			return -1;
+		}
+		std::cout << "PASS" << std::endl;
+	}
+
+	// CPU per broadcast, against copying the whole packet for each recipient and sending it alone as before
+	{
+		static const unsigned int rounds = 100;
+		Packet* const packet = new Packet(Address(), RR->identity.address(), Packet::VERB_MULTICAST_FRAME);
+		Packet* const tmp = new Packet();
+		packet->append((uint64_t)nwid);
+		packet->append((uint8_t)0x02);
+		packet->append((uint32_t)1);
+		mg.mac().appendTo(*packet);
+		packet->append((uint32_t)mg.adi());
+		packet->append((uint16_t)ZT_ETHERTYPE_IPV4);
+		packet->append(frame, sizeof(frame));
+		packet->compress();
+		const MAC macSrc(RR->identity.address(), nwid);
+		double fanoutTime = 0.0, previousTime = 0.0;
+		for (unsigned int r = 0; r < rounds; ++r) {
+			std::chrono::steady_clock::time_point t0(std::chrono::steady_clock::now());
+			{
+				WireBatch batch(RR, (void*)0);
+				for (unsigned int i = 0; i < recipients; ++i) {
+					const Address a(firstAddress + i);
+					uint8_t qosBucket = 255;
+					if (network->filterOutgoingPacket((void*)0, true, RR->identity.address(), a, macSrc, mg.mac(), frame, sizeof(frame), ZT_ETHERTYPE_IPV4, 0, qosBucket)) {
+						network->pushCredentialsIfNeeded((void*)0, a, now);
+						RR->sw->sendCopy((void*)0, *packet, a, true, nwid, ZT_QOS_NO_FLOW, batch);
+					}
+				}
+			}
+			fanoutTime += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+
+			t0 = std::chrono::steady_clock::now();
+			for (unsigned int i = 0; i < recipients; ++i) {
+				const Address a(firstAddress + i);
+				uint8_t qosBucket = 255;
+				if (network->filterOutgoingPacket((void*)0, true, RR->identity.address(), a, macSrc, mg.mac(), frame, sizeof(frame), ZT_ETHERTYPE_IPV4, 0, qosBucket)) {
+					network->pushCredentialsIfNeeded((void*)0, a, now);
+					packet->newInitializationVector();
+					packet->setDestination(a);
+					RR->node->expectReplyTo(packet->packetId());
+					*tmp = *packet;
+					RR->sw->send((void*)0, *tmp, true, nwid, ZT_QOS_NO_FLOW);
+				}
+			}
+			previousTime += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+		}
+		fanoutTime /= (double)rounds;
+		previousTime /= (double)rounds;
+		const unsigned int packetSize = packet->size();
+		delete tmp;
+		delete packet;
+
+		char tmpstr[256];
+		OSUtils::ztsnprintf(
+			tmpstr,
+			sizeof(tmpstr),
+			"[multicast] %u recipients, %u byte packets: %.0f us per broadcast in %u wire calls, copying %u header bytes (copying each packet first: %.0f us in %u calls, %u bytes)",
+			recipients,
+			packetSize,
+			fanoutTime,
+			(recipients + ZT_WIRE_BATCH_MAX_PACKETS - 1) / ZT_WIRE_BATCH_MAX_PACKETS,
+			recipients * ZT_PACKET_IDX_VERB,
+			previousTime,
+			recipients,
+			recipients * packetSize);
+		std::cout << tmpstr << std::endl;
+	}
+
+	peers.clear();
+	network.zero();
+	delete node;
+	return 0;
+}
+
+#ifndef __WINDOWS__
+static int testIdentityStore()
+{
+	static const unsigned long valueCount = 200000;
+	static const unsigned long fileCount = 10000;
+	char dir[256], path[512];
+	OSUtils::ztsnprintf(dir, sizeof(dir), "/tmp/zt-selftest-identities-%d", (int)getpid());
+	OSUtils::rmDashRf(dir);
+	OSUtils::mkdir(dir);
+	OSUtils::ztsnprintf(path, sizeof(path), "%s/identities", dir);
+
+	// Synthetic values the size of a serialized public identity
+	uint8_t value[71], got[256];
+	auto fill = [&value](const uint64_t a) {
+		for (unsigned int i = 0; i < sizeof(value); ++i) {
+			value[i] = (uint8_t)((a >> ((i % 5) * 8)) + i);
+		}
+	};
+	auto addressAt = [](const unsigned long i) {
+		return 0x0e00000000ULL + ((uint64_t)i * 7919ULL);
+	};
+
+	std::cout << "[identitystore] Testing put/get of " << valueCount << " values... ";
+	IdentityStore* store = new IdentityStore();
+	if (! store->open(path)) {
+		std::cout << "FAIL (open)" << std::endl;
+		return -1;
+	}
+	int64_t start = OSUtils::now();
+	for (unsigned long i = 0; i < valueCount; ++i) {
+		fill(addressAt(i));
+		if (! store->put(addressAt(i), value, sizeof(value))) {
+			std::cout << "FAIL (put)" << std::endl;
+			return -1;
+		}
+	}
+	const int64_t putTime = OSUtils::now() - start;
+	for (unsigned long i = 0; i < valueCount; ++i) {
+		fill(addressAt(i));
+		if ((store->get(addressAt(i), got, sizeof(got)) != (int)sizeof(value)) || (memcmp(got, value, sizeof(value)) != 0)) {
+			std::cout << "FAIL (get)" << std::endl;
+			return -1;
+		}
+	}
+	fill(addressAt(0));
+	store->put(addressAt(0), value, sizeof(value));
+	if ((store->count() != valueCount) || (store->get(0x0d00000001ULL, got, sizeof(got)) >= 0) || (store->get(addressAt(1), got, 8) >= 0)) {
+		std::cout << "FAIL (count or miss)" << std::endl;
+		return -1;
+	}
+	value[0] ^= 0xff;
+	store->put(addressAt(1), value, sizeof(value));
+	if ((store->count() != valueCount) || (store->get(addressAt(1), got, sizeof(got)) != (int)sizeof(value)) || (got[0] != value[0])) {
+		std::cout << "FAIL (replace)" << std::endl;
+		return -1;
+	}
+	std::cout << "PASS" << std::endl;
+
+	std::cout << "[identitystore] Testing reopen and index rebuild... ";
+	delete store;
+	store = new IdentityStore();
+	if ((! store->open(path)) || (store->count() != valueCount) || (store->get(addressAt(valueCount - 1), got, sizeof(got)) != (int)sizeof(value))) {
+		std::cout << "FAIL (reopen)" << std::endl;
+		return -1;
+	}
+	store->close();
+	OSUtils::ztsnprintf(path, sizeof(path), "%s/identities.idx", dir);
+	OSUtils::rm(path);
+	OSUtils::ztsnprintf(path, sizeof(path), "%s/identities", dir);
+	if ((! store->open(path)) || (store->count() != valueCount) || (store->get(addressAt(1), got, sizeof(got)) != (int)sizeof(value)) || (got[0] != value[0])) {
+		std::cout << "FAIL (rebuild)" << std::endl;
+		return -1;
+	}
+	std::cout << "PASS" << std::endl;
+
+	std::cout << "[identitystore] Testing reopen with damaged index offsets... ";
+	store->close();
+	{
+		// Index file: 32-byte header then 16-byte (address,offset) slots
+		OSUtils::ztsnprintf(path, sizeof(path), "%s/identities.idx", dir);
+		std::string idx;
+		OSUtils::readFile(path, idx);
+		for (std::string::size_type o = 32; (o + 16) <= idx.size(); o += 16) {
+			if (*reinterpret_cast<const uint64_t*>(idx.data() + o)) {
+				memset(&(idx[o + 8]), 0xff, 8);
+			}
+		}
+		OSUtils::writeFile(path, idx.data(), (unsigned int)idx.size());
+		OSUtils::ztsnprintf(path, sizeof(path), "%s/identities", dir);
+	}
+	if ((! store->open(path)) || (store->count() != valueCount) || (store->get(addressAt(valueCount / 2), got, sizeof(got)) != (int)sizeof(value))) {
+		std::cout << "FAIL" << std::endl;
+		return -1;
+	}
+	std::cout << "PASS" << std::endl;
+
+	std::cout << "[identitystore] Testing Topology::getIdentity() for a peer not in memory... ";
+	{
+		Identity base;
+		base.generate();
+		const Identity id(selftestIdentityAt(base, Address(0x0f10000001ULL)));
+		selftestIdentityStore = store;
+		Node* node = newSelftestNode();
+		node->RR->topology->addPeer((void*)0, SharedPtr<Peer>(new Peer(node->RR, node->RR->identity, id)));
+		delete node;
+		node = newSelftestNode();
+		const Identity found(node->RR->topology->getIdentity((void*)0, id.address()));
+		const bool missing = (bool)node->RR->topology->getIdentity((void*)0, Address(0x0f10000002ULL));
+		delete node;
+		selftestIdentityStore = (IdentityStore*)0;
+		if ((found != id) || (missing)) {
+			std::cout << "FAIL" << std::endl;
+			return -1;
+		}
+	}
+	std::cout << "PASS" << std::endl;
+
+	// Lookup latency: the store versus one file per address as in peers.d
+	unsigned long hits = 0;
+	start = OSUtils::now();
+	for (unsigned long i = 0; i < 2000000; ++i) {
+		hits += (store->get(addressAt((i * 104729) % valueCount), got, sizeof(got)) > 0);
+	}
+	const double storeNs = (double)(OSUtils::now() - start) * 1000000.0 / 2000000.0;
+	for (unsigned long i = 0; i < fileCount; ++i) {
+		fill(addressAt(i));
+		OSUtils::ztsnprintf(path, sizeof(path), "%s/%.10llx.peer", dir, (unsigned long long)addressAt(i));
+		OSUtils::writeFile(path, value, sizeof(value));
+	}
+	start = OSUtils::now();
+	for (unsigned long i = 0; i < (fileCount * 4); ++i) {
+		OSUtils::ztsnprintf(path, sizeof(path), "%s/%.10llx.peer", dir, (unsigned long long)addressAt((i * 104729) % fileCount));
+		FILE* f = fopen(path, "rb");
+		if (f) {
+			hits += (fread(got, 1, sizeof(got), f) > 0);
+			fclose(f);
+		}
+	}
+	const double fileNs = (double)(OSUtils::now() - start) * 1000000.0 / (double)(fileCount * 4);
+
+	char tmp[256];
+	OSUtils::ztsnprintf(tmp, sizeof(tmp), "[identitystore] put %.0f ns, get %.0f ns, file per address (hot cache) %.0f ns (%lu hits)", (double)putTime * 1000000.0 / (double)valueCount, storeNs, fileNs, hits);
+	std::cout << tmp << std::endl;
+
+	delete store;
+	OSUtils::rmDashRf(dir);
+	return 0;
+}
+
+static int testPeerStateStore()
+{
+	static const unsigned long peerCount = 100000;
+	static const unsigned long fileCount = 10000;
+	char dir[256], path[512];
+	OSUtils::ztsnprintf(dir, sizeof(dir), "/tmp/zt-selftest-peers-%d", (int)getpid());
+	OSUtils::rmDashRf(dir);
+	OSUtils::mkdir(dir);
+	OSUtils::ztsnprintf(path, sizeof(path), "%s/peers.db", dir);
+	const int64_t now = OSUtils::now();
+
+	// Synthetic peer state about the size Peer::serializeForCache() writes
+	uint8_t value[160], got[512];
+	auto fill = [&value](const uint64_t a, const unsigned int gen) {
+		for (unsigned int i = 0; i < sizeof(value); ++i) {
+			value[i] = (uint8_t)((a >> ((i % 5) * 8)) + i + gen);
+		}
+	};
+	auto addressAt = [](const unsigned long i) {
+		return 0x0c00000000ULL + ((uint64_t)i * 7919ULL);
+	};
+
+	std::cout << "[peerstore] Testing save and reload of " << peerCount << " peers... ";
+	PeerStateStore* store = new PeerStateStore();
+	if (! store->open(path)) {
+		std::cout << "FAIL (open)" << std::endl;
+		return -1;
+	}
+	for (unsigned long i = 0; i < peerCount; ++i) {
+		fill(addressAt(i), 0);
+		store->put(addressAt(i), value, sizeof(value), now);
+	}
+	int64_t start = OSUtils::now();
+	if (! store->flush()) {
+		std::cout << "FAIL (flush)" << std::endl;
+		return -1;
+	}
+	const int64_t saveTime = OSUtils::now() - start;
+	fill(addressAt(1), 1);
+	store->put(addressAt(1), value, sizeof(value), now);
+	store->erase(addressAt(2));
+	delete store;
+
+	// Simulate a crash in the middle of appending a record
+	FILE* f = fopen(path, "ab");
+	if (f) {
+		fwrite("\x0c\x00\x00\x00\x01", 5, 1, f);
+		fclose(f);
+	}
+
+	store = new PeerStateStore();
+	start = OSUtils::now();
+	if (! store->open(path)) {
+		std::cout << "FAIL (reopen)" << std::endl;
+		return -1;
+	}
+	const int64_t loadTime = OSUtils::now() - start;
+	if ((store->count() != (peerCount - 1)) || (store->get(addressAt(2), got, sizeof(got)) >= 0) || (store->get(addressAt(1), got, sizeof(got)) != (int)sizeof(value)) || (memcmp(got, value, sizeof(value)) != 0)) {
+		std::cout << "FAIL (contents)" << std::endl;
+		return -1;
+	}
+	fill(addressAt(peerCount - 1), 0);
+	if ((store->get(addressAt(peerCount - 1), got, sizeof(got)) != (int)sizeof(value)) || (memcmp(got, value, sizeof(value)) != 0)) {
+		std::cout << "FAIL (contents)" << std::endl;
+		return -1;
+	}
+	std::cout << "PASS" << std::endl;
+
+	std::cout << "[peerstore] Testing compaction... ";
+	for (unsigned int gen = 2; gen < 4; ++gen) {
+		for (unsigned long i = 0; i < peerCount; ++i) {
+			fill(addressAt(i), gen);
+			store->put(addressAt(i), value, sizeof(value), now);
+		}
+	}
+	fill(addressAt(3), 4);
+	store->put(addressAt(3), value, sizeof(value), now - 2592000001LL);
+	store->flush();
+	const int64_t sizeBefore = OSUtils::getFileSize(path);
+	if ((! store->shouldCompact()) || (! store->compact(now - 2592000000LL)) || (OSUtils::getFileSize(path) >= sizeBefore) || (store->count() != (peerCount - 1)) || (store->get(addressAt(3), got, sizeof(got)) >= 0)) {
+		std::cout << "FAIL (compact)" << std::endl;
+		return -1;
+	}
+	// Background requests must not lose anything put around them
+	fill(addressAt(8), 5);
+	store->put(addressAt(8), value, sizeof(value), now);
+	store->requestCompact(now - 2592000000LL);
+	store->requestFlush();
+	fill(addressAt(9), 5);
+	store->put(addressAt(9), value, sizeof(value), now);
+	delete store;
+	store = new PeerStateStore();
+	fill(addressAt(7), 3);
+	if ((! store->open(path)) || (store->count() != (peerCount - 1)) || (store->get(addressAt(7), got, sizeof(got)) != (int)sizeof(value)) || (memcmp(got, value, sizeof(value)) != 0)) {
+		std::cout << "FAIL (reopen after compact)" << std::endl;
+		return -1;
+	}
+	fill(addressAt(9), 5);
+	if ((store->get(addressAt(9), got, sizeof(got)) != (int)sizeof(value)) || (memcmp(got, value, sizeof(value)) != 0)) {
+		std::cout << "FAIL (reopen after background sync)" << std::endl;
+		return -1;
+	}
+	std::cout << "PASS" << std::endl;
+	delete store;
+
+	// The same peers written and read back as one file each, as in peers.d
+	start = OSUtils::now();
+	for (unsigned long i = 0; i < fileCount; ++i) {
+		fill(addressAt(i), 0);
+		OSUtils::ztsnprintf(path, sizeof(path), "%s/%.10llx.peer", dir, (unsigned long long)addressAt(i));
+		f = fopen(path, "wb");
+		if (f) {
+			fwrite(value, sizeof(value), 1, f);
+			fclose(f);
+		}
+	}
+	const int64_t fileSaveTime = OSUtils::now() - start;
+	start = OSUtils::now();
+	unsigned long hits = 0;
+	for (unsigned long i = 0; i < fileCount; ++i) {
+		OSUtils::ztsnprintf(path, sizeof(path), "%s/%.10llx.peer", dir, (unsigned long long)addressAt(i));
+		f = fopen(path, "rb");
+		if (f) {
+			hits += (fread(got, 1, sizeof(got), f) > 0);
+			fclose(f);
+		}
+	}
+	const int64_t fileLoadTime = OSUtils::now() - start;
+
+	char tmp[256];
+	OSUtils::ztsnprintf(
+		tmp,
+		sizeof(tmp),
+		"[peerstore] per 10000 peers: store save %.1f ms (with sync), load %.1f ms; peers.d save %lld ms (no sync), load %lld ms (hot cache, %lu hits)",
+		(double)saveTime * 10000.0 / (double)peerCount,
+		(double)loadTime * 10000.0 / (double)peerCount,
+		(long long)fileSaveTime,
+		(long long)fileLoadTime,
+		hits);
+	std::cout << tmp << std::endl;
+
+	OSUtils::rmDashRf(dir);
+	return 0;
+}
+
+static int testStateWriter()
+{
+	static const unsigned int fileCount = 10;
+	static const unsigned int writeCount = 20000;
+	char dir[256], path[512];
+	OSUtils::ztsnprintf(dir, sizeof(dir), "/tmp/zt-selftest-statewriter-%d", (int)getpid());
+	OSUtils::rmDashRf(dir);
+	const std::string subdir(std::string(dir) + "/sub");
+	auto pathOf = [&](const unsigned int i) {
+		OSUtils::ztsnprintf(path, sizeof(path), "%s/%u.conf", subdir.c_str(), i);
+		return std::string(path);
+	};
+	auto valueOf = [](const unsigned int gen) {
+		char v[64];
+		OSUtils::ztsnprintf(v, sizeof(v), "state generation %u", gen);
+		return std::string(v);
+	};
+	char got[128];
+	int n;
+
+	std::cout << "[statewriter] Testing " << writeCount << " coalesced writes to " << fileCount << " files... ";
+	StateWriter* w = new StateWriter();
+	w->start();
+	OSUtils::mkdir(dir);
+	int64_t start = OSUtils::now();
+	for (unsigned int i = 0; i < writeCount; ++i) {
+		const std::string v(valueOf(i));
+		w->write(pathOf(i % fileCount), subdir, v.data(), (int)v.length(), false);
+		if ((! w->get(pathOf(i % fileCount), got, sizeof(got), n)) && (! OSUtils::fileExists(pathOf(i % fileCount).c_str()))) {
+			std::cout << "FAIL (not readable before written)" << std::endl;
+			return -1;
+		}
+	}
+	const int64_t asyncTime = OSUtils::now() - start;
+	w->flush();
+	if (w->pending() != 0) {
+		std::cout << "FAIL (pending after flush)" << std::endl;
+		return -1;
+	}
+	for (unsigned int i = 0; i < fileCount; ++i) {
+		std::string onDisk;
+		if ((! OSUtils::readFile(pathOf(i).c_str(), onDisk)) || (onDisk != valueOf(writeCount - fileCount + i))) {
+			std::cout << "FAIL (contents)" << std::endl;
+			return -1;
+		}
+	}
+	if (OSUtils::listDirectory(subdir.c_str()).size() != fileCount) {
+		std::cout << "FAIL (temporary files left)" << std::endl;
+		return -1;
+	}
+	std::cout << "PASS" << std::endl;
+
+	std::cout << "[statewriter] Testing removal and stop... ";
+	w->write(pathOf(0), subdir, (const void*)0, -1, false);
+	// Either still queued, or already removed by the writer thread
+	if ((w->get(pathOf(0), got, sizeof(got), n)) ? (n != -1) : OSUtils::fileExists(pathOf(0).c_str())) {
+		std::cout << "FAIL (pending removal)" << std::endl;
+		return -1;
+	}
+	const std::string last(valueOf(writeCount));
+	w->write(pathOf(1), subdir, last.data(), (int)last.length(), false);
+	delete w;	// stops after writing everything
+	std::string onDisk;
+	if ((OSUtils::fileExists(pathOf(0).c_str())) || (! OSUtils::readFile(pathOf(1).c_str(), onDisk)) || (onDisk != last)) {
+		std::cout << "FAIL" << std::endl;
+		return -1;
+	}
+	std::cout << "PASS" << std::endl;
+
+	// The same writes made synchronously, as the calling thread used to do
+	start = OSUtils::now();
+	for (unsigned int i = 0; i < writeCount; ++i) {
+		const std::string v(valueOf(i + 1));
+		StateWriter::writeFile(pathOf(i % fileCount), subdir, v.data(), (unsigned int)v.length(), false);
+	}
+	const int64_t syncTime = OSUtils::now() - start;
+
+	char tmp[256];
+	OSUtils::ztsnprintf(
+		tmp,
+		sizeof(tmp),
+		"[statewriter] caller time for %u writes: queued %lld ms, synchronous %lld ms",
+		writeCount,
+		(long long)asyncTime,
+		(long long)syncTime);
+	std::cout << tmp << std::endl;
+
+	OSUtils::rmDashRf(dir);
+	return 0;
+}
+#endif
+
+static int testOther()
+{
+	char buf[1024];
+	char buf2[4096];
+	char buf3[1024];
+
+	std::cout << "[other] Testing hex/unhex... ";
+	std::cout.flush();
+	Utils::getSecureRandom(buf, (unsigned int)sizeof(buf));
+	Utils::hex(buf, (unsigned int)sizeof(buf), buf2);
+	Utils::unhex(buf2, buf3, (unsigned int)sizeof(buf3));
+	if (memcmp(buf, buf3, sizeof(buf)) == 0) {
+		std::cout << "PASS" << std::endl;
+	}
+	else {
+		std::cout << "FAIL!" << std::endl;
+		buf2[78] = 0;
+		std::cout << buf2 << std::endl;
+		Utils::hex(buf3, (unsigned int)sizeof(buf3), buf2);
+		buf2[78] = 0;
+		std::cout << buf2 << std::endl;
+		return -1;
+	}
+
+	std::cout << "[other] Testing InetAddress encode/decode...";
+	std::cout.flush();
+	std::cout << " " << InetAddress("127.0.0.1/9993").toString(buf);
+	std::cout << " " << InetAddress("feed:dead:babe:dead:beef:f00d:1234:5678/12345").toString(buf);
+	std::cout << " " << InetAddress("0/9993").toString(buf);
+	std::cout << " " << InetAddress("").toString(buf);
+	std::cout << std::endl;
+
+#if 0
+	std::cout << "[other] Testing Hashtable... "; std::cout.flush();
+	{
+		Hashtable<uint64_t,std::string> ht;
+		std::map<uint64_t,std::string> ref; // assume std::map works correctly :)
+		for(int x=0;x<2;++x) {
+			for(int i=0;i<77777;++i) {
+				uint64_t k = rand();
+				while ((k == 0)||(ref.count(k) > 0))
+					++k;
+				std::string v("!");
+				for(int j=0;j<(int)(k % 64);++j)
+					v.push_back("0123456789"[rand() % 10]);
+				ref[k] = v;
+				ht.set(0xffffffffffffffffULL,v);
+				std::string &vref = ht[k];
+				vref = v;
+				ht.erase(0xffffffffffffffffULL);
+			}
+			if (ht.size() != ref.size()) {
+				std::cout << "FAILED! (size mismatch, original)" << std::endl;
+				return -1;
+			}
+			{
+				Hashtable<uint64_t,std::string>::Iterator i(ht);
+				uint64_t *k = (uint64_t *)0;
+				std::string *v = (std::string *)0;
+				while(i.next(k,v)) {
+					if (ref.find(*k)->second != *v) {
+						std::cout << "FAILED! (data mismatch!)" << std::endl;
+						return -1;
+					}
+				}
+			}
+			for(std::map<uint64_t,std::string>::const_iterator i(ref.begin());i!=ref.end();++i) {
+				if (ht[i->first] != i->second) {
+					std::cout << "FAILED! (data mismatch!)" << std::endl;
+					return -1;
+				}
+			}
+
+			Hashtable<uint64_t,std::string> ht2;
+			ht2 = ht;
+			Hashtable<uint64_t,std::string> ht3(ht2);
+			if (ht2.size() != ref.size()) {
+				std::cout << "FAILED! (size mismatch, assigned)" << std::endl;
+				return -1;
+			}
+			if (ht3.size() != ref.size()) {
+				std::cout << "FAILED! (size mismatch, copied)" << std::endl;
+				return -1;
+			}
+
+			for(std::map<uint64_t,std::string>::iterator i(ref.begin());i!=ref.end();++i) {
+				std::string *v = ht.get(i->first);
+				if (!v) {
+					std::cout << "FAILED! (key " << i->first << " not found, original)" << std::endl;
+					return -1;
+				}
+				if (*v != i->second) {
+					std::cout << "FAILED! (key " << i->first << "  not equal, original)" << std::endl;
+					return -1;
+				}
+				v = ht2.get(i->first);
+				if (!v) {
+					std::cout << "FAILED! (key " << i->first << "  not found, assigned)" << std::endl;
+					return -1;
+				}
+				if (*v != i->second) {
+					std::cout << "FAILED! (key " << i->first << "  not equal, assigned)" << std::endl;
+					return -1;
+				}
+				v = ht3.get(i->first);
+				if (!v) {
+					std::cout << "FAILED! (key " << i->first << "  not found, copied)" << std::endl;
+					return -1;
+				}
+				if (*v != i->second) {
+					std::cout << "FAILED! (key " << i->first << "  not equal, copied)" << std::endl;
+					return -1;
+				}
+			}
+			{
+				uint64_t *k;
+				std::string *v;
+				Hashtable<uint64_t,std::string>::Iterator i(ht);
+				unsigned long ic = 0;
+				while (i.next(k,v)) {
+					if (ref[*k] != *v) {
+						std::cout << "FAILED! (iterate)" << std::endl;
+						return -1;
+					}
+					++ic;
+				}
+				if (ic != ht.size()) {
+					std::cout << "FAILED! (iterate coverage)" << std::endl;
+					return -1;
+				}
+			}
+			for(std::map<uint64_t,std::string>::iterator i(ref.begin());i!=ref.end();) {
+				if (!ht.get(i->first)) {
+					std::cout << "FAILED! (erase, check if exists)" << std::endl;
+					return -1;
+				}
+				ht.erase(i->first);
+				if (ht.get(i->first)) {
+					std::cout << "FAILED! (erase, check if erased)" << std::endl;
+					return -1;
+				}
+				ref.erase(i++);
+				if (ht.size() != ref.size()) {
+					std::cout << "FAILED! (erase, size)" << std::endl;
+					return -1;
+				}
+			}
+			if (!ht.empty()) {
+				std::cout << "FAILED! (erase, empty)" << std::endl;
+				return -1;
+			}
+			for(int i=0;i<10000;++i) {
+				uint64_t k = rand();
+				while ((k == 0)||(ref.count(k) > 0))
 					++k;
 				std::string v;
 				for(int j=0;j<(int)(k % 64);++j)
@@ -1581,6 +4948,45 @@ static int testPhy()
 	}
 	std::cout << "got " << phyTestUdpPacketCount << " packets, OK" << std::endl;
 
+	std::cout << "[phy] Testing batched UDP send... ";
+	std::cout.flush();
+	{
+		static const unsigned int batchSize = 1000;
+		std::vector<const struct sockaddr*> addrs(batchSize, (const struct sockaddr*)&bindaddr);
+		std::vector<const void*> data(batchSize, (const void*)udpTestPayload);
+		std::vector<unsigned int> lens(batchSize, (unsigned int)sizeof(udpTestPayload));
+
+		// Send in bursts small enough for the receive buffer, and time batches against single sends
+		double batchTime = 0.0, singleTime = 0.0;
+		unsigned long batchSent = 0;
+		const unsigned long before = phyTestUdpPacketCount;
+		for (unsigned int i = 0; i < batchSize; i += ZT_PHY_SENDMMSG_WINDOW) {
+			const unsigned int n = std::min(batchSize - i, (unsigned int)ZT_PHY_SENDMMSG_WINDOW);
+			std::chrono::steady_clock::time_point t0(std::chrono::steady_clock::now());
+			batchSent += testPhyInstance->udpSendBatch(udpListenSock, &(addrs[i]), &(data[i]), &(lens[i]), n);
+			batchTime += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+			testPhyInstance->poll(10);
+			t0 = std::chrono::steady_clock::now();
+			for (unsigned int k = 0; k < n; ++k) {
+				testPhyInstance->udpSend(udpListenSock, addrs[i + k], data[i + k], lens[i + k]);
+			}
+			singleTime += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+			testPhyInstance->poll(10);
+		}
+		const unsigned long expected = (unsigned long)batchSize * 2;
+		const int64_t batchTimeoutAt = OSUtils::now() + ZT_TEST_PHY_TIMEOUT_MS;
+		while ((OSUtils::now() < batchTimeoutAt) && ((phyTestUdpPacketCount - before) < expected)) {
+			testPhyInstance->poll(100);
+		}
+		if ((batchSent != (unsigned long)batchSize) || ((phyTestUdpPacketCount - before) != expected)) {
+			std::cout << "FAILED (sent " << batchSent << ", got " << (phyTestUdpPacketCount - before) << ")" << std::endl;
+			return -1;
+		}
+		char tmp[256];
+		OSUtils::ztsnprintf(tmp, sizeof(tmp), "%u packets in %.0f us (one at a time %.0f us), OK", batchSize, batchTime, singleTime);
+		std::cout << tmp << std::endl;
+	}
+
 	std::cout << "[phy] Testing TCP... ";
 	std::cout.flush();
 	timeoutAt = OSUtils::now() + ZT_TEST_PHY_TIMEOUT_MS;
@@ -1671,6 +5077,29 @@ int main(int argc, char** argv)
 	r |= testOther();
 	r |= testCrypto();
 	r |= testPacket();
+	r |= testFlowHash();
+	r |= testNetworkFilterContention();
+	r |= testCompiledRules();
+	r |= testFlowCache();
+	r |= testNetworkTable();
+	r |= testTopologyTables();
+	r |= testBorrowedPointers();
+	r |= testPeerBestPath();
+	r |= testFlatHashtable();
+	r |= testPacketBuffers();
+	r |= testQoSQueue();
+	r |= testTxQueues();
+	r |= testRelay();
+	r |= testPeerFootprint();
+	r |= testTimerWheel();
+	r |= testIncrementalClean();
+	r |= testMulticaster();
+	r |= testMulticastFanout();
+#ifndef __WINDOWS__
+	r |= testIdentityStore();
+	r |= testPeerStateStore();
+	r |= testStateWriter();
+#endif
 	r |= testIdentity();
 	r |= testCertificate();
 	r |= testPhy();
@@ -35,10 +35,13 @@
 #include "../node/World.hpp"
 #include "../osdep/Binder.hpp"
 #include "../osdep/BlockingQueue.hpp"
+#include "../osdep/IdentityStore.hpp"
 #include "../osdep/ManagedRoute.hpp"
 #include "../osdep/OSUtils.hpp"
+#include "../osdep/PeerStateStore.hpp"
 #include "../osdep/Phy.hpp"
 #include "../osdep/PortMapper.hpp"
+#include "../osdep/StateWriter.hpp"
 #include "../version.h"
 #include "OneService.hpp"
 
@@ -146,6 +149,9 @@ using json = nlohmann::json;
 // How often to check for new multicast subscriptions on a tap device
 #define ZT_TAP_CHECK_MULTICAST_INTERVAL 5000
 
+// How often pending writes to the peer state store are flushed
+#define ZT_PEER_STATE_STORE_FLUSH_INTERVAL 10000
+
 // TCP fallback relay (run by ZeroTier, Inc. -- this will eventually go away)
 #ifndef ZT_SDK
 #define ZT_TCP_FALLBACK_RELAY "204.80.128.1/443"
@@ -751,7 +757,9 @@ static void SnodeEventCallback(ZT_Node* node, void* uptr, void* tptr, enum ZT_Ev
 static void SnodeStatePutFunction(ZT_Node* node, void* uptr, void* tptr, enum ZT_StateObjectType type, const uint64_t id[2], const void* data, int len);
 static int SnodeStateGetFunction(ZT_Node* node, void* uptr, void* tptr, enum ZT_StateObjectType type, const uint64_t id[2], void* data, unsigned int maxlen);
 static int SnodeWirePacketSendFunction(ZT_Node* node, void* uptr, void* tptr, int64_t localSocket, const struct sockaddr_storage* addr, const void* data, unsigned int len, unsigned int ttl);
+static void SnodeWirePacketSendBatchFunction(ZT_Node* node, void* uptr, void* tptr, const ZT_WirePacket* packets, unsigned int count);
 static void SnodeVirtualNetworkFrameFunction(ZT_Node* node, void* uptr, void* tptr, uint64_t nwid, void** nuptr, uint64_t sourceMac, uint64_t destMac, unsigned int etherType, unsigned int vlanId, const void* data, unsigned int len);
+static void SnodeVirtualNetworkFrameBatchFunction(ZT_Node* node, void* uptr, void* tptr, uint64_t nwid, void** nuptr, const ZT_VirtualNetworkFrame* frames, unsigned int count);
 static int SnodePathCheckFunction(ZT_Node* node, void* uptr, void* tptr, uint64_t ztaddr, int64_t localSocket, const struct sockaddr_storage* remoteAddr);
 static int SnodePathLookupFunction(ZT_Node* node, void* uptr, void* tptr, uint64_t ztaddr, int family, struct sockaddr_storage* result);
 static void StapFrameHandler(void* uptr, void* tptr, uint64_t nwid, const MAC& from, const MAC& to, unsigned int etherType, unsigned int vlanId, const void* data, unsigned int len);
@@ -843,6 +851,19 @@ class OneServiceImpl : public OneService {
 	bool _multicoreEnabled;
 	bool _cpuPinningEnabled;
 	unsigned int _concurrency;
+	unsigned int _tapThreads;
+	unsigned int _relayThreads;
+
+	// Writes state object files in the background
+	StateWriter _stateWriter;
+
+#ifndef __WINDOWS__
+	// Peer identities for WHOIS, if enabled by the identityStore setting
+	IdentityStore _identityStore;
+
+	// Replaces peers.d if enabled by the peerStateStore setting
+	PeerStateStore _peerStateStore;
+#endif
 
 	bool _allowTcpFallbackRelay;
 	bool _forceTcpRelay;
@@ -1042,7 +1063,7 @@ class OneServiceImpl : public OneService {
 #if defined(__APPLE__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__WINDOWS__)
 		return;
 #endif
-		_node->initMultithreading(_concurrency, _cpuPinningEnabled);
+		_node->initMultithreading(_concurrency, _cpuPinningEnabled, _relayThreads);
 		bool pinning = _cpuPinningEnabled;
 	}
 
@@ -1148,9 +1169,11 @@ class OneServiceImpl : public OneService {
 				_metricsToken = _trimString(_metricsToken);
 			}
 
+			_stateWriter.start();
+
 			{
 				struct ZT_Node_Callbacks cb;
-				cb.version = 0;
+				cb.version = 2;
 				cb.stateGetFunction = SnodeStateGetFunction;
 				cb.statePutFunction = SnodeStatePutFunction;
 				cb.wirePacketSendFunction = SnodeWirePacketSendFunction;
@@ -1159,6 +1182,8 @@ class OneServiceImpl : public OneService {
 				cb.eventCallback = SnodeEventCallback;
 				cb.pathCheckFunction = SnodePathCheckFunction;
 				cb.pathLookupFunction = SnodePathLookupFunction;
+				cb.virtualNetworkFrameBatchFunction = SnodeVirtualNetworkFrameBatchFunction;
+				cb.wirePacketSendBatchFunction = SnodeWirePacketSendBatchFunction;
 				// These settings can get set later when local.conf is checked.
 				struct ZT_Node_Config config;
 				config.enableEncryptedHello = 0;
@@ -1296,6 +1321,7 @@ class OneServiceImpl : public OneService {
 			int64_t lastTapMulticastGroupCheck = 0;
 			int64_t lastBindRefresh = 0;
 			int64_t lastCleanedPeersDb = 0;
+			int64_t lastPeerStateFlush = 0;
 			int64_t lastLocalConfFileCheck = OSUtils::now();
 			int64_t lastOnline = lastLocalConfFileCheck;
 
@@ -1423,10 +1449,29 @@ class OneServiceImpl : public OneService {
 					}
 				}
 
+#ifndef __WINDOWS__
+				// Write peer state saved since the last flush with one sync
+				if ((now - lastPeerStateFlush) >= ZT_PEER_STATE_STORE_FLUSH_INTERVAL) {
+					lastPeerStateFlush = now;
+					if (_peerStateStore.shouldCompact()) {
+						_peerStateStore.requestCompact(now - 2592000000LL);
+					}
+					else {
+						_peerStateStore.requestFlush();
+					}
+				}
+#endif
+
 				// Clean peers.d periodically
 				if ((now - lastCleanedPeersDb) >= 3600000) {
 					lastCleanedPeersDb = now;
-					OSUtils::cleanDirectory((_homePath + ZT_PATH_SEPARATOR_S "peers.d").c_str(), now - 2592000000LL);	// delete older than 30 days
+#ifndef __WINDOWS__
+					if (_peerStateStore.isOpen()) {
+						_peerStateStore.requestCompact(now - 2592000000LL);	 // drop older than 30 days
+					}
+					else
+#endif
+						OSUtils::cleanDirectory((_homePath + ZT_PATH_SEPARATOR_S "peers.d").c_str(), now - 2592000000LL);	// delete older than 30 days
 				}
 
 				const unsigned long delay = (dl > now) ? (unsigned long)(dl - now) : 500;
@@ -1507,9 +1552,43 @@ class OneServiceImpl : public OneService {
 		delete _node;
 		_node = (Node*)0;
 
+#ifndef __WINDOWS__
+		// Deleting the node saved every peer; write them all at once
+		_peerStateStore.close();
+#endif
+
+		// Don't exit before queued state is on disk
+		_stateWriter.stop();
+
 		return _termReason;
 	}
 
+#ifndef __WINDOWS__
+	// Open peers.db, moving anything left in peers.d into it on first use
+	void _openPeerStateStore()
+	{
+		if (! _peerStateStore.open((_homePath + ZT_PATH_SEPARATOR_S "peers.db").c_str())) {
+			return;
+		}
+		_stateWriter.flush();	// peers.d must be complete before it is imported
+		const std::string peersDotD(_homePath + ZT_PATH_SEPARATOR_S "peers.d");
+		const std::vector<std::string> files(OSUtils::listDirectory(peersDotD.c_str()));
+		if (files.empty()) {
+			return;
+		}
+		const int64_t now = OSUtils::now();
+		std::string buf;
+		for (std::vector<std::string>::const_iterator f(files.begin()); f != files.end(); ++f) {
+			if ((f->length() == (ZT_ADDRESS_LENGTH_HEX + 5)) && (f->substr(ZT_ADDRESS_LENGTH_HEX) == ".peer") && (OSUtils::readFile((peersDotD + ZT_PATH_SEPARATOR_S + *f).c_str(), buf))) {
+				_peerStateStore.put(Utils::hexStrToU64(f->substr(0, ZT_ADDRESS_LENGTH_HEX).c_str()), buf.data(), (unsigned int)buf.length(), now);
+			}
+		}
+		if (_peerStateStore.flush()) {
+			OSUtils::rmDashRf(peersDotD.c_str());
+		}
+	}
+#endif
+
 	void readLocalSettings()
 	{
 		// Read local configuration
@@ -2890,6 +2969,25 @@ class OneServiceImpl : public OneService {
 		_portMappingEnabled = OSUtils::jsonBool(settings["portMappingEnabled"], true);
 		_node->setEncryptedHelloEnabled(OSUtils::jsonBool(settings["encryptedHelloEnabled"], false));
 		_node->setLowBandwidthMode(OSUtils::jsonBool(settings["lowBandwidthMode"], false));
+		_node->setFlowCacheEnabled(OSUtils::jsonBool(settings["flowCache"], true));
+#ifndef __WINDOWS__
+		if (OSUtils::jsonBool(settings["identityStore"], false)) {
+			if (! _identityStore.isOpen()) {
+				_identityStore.open((_homePath + ZT_PATH_SEPARATOR_S "identities").c_str());
+			}
+		}
+		else {
+			_identityStore.close();
+		}
+		if (OSUtils::jsonBool(settings["peerStateStore"], false)) {
+			if (! _peerStateStore.isOpen()) {
+				_openPeerStateStore();
+			}
+		}
+		else {
+			_peerStateStore.close();
+		}
+#endif
 #if defined(__LINUX__) || defined(__FreeBSD__)
 		_multicoreEnabled = OSUtils::jsonBool(settings["multicoreEnabled"], false);
 		_concurrency = OSUtils::jsonInt(settings["concurrency"], 1);
@@ -2901,16 +2999,32 @@ class OneServiceImpl : public OneService {
 				fprintf(stderr, "Concurrency level provided (%d) is invalid, assigning conservative default value of (%d)\n", _concurrency, conservativeDefault);
 				_concurrency = conservativeDefault;
 			}
+			// Tap I/O threads are shared by all networks, so this is independent of how many are joined
+			_tapThreads = OSUtils::jsonInt(settings["tapThreads"], _concurrency);
+			if (_tapThreads < 1 || _tapThreads > maxConcurrency) {
+				fprintf(stderr, "Tap thread count provided (%d) is invalid, using concurrency level (%d)\n", _tapThreads, _concurrency);
+				_tapThreads = _concurrency;
+			}
+			// Relaying stays inline on the wire reader unless workers are asked for
+			_relayThreads = OSUtils::jsonInt(settings["relayThreads"], 0);
+			if (_relayThreads > maxConcurrency) {
+				fprintf(stderr, "Relay thread count provided (%d) is invalid, relaying inline\n", _relayThreads);
+				_relayThreads = 0;
+			}
 			setUpMultithreading();
 		}
 		else {
 			// Force values in case the user accidentally defined them with multicore disabled
 			_concurrency = 1;
+			_tapThreads = 1;
+			_relayThreads = 0;
 			_cpuPinningEnabled = false;
 		}
 #else
 		_multicoreEnabled = false;
 		_concurrency = 1;
+		_tapThreads = 1;
+		_relayThreads = 0;
 		_cpuPinningEnabled = false;
 #endif
 
@@ -3522,7 +3636,7 @@ class OneServiceImpl : public OneService {
 						char friendlyName[128];
 						OSUtils::ztsnprintf(friendlyName, sizeof(friendlyName), "ZeroTier One [%.16llx]", nwid);
 
-						n.setTap(EthernetTap::newInstance(nullptr, _concurrency, _cpuPinningEnabled, _homePath.c_str(), MAC(nwc->mac), nwc->mtu, (unsigned int)ZT_IF_METRIC, nwid, friendlyName, StapFrameHandler, (void*)this));
+						n.setTap(EthernetTap::newInstance(nullptr, _tapThreads, _cpuPinningEnabled, _homePath.c_str(), MAC(nwc->mac), nwc->mtu, (unsigned int)ZT_IF_METRIC, nwid, friendlyName, StapFrameHandler, (void*)this));
 						*nuptr = (void*)&n;
 
 						char nlcpath[256];
@@ -3737,6 +3851,25 @@ class OneServiceImpl : public OneService {
 
 	inline void nodeStatePutFunction(enum ZT_StateObjectType type, const uint64_t id[2], const void* data, int len)
 	{
+		if (type == ZT_STATE_OBJECT_PEER_IDENTITY) {
+#ifndef __WINDOWS__
+			if ((len > 0) && (data)) {
+				_identityStore.put(id[0], data, (unsigned int)len);
+			}
+#endif
+			return;
+		}
+#ifndef __WINDOWS__
+		if ((type == ZT_STATE_OBJECT_PEER) && (_peerStateStore.isOpen())) {
+			if ((len > 0) && (data)) {
+				_peerStateStore.put(id[0], data, (unsigned int)len, OSUtils::now());
+			}
+			else {
+				_peerStateStore.erase(id[0]);
+			}
+			return;
+		}
+#endif
 #if ZT_VAULT_SUPPORT
 		if (_vaultEnabled && (type == ZT_STATE_OBJECT_IDENTITY_SECRET || type == ZT_STATE_OBJECT_IDENTITY_PUBLIC)) {
 			if (nodeVaultPutIdentity(type, data, len)) {
@@ -3747,7 +3880,6 @@ class OneServiceImpl : public OneService {
 		}
 #endif
 		char p[1024];
-		FILE* f;
 		bool secure = false;
 		char dirname[1024];
 		dirname[0] = 0;
@@ -3779,43 +3911,8 @@ class OneServiceImpl : public OneService {
 				return;
 		}
 
-		if ((len >= 0) && (data)) {
-			// Check to see if we've already written this first. This reduces
-			// redundant writes and I/O overhead on most platforms and has
-			// little effect on others.
-			f = fopen(p, "rb");
-			if (f) {
-				char* const buf = (char*)malloc(len * 4);
-				if (buf) {
-					long l = (long)fread(buf, 1, (size_t)(len * 4), f);
-					fclose(f);
-					if ((l == (long)len) && (memcmp(data, buf, l) == 0)) {
-						free(buf);
-						return;
-					}
-					free(buf);
-				}
-			}
-
-			f = fopen(p, "wb");
-			if ((! f) && (dirname[0])) {   // create subdirectory if it does not exist
-				OSUtils::mkdir(dirname);
-				f = fopen(p, "wb");
-			}
-			if (f) {
-				if (fwrite(data, len, 1, f) != 1)
-					fprintf(stderr, "WARNING: unable to write to file: %s (I/O error)" ZT_EOL_S, p);
-				fclose(f);
-				if (secure)
-					OSUtils::lockDownFile(p, false);
-			}
-			else {
-				fprintf(stderr, "WARNING: unable to write to file: %s (unable to open)" ZT_EOL_S, p);
-			}
-		}
-		else {
-			OSUtils::rm(p);
-		}
+		// Written by _stateWriter's thread so slow disks don't stall the caller
+		_stateWriter.write(p, dirname, data, ((data) ? len : -1), secure);
 	}
 
 #if ZT_VAULT_SUPPORT
@@ -3896,6 +3993,18 @@ class OneServiceImpl : public OneService {
 
 	inline int nodeStateGetFunction(enum ZT_StateObjectType type, const uint64_t id[2], void* data, unsigned int maxlen)
 	{
+		if (type == ZT_STATE_OBJECT_PEER_IDENTITY) {
+#ifndef __WINDOWS__
+			return _identityStore.get(id[0], data, maxlen);
+#else
+			return -1;
+#endif
+		}
+#ifndef __WINDOWS__
+		if ((type == ZT_STATE_OBJECT_PEER) && (_peerStateStore.isOpen())) {
+			return _peerStateStore.get(id[0], data, maxlen);
+		}
+#endif
 #if ZT_VAULT_SUPPORT
 		if (_vaultEnabled && (type == ZT_STATE_OBJECT_IDENTITY_SECRET || type == ZT_STATE_OBJECT_IDENTITY_PUBLIC)) {
 			int retval = nodeVaultGetIdentity(type, data, maxlen);
@@ -3928,9 +4037,13 @@ class OneServiceImpl : public OneService {
 			default:
 				return -1;
 		}
+		int n;
+		if (_stateWriter.get(p, data, maxlen, n)) {
+			return n;	// not written to disk yet
+		}
 		FILE* f = fopen(p, "rb");
 		if (f) {
-			int n = (int)fread(data, 1, maxlen, f);
+			n = (int)fread(data, 1, maxlen, f);
 			fclose(f);
 #if ZT_VAULT_SUPPORT
 			if (_vaultEnabled && (type == ZT_STATE_OBJECT_IDENTITY_SECRET || type == ZT_STATE_OBJECT_IDENTITY_PUBLIC)) {
@@ -4032,6 +4145,54 @@ class OneServiceImpl : public OneService {
 		}
 	}
 
+	inline void nodeWirePacketSendBatchFunction(const ZT_WirePacket* packets, unsigned int count)
+	{
+		// Runs of packets from the same bound UDP socket go out with one udpSendBatch(), anything
+		// else (sends from all sockets, packets the TCP fallback relay may take) one at a time.
+		const struct sockaddr* addrs[ZT_PHY_SENDMMSG_WINDOW];
+		const void* data[ZT_PHY_SENDMMSG_WINDOW];
+		unsigned int lens[ZT_PHY_SENDMMSG_WINDOW];
+		const int64_t now = OSUtils::now();
+		unsigned int i = 0;
+		while (i < count) {
+			PhySocket* const sock = _batchUdpSocket(packets[i], now);
+			if (! sock) {
+				nodeWirePacketSendFunction(packets[i].localSocket, packets[i].address, packets[i].data, packets[i].len, 0);
+				++i;
+				continue;
+			}
+			unsigned int n = 0;
+			do {
+				addrs[n] = reinterpret_cast<const struct sockaddr*>(packets[i].address);
+				data[n] = packets[i].data;
+				lens[n] = packets[i].len;
+				++n;
+				++i;
+			} while ((n < ZT_PHY_SENDMMSG_WINDOW) && (i < count) && (packets[i].localSocket == packets[i - 1].localSocket) && (_batchUdpSocket(packets[i], now)));
+			_phy.udpSendBatch(sock, addrs, data, lens, n);
+		}
+	}
+
+	// UDP socket to send a batched packet from, or NULL if it must go through nodeWirePacketSendFunction()
+	inline PhySocket* _batchUdpSocket(const ZT_WirePacket& p, const int64_t now)
+	{
+#ifdef ZT_TCP_FALLBACK_RELAY
+		if (_forceTcpRelay) {
+			return (PhySocket*)0;
+		}
+		if ((_allowTcpFallbackRelay) && (p.address->ss_family == AF_INET) && (p.len >= 16) && (reinterpret_cast<const InetAddress*>(p.address)->ipScope() == InetAddress::IP_SCOPE_GLOBAL)) {
+			if (((now - _lastDirectReceiveFromGlobal) > ZT_TCP_FALLBACK_AFTER) && ((now - _lastRestart) > ZT_TCP_FALLBACK_AFTER)) {
+				return (PhySocket*)0;	// TCP fallback may be engaged
+			}
+			_lastSendToGlobalV4 = now;
+		}
+#endif
+		if ((p.localSocket != -1) && (p.localSocket != 0) && (_binder.isUdpSocketValid((PhySocket*)((uintptr_t)p.localSocket)))) {
+			return (PhySocket*)((uintptr_t)p.localSocket);
+		}
+		return (PhySocket*)0;
+	}
+
 	inline void nodeVirtualNetworkFrameFunction(uint64_t nwid, void** nuptr, uint64_t sourceMac, uint64_t destMac, unsigned int etherType, unsigned int vlanId, const void* data, unsigned int len)
 	{
 		NetworkState* n = reinterpret_cast<NetworkState*>(*nuptr);
@@ -4041,6 +4202,15 @@ class OneServiceImpl : public OneService {
 		n->tap()->put(MAC(sourceMac), MAC(destMac), etherType, data, len);
 	}
 
+	inline void nodeVirtualNetworkFrameBatchFunction(uint64_t nwid, void** nuptr, const ZT_VirtualNetworkFrame* frames, unsigned int count)
+	{
+		NetworkState* n = reinterpret_cast<NetworkState*>(*nuptr);
+		if ((! n) || (! n->tap())) {
+			return;
+		}
+		n->tap()->putBatch(frames, count);
+	}
+
 	inline int nodePathCheckFunction(uint64_t ztaddr, const int64_t localSocket, const struct sockaddr_storage* remoteAddr)
 	{
 		// Make sure we're not trying to do ZeroTier-over-ZeroTier
@@ -4277,10 +4447,18 @@ static int SnodeWirePacketSendFunction(ZT_Node* node, void* uptr, void* tptr, in
 {
 	return reinterpret_cast<OneServiceImpl*>(uptr)->nodeWirePacketSendFunction(localSocket, addr, data, len, ttl);
 }
+static void SnodeWirePacketSendBatchFunction(ZT_Node* node, void* uptr, void* tptr, const ZT_WirePacket* packets, unsigned int count)
+{
+	reinterpret_cast<OneServiceImpl*>(uptr)->nodeWirePacketSendBatchFunction(packets, count);
+}
 static void SnodeVirtualNetworkFrameFunction(ZT_Node* node, void* uptr, void* tptr, uint64_t nwid, void** nuptr, uint64_t sourceMac, uint64_t destMac, unsigned int etherType, unsigned int vlanId, const void* data, unsigned int len)
 {
 	reinterpret_cast<OneServiceImpl*>(uptr)->nodeVirtualNetworkFrameFunction(nwid, nuptr, sourceMac, destMac, etherType, vlanId, data, len);
 }
+static void SnodeVirtualNetworkFrameBatchFunction(ZT_Node* node, void* uptr, void* tptr, uint64_t nwid, void** nuptr, const ZT_VirtualNetworkFrame* frames, unsigned int count)
+{
+	reinterpret_cast<OneServiceImpl*>(uptr)->nodeVirtualNetworkFrameBatchFunction(nwid, nuptr, frames, count);
+}
 static int SnodePathCheckFunction(ZT_Node* node, void* uptr, void* tptr, uint64_t ztaddr, int64_t localSocket, const struct sockaddr_storage* remoteAddr)
 {
 	return reinterpret_cast<OneServiceImpl*>(uptr)->nodePathCheckFunction(ztaddr, localSocket, remoteAddr);